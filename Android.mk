@@ -10,6 +10,15 @@ LOCAL_PRELINK_MODULE := false
 LOCAL_SRC_FILES := QualcommCameraHardware.cpp
 LOCAL_SRC_FILES += Overlay.cpp
 LOCAL_SRC_FILES += cameraHAL.cpp
+LOCAL_SRC_FILES += YuvTransform.cpp
+LOCAL_SRC_FILES += FrameRing.cpp
+LOCAL_SRC_FILES += JpegEncoder.cpp
+LOCAL_SRC_FILES += JpegSink.cpp
+LOCAL_SRC_FILES += WorkerPool.cpp
+LOCAL_SRC_FILES += YuvScale.cpp
+LOCAL_SRC_FILES += ExifBuilder.cpp
+LOCAL_SRC_FILES += MemAlloc.cpp
+LOCAL_SRC_FILES += RecordBuffers.cpp
 
 LOCAL_CFLAGS := -DDLOPEN_LIBMMCAMERA=1 -DHW_ENCODE
 LOCAL_CFLAGS += -DNUM_PREVIEW_BUFFERS=4 -D_ANDROID_
@@ -32,3 +41,5 @@ ifeq ($(BOARD_DEBUG_MEMLEAKS),true)
 endif
 
 include $(BUILD_SHARED_LIBRARY)
+
+include $(call all-makefiles-under,$(LOCAL_PATH))
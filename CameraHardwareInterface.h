@@ -36,6 +36,7 @@
 namespace android {
 
 class Overlay;
+class JpegSink;
 
 /**
  *  The size of image for display.
@@ -154,6 +155,59 @@ public:
     virtual bool         useOverlay() {return false;}
     virtual status_t     setOverlay(const sp<Overlay> &overlay) {return BAD_VALUE;}
 
+    /**
+     * Reports how the heap behind the buffers passed to the data callbacks
+     * is split into equally sized buffers, so the client can map the heap
+     * once and refer to frames by index instead of copying them. Returns
+     * false for heaps without such a layout (e.g. the JPEG heap).
+     */
+    virtual bool         getHeapLayout(const sp<IMemoryHeap>& heap,
+                                       size_t *bufferSize, int *numBuffers)
+                             {return false;}
+
+    /** How the CPU is about to touch a buffer, see beginCpuAccess */
+    enum {
+        CPU_READ = 1,
+        CPU_WRITE = 2
+    };
+
+    /** Who touches it, each is timed separately for dump() */
+    enum {
+        CPU_PREVIEW_FLIP,       // preview copied into the window
+        CPU_DATA_COPY,          // callback data copied for the client
+        CPU_DATA_MAP,           // callback data the client reads in place
+        CPU_CROP,               // snapshot cropped or upscaled after zoom
+        CPU_DISPLAY,            // preview frame copied for the display ring
+        CPU_HISTOGRAM,          // histogram copied into the stat heap
+        CPU_ZSL,                // preview frame copied into the ZSL ring
+        CPU_LIVESHOT,           // preview frame copied for a live snapshot
+        CPU_JPEG,               // snapshot read by the JPEG encoder
+        CPU_CONSUMERS
+    };
+
+    /**
+     * Brackets CPU access to size bytes at offset in heap. On heaps mapped
+     * cached, begin drops stale cache lines the hardware wrote behind and
+     * end writes back what the CPU wrote when access has CPU_WRITE. Both
+     * are no-ops on uncached heaps. begin returns the time end needs to
+     * account the window to consumer.
+     */
+    virtual nsecs_t      beginCpuAccess(const sp<IMemoryHeap>& heap, size_t offset,
+                                        size_t size, int access)
+                             {return 0;}
+    virtual void         endCpuAccess(const sp<IMemoryHeap>& heap, size_t offset,
+                                      size_t size, int access, int consumer,
+                                      nsecs_t start)
+                             {}
+
+    /**
+     * Streams the compressed pictures into sink as they are encoded
+     * instead of collecting them in the JPEG heap, see JpegSink.h. The
+     * sink delivers them to the client. NULL goes back to the heap.
+     */
+    virtual status_t     setJpegSink(const sp<JpegSink>& sink)
+                             {return INVALID_OPERATION;}
+
     /**
      * Stop a previously started preview.
      */
@@ -0,0 +1,469 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "ExifBuilder"
+#include <utils/Log.h>
+
+#include <math.h>
+#include <string.h>
+
+#include "ExifBuilder.h"
+
+namespace android {
+
+enum {
+    IFD_0 = 0,
+    IFD_EXIF,
+    IFD_GPS,
+    IFD_COUNT
+};
+
+enum {
+    TYPE_BYTE = 1,
+    TYPE_ASCII = 2,
+    TYPE_SHORT = 3,
+    TYPE_LONG = 4,
+    TYPE_RATIONAL = 5,
+    TYPE_UNDEFINED = 7
+};
+
+#define TAG_EXIF_IFD                0x8769
+#define TAG_GPS_IFD                 0x8825
+#define TAG_COMPRESSION             0x0103
+#define TAG_THUMBNAIL_OFFSET        0x0201
+#define TAG_THUMBNAIL_LENGTH        0x0202
+
+/* IFD1 holds Compression and where the thumbnail is and how long. */
+#define IFD1_SIZE                   (2 + 3 * 12 + 4)
+
+/* "Exif\0\0" after the marker and length */
+#define APP1_HEADER_SIZE            10
+
+#define GPS_PROCESSING_METHOD_MAX   99
+
+static const struct {
+    uint8_t ifd;
+    uint8_t type;
+    uint16_t tag;
+    uint16_t max;               /* count */
+} kFields[ExifBuilder::FIELD_COUNT] = {
+    { IFD_0,    TYPE_ASCII,     0x010f, 32 },   /* Make */
+    { IFD_0,    TYPE_ASCII,     0x0110, 32 },   /* Model */
+    { IFD_0,    TYPE_SHORT,     0x0112, 1 },    /* Orientation */
+    { IFD_0,    TYPE_SHORT,     0x0213, 1 },    /* YCbCrPositioning */
+    { IFD_EXIF, TYPE_UNDEFINED, 0x9000, 4 },    /* ExifVersion */
+    { IFD_EXIF, TYPE_ASCII,     0x9003, 20 },   /* DateTimeOriginal */
+    { IFD_EXIF, TYPE_UNDEFINED, 0x9101, 4 },    /* ComponentsConfiguration */
+    { IFD_EXIF, TYPE_RATIONAL,  0x920a, 1 },    /* FocalLength */
+    { IFD_EXIF, TYPE_UNDEFINED, 0xa000, 4 },    /* FlashpixVersion */
+    { IFD_EXIF, TYPE_SHORT,     0xa001, 1 },    /* ColorSpace */
+    { IFD_EXIF, TYPE_LONG,      0xa002, 1 },    /* PixelXDimension */
+    { IFD_EXIF, TYPE_LONG,      0xa003, 1 },    /* PixelYDimension */
+    { IFD_GPS,  TYPE_BYTE,      0x0000, 4 },    /* GPSVersionID */
+    { IFD_GPS,  TYPE_ASCII,     0x0001, 2 },    /* GPSLatitudeRef */
+    { IFD_GPS,  TYPE_RATIONAL,  0x0002, 3 },    /* GPSLatitude */
+    { IFD_GPS,  TYPE_ASCII,     0x0003, 2 },    /* GPSLongitudeRef */
+    { IFD_GPS,  TYPE_RATIONAL,  0x0004, 3 },    /* GPSLongitude */
+    { IFD_GPS,  TYPE_BYTE,      0x0005, 1 },    /* GPSAltitudeRef */
+    { IFD_GPS,  TYPE_RATIONAL,  0x0006, 1 },    /* GPSAltitude */
+    { IFD_GPS,  TYPE_RATIONAL,  0x0007, 3 },    /* GPSTimeStamp */
+    { IFD_GPS,  TYPE_UNDEFINED, 0x001b, 8 + GPS_PROCESSING_METHOD_MAX + 1 },
+                                                /* GPSProcessingMethod */
+    { IFD_GPS,  TYPE_ASCII,     0x001d, 11 },   /* GPSDateStamp */
+};
+
+static int type_size(int type)
+{
+    switch (type) {
+    case TYPE_SHORT: return 2;
+    case TYPE_LONG: return 4;
+    case TYPE_RATIONAL: return 8;
+    }
+    return 1;
+}
+
+static inline void le16(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static inline void le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void put_entry(uint8_t *p, int tag, int type, uint32_t count, uint32_t value)
+{
+    le16(p, tag);
+    le16(p + 2, type);
+    le32(p + 4, count);
+    if (type == TYPE_SHORT)
+        le16(p + 8, value);
+    else
+        le32(p + 8, value);
+}
+
+ExifBuilder::ExifBuilder()
+    : mIfd1Offset(0),
+      mNextIfdOffset(0),
+      mDirty(true)
+{
+    static const uint8_t exif_version[4] = { '0', '2', '2', '0' };
+    static const uint8_t flashpix_version[4] = { '0', '1', '0', '0' };
+    static const uint8_t components[4] = { 1, 2, 3, 0 };   /* Y Cb Cr */
+    static const uint8_t gps_version[4] = { 2, 2, 0, 0 };
+    uint16_t centered = 1, srgb = 1;
+
+    memset(mValues, 0, sizeof(mValues));
+    memset(mOffsets, 0, sizeof(mOffsets));
+    store(EXIF_VERSION, exif_version, 4);
+    store(FLASHPIX_VERSION, flashpix_version, 4);
+    store(COMPONENTS_CONFIGURATION, components, 4);
+    store(YCBCR_POSITIONING, &centered, 1);
+    store(COLOR_SPACE, &srgb, 1);
+    store(GPS_VERSION, gps_version, 4);
+    setOrientation(0);
+}
+
+void ExifBuilder::setCamera(const char *make, const char *model)
+{
+    storeAscii(MAKE, make);
+    storeAscii(MODEL, model);
+    update();
+}
+
+void ExifBuilder::setFocalLength(float millimeters)
+{
+    uint32_t focal[2] = { (uint32_t)(millimeters * 100 + 0.5f), 100 };
+
+    store(FOCAL_LENGTH, focal, 1);
+    update();
+}
+
+void ExifBuilder::setOrientation(int degrees)
+{
+    uint16_t orientation = 1;
+
+    switch (degrees) {
+    case 90: orientation = 6; break;
+    case 180: orientation = 3; break;
+    case 270: orientation = 8; break;
+    }
+    store(ORIENTATION, &orientation, 1);
+    update();
+}
+
+void ExifBuilder::setPictureSize(int width, int height)
+{
+    uint32_t w = width, h = height;
+
+    store(PIXEL_X_DIMENSION, &w, 1);
+    store(PIXEL_Y_DIMENSION, &h, 1);
+    update();
+}
+
+void ExifBuilder::setDateTime(const char *dateTime)
+{
+    storeAscii(DATE_TIME_ORIGINAL, dateTime);
+    update();
+}
+
+/* Degrees, minutes and thousandths of a second. */
+static void to_dms(double value, uint32_t *dms)
+{
+    value = fabs(value);
+    uint32_t degrees = (uint32_t)value;
+    double minutes = (value - degrees) * 60;
+    dms[0] = degrees;
+    dms[1] = 1;
+    dms[2] = (uint32_t)minutes;
+    dms[3] = 1;
+    dms[4] = (uint32_t)((minutes - dms[2]) * 60 * 1000);
+    dms[5] = 1000;
+}
+
+void ExifBuilder::setGps(const Gps *gps)
+{
+    uint32_t dms[6];
+
+    if (gps != NULL && gps->hasPosition) {
+        storeAscii(GPS_LATITUDE_REF, gps->latitude < 0 ? "S" : "N");
+        to_dms(gps->latitude, dms);
+        store(GPS_LATITUDE, dms, 3);
+        storeAscii(GPS_LONGITUDE_REF, gps->longitude < 0 ? "W" : "E");
+        to_dms(gps->longitude, dms);
+        store(GPS_LONGITUDE, dms, 3);
+    } else {
+        clear(GPS_LATITUDE_REF);
+        clear(GPS_LATITUDE);
+        clear(GPS_LONGITUDE_REF);
+        clear(GPS_LONGITUDE);
+    }
+
+    if (gps != NULL && gps->hasAltitude) {
+        uint8_t below = gps->altitude < 0;
+        uint32_t altitude[2] = { (uint32_t)(fabs(gps->altitude) * 1000), 1000 };
+        store(GPS_ALTITUDE_REF, &below, 1);
+        store(GPS_ALTITUDE, altitude, 1);
+    } else {
+        clear(GPS_ALTITUDE_REF);
+        clear(GPS_ALTITUDE);
+    }
+
+    if (gps != NULL && gps->hasTimestamp) {
+        struct tm tm;
+        char date[12];
+        gmtime_r(&gps->timestamp, &tm);
+        uint32_t time[6] = { (uint32_t)tm.tm_hour, 1, (uint32_t)tm.tm_min, 1,
+                             (uint32_t)tm.tm_sec, 1 };
+        strftime(date, sizeof(date), "%Y:%m:%d", &tm);
+        store(GPS_TIMESTAMP, time, 3);
+        storeAscii(GPS_DATESTAMP, date);
+    } else {
+        clear(GPS_TIMESTAMP);
+        clear(GPS_DATESTAMP);
+    }
+
+    if (gps != NULL && gps->processingMethod != NULL) {
+        /* character code "ASCII" padded to 8 bytes, then the text */
+        uint8_t method[8 + GPS_PROCESSING_METHOD_MAX + 1] = { 'A', 'S', 'C', 'I', 'I' };
+        size_t len = strnlen(gps->processingMethod, GPS_PROCESSING_METHOD_MAX);
+        memcpy(method + 8, gps->processingMethod, len);
+        method[8 + len] = '\0';
+        store(GPS_PROCESSING_METHOD, method, 8 + len + 1);
+    } else {
+        clear(GPS_PROCESSING_METHOD);
+    }
+    update();
+}
+
+const void *ExifBuilder::value(Field field, int *type, uint32_t *count) const
+{
+    const Value *v = &mValues[field];
+
+    if (v->count == 0)
+        return NULL;
+    *type = kFields[field].type;
+    *count = v->count;
+    return v->data.bytes;
+}
+
+size_t ExifBuilder::app1Size(size_t thumbnailSize) const
+{
+    if (thumbnailSize == 0)
+        return APP1_HEADER_SIZE + mIfd1Offset;
+    return APP1_HEADER_SIZE + mIfd1Offset + IFD1_SIZE + thumbnailSize;
+}
+
+size_t ExifBuilder::maxThumbnailSize() const
+{
+    return kMaxApp1Size - (APP1_HEADER_SIZE + mIfd1Offset + IFD1_SIZE);
+}
+
+size_t ExifBuilder::writeApp1(uint8_t *dst, const uint8_t *thumbnail,
+                              size_t thumbnailSize) const
+{
+    if (thumbnail == NULL)
+        thumbnailSize = 0;
+    if (thumbnailSize > maxThumbnailSize())
+        return 0;
+
+    size_t size = app1Size(thumbnailSize);
+    dst[0] = 0xff;
+    dst[1] = 0xe1;
+    dst[2] = (size - 2) >> 8;
+    dst[3] = size - 2;
+    memcpy(dst + 4, "Exif\0\0", 6);
+
+    uint8_t *tiff = dst + APP1_HEADER_SIZE;
+    if (thumbnailSize > 0) {
+        memcpy(tiff, mTiff, mIfd1Offset + IFD1_SIZE);
+        le32(tiff + mIfd1Offset + 2 + 2 * 12 + 8, thumbnailSize);
+        memcpy(tiff + mIfd1Offset + IFD1_SIZE, thumbnail, thumbnailSize);
+    } else {
+        memcpy(tiff, mTiff, mIfd1Offset);
+        le32(tiff + mNextIfdOffset, 0);
+    }
+    return size;
+}
+
+/*
+ * Copies a value into its slot. A value of the size already laid out is
+ * rewritten in the body right away, any other change waits for update().
+ */
+void ExifBuilder::store(Field field, const void *data, uint32_t count)
+{
+    Value *v = &mValues[field];
+
+    if (count > kFields[field].max)
+        count = kFields[field].max;
+    if (count == 0) {
+        clear(field);
+        return;
+    }
+    memcpy(v->data.bytes, data, count * type_size(kFields[field].type));
+    if (!mDirty && v->count == count && mOffsets[field] != 0) {
+        encode(field, mTiff + mOffsets[field]);
+    } else {
+        v->count = count;
+        mDirty = true;
+    }
+}
+
+void ExifBuilder::storeAscii(Field field, const char *str)
+{
+    char value[kMaxValueSize];
+
+    if (str == NULL) {
+        clear(field);
+        return;
+    }
+    size_t len = strnlen(str, kFields[field].max - 1);
+    memcpy(value, str, len);
+    value[len] = '\0';
+    store(field, value, len + 1);
+}
+
+void ExifBuilder::clear(Field field)
+{
+    if (mValues[field].count > 0) {
+        mValues[field].count = 0;
+        mDirty = true;
+    }
+}
+
+void ExifBuilder::update()
+{
+    if (mDirty)
+        layout();
+}
+
+/* Stores the value of field as little endian at dst. */
+void ExifBuilder::encode(Field field, uint8_t *dst) const
+{
+    const Value *v = &mValues[field];
+
+    switch (type_size(kFields[field].type)) {
+    case 1:
+        memcpy(dst, v->data.bytes, v->count);
+        break;
+    case 2:
+        for (uint32_t i = 0; i < v->count; i++)
+            le16(dst + i * 2, v->data.shorts[i]);
+        break;
+    default:
+        /* LONG, or RATIONAL as two of them */
+        for (uint32_t i = 0; i < v->count * (type_size(kFields[field].type) / 4); i++)
+            le32(dst + i * 4, v->data.longs[i]);
+        break;
+    }
+}
+
+/*
+ * Serializes the body: header, IFD0, the Exif IFD, the GPS IFD if there
+ * are GPS fields and IFD1. Values over 4 bytes follow their IFD. With
+ * every field at its longest this takes about 650 bytes.
+ */
+void ExifBuilder::layout()
+{
+    int entries[IFD_COUNT] = { 0 };
+    uint32_t sizes[IFD_COUNT] = { 0 };
+    uint32_t offsets[IFD_COUNT];
+    bool gps = false;
+
+    for (int f = 0; f < FIELD_COUNT; f++) {
+        if (mValues[f].count == 0)
+            continue;
+        uint32_t bytes = type_size(kFields[f].type) * mValues[f].count;
+        entries[kFields[f].ifd]++;
+        if (bytes > 4)
+            sizes[kFields[f].ifd] += (bytes + 1) & ~1;
+        if (f > GPS_VERSION)
+            gps = true;
+    }
+    if (!gps)
+        entries[IFD_GPS] = 0;
+    entries[IFD_0] += gps ? 2 : 1;      /* links to the Exif and GPS IFDs */
+
+    offsets[IFD_0] = 8;
+    for (int i = 0; i < IFD_COUNT; i++) {
+        if (entries[i] > 0)
+            sizes[i] += 2 + 12 * entries[i] + 4;
+        else
+            sizes[i] = 0;
+        if (i > 0)
+            offsets[i] = offsets[i - 1] + sizes[i - 1];
+    }
+    mIfd1Offset = offsets[IFD_GPS] + sizes[IFD_GPS];
+
+    memset(mOffsets, 0, sizeof(mOffsets));
+    memset(mTiff, 0, sizeof(mTiff));
+    mTiff[0] = 'I';
+    mTiff[1] = 'I';
+    le16(mTiff + 2, 42);
+    le32(mTiff + 4, offsets[IFD_0]);
+
+    for (int i = 0; i < IFD_COUNT; i++) {
+        if (entries[i] == 0)
+            continue;
+        uint8_t *p = mTiff + offsets[i];
+        uint32_t data = offsets[i] + 2 + 12 * entries[i] + 4;
+
+        le16(p, entries[i]);
+        p += 2;
+        for (int f = 0; f < FIELD_COUNT; f++) {
+            if (kFields[f].ifd != i || mValues[f].count == 0)
+                continue;
+            uint32_t bytes = type_size(kFields[f].type) * mValues[f].count;
+            put_entry(p, kFields[f].tag, kFields[f].type, mValues[f].count, 0);
+            if (bytes <= 4) {
+                mOffsets[f] = p + 8 - mTiff;
+            } else {
+                le32(p + 8, data);
+                mOffsets[f] = data;
+                data += (bytes + 1) & ~1;
+            }
+            encode((Field)f, mTiff + mOffsets[f]);
+            p += 12;
+        }
+        if (i == IFD_0) {
+            put_entry(p, TAG_EXIF_IFD, TYPE_LONG, 1, offsets[IFD_EXIF]);
+            p += 12;
+            if (gps) {
+                put_entry(p, TAG_GPS_IFD, TYPE_LONG, 1, offsets[IFD_GPS]);
+                p += 12;
+            }
+            mNextIfdOffset = p - mTiff;
+            le32(p, mIfd1Offset);
+        }
+    }
+
+    uint8_t *p = mTiff + mIfd1Offset;
+    le16(p, 3);
+    put_entry(p + 2, TAG_COMPRESSION, TYPE_SHORT, 1, 6);
+    put_entry(p + 2 + 12, TAG_THUMBNAIL_OFFSET, TYPE_LONG, 1, mIfd1Offset + IFD1_SIZE);
+    put_entry(p + 2 + 24, TAG_THUMBNAIL_LENGTH, TYPE_LONG, 1, 0);
+
+    mDirty = false;
+    ALOGV("%s: %u bytes, gps %d", __FUNCTION__, mIfd1Offset + IFD1_SIZE, gps);
+}
+
+}; // namespace android
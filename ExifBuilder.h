@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_EXIF_BUILDER_H
+#define ANDROID_HARDWARE_EXIF_BUILDER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+namespace android {
+
+/*
+ * Keeps the EXIF fields of a session serialized as a little endian TIFF
+ * body, ready to be copied into APP1. Every field the HAL writes has a slot
+ * of its own, so setting one twice replaces it and nothing is dropped.
+ * A setter that keeps the size of a field only rewrites its bytes in
+ * place. Adding, removing or resizing a field lays the body out again,
+ * which happens when the session starts and when GPS comes or goes, not
+ * per picture. Nothing is allocated, a copy is a plain assignment.
+ */
+class ExifBuilder {
+public:
+    /* Slots in the order of their tags within each IFD. */
+    enum Field {
+        /* IFD0 */
+        MAKE = 0,
+        MODEL,
+        ORIENTATION,
+        YCBCR_POSITIONING,
+        /* Exif IFD */
+        EXIF_VERSION,
+        DATE_TIME_ORIGINAL,
+        COMPONENTS_CONFIGURATION,
+        FOCAL_LENGTH,
+        FLASHPIX_VERSION,
+        COLOR_SPACE,
+        PIXEL_X_DIMENSION,
+        PIXEL_Y_DIMENSION,
+        /* GPS IFD, written only when a field past the version is set */
+        GPS_VERSION,
+        GPS_LATITUDE_REF,
+        GPS_LATITUDE,
+        GPS_LONGITUDE_REF,
+        GPS_LONGITUDE,
+        GPS_ALTITUDE_REF,
+        GPS_ALTITUDE,
+        GPS_TIMESTAMP,
+        GPS_PROCESSING_METHOD,
+        GPS_DATESTAMP,
+        FIELD_COUNT
+    };
+
+    enum {
+        kMaxValueSize = 112,    /* bytes of the longest field */
+        kMaxTiffSize = 1024,    /* body without the thumbnail */
+        kMaxApp1Size = 2 + 65535
+    };
+
+    ExifBuilder();
+
+    /* Session constants. */
+    void setCamera(const char *make, const char *model);
+    void setFocalLength(float millimeters);
+
+    /* Per picture. */
+    void setOrientation(int degrees);
+    void setPictureSize(int width, int height);
+    /* "YYYY:MM:DD HH:MM:SS", NULL to leave it out. */
+    void setDateTime(const char *dateTime);
+
+    /* What the client told about the location, parts it left out are
+     * left out of the GPS IFD too. */
+    struct Gps {
+        bool hasPosition;
+        double latitude;        /* degrees, negative south */
+        double longitude;       /* degrees, negative west */
+        bool hasAltitude;
+        double altitude;        /* meters, negative below sea level */
+        bool hasTimestamp;
+        time_t timestamp;       /* UTC */
+        const char *processingMethod;
+    };
+    /* NULL drops the GPS IFD. */
+    void setGps(const Gps *gps);
+
+    /*
+     * Host order value of a field and its TIFF type and count, NULL when
+     * the field is not set. Rationals are numerator, denominator pairs of
+     * uint32_t.
+     */
+    const void *value(Field field, int *type, uint32_t *count) const;
+
+    /* Bytes of the APP1 segment, marker included, for a thumbnail of
+     * thumbnailSize bytes or none if 0. */
+    size_t app1Size(size_t thumbnailSize) const;
+    /* Largest thumbnail that still fits the segment. */
+    size_t maxThumbnailSize() const;
+    /*
+     * Writes the APP1 segment to dst, which holds app1Size(thumbnailSize)
+     * bytes, with IFD1 pointing at the thumbnail if there is one. Returns
+     * the bytes written or 0 if the thumbnail does not fit.
+     */
+    size_t writeApp1(uint8_t *dst, const uint8_t *thumbnail,
+                     size_t thumbnailSize) const;
+
+private:
+    void store(Field field, const void *data, uint32_t count);
+    void storeAscii(Field field, const char *str);
+    void clear(Field field);
+    void update();
+    void layout();
+    void encode(Field field, uint8_t *dst) const;
+
+    struct Value {
+        uint32_t count;         /* 0 when the field is not set */
+        union {
+            uint8_t bytes[kMaxValueSize];
+            uint16_t shorts[kMaxValueSize / 2];
+            uint32_t longs[kMaxValueSize / 4];
+        } data;
+    };
+
+    Value mValues[FIELD_COUNT];
+    /* where each value sits in mTiff, in its entry or after the IFD,
+       0 while it is not laid out */
+    uint16_t mOffsets[FIELD_COUNT];
+    uint32_t mIfd1Offset;       /* also the body size without a thumbnail */
+    uint32_t mNextIfdOffset;    /* IFD0's link to IFD1 */
+    bool mDirty;                /* mTiff lags behind mValues */
+    uint8_t mTiff[kMaxTiffSize];
+};
+
+}; // namespace android
+
+#endif // ANDROID_HARDWARE_EXIF_BUILDER_H
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "FrameRing"
+#include <utils/Log.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <cutils/atomic.h>
+
+#include "FrameRing.h"
+
+namespace android {
+
+FrameRing::FrameRing(const char *name)
+    : mName(name),
+      mSlots(NULL),
+      mMask(0),
+      mHead(0),
+      mTail(0),
+      mEventFd(-1)
+{
+    pthread_mutex_init(&mConsumerLock, NULL);
+}
+
+FrameRing::~FrameRing()
+{
+    if (mEventFd >= 0)
+        close(mEventFd);
+    delete [] mSlots;
+    pthread_mutex_destroy(&mConsumerLock);
+}
+
+bool FrameRing::init(int capacity)
+{
+    uint32_t size = 1;
+
+    while (size < (uint32_t)capacity)
+        size <<= 1;
+
+    if (mEventFd < 0) {
+        mEventFd = eventfd(0, 0);
+        if (mEventFd < 0) {
+            ALOGE("%s: eventfd failed: %s", mName, strerror(errno));
+            return false;
+        }
+    }
+
+    pthread_mutex_lock(&mConsumerLock);
+    if (size > mMask + 1 || mSlots == NULL) {
+        delete [] mSlots;
+        mSlots = new struct msm_frame *[size];
+        mMask = size - 1;
+    }
+    mHead = mTail = 0;
+    pthread_mutex_unlock(&mConsumerLock);
+
+    ALOGV("%s: %u slots", mName, mMask + 1);
+    return true;
+}
+
+bool FrameRing::post(struct msm_frame *frame)
+{
+    int32_t head = mHead;
+    int32_t tail = android_atomic_acquire_load(&mTail);
+
+    if ((uint32_t)(head - tail) > mMask)
+        return false;
+
+    mSlots[head & mMask] = frame;
+    android_atomic_release_store(head + 1, &mHead);
+
+    wake();
+    return true;
+}
+
+struct msm_frame *FrameRing::get()
+{
+    struct msm_frame *frame = NULL;
+
+    pthread_mutex_lock(&mConsumerLock);
+    int32_t tail = mTail;
+    if (android_atomic_acquire_load(&mHead) != tail) {
+        frame = mSlots[tail & mMask];
+        android_atomic_release_store(tail + 1, &mTail);
+    }
+    pthread_mutex_unlock(&mConsumerLock);
+
+    return frame;
+}
+
+int FrameRing::flush()
+{
+    pthread_mutex_lock(&mConsumerLock);
+    int32_t head = android_atomic_acquire_load(&mHead);
+    int dropped = head - mTail;
+    android_atomic_release_store(head, &mTail);
+    pthread_mutex_unlock(&mConsumerLock);
+
+    ALOGV("%s: flushed %d frames", mName, dropped);
+    return dropped;
+}
+
+void FrameRing::wait()
+{
+    uint64_t value;
+
+    // A post after this check leaves the eventfd signalled, so the read
+    // below returns right away and no wakeup is lost.
+    if (count() > 0)
+        return;
+
+    while (read(mEventFd, &value, sizeof(value)) < 0 && errno == EINTR)
+        ;
+}
+
+void FrameRing::wake()
+{
+    uint64_t one = 1;
+
+    while (write(mEventFd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+int FrameRing::count() const
+{
+    return android_atomic_acquire_load(&mHead) - android_atomic_acquire_load(&mTail);
+}
+
+}; // namespace android
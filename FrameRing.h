@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_FRAME_RING_H
+#define ANDROID_HARDWARE_FRAME_RING_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+struct msm_frame;
+
+namespace android {
+
+/*
+ * Fixed-capacity single producer / single consumer ring of frames.
+ *
+ * post() must only be called from one thread; it never blocks and never
+ * allocates. get() and flush() are serialized by a lock the producer never
+ * takes, so stop paths may flush while the consumer thread is still
+ * around. wait() sleeps on an eventfd until a frame is posted or wake()
+ * is called.
+ */
+class FrameRing {
+public:
+    FrameRing(const char *name);
+    ~FrameRing();
+
+    /* Allocates room for at least capacity frames, call before posting. */
+    bool init(int capacity);
+
+    /* Returns false when the ring is full. */
+    bool post(struct msm_frame *frame);
+
+    /* Returns the oldest frame or NULL when the ring is empty. */
+    struct msm_frame *get();
+
+    /* Drops all queued frames, returns how many were dropped. */
+    int flush();
+
+    /* Blocks until the ring is not empty or wake() was called. */
+    void wait();
+    void wake();
+
+    int count() const;
+
+private:
+    FrameRing(const FrameRing &);
+    FrameRing &operator=(const FrameRing &);
+
+    const char *mName;
+    struct msm_frame **mSlots;
+    uint32_t mMask;
+    volatile int32_t mHead;     // next slot to fill, written by post()
+    volatile int32_t mTail;     // next slot to read, written by get()/flush()
+    int mEventFd;
+    pthread_mutex_t mConsumerLock;
+};
+
+}; // namespace android
+
+#endif // ANDROID_HARDWARE_FRAME_RING_H
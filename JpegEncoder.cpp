@@ -0,0 +1,1379 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "JpegEncoder"
+#include <utils/Log.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <cutils/atomic.h>
+#include <cutils/properties.h>
+#include <utils/Timers.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define JPEG_ENCODER_NEON 1
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#define JPEG_ENCODER_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#include "JpegEncoder.h"
+#include "WorkerPool.h"
+#include "YuvScale.h"
+
+namespace android {
+
+/*******************************************************************
+ * tables
+ *******************************************************************/
+
+/* Zigzag position -> natural (row major) coefficient index. */
+static const uint8_t natural_order[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+/* ITU-T T.81 Annex K quantization tables, natural order. */
+static const uint8_t std_luma_quant[64] = {
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99
+};
+
+static const uint8_t std_chroma_quant[64] = {
+    17,  18,  24,  47,  99,  99,  99,  99,
+    18,  21,  26,  66,  99,  99,  99,  99,
+    24,  26,  56,  99,  99,  99,  99,  99,
+    47,  66,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99
+};
+
+/* Annex K Huffman tables: code counts per length, then symbols. */
+static const uint8_t dc_luma_bits[16] = {
+    0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0
+};
+static const uint8_t dc_chroma_bits[16] = {
+    0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0
+};
+static const uint8_t dc_vals[12] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
+};
+
+static const uint8_t ac_luma_bits[16] = {
+    0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d
+};
+static const uint8_t ac_luma_vals[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+    0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+    0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16,
+    0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+    0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+    0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+    0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+    0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+    0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+static const uint8_t ac_chroma_bits[16] = {
+    0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77
+};
+static const uint8_t ac_chroma_vals[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+    0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+    0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34,
+    0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38,
+    0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+    0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
+    0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+    0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+    0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+    0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+/* AAN scale factors: 1 for k == 0, cos(k * pi / 16) * sqrt(2) otherwise. */
+static const float aan_scale[8] = {
+    1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+    1.0f, 0.785694958f, 0.541196100f, 0.275899379f
+};
+
+typedef struct {
+    uint16_t code[256];
+    uint8_t size[256];
+} jpeg_huff_t;
+
+/* Everything that depends only on the quality, shared by all slices. */
+typedef struct {
+    uint8_t luma_quant[64];     /* natural order */
+    uint8_t chroma_quant[64];
+    float luma_div[64];         /* kernel output order, see below */
+    float chroma_div[64];
+    uint8_t zigzag[64];         /* zigzag position -> kernel output index */
+    jpeg_huff_t dc_luma, ac_luma, dc_chroma, ac_chroma;
+} jpeg_tables_t;
+
+static void build_huff(jpeg_huff_t *h, const uint8_t *bits, const uint8_t *vals)
+{
+    int code = 0, k = 0;
+
+    memset(h, 0, sizeof(*h));
+    for (int len = 1; len <= 16; len++) {
+        for (int i = 0; i < bits[len - 1]; i++, k++) {
+            h->code[vals[k]] = code++;
+            h->size[vals[k]] = len;
+        }
+        code <<= 1;
+    }
+}
+
+/*
+ * The kernels leave the coefficients transposed: out[v * 8 + u] holds the
+ * coefficient for vertical frequency u and horizontal frequency v, which
+ * is natural index u * 8 + v. The divisors are stored the same way.
+ */
+static inline int kernel_index(int natural)
+{
+    return (natural & 7) * 8 + (natural >> 3);
+}
+
+static void scale_quant(uint8_t *dst, const uint8_t *std, int quality)
+{
+    int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+
+    for (int i = 0; i < 64; i++) {
+        int q = (std[i] * scale + 50) / 100;
+        dst[i] = q < 1 ? 1 : (q > 255 ? 255 : q);
+    }
+}
+
+static void init_tables(jpeg_tables_t *t, int quality)
+{
+    if (quality < 1)
+        quality = 1;
+    if (quality > 100)
+        quality = 100;
+
+    scale_quant(t->luma_quant, std_luma_quant, quality);
+    scale_quant(t->chroma_quant, std_chroma_quant, quality);
+    for (int n = 0; n < 64; n++) {
+        float aan = aan_scale[n >> 3] * aan_scale[n & 7] * 8.0f;
+        t->luma_div[kernel_index(n)] = 1.0f / (t->luma_quant[n] * aan);
+        t->chroma_div[kernel_index(n)] = 1.0f / (t->chroma_quant[n] * aan);
+    }
+    for (int k = 0; k < 64; k++)
+        t->zigzag[k] = kernel_index(natural_order[k]);
+
+    build_huff(&t->dc_luma, dc_luma_bits, dc_vals);
+    build_huff(&t->ac_luma, ac_luma_bits, ac_luma_vals);
+    build_huff(&t->dc_chroma, dc_chroma_bits, dc_vals);
+    build_huff(&t->ac_chroma, ac_chroma_bits, ac_chroma_vals);
+}
+
+/*******************************************************************
+ * DCT + quantization kernels
+ *
+ * Float AAN forward DCT. Each 1-D pass works down the columns with the
+ * eight columns side by side, so the vector versions handle four columns
+ * per register; an 8x8 transpose between the passes turns rows into
+ * columns. The quantizer divisors include the AAN scaling.
+ *******************************************************************/
+
+typedef struct {
+    const char *name;
+    /* 8x8 samples at src, level shifted, transformed and quantized */
+    void (*fdct_quant)(const uint8_t *src, int stride, const float *div,
+                       int16_t *out);
+} jpeg_kernels_t;
+
+#define FDCT_1D(T, ADD, SUB, MUL, K, d)                                     \
+    do {                                                                    \
+        T tmp0 = ADD(d[0], d[7]), tmp7 = SUB(d[0], d[7]);                   \
+        T tmp1 = ADD(d[1], d[6]), tmp6 = SUB(d[1], d[6]);                   \
+        T tmp2 = ADD(d[2], d[5]), tmp5 = SUB(d[2], d[5]);                   \
+        T tmp3 = ADD(d[3], d[4]), tmp4 = SUB(d[3], d[4]);                   \
+        T tmp10 = ADD(tmp0, tmp3), tmp13 = SUB(tmp0, tmp3);                 \
+        T tmp11 = ADD(tmp1, tmp2), tmp12 = SUB(tmp1, tmp2);                 \
+        d[0] = ADD(tmp10, tmp11);                                           \
+        d[4] = SUB(tmp10, tmp11);                                           \
+        T z1 = MUL(ADD(tmp12, tmp13), K(0.707106781f));                     \
+        d[2] = ADD(tmp13, z1);                                              \
+        d[6] = SUB(tmp13, z1);                                              \
+        tmp10 = ADD(tmp4, tmp5);                                            \
+        tmp11 = ADD(tmp5, tmp6);                                            \
+        tmp12 = ADD(tmp6, tmp7);                                            \
+        T z5 = MUL(SUB(tmp10, tmp12), K(0.382683433f));                     \
+        T z2 = ADD(MUL(tmp10, K(0.541196100f)), z5);                        \
+        T z4 = ADD(MUL(tmp12, K(1.306562965f)), z5);                        \
+        T z3 = MUL(tmp11, K(0.707106781f));                                 \
+        T z11 = ADD(tmp7, z3), z13 = SUB(tmp7, z3);                         \
+        d[5] = ADD(z13, z2);                                                \
+        d[3] = SUB(z13, z2);                                                \
+        d[1] = ADD(z11, z4);                                                \
+        d[7] = SUB(z11, z4);                                                \
+    } while (0)
+
+/*******************************************************************
+ * C kernels
+ *******************************************************************/
+
+#define C_ADD(a, b) ((a) + (b))
+#define C_SUB(a, b) ((a) - (b))
+#define C_MUL(a, b) ((a) * (b))
+#define C_K(k) (k)
+
+static void fdct_quant_c(const uint8_t *src, int stride, const float *div,
+                         int16_t *out)
+{
+    float block[8][8], col[8];
+
+    for (int r = 0; r < 8; r++)
+        for (int c = 0; c < 8; c++)
+            block[r][c] = src[r * stride + c] - 128.0f;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int c = 0; c < 8; c++) {
+            for (int r = 0; r < 8; r++)
+                col[r] = block[r][c];
+            FDCT_1D(float, C_ADD, C_SUB, C_MUL, C_K, col);
+            for (int r = 0; r < 8; r++)
+                block[r][c] = col[r];
+        }
+        for (int r = 0; r < 8; r++)
+            for (int c = r + 1; c < 8; c++) {
+                float t = block[r][c];
+                block[r][c] = block[c][r];
+                block[c][r] = t;
+            }
+    }
+
+    /* after the second transpose the block is back in natural order */
+    for (int r = 0; r < 8; r++)
+        for (int c = 0; c < 8; c++) {
+            float v = block[c][r] * div[r * 8 + c];
+            out[r * 8 + c] = (int16_t)(v < 0 ? v - 0.5f : v + 0.5f);
+        }
+}
+
+static const jpeg_kernels_t kernels_c = {
+    "c", fdct_quant_c
+};
+
+/*******************************************************************
+ * NEON kernels
+ *******************************************************************/
+
+#ifdef JPEG_ENCODER_NEON
+#define NEON_K(k) vdupq_n_f32(k)
+
+static inline void transpose4_neon(float32x4_t &r0, float32x4_t &r1,
+                                   float32x4_t &r2, float32x4_t &r3)
+{
+    float32x4x2_t t0 = vtrnq_f32(r0, r1);
+    float32x4x2_t t1 = vtrnq_f32(r2, r3);
+
+    r0 = vcombine_f32(vget_low_f32(t0.val[0]), vget_low_f32(t1.val[0]));
+    r1 = vcombine_f32(vget_low_f32(t0.val[1]), vget_low_f32(t1.val[1]));
+    r2 = vcombine_f32(vget_high_f32(t0.val[0]), vget_high_f32(t1.val[0]));
+    r3 = vcombine_f32(vget_high_f32(t0.val[1]), vget_high_f32(t1.val[1]));
+}
+
+static void fdct_quant_neon(const uint8_t *src, int stride, const float *div,
+                            int16_t *out)
+{
+    float32x4_t lo[8], hi[8];
+    const float32x4_t bias = vdupq_n_f32(128.0f);
+
+    for (int r = 0; r < 8; r++) {
+        uint16x8_t p = vmovl_u8(vld1_u8(src + r * stride));
+        lo[r] = vsubq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(p))), bias);
+        hi[r] = vsubq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(p))), bias);
+    }
+
+    FDCT_1D(float32x4_t, vaddq_f32, vsubq_f32, vmulq_f32, NEON_K, lo);
+    FDCT_1D(float32x4_t, vaddq_f32, vsubq_f32, vmulq_f32, NEON_K, hi);
+
+    transpose4_neon(lo[0], lo[1], lo[2], lo[3]);
+    transpose4_neon(hi[4], hi[5], hi[6], hi[7]);
+    transpose4_neon(hi[0], hi[1], hi[2], hi[3]);
+    transpose4_neon(lo[4], lo[5], lo[6], lo[7]);
+    for (int i = 0; i < 4; i++) {
+        float32x4_t t = hi[i];
+        hi[i] = lo[i + 4];
+        lo[i + 4] = t;
+    }
+
+    FDCT_1D(float32x4_t, vaddq_f32, vsubq_f32, vmulq_f32, NEON_K, lo);
+    FDCT_1D(float32x4_t, vaddq_f32, vsubq_f32, vmulq_f32, NEON_K, hi);
+
+    /* round half away from zero, like the C kernel */
+    const uint32x4_t sign = vdupq_n_u32(0x80000000);
+    const uint32x4_t half = vreinterpretq_u32_f32(vdupq_n_f32(0.5f));
+    for (int r = 0; r < 8; r++) {
+        float32x4_t a = vmulq_f32(lo[r], vld1q_f32(div + r * 8));
+        float32x4_t b = vmulq_f32(hi[r], vld1q_f32(div + r * 8 + 4));
+        a = vaddq_f32(a, vreinterpretq_f32_u32(
+                vorrq_u32(vandq_u32(vreinterpretq_u32_f32(a), sign), half)));
+        b = vaddq_f32(b, vreinterpretq_f32_u32(
+                vorrq_u32(vandq_u32(vreinterpretq_u32_f32(b), sign), half)));
+        vst1q_s16(out + r * 8, vcombine_s16(vqmovn_s32(vcvtq_s32_f32(a)),
+                                            vqmovn_s32(vcvtq_s32_f32(b))));
+    }
+}
+
+static const jpeg_kernels_t kernels_neon = {
+    "neon", fdct_quant_neon
+};
+#endif
+
+/*******************************************************************
+ * SSE2 kernels
+ *******************************************************************/
+
+#ifdef JPEG_ENCODER_SSE2
+#define SSE_K(k) _mm_set1_ps(k)
+
+static void fdct_quant_sse2(const uint8_t *src, int stride, const float *div,
+                            int16_t *out)
+{
+    __m128 lo[8], hi[8];
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 bias = _mm_set1_ps(128.0f);
+
+    for (int r = 0; r < 8; r++) {
+        __m128i p = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i *)(src + r * stride)), zero);
+        lo[r] = _mm_sub_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(p, zero)), bias);
+        hi[r] = _mm_sub_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(p, zero)), bias);
+    }
+
+    FDCT_1D(__m128, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, SSE_K, lo);
+    FDCT_1D(__m128, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, SSE_K, hi);
+
+    _MM_TRANSPOSE4_PS(lo[0], lo[1], lo[2], lo[3]);
+    _MM_TRANSPOSE4_PS(hi[4], hi[5], hi[6], hi[7]);
+    _MM_TRANSPOSE4_PS(hi[0], hi[1], hi[2], hi[3]);
+    _MM_TRANSPOSE4_PS(lo[4], lo[5], lo[6], lo[7]);
+    for (int i = 0; i < 4; i++) {
+        __m128 t = hi[i];
+        hi[i] = lo[i + 4];
+        lo[i + 4] = t;
+    }
+
+    FDCT_1D(__m128, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, SSE_K, lo);
+    FDCT_1D(__m128, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, SSE_K, hi);
+
+    /* _mm_cvtps_epi32 rounds to nearest, ties differ from C by one at most */
+    for (int r = 0; r < 8; r++) {
+        __m128i a = _mm_cvtps_epi32(_mm_mul_ps(lo[r], _mm_loadu_ps(div + r * 8)));
+        __m128i b = _mm_cvtps_epi32(_mm_mul_ps(hi[r], _mm_loadu_ps(div + r * 8 + 4)));
+        _mm_storeu_si128((__m128i *)(out + r * 8), _mm_packs_epi32(a, b));
+    }
+}
+
+static const jpeg_kernels_t kernels_sse2 = {
+    "sse2", fdct_quant_sse2
+};
+#endif
+
+/*******************************************************************
+ * runtime dispatch
+ *******************************************************************/
+
+static const jpeg_kernels_t *gKernels = &kernels_c;
+static pthread_once_t gKernelsOnce = PTHREAD_ONCE_INIT;
+
+#ifdef JPEG_ENCODER_NEON
+static bool cpu_has_neon(void)
+{
+#if defined(__aarch64__)
+    return true;
+#else
+    char line[512];
+    bool neon = false;
+    FILE *fp = fopen("/proc/cpuinfo", "r");
+
+    if (!fp)
+        return false;
+    while (!neon && fgets(line, sizeof(line), fp)) {
+        if (!strncmp(line, "Features", 8) && strstr(line, " neon"))
+            neon = true;
+    }
+    fclose(fp);
+    return neon;
+#endif
+}
+#endif
+
+static void select_kernels(void)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    /* "c" forces the plain kernels, handy to compare against the vector ones */
+    property_get("persist.camera.hal.jpeg.impl", value, "auto");
+    if (strcmp(value, "c")) {
+#if defined(JPEG_ENCODER_NEON)
+        if (cpu_has_neon())
+            gKernels = &kernels_neon;
+#elif defined(JPEG_ENCODER_SSE2)
+        gKernels = &kernels_sse2;
+#endif
+    }
+    ALOGI("%s: using %s kernels", __FUNCTION__, gKernels->name);
+}
+
+static inline const jpeg_kernels_t *kernels(void)
+{
+    pthread_once(&gKernelsOnce, select_kernels);
+    return gKernels;
+}
+
+const char *jpeg_encoder_impl_name(void)
+{
+    return kernels()->name;
+}
+
+/*******************************************************************
+ * byte and bit output
+ *******************************************************************/
+
+typedef struct {
+    uint8_t *data;
+    uint32_t size;
+    uint32_t capacity;
+    bool failed;
+} jpeg_buf_t;
+
+static bool buf_reserve(jpeg_buf_t *b, uint32_t extra)
+{
+    if (b->failed)
+        return false;
+    if (b->size + extra <= b->capacity)
+        return true;
+
+    uint32_t capacity = b->capacity ? b->capacity : 4096;
+    while (capacity < b->size + extra)
+        capacity *= 2;
+    uint8_t *data = (uint8_t *)realloc(b->data, capacity);
+    if (data == NULL) {
+        b->failed = true;
+        return false;
+    }
+    b->data = data;
+    b->capacity = capacity;
+    return true;
+}
+
+static void buf_free(jpeg_buf_t *b)
+{
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+static inline void put8(jpeg_buf_t *b, int v)
+{
+    if (buf_reserve(b, 1))
+        b->data[b->size++] = v;
+}
+
+static inline void put16be(jpeg_buf_t *b, int v)
+{
+    put8(b, v >> 8);
+    put8(b, v & 0xff);
+}
+
+static void put_bytes(jpeg_buf_t *b, const void *data, uint32_t size)
+{
+    if (buf_reserve(b, size)) {
+        memcpy(b->data + b->size, data, size);
+        b->size += size;
+    }
+}
+
+/* Entropy coded data; the caller reserves room before every MCU. */
+typedef struct {
+    jpeg_buf_t buf;
+    uint64_t acc;
+    int bits;
+} jpeg_bits_t;
+
+static inline void bits_emit(jpeg_bits_t *b, int byte)
+{
+    b->buf.data[b->buf.size++] = byte;
+    if (byte == 0xff)
+        b->buf.data[b->buf.size++] = 0;
+}
+
+/* len is at most 27: a 16 bit code followed by up to 11 value bits. */
+static inline void bits_put(jpeg_bits_t *b, uint32_t code, int len)
+{
+    b->acc = (b->acc << len) | code;
+    b->bits += len;
+    if (b->bits >= 32) {
+        b->bits -= 32;
+        uint32_t w = (uint32_t)(b->acc >> b->bits);
+        uint32_t nw = ~w;
+        /* no 0xff byte in w, so no stuffing needed */
+        if (!((nw - 0x01010101) & ~nw & 0x80808080)) {
+            uint8_t *p = b->buf.data + b->buf.size;
+            p[0] = w >> 24;
+            p[1] = w >> 16;
+            p[2] = w >> 8;
+            p[3] = w;
+            b->buf.size += 4;
+        } else {
+            bits_emit(b, w >> 24);
+            bits_emit(b, (w >> 16) & 0xff);
+            bits_emit(b, (w >> 8) & 0xff);
+            bits_emit(b, w & 0xff);
+        }
+    }
+}
+
+/* Pads the last byte with ones and writes out what is left. */
+static void bits_flush(jpeg_bits_t *b)
+{
+    int pad = (8 - (b->bits & 7)) & 7;
+
+    if (!buf_reserve(&b->buf, 16))
+        return;
+    b->acc = (b->acc << pad) | ((1 << pad) - 1);
+    b->bits += pad;
+    while (b->bits > 0) {
+        b->bits -= 8;
+        bits_emit(b, (b->acc >> b->bits) & 0xff);
+    }
+}
+
+/*******************************************************************
+ * scan encoding
+ *******************************************************************/
+
+typedef struct {
+    const yuv_sp_frame_t *image;
+    const jpeg_tables_t *tables;
+    const jpeg_kernels_t *kernels;
+    bool nv21;
+    int mcu_cols;
+    int mcu_rows;
+    int rows_per_slice;
+    int slices;
+    volatile int32_t next_slice;
+    jpeg_bits_t *out;           /* one per slice */
+    worker_pool_fn side;        /* run by one of the threads next to the slices */
+    void *side_arg;
+    volatile int32_t side_taken;
+} jpeg_scan_t;
+
+static inline void encode_block(jpeg_bits_t *b, const int16_t *coef,
+                                const uint8_t *zigzag, int *last_dc,
+                                const jpeg_huff_t *dc, const jpeg_huff_t *ac)
+{
+    int v = coef[0] - *last_dc;
+    *last_dc = coef[0];
+
+    int a = v < 0 ? -v : v;
+    int nbits = a ? 32 - __builtin_clz(a) : 0;
+    if (v < 0)
+        v--;
+    bits_put(b, (dc->code[nbits] << nbits) | (v & ((1 << nbits) - 1)),
+             dc->size[nbits] + nbits);
+
+    int run = 0;
+    for (int k = 1; k < 64; k++) {
+        v = coef[zigzag[k]];
+        if (v == 0) {
+            run++;
+            continue;
+        }
+        while (run > 15) {
+            bits_put(b, ac->code[0xf0], ac->size[0xf0]);
+            run -= 16;
+        }
+        a = v < 0 ? -v : v;
+        nbits = 32 - __builtin_clz(a);
+        if (v < 0)
+            v--;
+        int sym = (run << 4) | nbits;
+        bits_put(b, (ac->code[sym] << nbits) | (v & ((1 << nbits) - 1)),
+                 ac->size[sym] + nbits);
+        run = 0;
+    }
+    if (run > 0)
+        bits_put(b, ac->code[0x00], ac->size[0x00]);
+}
+
+/*
+ * Gathers one MCU: 16x16 luma and the two 8x8 chroma blocks, replicating
+ * the last column and row past the image edges.
+ */
+static void load_mcu(const jpeg_scan_t *scan, int mx, int my,
+                     uint8_t *luma, uint8_t *cb, uint8_t *cr)
+{
+    const yuv_sp_frame_t *img = scan->image;
+    int x0 = mx * 16, y0 = my * 16;
+    int w = img->width - x0 < 16 ? img->width - x0 : 16;
+    int h = img->height - y0 < 16 ? img->height - y0 : 16;
+
+    for (int r = 0; r < 16; r++) {
+        const uint8_t *s = img->y + (y0 + (r < h ? r : h - 1)) * img->y_stride + x0;
+        memcpy(luma + r * 16, s, w);
+        for (int c = w; c < 16; c++)
+            luma[r * 16 + c] = s[w - 1];
+    }
+
+    int cw = w / 2, ch = h / 2;
+    int first = scan->nv21 ? 1 : 0;     /* offset of Cb in a pair */
+    for (int r = 0; r < 8; r++) {
+        const uint8_t *s = img->uv + (y0 / 2 + (r < ch ? r : ch - 1)) * img->uv_stride + x0;
+        for (int c = 0; c < 8; c++) {
+            int cc = (c < cw ? c : cw - 1) * 2;
+            cb[r * 8 + c] = s[cc + first];
+            cr[r * 8 + c] = s[cc + 1 - first];
+        }
+    }
+}
+
+static void encode_slice(jpeg_scan_t *scan, int slice)
+{
+    const jpeg_tables_t *t = scan->tables;
+    jpeg_bits_t *b = &scan->out[slice];
+    int first = slice * scan->rows_per_slice;
+    int last = first + scan->rows_per_slice;
+    int dc[3] = { 0, 0, 0 };
+    uint8_t luma[256], cb[64], cr[64];
+    int16_t coef[64];
+
+    if (last > scan->mcu_rows)
+        last = scan->mcu_rows;
+
+    buf_reserve(&b->buf, (last - first) * scan->mcu_cols * 128);
+    for (int my = first; my < last; my++) {
+        for (int mx = 0; mx < scan->mcu_cols; mx++) {
+            /* worst case for six blocks with every byte stuffed */
+            if (!buf_reserve(&b->buf, 6 * 2 * 220))
+                return;
+            load_mcu(scan, mx, my, luma, cb, cr);
+            for (int i = 0; i < 4; i++) {
+                scan->kernels->fdct_quant(luma + (i >> 1) * 128 + (i & 1) * 8, 16,
+                                          t->luma_div, coef);
+                encode_block(b, coef, t->zigzag, &dc[0], &t->dc_luma, &t->ac_luma);
+            }
+            scan->kernels->fdct_quant(cb, 8, t->chroma_div, coef);
+            encode_block(b, coef, t->zigzag, &dc[1], &t->dc_chroma, &t->ac_chroma);
+            scan->kernels->fdct_quant(cr, 8, t->chroma_div, coef);
+            encode_block(b, coef, t->zigzag, &dc[2], &t->dc_chroma, &t->ac_chroma);
+        }
+    }
+    bits_flush(b);
+
+    if (slice != scan->slices - 1 && buf_reserve(&b->buf, 2)) {
+        b->buf.data[b->buf.size++] = 0xff;
+        b->buf.data[b->buf.size++] = 0xd0 + (slice & 7);
+    }
+}
+
+static void scan_worker(void *arg)
+{
+    jpeg_scan_t *scan = (jpeg_scan_t *)arg;
+    int slice;
+
+    if (scan->side != NULL && android_atomic_inc(&scan->side_taken) == 0)
+        scan->side(scan->side_arg);
+    while ((slice = android_atomic_inc(&scan->next_slice)) < scan->slices)
+        encode_slice(scan, slice);
+}
+
+/*******************************************************************
+ * headers
+ *******************************************************************/
+
+static void write_dqt(jpeg_buf_t *b, const jpeg_tables_t *t)
+{
+    put16be(b, 0xffdb);
+    put16be(b, 2 + 2 * 65);
+    put8(b, 0);
+    for (int k = 0; k < 64; k++)
+        put8(b, t->luma_quant[natural_order[k]]);
+    put8(b, 1);
+    for (int k = 0; k < 64; k++)
+        put8(b, t->chroma_quant[natural_order[k]]);
+}
+
+static void write_dht_table(jpeg_buf_t *b, int id, const uint8_t *bits,
+                            const uint8_t *vals)
+{
+    int n = 0;
+
+    for (int i = 0; i < 16; i++)
+        n += bits[i];
+    put8(b, id);
+    put_bytes(b, bits, 16);
+    put_bytes(b, vals, n);
+}
+
+static void write_dht(jpeg_buf_t *b)
+{
+    put16be(b, 0xffc4);
+    put16be(b, 2 + 4 * 17 + 12 + 162 + 12 + 162);
+    write_dht_table(b, 0x00, dc_luma_bits, dc_vals);
+    write_dht_table(b, 0x10, ac_luma_bits, ac_luma_vals);
+    write_dht_table(b, 0x01, dc_chroma_bits, dc_vals);
+    write_dht_table(b, 0x11, ac_chroma_bits, ac_chroma_vals);
+}
+
+static void write_frame_headers(jpeg_buf_t *b, const jpeg_tables_t *t,
+                                int width, int height, int restart_interval)
+{
+    write_dqt(b, t);
+
+    put16be(b, 0xffc0);             /* SOF0 */
+    put16be(b, 17);
+    put8(b, 8);
+    put16be(b, height);
+    put16be(b, width);
+    put8(b, 3);
+    put8(b, 1); put8(b, 0x22); put8(b, 0);
+    put8(b, 2); put8(b, 0x11); put8(b, 1);
+    put8(b, 3); put8(b, 0x11); put8(b, 1);
+
+    write_dht(b);
+
+    if (restart_interval) {
+        put16be(b, 0xffdd);         /* DRI */
+        put16be(b, 4);
+        put16be(b, restart_interval);
+    }
+
+    put16be(b, 0xffda);             /* SOS */
+    put16be(b, 12);
+    put8(b, 3);
+    put8(b, 1); put8(b, 0x00);
+    put8(b, 2); put8(b, 0x11);
+    put8(b, 3); put8(b, 0x11);
+    put8(b, 0);
+    put8(b, 63);
+    put8(b, 0);
+}
+
+/*******************************************************************
+ * frame encoding
+ *******************************************************************/
+
+static void output_to_buf(const uint8_t *data, uint32_t size, void *user)
+{
+    put_bytes((jpeg_buf_t *)user, data, size);
+}
+
+/* A frame coded into memory, so its size is known before it goes out. */
+typedef struct {
+    jpeg_buf_t header;          /* SOI, the optional APP1 and the tables */
+    jpeg_bits_t *slices;
+    int count;
+    uint32_t size;              /* all of it, EOI included */
+} jpeg_frame_t;
+
+static void free_frame(jpeg_frame_t *frame)
+{
+    for (int i = 0; i < frame->count; i++)
+        buf_free(&frame->slices[i].buf);
+    free(frame->slices);
+    buf_free(&frame->header);
+    memset(frame, 0, sizeof(*frame));
+}
+
+/*
+ * Codes one frame: SOI, the optional APP1, tables and the scan. Slices
+ * are coded by the calling thread and threads - 1 pool helpers. side, if
+ * given, runs on one of those threads meanwhile and may fill in app1.
+ */
+static bool code_frame(const yuv_sp_frame_t *image, int quality, bool nv21,
+                       int threads, worker_pool_fn side, void *side_arg,
+                       const jpeg_buf_t *app1, jpeg_frame_t *frame)
+{
+    jpeg_tables_t tables;
+    jpeg_scan_t scan;
+
+    init_tables(&tables, quality);
+    memset(frame, 0, sizeof(*frame));
+
+    memset(&scan, 0, sizeof(scan));
+    scan.image = image;
+    scan.tables = &tables;
+    scan.kernels = kernels();
+    scan.nv21 = nv21;
+    scan.side = side;
+    scan.side_arg = side_arg;
+    scan.mcu_cols = (image->width + 15) / 16;
+    scan.mcu_rows = (image->height + 15) / 16;
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > WORKER_POOL_MAX_HELPERS + 1)
+        threads = WORKER_POOL_MAX_HELPERS + 1;
+
+    /* A few slices per thread keep them busy when slices differ in cost.
+     * The restart interval counts MCUs and has to fit 16 bits. */
+    int slices = threads > 1 ? threads * 4 : 1;
+    if (slices > scan.mcu_rows)
+        slices = scan.mcu_rows;
+    scan.rows_per_slice = (scan.mcu_rows + slices - 1) / slices;
+    while (scan.rows_per_slice * scan.mcu_cols > 0xffff)
+        scan.rows_per_slice--;
+    scan.slices = (scan.mcu_rows + scan.rows_per_slice - 1) / scan.rows_per_slice;
+
+    scan.out = (jpeg_bits_t *)calloc(scan.slices, sizeof(jpeg_bits_t));
+    if (scan.out == NULL)
+        return false;
+    frame->slices = scan.out;
+    frame->count = scan.slices;
+
+    if (threads > scan.slices)
+        threads = scan.slices;
+    worker_pool_run(scan_worker, &scan, threads - 1);
+
+    put16be(&frame->header, 0xffd8);
+    if (app1 != NULL && app1->size > 0)
+        put_bytes(&frame->header, app1->data, app1->size);
+    write_frame_headers(&frame->header, &tables, image->width, image->height,
+                        scan.slices > 1 ? scan.rows_per_slice * scan.mcu_cols : 0);
+
+    bool failed = frame->header.failed;
+    frame->size = frame->header.size + 2;
+    for (int i = 0; i < scan.slices; i++) {
+        failed |= scan.out[i].buf.failed;
+        frame->size += scan.out[i].buf.size;
+    }
+    if (failed)
+        ALOGE("%s: out of memory", __FUNCTION__);
+    return !failed;
+}
+
+static int output_frame(const jpeg_frame_t *frame, jpeg_output_fn output,
+                        void *user)
+{
+    static const uint8_t eoi[2] = { 0xff, 0xd9 };
+
+    output(frame->header.data, frame->header.size, user);
+    for (int i = 0; i < frame->count; i++)
+        output(frame->slices[i].buf.data, frame->slices[i].buf.size, user);
+    output(eoi, sizeof(eoi), user);
+    return frame->size;
+}
+
+static int encode_frame(const yuv_sp_frame_t *image, int quality, bool nv21,
+                        int threads, worker_pool_fn side, void *side_arg,
+                        jpeg_buf_t *app1, jpeg_output_fn output, void *user)
+{
+    jpeg_frame_t frame;
+    int total = -1;
+
+    if (code_frame(image, quality, nv21, threads, side, side_arg, app1, &frame))
+        total = output_frame(&frame, output, user);
+    free_frame(&frame);
+    return total;
+}
+
+/*
+ * Area averages the image down to the thumbnail and encodes that, lowering
+ * the quality until it fits into APP1. It runs next to the main scan, so
+ * the scaling and coding stay on this thread.
+ */
+static bool encode_thumbnail(const yuv_sp_frame_t *image,
+                             const jpeg_encode_params_t *params,
+                             jpeg_buf_t *out)
+{
+    yuv_sp_frame_t thumb;
+    int width = params->thumbnail_width & ~1;
+    int height = params->thumbnail_height & ~1;
+
+    if (width <= 0 || height <= 0)
+        return false;
+    if (width > image->width || height > image->height) {
+        width = image->width;
+        height = image->height;
+    }
+
+    uint8_t *pixels = params->thumbnail_buffer;
+    if (pixels == NULL)
+        pixels = (uint8_t *)malloc(width * height * 3 / 2);
+    if (pixels == NULL)
+        return false;
+    yuv_sp_frame_init(&thumb, pixels, width, height, width);
+
+    bool ok = false;
+    int q = yuv_scale(image, &thumb, YUV_SCALE_AREA, 1) == 0 ?
+            params->thumbnail_quality : 0;
+    for (; q > 0; q -= 15) {
+        out->size = 0;
+        if (encode_frame(&thumb, q, params->nv21, 1, NULL, NULL, NULL,
+                         output_to_buf, out) < 0)
+            break;
+        if (out->size <= params->exif->maxThumbnailSize()) {
+            ok = true;
+            break;
+        }
+        ALOGV("%s: %u bytes at quality %d is too big", __FUNCTION__, out->size, q);
+    }
+    if (pixels != params->thumbnail_buffer)
+        free(pixels);
+    return ok;
+}
+
+typedef struct {
+    const yuv_sp_frame_t *image;
+    const jpeg_encode_params_t *params;
+    jpeg_buf_t app1;
+} jpeg_app1_job_t;
+
+/* Builds APP1 from the EXIF fields and the thumbnail. */
+static void build_app1(void *arg)
+{
+    jpeg_app1_job_t *job = (jpeg_app1_job_t *)arg;
+    const jpeg_encode_params_t *params = job->params;
+    jpeg_buf_t thumb;
+
+    memset(&thumb, 0, sizeof(thumb));
+    if (params->thumbnail_width > 0 && params->thumbnail_height > 0 &&
+        !encode_thumbnail(job->image, params, &thumb)) {
+        ALOGE("%s: writing EXIF without thumbnail", __FUNCTION__);
+        thumb.size = 0;
+    }
+    if (buf_reserve(&job->app1, params->exif->app1Size(thumb.size))) {
+        job->app1.size = params->exif->writeApp1(job->app1.data, thumb.data,
+                                                 thumb.size);
+    }
+    buf_free(&thumb);
+}
+
+/*******************************************************************
+ * rate control
+ *
+ * Short runs of MCUs spread over the image are transformed once, without
+ * quantization. Quantizing that sample for a quality and counting its
+ * Huffman bits costs a small fraction of a scan, so the quality for a
+ * size is found by bisection, scaling the sample's bits up by its share
+ * of the MCUs. Full resolution blocks are used rather than a scaled down
+ * image, whose spectrum says little about the bits of the real one.
+ *******************************************************************/
+
+#define RC_RUN          4       /* adjacent MCUs per run, keeps DC deltas honest */
+#define RC_MAX_RUNS     64
+#define RC_OVERHEAD     640     /* SOI, tables, restart markers and EOI, about */
+#define RC_AIM          95      /* percent of the scan budget aimed at */
+#define RC_UNDERSHOOT   85      /* a frame under this percent of the target
+                                   is coded again at a higher quality */
+
+typedef struct {
+    int16_t *coef;              /* 6 blocks per MCU, kernel order, unquantized */
+    int mcus;
+    int run;                    /* MCUs per run, DC prediction restarts */
+    double scale;               /* image MCUs per sampled MCU */
+    uint32_t bytes[101];        /* scan bytes predicted per quality, 0 unknown */
+} jpeg_sample_t;
+
+static bool sample_image(const yuv_sp_frame_t *image, bool nv21,
+                         jpeg_sample_t *sample)
+{
+    jpeg_scan_t scan;
+    const jpeg_kernels_t *k = kernels();
+    uint8_t luma[256], cb[64], cr[64];
+    float div[64];
+
+    memset(sample, 0, sizeof(*sample));
+    memset(&scan, 0, sizeof(scan));
+    scan.image = image;
+    scan.nv21 = nv21;
+    scan.mcu_cols = (image->width + 15) / 16;
+    scan.mcu_rows = (image->height + 15) / 16;
+
+    int total = scan.mcu_cols * scan.mcu_rows;
+    sample->run = total < RC_RUN ? total : RC_RUN;
+    int runs = total / sample->run;
+    int step = (runs + RC_MAX_RUNS - 1) / RC_MAX_RUNS;
+    runs /= step;
+
+    sample->coef = (int16_t *)malloc(runs * sample->run * 6 * 64 * sizeof(int16_t));
+    if (sample->coef == NULL)
+        return false;
+
+    for (int n = 0; n < 64; n++)
+        div[kernel_index(n)] = 1.0f / (aan_scale[n >> 3] * aan_scale[n & 7] * 8.0f);
+
+    /* one run out of every step, at a scrambled place within it so the
+       runs do not line up with structure in the image */
+    int16_t *c = sample->coef;
+    for (int r = 0; r < runs; r++) {
+        uint32_t jitter = (r + 1) * 2654435761u;
+        int first = (r * step + (jitter >> 16) % step) * sample->run;
+        for (int m = first; m < first + sample->run; m++, c += 6 * 64) {
+            load_mcu(&scan, m % scan.mcu_cols, m / scan.mcu_cols, luma, cb, cr);
+            for (int i = 0; i < 4; i++)
+                k->fdct_quant(luma + (i >> 1) * 128 + (i & 1) * 8, 16, div,
+                              c + i * 64);
+            k->fdct_quant(cb, 8, div, c + 4 * 64);
+            k->fdct_quant(cr, 8, div, c + 5 * 64);
+        }
+    }
+    sample->mcus = runs * sample->run;
+    sample->scale = (double)total / sample->mcus;
+    return true;
+}
+
+/* Huffman bits of one quantized block, as encode_block would write them. */
+static inline uint32_t block_bits(const int16_t *coef, const uint8_t *zigzag,
+                                  int *last_dc, const jpeg_huff_t *dc,
+                                  const jpeg_huff_t *ac)
+{
+    int v = coef[0] - *last_dc;
+    *last_dc = coef[0];
+
+    int a = v < 0 ? -v : v;
+    int nbits = a ? 32 - __builtin_clz(a) : 0;
+    uint32_t bits = dc->size[nbits] + nbits;
+
+    int run = 0;
+    for (int k = 1; k < 64; k++) {
+        v = coef[zigzag[k]];
+        if (v == 0) {
+            run++;
+            continue;
+        }
+        for (; run > 15; run -= 16)
+            bits += ac->size[0xf0];
+        a = v < 0 ? -v : v;
+        nbits = 32 - __builtin_clz(a);
+        bits += ac->size[(run << 4) | nbits] + nbits;
+        run = 0;
+    }
+    if (run > 0)
+        bits += ac->size[0x00];
+    return bits;
+}
+
+/* Scan bytes of the whole image at quality as predicted from the sample. */
+static uint32_t sample_bytes(jpeg_sample_t *sample, int quality)
+{
+    jpeg_tables_t t;
+    float inv[2][64];
+    int16_t q[64];
+    uint64_t bits = 0;
+    int dc[3];
+
+    if (sample->bytes[quality] != 0)
+        return sample->bytes[quality];
+
+    init_tables(&t, quality);
+    for (int n = 0; n < 64; n++) {
+        inv[0][kernel_index(n)] = 1.0f / t.luma_quant[n];
+        inv[1][kernel_index(n)] = 1.0f / t.chroma_quant[n];
+    }
+
+    const int16_t *c = sample->coef;
+    for (int m = 0; m < sample->mcus; m++) {
+        if (m % sample->run == 0)
+            dc[0] = dc[1] = dc[2] = 0;
+        for (int b = 0; b < 6; b++, c += 64) {
+            const float *f = inv[b < 4 ? 0 : 1];
+            for (int k = 0; k < 64; k++)
+                q[k] = (int16_t)lrintf(c[k] * f[k]);
+            if (b < 4)
+                bits += block_bits(q, t.zigzag, &dc[0], &t.dc_luma, &t.ac_luma);
+            else
+                bits += block_bits(q, t.zigzag, &dc[b - 3], &t.dc_chroma,
+                                   &t.ac_chroma);
+        }
+    }
+
+    sample->bytes[quality] = (uint32_t)(bits / 8 * sample->scale) + 1;
+    return sample->bytes[quality];
+}
+
+/*
+ * Highest quality whose predicted scan, times correction, fits into
+ * budget. Sizes only grow with the quality, so bisection will do.
+ */
+static int pick_quality(jpeg_sample_t *sample, uint32_t budget,
+                        double correction)
+{
+    int lo = 1, hi = 100, best = 1;
+
+    while (lo <= hi) {
+        int q = (lo + hi) / 2;
+        if (sample_bytes(sample, q) * correction <= budget) {
+            best = q;
+            lo = q + 1;
+        } else {
+            hi = q - 1;
+        }
+    }
+    return best;
+}
+
+int jpeg_estimate_quality(const yuv_sp_frame_t *image, bool nv21,
+                          uint32_t target_size)
+{
+    jpeg_sample_t sample;
+    int quality = -1;
+
+    if (image == NULL || image->width <= 0 || image->height <= 0)
+        return -1;
+    if (sample_image(image, nv21, &sample)) {
+        uint32_t budget = target_size > RC_OVERHEAD ? target_size - RC_OVERHEAD : 1;
+        quality = pick_quality(&sample, budget / 100 * RC_AIM, 1.0);
+    }
+    free(sample.coef);
+    return quality;
+}
+
+typedef struct {
+    jpeg_app1_job_t *app1;
+    const jpeg_encode_params_t *params;
+    jpeg_sample_t sample;
+    bool sampled;
+    nsecs_t sample_time;
+    volatile int32_t next;
+} jpeg_rc_job_t;
+
+/* APP1 and the sample, by whichever threads get to them. */
+static void rc_worker(void *arg)
+{
+    jpeg_rc_job_t *job = (jpeg_rc_job_t *)arg;
+    int task;
+
+    while ((task = android_atomic_inc(&job->next)) < 2) {
+        if (task == 0 && job->params->exif != NULL)
+            build_app1(job->app1);
+        else if (task == 1) {
+            nsecs_t start = systemTime();
+            job->sampled = sample_image(job->app1->image, job->params->nv21,
+                                        &job->sample);
+            job->sample_time = systemTime() - start;
+        }
+    }
+}
+
+/*
+ * Codes the frame at the quality predicted for params->target_size. APP1
+ * is built next to the sampling instead of next to the scan, so its size
+ * is known when the quality is picked. A frame over the target or well
+ * under it is coded once more, with the prediction corrected by how far
+ * off the first one was, and the closer fit of the two goes out.
+ */
+static int encode_to_size(const yuv_sp_frame_t *image,
+                          const jpeg_encode_params_t *params, int threads,
+                          jpeg_app1_job_t *app1)
+{
+    jpeg_encode_stats_t stats;
+    jpeg_frame_t frames[2];
+    jpeg_rc_job_t job;
+    uint32_t target = params->target_size;
+    int total = -1, pick = 0;
+
+    memset(&stats, 0, sizeof(stats));
+    memset(frames, 0, sizeof(frames));
+    memset(&job, 0, sizeof(job));
+    job.app1 = app1;
+    job.params = params;
+
+    worker_pool_run(rc_worker, &job, threads > 1 ? 1 : 0);
+    if (!job.sampled) {
+        ALOGE("%s: out of memory", __FUNCTION__);
+        goto out;
+    }
+
+    {
+        uint32_t fixed = RC_OVERHEAD + app1->app1.size;
+        uint32_t budget = target > fixed ? target - fixed : 1;
+        uint32_t aim = budget / 100 * RC_AIM;
+
+        nsecs_t start = systemTime();
+        stats.quality = pick_quality(&job.sample, aim, 1.0);
+        /* APP1 is not counted, it would have been built anyway */
+        stats.extra_time = job.sample_time + systemTime() - start;
+        if (!code_frame(image, stats.quality, params->nv21, threads, NULL, NULL,
+                        &app1->app1, &frames[0]))
+            goto out;
+        stats.passes = 1;
+
+        if (frames[0].size > target ||
+            frames[0].size < target / 100 * RC_UNDERSHOOT) {
+            nsecs_t again = systemTime();
+            uint32_t scan = frames[0].size - frames[0].header.size - 2;
+            double correction = (double)scan / sample_bytes(&job.sample, stats.quality);
+            int quality = pick_quality(&job.sample, aim, correction);
+
+            ALOGV("%s: %u bytes at quality %d for %u, scan %.2fx the estimate",
+                  __FUNCTION__, frames[0].size, stats.quality, target, correction);
+            if (quality != stats.quality) {
+                bool ok = code_frame(image, quality, params->nv21, threads,
+                                     NULL, NULL, &app1->app1, &frames[1]);
+                stats.passes = 2;
+
+                /* the larger of those that fit, else the smaller */
+                bool fits0 = frames[0].size <= target;
+                bool fits1 = frames[1].size <= target;
+                if (!ok)
+                    pick = 0;
+                else if (fits0 != fits1)
+                    pick = fits1;
+                else if (fits1)
+                    pick = frames[1].size > frames[0].size;
+                else
+                    pick = frames[1].size < frames[0].size;
+                if (pick == 1)
+                    stats.quality = quality;
+            }
+            stats.extra_time += systemTime() - again;
+        }
+        total = output_frame(&frames[pick], params->output, params->user);
+        stats.size = total;
+        if ((uint32_t)total > target)
+            ALOGI("%s: %d bytes at quality %d exceed the target of %u",
+                  __FUNCTION__, total, stats.quality, target);
+    }
+
+out:
+    free_frame(&frames[0]);
+    free_frame(&frames[1]);
+    free(job.sample.coef);
+    if (params->stats != NULL)
+        *params->stats = stats;
+    return total;
+}
+
+void jpeg_encode_params_init(jpeg_encode_params_t *params)
+{
+    memset(params, 0, sizeof(*params));
+    params->quality = 85;
+    params->thumbnail_quality = 85;
+    params->nv21 = true;
+}
+
+int jpeg_encode_yuv420sp(const yuv_sp_frame_t *image,
+                         const jpeg_encode_params_t *params)
+{
+    jpeg_app1_job_t app1;
+
+    if (image == NULL || params == NULL || params->output == NULL ||
+        image->width <= 0 || image->height <= 0 ||
+        (image->width & 1) || (image->height & 1) ||
+        image->width > 0xffff || image->height > 0xffff) {
+        ALOGE("%s: invalid arguments", __FUNCTION__);
+        return -1;
+    }
+
+    /* The thumbnail and EXIF are built while the main scan is coded. */
+    memset(&app1, 0, sizeof(app1));
+    app1.image = image;
+    app1.params = params;
+
+    int threads = params->threads > 0 ? params->threads : worker_pool_cpus();
+    if (params->target_size > 0) {
+        int total = encode_to_size(image, params, threads, &app1);
+        buf_free(&app1.app1);
+        return total;
+    }
+
+    int total = encode_frame(image, params->quality, params->nv21, threads,
+                             params->exif != NULL ? build_app1 : NULL, &app1,
+                             &app1.app1,
+                             params->output, params->user);
+    buf_free(&app1.app1);
+    if (params->stats != NULL) {
+        memset(params->stats, 0, sizeof(*params->stats));
+        params->stats->quality = params->quality;
+        params->stats->passes = 1;
+        params->stats->size = total;
+    }
+    return total;
+}
+
+static void count_output(const uint8_t *, uint32_t size, void *user)
+{
+    *(uint32_t *)user += size;
+}
+
+void jpeg_encoder_benchmark(const yuv_sp_frame_t *image, int quality,
+                            int max_threads)
+{
+    nsecs_t single = 0;
+
+    if (max_threads <= 0)
+        max_threads = worker_pool_cpus();
+    if (max_threads > WORKER_POOL_MAX_HELPERS + 1)
+        max_threads = WORKER_POOL_MAX_HELPERS + 1;
+
+    for (int threads = 1; threads <= max_threads; threads++) {
+        nsecs_t best = 0;
+        uint32_t bytes = 0;
+
+        for (int run = 0; run < 3; run++) {
+            bytes = 0;
+            nsecs_t start = systemTime();
+            if (encode_frame(image, quality, true, threads, NULL, NULL, NULL,
+                             count_output, &bytes) < 0)
+                return;
+            nsecs_t elapsed = systemTime() - start;
+            if (run == 0 || elapsed < best)
+                best = elapsed;
+        }
+        if (threads == 1)
+            single = best;
+        ALOGI("jpeg benchmark %dx%d q%d (%s): %d threads %lld us, %.2fx, %u bytes",
+              image->width, image->height, quality, jpeg_encoder_impl_name(),
+              threads, (long long)(best / 1000), (double)single / best, bytes);
+    }
+}
+
+}; // namespace android
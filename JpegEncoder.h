@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_JPEG_ENCODER_H
+#define ANDROID_HARDWARE_JPEG_ENCODER_H
+
+#include <stdint.h>
+
+#include "ExifBuilder.h"
+#include "YuvTransform.h"
+
+namespace android {
+
+/*
+ * Baseline JPEG encoder for YUV420 semi-planar frames (NV21/NV12).
+ *
+ * The image is cut into slices of whole MCU rows separated by restart
+ * markers. Slices are transformed and entropy coded independently, on as
+ * many threads as asked for, and written out in order, so the result is
+ * a plain baseline stream any decoder reads. The APP1 segment from an
+ * ExifBuilder with an optional thumbnail, area averaged from the main image
+ * while the slices are coded, precedes the scan.
+ */
+
+/* Receives the compressed stream in order, one piece at a time. */
+typedef void (*jpeg_output_fn)(const uint8_t *data, uint32_t size, void *user);
+
+/* How a picture came out, filled in by jpeg_encode_yuv420sp. */
+typedef struct {
+    int quality;                /* the one the delivered stream was coded at */
+    int passes;                 /* times the scan was coded */
+    int size;                   /* bytes delivered */
+    int64_t extra_time;         /* ns spent on rate control and a second pass */
+} jpeg_encode_stats_t;
+
+typedef struct {
+    int quality;                /* 1..100, ignored with a target_size */
+    uint32_t target_size;       /* bytes to stay under, 0 to code at quality */
+    bool nv21;                  /* chroma pairs are CrCb, otherwise CbCr */
+    int thumbnail_width;        /* 0 for no thumbnail */
+    int thumbnail_height;
+    int thumbnail_quality;
+    uint8_t *thumbnail_buffer;  /* thumbnail_width * thumbnail_height * 3 / 2
+                                   bytes reused for the scaled thumbnail, NULL
+                                   to allocate them per picture */
+    const ExifBuilder *exif;    /* APP1 fields, NULL for no APP1 and thus
+                                   no thumbnail */
+    int threads;                /* 0 for one per online cpu, capped at 16 */
+    jpeg_output_fn output;
+    void *user;
+    jpeg_encode_stats_t *stats; /* NULL if not wanted */
+} jpeg_encode_params_t;
+
+/* Quality 85, NV21, no thumbnail, no EXIF, one thread per cpu. */
+void jpeg_encode_params_init(jpeg_encode_params_t *params);
+
+/*
+ * Encodes image and passes the stream to params->output. Width and height
+ * must be even. Returns the number of bytes produced or -1 on error.
+ *
+ * With a target_size the quality is picked from a sample of the image's
+ * blocks and the scan is coded again, at most once, if it misses the
+ * target by too much. The stream may still exceed the target when even
+ * quality 1 does, see params->stats.
+ */
+int jpeg_encode_yuv420sp(const yuv_sp_frame_t *image,
+                         const jpeg_encode_params_t *params);
+
+/*
+ * Quality at which image should come out at about target_size bytes
+ * without APP1, predicted from a sample of its blocks, or -1 on error.
+ * For encoders that cannot be driven by jpeg_encode_yuv420sp's own rate
+ * control.
+ */
+int jpeg_estimate_quality(const yuv_sp_frame_t *image, bool nv21,
+                          uint32_t target_size);
+
+/*
+ * Encodes image with 1, 2, ... max_threads threads (0 for one per online
+ * cpu), best of three runs each, and logs the times. The output is thrown
+ * away.
+ */
+void jpeg_encoder_benchmark(const yuv_sp_frame_t *image, int quality,
+                            int max_threads);
+
+/* Name of the DCT kernels picked at runtime ("neon", "sse2", "c"). */
+const char *jpeg_encoder_impl_name(void);
+
+}; // namespace android
+
+#endif // ANDROID_HARDWARE_JPEG_ENCODER_H
@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "JpegSink"
+#include <utils/Log.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <binder/MemoryBase.h>
+#include <binder/MemoryHeapBase.h>
+
+#include "JpegSink.h"
+
+namespace android {
+
+ChunkJpegSink::ChunkJpegSink(size_t chunkSize)
+    : mChunkSize(chunkSize),
+      mHead(NULL),
+      mTail(NULL),
+      mSize(0),
+      mAllocated(0),
+      mPeak(0),
+      mFailed(false)
+{
+}
+
+ChunkJpegSink::~ChunkJpegSink()
+{
+    freeChunks();
+}
+
+bool ChunkJpegSink::begin()
+{
+    freeChunks();
+    mSize = 0;
+    mPeak = 0;
+    mFailed = false;
+    return true;
+}
+
+bool ChunkJpegSink::write(const uint8_t *data, size_t size)
+{
+    if (mFailed)
+        return false;
+
+    while (size > 0) {
+        if (mTail == NULL || mTail->used == mChunkSize) {
+            Chunk *chunk = (Chunk *)malloc(sizeof(Chunk) + mChunkSize);
+            if (chunk == NULL) {
+                ALOGE("%s: out of memory after %u bytes", __FUNCTION__, mSize);
+                mFailed = true;
+                return false;
+            }
+            chunk->next = NULL;
+            chunk->used = 0;
+            if (mTail != NULL)
+                mTail->next = chunk;
+            else
+                mHead = chunk;
+            mTail = chunk;
+            mAllocated += mChunkSize;
+            notePeak(0);
+        }
+
+        size_t n = mChunkSize - mTail->used;
+        if (n > size)
+            n = size;
+        memcpy(mTail->data() + mTail->used, data, n);
+        mTail->used += n;
+        mSize += n;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+sp<IMemory> ChunkJpegSink::end(bool deliver)
+{
+    sp<IMemory> picture;
+
+    if (deliver && !mFailed && mSize > 0) {
+        sp<MemoryHeapBase> heap = new MemoryHeapBase(mSize, 0, "jpeg");
+        if (heap->getHeapID() >= 0 && heap->getBase() != MAP_FAILED) {
+            notePeak(mSize);
+            gather(heap->getBase());
+            picture = new MemoryBase(heap, 0, mSize);
+        } else {
+            ALOGE("%s: no heap for %u bytes", __FUNCTION__, mSize);
+        }
+    }
+    freeChunks();
+    return picture;
+}
+
+void ChunkJpegSink::gather(void *dst) const
+{
+    uint8_t *p = (uint8_t *)dst;
+
+    for (Chunk *chunk = mHead; chunk != NULL; chunk = chunk->next) {
+        memcpy(p, chunk->data(), chunk->used);
+        p += chunk->used;
+    }
+}
+
+void ChunkJpegSink::notePeak(size_t extra)
+{
+    if (mAllocated + extra > mPeak)
+        mPeak = mAllocated + extra;
+}
+
+void ChunkJpegSink::freeChunks()
+{
+    while (mHead != NULL) {
+        Chunk *next = mHead->next;
+        free(mHead);
+        mHead = next;
+    }
+    mTail = NULL;
+    mAllocated = 0;
+}
+
+FdJpegSink::FdJpegSink(const char *dir)
+    : mFd(-1),
+      mSize(0),
+      mFailed(false)
+{
+    strlcpy(mDir, dir, sizeof(mDir));
+}
+
+FdJpegSink::~FdJpegSink()
+{
+    if (mFd >= 0)
+        close(mFd);
+}
+
+bool FdJpegSink::begin()
+{
+    char path[sizeof(mDir) + 32];
+
+    if (mFd >= 0)
+        close(mFd);
+    mSize = 0;
+    mFailed = false;
+
+    snprintf(path, sizeof(path), "%s/jpeg-%d-XXXXXX", mDir, getpid());
+    mFd = mkstemp(path);
+    if (mFd < 0) {
+        ALOGE("%s: cannot create %s: %s", __FUNCTION__, path, strerror(errno));
+        mFailed = true;
+        return false;
+    }
+    unlink(path);
+    return true;
+}
+
+bool FdJpegSink::write(const uint8_t *data, size_t size)
+{
+    if (mFailed)
+        return false;
+
+    while (size > 0) {
+        ssize_t n = ::write(mFd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            ALOGE("%s: write failed after %u bytes: %s", __FUNCTION__, mSize,
+                  strerror(errno));
+            mFailed = true;
+            return false;
+        }
+        data += n;
+        size -= n;
+        mSize += n;
+    }
+    return true;
+}
+
+sp<IMemory> FdJpegSink::end(bool deliver)
+{
+    sp<IMemory> picture;
+
+    if (deliver && !mFailed && mSize > 0) {
+        // The heap maps its own dup of the file, ours can go.
+        sp<MemoryHeapBase> heap = new MemoryHeapBase(mFd, mSize);
+        if (heap->getBase() != MAP_FAILED)
+            picture = new MemoryBase(heap, 0, mSize);
+        else
+            ALOGE("%s: cannot map %u bytes", __FUNCTION__, mSize);
+    }
+    if (mFd >= 0) {
+        close(mFd);
+        mFd = -1;
+    }
+    return picture;
+}
+
+}; // namespace android
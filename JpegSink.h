@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_JPEG_SINK_H
+#define ANDROID_HARDWARE_JPEG_SINK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <binder/IMemory.h>
+#include <utils/RefBase.h>
+
+namespace android {
+
+/*
+ * Receives a compressed picture fragment by fragment as the encoder
+ * produces it, instead of the HAL collecting it in a heap sized for the
+ * worst case. begin() starts a picture and end() finishes it. end()
+ * either hands the picture to the client itself and returns NULL, or
+ * returns the memory the HAL should pass to the data callback.
+ */
+class JpegSink : public virtual RefBase {
+public:
+    virtual ~JpegSink() {}
+    virtual const char *name() const = 0;
+    virtual bool begin() = 0;
+    virtual bool write(const uint8_t *data, size_t size) = 0;
+    /* deliver is false when the encoder failed or nobody wants the picture */
+    virtual sp<IMemory> end(bool deliver) = 0;
+    /* Bytes of the current or last picture. */
+    virtual size_t size() const = 0;
+    /* Most memory the sink held at once for the last picture. */
+    virtual size_t peakMemory() const = 0;
+};
+
+/*
+ * Collects the picture in a list of fixed size chunks, so nothing has to
+ * be reserved up front, and gathers it into an ashmem heap of the exact
+ * size at the end. The chunks are freed once the picture is out.
+ */
+class ChunkJpegSink : public JpegSink {
+public:
+    enum { kDefaultChunkSize = 64 * 1024 };
+
+    ChunkJpegSink(size_t chunkSize = kDefaultChunkSize);
+    virtual ~ChunkJpegSink();
+
+    virtual const char *name() const { return "chunks"; }
+    virtual bool begin();
+    virtual bool write(const uint8_t *data, size_t size);
+    virtual sp<IMemory> end(bool deliver);
+    virtual size_t size() const { return mSize; }
+    virtual size_t peakMemory() const { return mPeak; }
+
+protected:
+    /* Copies the picture into dst, which holds at least size() bytes. */
+    void gather(void *dst) const;
+    bool failed() const { return mFailed; }
+    /* Accounts for memory held next to the chunks, e.g. the gather target. */
+    void notePeak(size_t extra);
+    void freeChunks();
+
+private:
+    struct Chunk {
+        Chunk *next;
+        size_t used;
+        uint8_t *data() { return (uint8_t *)(this + 1); }
+    };
+    size_t mChunkSize;
+    Chunk *mHead;
+    Chunk *mTail;
+    size_t mSize;
+    size_t mAllocated;
+    size_t mPeak;
+    bool mFailed;
+};
+
+/*
+ * Writes the picture to an unlinked file in dir, so it sits in the page
+ * cache rather than in the camera process, and hands out a mapping of
+ * the file at the end. Every picture gets a file of its own as the client
+ * may still be reading the previous one.
+ */
+class FdJpegSink : public JpegSink {
+public:
+    FdJpegSink(const char *dir);
+    virtual ~FdJpegSink();
+
+    virtual const char *name() const { return "fd"; }
+    virtual bool begin();
+    virtual bool write(const uint8_t *data, size_t size);
+    virtual sp<IMemory> end(bool deliver);
+    virtual size_t size() const { return mSize; }
+    virtual size_t peakMemory() const { return mSize; }
+
+private:
+    char mDir[128];
+    int mFd;
+    size_t mSize;
+    bool mFailed;
+};
+
+}; // namespace android
+
+#endif // ANDROID_HARDWARE_JPEG_SINK_H
@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "MemAlloc"
+#include <utils/Log.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__ANDROID__) || defined(HAVE_ANDROID_OS)
+#include <cutils/ashmem.h>
+#define HAVE_ASHMEM 1
+#endif
+
+#include "MemAlloc.h"
+
+/* Older kernel headers know neither the syscall nor its flags. */
+#if !defined(__NR_memfd_create) && defined(__arm__)
+#define __NR_memfd_create 385
+#endif
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif
+#ifndef MFD_HUGE_2MB
+#define MFD_HUGE_2MB (21U << 26)
+#endif
+
+#define HUGE_PAGE_SIZE (2U << 20)
+
+namespace android {
+
+void mem_layout_init(mem_layout_t *layout, int buffer_size, int num_buffers,
+                     int frame_size, int cbcr_offset, size_t align)
+{
+    int mask = (int)align - 1;
+
+    layout->buffer_size = buffer_size;
+    layout->aligned_buffer_size = (buffer_size + mask) & ~mask;
+    layout->num_buffers = num_buffers;
+    layout->frame_size = frame_size;
+    layout->cbcr_offset = cbcr_offset;
+    layout->heap_size = (size_t)layout->aligned_buffer_size * num_buffers;
+}
+
+#ifdef HAVE_ASHMEM
+class AshmemAllocator : public MemAllocator {
+public:
+    virtual const char *name() const { return "ashmem"; }
+
+    virtual int allocate(const char *tag, size_t *size)
+    {
+        size_t page_mask = getpagesize() - 1;
+
+        *size = (*size + page_mask) & ~page_mask;
+        int fd = ashmem_create_region(tag, *size);
+        if (fd < 0)
+            ALOGE("ashmem region %s of %u bytes: %s", tag, (unsigned)*size,
+                  strerror(errno));
+        return fd;
+    }
+};
+#endif
+
+#ifdef __NR_memfd_create
+class MemfdAllocator : public MemAllocator {
+public:
+    MemfdAllocator(bool huge) : mHuge(huge) {}
+
+    virtual const char *name() const { return mHuge ? "memfd-huge" : "memfd"; }
+
+    virtual int allocate(const char *tag, size_t *size)
+    {
+        size_t page_mask = getpagesize() - 1;
+        size_t want = *size;
+        int fd = -1;
+
+        // Huge pages are a pool the kernel may have run out of. The test
+        // mapping reserves them, so a region handed out here maps later.
+        if (mHuge) {
+            size_t huge = (want + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+            fd = create(tag, MFD_HUGETLB | MFD_HUGE_2MB, huge);
+            if (fd >= 0) {
+                void *base = mmap(NULL, huge, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED, fd, 0);
+                if (base != MAP_FAILED) {
+                    munmap(base, huge);
+                    *size = huge;
+                    return fd;
+                }
+                close(fd);
+            }
+            ALOGI("memfd %s: no huge pages for %u bytes, using small ones",
+                  tag, (unsigned)want);
+        }
+
+        *size = (want + page_mask) & ~page_mask;
+        fd = create(tag, 0, *size);
+        if (fd < 0)
+            ALOGE("memfd %s of %u bytes: %s", tag, (unsigned)*size,
+                  strerror(errno));
+        return fd;
+    }
+
+private:
+    static int create(const char *tag, unsigned flags, size_t size)
+    {
+        int fd = syscall(__NR_memfd_create, tag, MFD_CLOEXEC | flags);
+
+        if (fd < 0)
+            return -1;
+        if (ftruncate(fd, size) < 0) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        return fd;
+    }
+
+    bool mHuge;
+};
+#endif
+
+MemAllocator *MemAllocator::create(const char *kind)
+{
+#ifdef HAVE_ASHMEM
+    static AshmemAllocator ashmem;
+    if (!strcmp(kind, "ashmem"))
+        return &ashmem;
+#endif
+#ifdef __NR_memfd_create
+    static MemfdAllocator memfd(false);
+    static MemfdAllocator memfdHuge(true);
+    if (!strcmp(kind, "memfd"))
+        return &memfd;
+    if (!strcmp(kind, "memfd-huge"))
+        return &memfdHuge;
+#endif
+    ALOGE("no %s allocator in this build", kind);
+    return NULL;
+}
+
+MemBudget::MemBudget()
+    : mCount(0),
+      mLimit(0),
+      mUsed(0),
+      mPeak(0),
+      mEvictorCount(0)
+{
+    pthread_mutex_init(&mLock, NULL);
+}
+
+MemBudget::~MemBudget()
+{
+    pthread_mutex_destroy(&mLock);
+}
+
+void MemBudget::setLimit(size_t bytes)
+{
+    pthread_mutex_lock(&mLock);
+    mLimit = bytes;
+    pthread_mutex_unlock(&mLock);
+}
+
+void MemBudget::addEvictor(evict_fn evict, void *user)
+{
+    pthread_mutex_lock(&mLock);
+    if (mEvictorCount < kMaxEvictors) {
+        mEvictors[mEvictorCount].evict = evict;
+        mEvictors[mEvictorCount].user = user;
+        mEvictorCount++;
+    } else {
+        ALOGE("memory budget: no room for another evictor");
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+void MemBudget::removeEvictors(void *user)
+{
+    int n = 0;
+
+    pthread_mutex_lock(&mLock);
+    for (int i = 0; i < mEvictorCount; i++) {
+        if (mEvictors[i].user != user)
+            mEvictors[n++] = mEvictors[i];
+    }
+    mEvictorCount = n;
+    pthread_mutex_unlock(&mLock);
+}
+
+/*
+ * Asks the evictors in order until one frees something. Called and
+ * returns with mLock held, the evictors refund what they drop, so they
+ * run without it.
+ */
+bool MemBudget::evict()
+{
+    for (int i = 0; i < mEvictorCount; i++) {
+        Evictor e = mEvictors[i];
+        pthread_mutex_unlock(&mLock);
+        bool freed = e.evict(e.user);
+        pthread_mutex_lock(&mLock);
+        if (freed)
+            return true;
+    }
+    return false;
+}
+
+/* Pools are named by literals, names past the table share its last slot. */
+MemBudget::Entry *MemBudget::entry(const char *name)
+{
+    for (int i = 0; i < mCount; i++) {
+        if (mEntries[i].name == name || !strcmp(mEntries[i].name, name))
+            return &mEntries[i];
+    }
+    if (mCount == kMaxNames)
+        return &mEntries[kMaxNames - 1];
+
+    Entry *e = &mEntries[mCount++];
+    e->name = mCount == kMaxNames ? "other" : name;
+    e->current = 0;
+    e->peak = 0;
+    return e;
+}
+
+bool MemBudget::charge(const char *name, size_t bytes)
+{
+    pthread_mutex_lock(&mLock);
+    while (mLimit && mUsed + bytes > mLimit) {
+        if (!evict())
+            break;
+    }
+    if (mLimit && mUsed + bytes > mLimit) {
+        ALOGE("memory budget: %s needs %u KB, %u of %u KB are in use",
+              name, (unsigned)(bytes >> 10), (unsigned)(mUsed >> 10),
+              (unsigned)(mLimit >> 10));
+        pthread_mutex_unlock(&mLock);
+        return false;
+    }
+
+    Entry *e = entry(name);
+    e->current += bytes;
+    if (e->current > e->peak)
+        e->peak = e->current;
+    mUsed += bytes;
+    if (mUsed > mPeak)
+        mPeak = mUsed;
+    ALOGV("memory budget: %s +%u KB, %u KB in use", name,
+          (unsigned)(bytes >> 10), (unsigned)(mUsed >> 10));
+    pthread_mutex_unlock(&mLock);
+    return true;
+}
+
+void MemBudget::refund(const char *name, size_t bytes)
+{
+    pthread_mutex_lock(&mLock);
+    Entry *e = entry(name);
+    e->current -= bytes;
+    mUsed -= bytes;
+    ALOGV("memory budget: %s -%u KB, %u KB in use", name,
+          (unsigned)(bytes >> 10), (unsigned)(mUsed >> 10));
+    pthread_mutex_unlock(&mLock);
+}
+
+bool MemBudget::pool(int index, const char **name, size_t *current,
+                     size_t *peak) const
+{
+    bool found;
+
+    pthread_mutex_lock(&mLock);
+    found = index < mCount;
+    if (found) {
+        *name = mEntries[index].name;
+        *current = mEntries[index].current;
+        *peak = mEntries[index].peak;
+    }
+    pthread_mutex_unlock(&mLock);
+    return found;
+}
+
+}; // namespace android
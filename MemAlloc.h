@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_MEM_ALLOC_H
+#define ANDROID_HARDWARE_MEM_ALLOC_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+namespace android {
+
+/*
+ * Where the buffers of a pool sit in its heap. Every buffer starts on an
+ * alignment boundary, so one can be handed out or registered on its own,
+ * and holds a frame of frame_size bytes whose CbCr plane starts
+ * cbcr_offset bytes in. Nothing here touches a device, so the pool
+ * arithmetic builds and runs anywhere.
+ */
+typedef struct {
+    int buffer_size;            /* bytes asked for per buffer */
+    int aligned_buffer_size;    /* stride between buffers */
+    int num_buffers;
+    int frame_size;             /* bytes handed out per buffer, 0 if unknown */
+    int cbcr_offset;
+    size_t heap_size;           /* aligned_buffer_size * num_buffers */
+} mem_layout_t;
+
+/* align must be a power of two, usually the page size. */
+void mem_layout_init(mem_layout_t *layout, int buffer_size, int num_buffers,
+                     int frame_size, int cbcr_offset, size_t align);
+
+static inline uint32_t mem_layout_offset(const mem_layout_t *layout, int index)
+{
+    return (uint32_t)layout->aligned_buffer_size * index;
+}
+
+static inline uint32_t mem_layout_cbcr(const mem_layout_t *layout, int index)
+{
+    return mem_layout_offset(layout, index) + layout->cbcr_offset;
+}
+
+/*
+ * Source of shareable memory for the pools that are not pmem. A region is
+ * an fd the caller maps and passes on, it stays allocated for as long as
+ * the fd or a mapping of it is around. pmem is not behind this interface:
+ * the driver wants pmem heaps connected to a master heap opened by device
+ * name, which PmemPool keeps doing itself.
+ */
+class MemAllocator {
+public:
+    virtual ~MemAllocator() {}
+
+    virtual const char *name() const = 0;
+
+    /*
+     * Allocates a region of at least *size bytes named after tag and
+     * returns its fd, or -1 on error. *size is rounded up to what was
+     * actually allocated, which is what must be mapped.
+     */
+    virtual int allocate(const char *tag, size_t *size) = 0;
+
+    /*
+     * "ashmem", "memfd" or "memfd-huge", the last backed by 2 MB huge
+     * pages when the kernel has them to spare. NULL for an unknown kind
+     * or one this build cannot provide. The allocators are static, never
+     * delete them.
+     */
+    static MemAllocator *create(const char *kind);
+};
+
+/*
+ * Bytes held by the pools, in total and per pool name, against an
+ * optional limit. A pool charges its heap before allocating it and
+ * refunds it when it goes away. A charge that would cross the limit first
+ * lets the evictors drop cached pools, one call at a time, and fails only
+ * when nothing is left to drop. Evictors are asked in the order they were
+ * added, so the cheapest cache to rebuild goes first.
+ */
+class MemBudget {
+public:
+    /* Frees something and returns true, or returns false if it cannot. */
+    typedef bool (*evict_fn)(void *user);
+
+    MemBudget();
+    ~MemBudget();
+
+    /* 0 for no limit, usage is tracked either way. */
+    void setLimit(size_t bytes);
+    size_t limit() const { return mLimit; }
+    /* Up to kMaxEvictors, the first added is asked first. */
+    void addEvictor(evict_fn evict, void *user);
+    void removeEvictors(void *user);
+
+    bool charge(const char *name, size_t bytes);
+    void refund(const char *name, size_t bytes);
+
+    size_t used() const { return mUsed; }
+    size_t peak() const { return mPeak; }
+
+    /* Usage of the index-th pool name seen, false past the last one. */
+    bool pool(int index, const char **name, size_t *current,
+              size_t *peak) const;
+
+private:
+    MemBudget(const MemBudget &);
+    MemBudget &operator=(const MemBudget &);
+
+    enum { kMaxNames = 16, kMaxEvictors = 4 };
+    struct Entry {
+        const char *name;
+        size_t current;
+        size_t peak;
+    };
+
+    struct Evictor {
+        evict_fn evict;
+        void *user;
+    };
+
+    Entry *entry(const char *name);
+    bool evict();
+
+    Entry mEntries[kMaxNames];
+    int mCount;
+    size_t mLimit;
+    size_t mUsed;
+    size_t mPeak;
+    Evictor mEvictors[kMaxEvictors];
+    int mEvictorCount;
+    mutable pthread_mutex_t mLock;
+};
+
+}; // namespace android
+
+#endif // ANDROID_HARDWARE_MEM_ALLOC_H
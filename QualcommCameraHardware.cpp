@@ -21,6 +21,8 @@
 #include <utils/Log.h>
 
 #include "QualcommCameraHardware.h"
+#include "FrameRing.h"
+#include "JpegEncoder.h"
 
 #include <utils/Errors.h>
 #include <utils/threads.h>
@@ -28,9 +30,11 @@
 #include <utils/String16.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysinfo.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <cutils/properties.h>
+#include <cutils/atomic.h>
 #include <math.h>
 #if HAVE_ANDROID_OS
 #include <linux/android_pmem.h>
@@ -300,11 +304,7 @@ static inline unsigned clp2(unsigned x)
     return x + 1;
 }
 
-static int exif_table_numEntries = 0;
-#define MAX_EXIF_TABLE_ENTRIES 11
-exif_tags_info_t exif_data[MAX_EXIF_TABLE_ENTRIES];
 static zoom_crop_info zoomCropInfo;
-static void *mLastQueuedFrame = NULL;
 #define RECORD_BUFFERS 9
 #define RECORD_BUFFERS_8x50 8
 static int kRecordBufferCount;
@@ -315,6 +315,9 @@ static int kRecordBufferCount;
  */
 static bool mVpeEnabled;
 
+/* What all the pools of the HAL hold, see MemPool::charge(). */
+static android::MemBudget gMemBudget;
+
 static int HAL_numOfCameras = 0;
 static camera_info_t HAL_cameraInfo[MSM_MAX_CAMERA_SENSORS];
 static int HAL_currentCameraId = 0;
@@ -833,13 +836,12 @@ static String8 create_values_range_str(int min, int max){
 }
 
 
-extern "C" {
 //------------------------------------------------------------------------
 //   : 720p busyQ funcitons
 //   --------------------------------------------------------------------
-static struct fifo_queue g_busy_frame_queue =
-    {0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, "frame_queue"};
-};
+// Filled by the camframe video callback, drained by the video thread.
+static FrameRing g_busy_frame_queue("video busy queue");
+
 /*===========================================================================
  * FUNCTION      cam_frame_wait_video
  *
@@ -849,9 +851,7 @@ static struct fifo_queue g_busy_frame_queue =
 static void cam_frame_wait_video (void)
 {
     ALOGV("cam_frame_wait_video E ");
-    if ((g_busy_frame_queue.num_of_frames) <=0){
-        pthread_cond_wait(&(g_busy_frame_queue.wait), &(g_busy_frame_queue.mut));
-    }
+    g_busy_frame_queue.wait();
     ALOGV("cam_frame_wait_video X");
     return;
 }
@@ -863,20 +863,8 @@ static void cam_frame_wait_video (void)
  * ===========================================================================*/
 void cam_frame_flush_video (void)
 {
-    ALOGV("cam_frame_flush_video: in n = %d\n", g_busy_frame_queue.num_of_frames);
-    pthread_mutex_lock(&(g_busy_frame_queue.mut));
-
-    while (g_busy_frame_queue.front)
-    {
-       //dequeue from the busy queue
-       struct fifo_node *node  = dequeue (&g_busy_frame_queue);
-       if(node)
-           free(node);
-
-       ALOGV("cam_frame_flush_video: node \n");
-    }
-    pthread_mutex_unlock(&(g_busy_frame_queue.mut));
-    ALOGV("cam_frame_flush_video: out n = %d\n", g_busy_frame_queue.num_of_frames);
+    int n = g_busy_frame_queue.flush();
+    ALOGV("cam_frame_flush_video: flushed n = %d\n", n);
     return ;
 }
 /*===========================================================================
@@ -886,20 +874,9 @@ void cam_frame_flush_video (void)
  * ===========================================================================*/
 static struct msm_frame * cam_frame_get_video()
 {
-    struct msm_frame *p = NULL;
-    ALOGV("cam_frame_get_video... in\n");
-    ALOGV("cam_frame_get_video... got lock\n");
-    if (g_busy_frame_queue.front)
-    {
-        //dequeue
-       struct fifo_node *node  = dequeue (&g_busy_frame_queue);
-       if (node)
-       {
-           p = (struct msm_frame *)node->f;
-           free (node);
-       }
+    struct msm_frame *p = g_busy_frame_queue.get();
+    if (p)
        ALOGV("cam_frame_get_video... out = %lx\n", p->buffer);
-    }
     return p;
 }
 
@@ -908,37 +885,25 @@ static struct msm_frame * cam_frame_get_video()
  *
  * DESCRIPTION    this function add a busy video frame to the busy queue tails
  * ===========================================================================*/
-static void cam_frame_post_video (struct msm_frame *p)
+static bool cam_frame_post_video (struct msm_frame *p)
 {
     if (!p)
     {
         ALOGE("post video , buffer is null");
-        return;
+        return false;
     }
     ALOGV("cam_frame_post_video... in = %x\n", (unsigned int)(p->buffer));
-    pthread_mutex_lock(&(g_busy_frame_queue.mut));
-    ALOGV("post_video got lock. q count before enQ %d", g_busy_frame_queue.num_of_frames);
-    //enqueue to busy queue
-    struct fifo_node *node = (struct fifo_node *)malloc (sizeof (struct fifo_node));
-    if (node)
-    {
-        ALOGV(" post video , enqueing in busy queue");
-        node->f = p;
-        node->next = NULL;
-        enqueue (&g_busy_frame_queue, node);
-        ALOGV("post_video got lock. q count after enQ %d", g_busy_frame_queue.num_of_frames);
-    }
-    else
+    // The queue holds every record buffer, it can only be full if a frame
+    // is posted twice. Hand it back rather than losing the buffer.
+    if (!g_busy_frame_queue.post(p))
     {
-        ALOGE("cam_frame_post_video error... out of memory\n");
+        ALOGE("cam_frame_post_video error... busy queue full\n");
+        LINK_camframe_free_video(p);
+        return false;
     }
-
-    pthread_mutex_unlock(&(g_busy_frame_queue.mut));
-    pthread_cond_signal(&(g_busy_frame_queue.wait));
-
     ALOGV("cam_frame_post_video... out = %lx\n", p->buffer);
 
-    return;
+    return true;
 }
 
 void QualcommCameraHardware::storeTargetType(void) {
@@ -1032,16 +997,92 @@ static int camerafd = -1;
  */
 #define NUM_MORE_BUFS 2
 
+/* Memory budget evictors, the snapshot cache is dropped before the
+ * preview one since only a capture needs it back. */
+bool evict_cached_snapshot_pools(void *user)
+{
+    QualcommCameraHardware *obj = (QualcommCameraHardware *)user;
+
+    if (!obj->flushSnapshotCache())
+        return false;
+    ALOGI("memory budget: evicted cached snapshot pools");
+    return true;
+}
+
+bool evict_cached_preview_pools(void *user)
+{
+    QualcommCameraHardware *obj = (QualcommCameraHardware *)user;
+
+    if (!obj->flushPreviewCache())
+        return false;
+    ALOGI("memory budget: evicted cached preview pools");
+    return true;
+}
+
 QualcommCameraHardware::QualcommCameraHardware()
     : mParameters(),
       mCameraRunning(false),
       mPreviewInitialized(false),
+      mBurstCount(1),
+      mBurstShots(1),
+      mBurstDepth(1),
+      mBurstRegistered(0),
+      mBurstEncoded(0),
+      mBurstCaptureDone(false),
+      mBurstEncoderRunning(false),
+      mBurstFps(0),
+      mZslDepth(0),
+      mZslNext(0),
+      mZslWidth(0),
+      mZslHeight(0),
+      mZslYOffset(0),
+      mZslCbCrOffset(0),
+      mZslEnabled(false),
+      mZslPictureFits(false),
+      mZslCapture(false),
+      mZslIndex(-1),
+      mJpegEncodeStart(0),
+      mJpegEncodeTime(0),
+      mJpegPeakMemory(0),
+      mJpegTargetSize(0),
+      mShutterTime(0),
+      mShutterLatency(0),
+      mPreviewStartTime(0),
+      mPreviewStartLatency(0),
+      mPreviewHeapTime(0),
+      mPreviewHeapReused(false),
+      mRecordHeapReused(false),
       mFrameThreadRunning(false),
+      mDisplayDepth(0),
+      mDisplayHead(0),
+      mDisplayCount(0),
+      mDisplayDropNewest(false),
+      mDisplayShowing(-1),
+      mDisplayCropValid(false),
+      mLastQueuedValid(false),
+      mDisplayPosted(0),
+      mDisplayShown(0),
+      mDisplayDropped(0),
+      mDisplayMaxCount(0),
+      mDisplayThreadRunning(false),
+      mDisplayThreadExit(false),
       mVideoThreadRunning(false),
+      mRecordBufferStride(0),
+      mDebugRecordBuffers(false),
+      mLiveshotArmed(0),
+      mLiveshotThreadRunning(false),
+      mLiveshotBuffer(-1),
+      mLiveshotCopy(NULL),
+      mLiveshotCopySize(0),
+      mLiveshotQuality(85),
+      mLiveshotStart(0),
+      mLiveshotLatency(0),
+      mLiveshotCount(0),
       mSnapshotThreadRunning(false),
       mJpegThreadRunning(false),
       mInSnapshotMode(false),
       mEncodePending(false),
+      mEncodeRunning(false),
       mSnapshotFormat(0),
       mFirstFrame(true),
       mReleasedRecordingFrame(false),
@@ -1096,14 +1137,16 @@ QualcommCameraHardware::QualcommCameraHardware()
         kPreviewBufferCountActual = kPreviewBufferCount;
         kRecordBufferCount = RECORD_BUFFERS;
         recordframes = new msm_frame[kRecordBufferCount];
-        record_buffers_tracking_flag = new bool[kRecordBufferCount];
+        mRecordBuffers.init(kRecordBufferCount);
+        g_busy_frame_queue.init(kRecordBufferCount);
     }
     else {
         kPreviewBufferCountActual = kPreviewBufferCount + NUM_MORE_BUFS;
         if( mCurrentTarget == TARGET_QSD8250 ) {
             kRecordBufferCount = RECORD_BUFFERS_8x50;
             recordframes = new msm_frame[kRecordBufferCount];
-            record_buffers_tracking_flag = new bool[kRecordBufferCount];
+            mRecordBuffers.init(kRecordBufferCount);
+            g_busy_frame_queue.init(kRecordBufferCount);
         }
     }
 
@@ -1144,6 +1187,15 @@ QualcommCameraHardware::QualcommCameraHardware()
         mVpeEnabled = 1;
     }
 
+    property_get("persist.camera.hal.pmem.cached", value, "0");
+    mCachedPmem = atoi(value) != 0;
+    memset(mCpuAccessStats, 0, sizeof(mCpuAccessStats));
+
+    property_get("persist.camera.hal.membudget", value, "0");
+    gMemBudget.setLimit((size_t)atoi(value) << 20);
+    gMemBudget.addEvictor(evict_cached_snapshot_pools, this);
+    gMemBudget.addEvictor(evict_cached_preview_pools, this);
+
     ALOGV("constructor EX");
 }
 
@@ -1373,6 +1425,8 @@ void QualcommCameraHardware::initDefaultParameters()
     mParameters.set(CameraParameters::KEY_JPEG_THUMBNAIL_HEIGHT,
                     THUMBNAIL_HEIGHT_STR); // informative
     mParameters.set(CameraParameters::KEY_JPEG_THUMBNAIL_QUALITY, "90");
+    // Bytes the picture should stay under, 0 to encode at jpeg-quality.
+    mParameters.set("jpeg-target-size", 0);
 
     String8 valuesStr = create_sizes_str(jpeg_thumbnail_sizes, JPEG_THUMBNAIL_SIZE_COUNT);
     mParameters.set(CameraParameters::KEY_SUPPORTED_JPEG_THUMBNAIL_SIZES,
@@ -1518,6 +1572,13 @@ void QualcommCameraHardware::initDefaultParameters()
                     CameraParameters::SCENE_MODE_AUTO);
     mParameters.set("strtextures", "OFF");
 
+    char burst[PROPERTY_VALUE_MAX];
+    property_get("persist.camera.hal.burst.max", burst, "8");
+    mParameters.set("max-num-snaps-per-shutter", atoi(burst) > 1 ? atoi(burst) : 1);
+    mParameters.set("num-snaps-per-shutter", 1);
+    mParameters.set("zsl", "off");
+    mParameters.set("zsl-values", "off,on");
+
     mParameters.set(CameraParameters::KEY_SUPPORTED_SCENE_MODES,
                     scenemode_values);
     mParameters.set(CameraParameters::KEY_CONTINUOUS_AF,
@@ -1540,6 +1601,13 @@ void QualcommCameraHardware::initDefaultParameters()
                     scenedetect_values);
     mParameters.setFloat(CameraParameters::KEY_FOCAL_LENGTH,
                     CAMERA_FOCAL_LENGTH_DEFAULT);
+    {
+        char make[PROPERTY_VALUE_MAX], model[PROPERTY_VALUE_MAX];
+        property_get("ro.product.manufacturer", make, "QCOM-AA");
+        property_get("ro.product.model", model, "QCAM-AA");
+        mExif.setCamera(make, model);
+        mExif.setFocalLength(CAMERA_FOCAL_LENGTH_DEFAULT);
+    }
     mParameters.setFloat(CameraParameters::KEY_HORIZONTAL_VIEW_ANGLE,
                     CAMERA_HORIZONTAL_VIEW_ANGLE_DEFAULT);
     mParameters.setFloat(CameraParameters::KEY_VERTICAL_VIEW_ANGLE,
@@ -1564,7 +1632,6 @@ void QualcommCameraHardware::initDefaultParameters()
     camframe_timeout_flag = FALSE;
 
     /* Initialize heaps */
-    mPostViewHeap = NULL;
     mDisplayHeap = NULL;
     mThumbnailHeap = NULL;
     mPreviewHeap = NULL;
@@ -1581,6 +1648,275 @@ void QualcommCameraHardware::initDefaultParameters()
     ALOGI("initDefaultParameters X");
 }
 
+/*
+ * Fills table with the fields liboemcamera takes for its encoder and for
+ * live snapshots, pointing into exif. Returns the number of entries.
+ */
+static int exportExifTable(const ExifBuilder& exif, exif_tags_info_t *table)
+{
+    static const struct {
+        ExifBuilder::Field field;
+        exif_tag_id_t id;
+    } tags[] = {
+        { ExifBuilder::DATE_TIME_ORIGINAL,      EXIFTAGID_EXIF_DATE_TIME_ORIGINAL },
+        { ExifBuilder::FOCAL_LENGTH,            EXIFTAGID_FOCAL_LENGTH },
+        { ExifBuilder::GPS_LATITUDE_REF,        EXIFTAGID_GPS_LATITUDE_REF },
+        { ExifBuilder::GPS_LATITUDE,            EXIFTAGID_GPS_LATITUDE },
+        { ExifBuilder::GPS_LONGITUDE_REF,       EXIFTAGID_GPS_LONGITUDE_REF },
+        { ExifBuilder::GPS_LONGITUDE,           EXIFTAGID_GPS_LONGITUDE },
+        { ExifBuilder::GPS_ALTITUDE_REF,        EXIFTAGID_GPS_ALTITUDE_REF },
+        { ExifBuilder::GPS_ALTITUDE,            EXIFTAGID_GPS_ALTITUDE },
+        { ExifBuilder::GPS_TIMESTAMP,           EXIFTAGID_GPS_TIMESTAMP },
+        { ExifBuilder::GPS_PROCESSING_METHOD,   EXIFTAGID_GPS_PROCESSINGMETHOD },
+        { ExifBuilder::GPS_DATESTAMP,           EXIFTAGID_GPS_DATESTAMP },
+    };
+    int count = 0;
+
+    for (size_t i = 0; i < sizeof(tags) / sizeof(tags[0]); i++) {
+        int type;
+        uint32_t n;
+        const void *data = exif.value(tags[i].field, &type, &n);
+        if (data == NULL)
+            continue;
+
+        exif_tag_entry_t *entry = &table[count].tag_entry;
+        table[count++].tag_id = tags[i].id;
+        entry->type = (exif_tag_type_t)type;
+        entry->count = n;
+        entry->copy = 1;
+        if (type == EXIF_RATIONAL && n == 1)
+            entry->data._rat = *(const rat_t *)data;
+        else if (type == EXIF_RATIONAL)
+            entry->data._rats = (rat_t *)data;
+        else if (type == EXIF_BYTE && n == 1)
+            entry->data._byte = *(const uint8_t *)data;
+        else
+            entry->data._bytes = (uint8_t *)data;
+        // liboemcamera wants the character code prefix typed as ASCII
+        if (tags[i].field == ExifBuilder::GPS_PROCESSING_METHOD)
+            entry->type = EXIF_ASCII;
+    }
+    return count;
+}
+
+/*
+ * The liboemcamera encoder. It calls back through the jpeg callbacks
+ * registered in startCamera().
+ */
+class QualcommCameraHardware::HardwareJpegBackend
+    : public QualcommCameraHardware::JpegBackend {
+public:
+    static bool available() {
+#if DLOPEN_LIBMMCAMERA
+        return LINK_jpeg_encoder_init != NULL &&
+               LINK_jpeg_encoder_encode != NULL &&
+               LINK_jpeg_encoder_join != NULL &&
+               LINK_jpeg_encoder_setMainImageQuality != NULL &&
+               LINK_jpeg_encoder_setThumbnailQuality != NULL &&
+               LINK_jpeg_encoder_setRotation != NULL;
+#else
+        return true;
+#endif
+    }
+
+    virtual const char *name() const { return "hw"; }
+
+    virtual bool init() { return LINK_jpeg_encoder_init(); }
+
+    virtual bool encode(const JpegJob &job) {
+        if (job.quality >= 0 &&
+            !LINK_jpeg_encoder_setMainImageQuality(job.quality)) {
+            ALOGE("native_jpeg_encode set jpeg-quality failed");
+            return false;
+        }
+        if (job.thumbnailQuality >= 0 &&
+            !LINK_jpeg_encoder_setThumbnailQuality(job.thumbnailQuality)) {
+            ALOGE("native_jpeg_encode set thumbnail-quality failed");
+            return false;
+        }
+        if (job.rotation >= 0 && !LINK_jpeg_encoder_setRotation(job.rotation)) {
+            ALOGE("native_jpeg_encode set rotation failed");
+            return false;
+        }
+        int exifCount = exportExifTable(*job.exif, mExifTable);
+        if (!LINK_jpeg_encoder_encode(job.dimension, job.thumbnail, job.thumbfd,
+                                      job.raw, job.rawfd, job.crop,
+                                      mExifTable, exifCount,
+                                      job.padding, job.cbcrOffset)) {
+            ALOGE("native_jpeg_encode: jpeg_encoder_encode failed.");
+            return false;
+        }
+        return true;
+    }
+
+    virtual void join() { LINK_jpeg_encoder_join(); }
+
+private:
+    // Read by the encoder until the join.
+    exif_tags_info_t mExifTable[ExifBuilder::FIELD_COUNT];
+};
+
+/*
+ * The encoder from JpegEncoder.cpp. It runs on its own thread so encode()
+ * returns right away, like the hardware one, and reports through the same
+ * callbacks. The picture is not rotated, the orientation goes into EXIF.
+ */
+class QualcommCameraHardware::SoftwareJpegBackend
+    : public QualcommCameraHardware::JpegBackend {
+public:
+    SoftwareJpegBackend()
+        : mThumbnail(NULL), mThumbnailSize(0), mBenchmark(false), mRunning(false) {}
+
+    virtual ~SoftwareJpegBackend() {
+        join();
+        free(mThumbnail);
+    }
+
+    virtual const char *name() const { return "sw"; }
+
+    virtual bool init() { return true; }
+
+    virtual bool encode(const JpegJob &job) {
+        char value[PROPERTY_VALUE_MAX];
+
+        if (mRunning) {
+            ALOGE("software jpeg: previous picture was not joined");
+            return false;
+        }
+        jpeg_encode_params_init(&mParams);
+        // Threads for the restart interval slices, 0 for one per cpu.
+        property_get("persist.camera.hal.jpeg.threads", value, "0");
+        mParams.threads = atoi(value);
+        property_get("persist.debug.camera.jpeg.bench", value, "0");
+        mBenchmark = atoi(value) != 0;
+        if (job.quality > 0)
+            mParams.quality = job.quality;
+        mParams.nv21 = job.nv21;
+        if (job.thumbnailWidth > 0 && job.thumbnailHeight > 0) {
+            mParams.thumbnail_width = job.thumbnailWidth;
+            mParams.thumbnail_height = job.thumbnailHeight;
+            mParams.thumbnail_quality =
+                job.thumbnailQuality > 0 ? job.thumbnailQuality : mParams.quality;
+            // The thumbnail is scaled from the main image, into memory kept
+            // from picture to picture rather than a heap of its own.
+            size_t size = job.thumbnailWidth * job.thumbnailHeight * 3 / 2;
+            if (size > mThumbnailSize) {
+                free(mThumbnail);
+                mThumbnail = (uint8_t *)malloc(size);
+                mThumbnailSize = mThumbnail != NULL ? size : 0;
+            }
+            mParams.thumbnail_buffer = mThumbnail;
+        }
+        mParams.exif = job.exif;
+        mParams.target_size = job.targetSize;
+        mParams.stats = job.stats;
+        mParams.output = output;
+        mParams.user = this;
+        mImage = job.image;
+
+        if (pthread_create(&mThread, NULL, thread, this) != 0) {
+            ALOGE("software jpeg: thread creation failed: %s", strerror(errno));
+            return false;
+        }
+        mRunning = true;
+        return true;
+    }
+
+    virtual void join() {
+        if (mRunning) {
+            pthread_join(mThread, NULL);
+            mRunning = false;
+        }
+    }
+
+private:
+    static void output(const uint8_t *data, uint32_t size, void *user) {
+        receive_jpeg_fragment_callback((uint8_t *)data, size);
+    }
+
+    static void *thread(void *user) {
+        SoftwareJpegBackend *backend = (SoftwareJpegBackend *)user;
+
+        if (backend->mBenchmark)
+            jpeg_encoder_benchmark(&backend->mImage, backend->mParams.quality, 0);
+        int size = jpeg_encode_yuv420sp(&backend->mImage, &backend->mParams);
+
+        ALOGV("software jpeg (%s): %d bytes", jpeg_encoder_impl_name(), size);
+        if (size >= 0) {
+            receive_jpeg_callback(JPEG_EVENT_DONE);
+        } else {
+            sp<QualcommCameraHardware> obj = QualcommCameraHardware::getInstance();
+            if (obj != 0)
+                obj->receiveJpegError();
+        }
+        return NULL;
+    }
+
+    jpeg_encode_params_t mParams;
+    yuv_sp_frame_t mImage;
+    uint8_t *mThumbnail;
+    size_t mThumbnailSize;
+    bool mBenchmark;
+    pthread_t mThread;
+    bool mRunning;
+};
+
+/*
+ * persist.camera.hal.jpeg.encoder picks the encoder, "hw" (default) or "sw".
+ * The software one is also used when liboemcamera lacks the encoder.
+ */
+void QualcommCameraHardware::selectJpegBackend()
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get("persist.camera.hal.jpeg.encoder", value, "hw");
+    if (strcmp(value, "sw") && HardwareJpegBackend::available())
+        mJpegBackend = new HardwareJpegBackend();
+    else
+        mJpegBackend = new SoftwareJpegBackend();
+    ALOGI("selectJpegBackend: %s jpeg encoder", mJpegBackend->name());
+}
+
+/*
+ * persist.camera.hal.jpeg.sink: "heap" (default) collects the picture in
+ * mJpegHeap, "chunks" and "fd" stream it into a JpegSink, the fd one into
+ * files in persist.camera.hal.jpeg.sink.dir. "client" is left to the
+ * wrapper, which installs a sink of its own through setJpegSink().
+ */
+void QualcommCameraHardware::selectJpegSink()
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get("persist.camera.hal.jpeg.sink", value, "heap");
+    if (!strcmp(value, "chunks")) {
+        mJpegSink = new ChunkJpegSink();
+    } else if (!strcmp(value, "fd")) {
+        char dir[PROPERTY_VALUE_MAX];
+        property_get("persist.camera.hal.jpeg.sink.dir", dir, "/data/local/tmp");
+        mJpegSink = new FdJpegSink(dir);
+    }
+    if (mJpegSink != NULL)
+        ALOGI("selectJpegSink: streaming pictures to the %s sink", mJpegSink->name());
+}
+
+bool QualcommCameraHardware::jpegEncoderInit()
+{
+    if (mJpegBackend->init())
+        return true;
+    if (!strcmp(mJpegBackend->name(), "sw"))
+        return false;
+    ALOGE("jpegEncoderInit: %s encoder init failed, using software",
+          mJpegBackend->name());
+    mJpegBackend = new SoftwareJpegBackend();
+    return mJpegBackend->init();
+}
+
+void QualcommCameraHardware::jpegEncoderJoin()
+{
+    if (mJpegBackend != NULL)
+        mJpegBackend->join();
+}
+
 #define ROUND_TO_PAGE(x)  (((x)+0xfff)&~0xfff)
 
 bool QualcommCameraHardware::startCamera()
@@ -1676,7 +2012,8 @@ bool QualcommCameraHardware::startCamera()
     *(void **)&LINK_mm_camera_destroy =
         ::dlsym(libmmcamera, "mm_camera_destroy");
 
-/* Disabling until support is available.
+/* Disabling until support is available; upscalePicture scales zoomed
+ * pictures meanwhile.
     *(void **)&LINK_zoom_crop_upscale =
         ::dlsym(libmmcamera, "zoom_crop_upscale");
 */
@@ -1692,6 +2029,9 @@ bool QualcommCameraHardware::startCamera()
     mCamNotify.video_frame_cb = &receive_camframe_video_callback;
 #endif // DLOPEN_LIBMMCAMERA
 
+    selectJpegBackend();
+    selectJpegSink();
+
     /* The control thread is in libcamera itself. */
 
     if((mCurrentTarget != TARGET_MSM7630) && (mCurrentTarget != TARGET_MSM8660)){
@@ -1754,6 +2094,76 @@ status_t QualcommCameraHardware::dump(int fd,
              "and jpeg max size (%d)\n", mPreviewFrameSize, mRawSize,
              mJpegSize, mJpegMaxSize);
     result.append(buffer);
+    snprintf(buffer, 255,
+             "display ring depth (%d/%d, max %d), frames posted (%u), shown (%u), "
+             "dropped (%u)\n",
+             mDisplayCount, mDisplayDepth, mDisplayMaxCount, mDisplayPosted,
+             mDisplayShown, mDisplayDropped);
+    result.append(buffer);
+    snprintf(buffer, 255, "burst of %d, ring depth (%d), last throughput (%.2f fps)\n",
+             mBurstCount, mBurstDepth, mBurstFps);
+    result.append(buffer);
+    snprintf(buffer, 255, "encode stage running (%d)\n", mEncodeRunning);
+    result.append(buffer);
+    snprintf(buffer, 255, "jpeg encoder (%s), last encode (%lld ms)\n",
+             mJpegBackend != NULL ? mJpegBackend->name() : "none",
+             (long long)(mJpegEncodeTime / 1000000));
+    result.append(buffer);
+    snprintf(buffer, 255, "jpeg target size (%u), last quality (%d), passes (%d), "
+             "extra time (%lld ms)\n", mJpegTargetSize, mJpegStats.quality,
+             mJpegStats.passes, (long long)(mJpegStats.extra_time / 1000000));
+    result.append(buffer);
+    snprintf(buffer, 255, "jpeg sink (%s), memory held for the last picture (%u)\n",
+             mJpegSink != NULL ? mJpegSink->name() : "heap", mJpegPeakMemory);
+    result.append(buffer);
+    snprintf(buffer, 255, "live snapshots (%u, %s), last latency (%lld ms), "
+             "recording frames dropped (%u)\n", mLiveshotCount,
+             softwareLiveSnapshot() ? "sw" : "hw",
+             (long long)(mLiveshotLatency / 1000000), mRecordFrameGaps.totalDrops());
+    result.append(buffer);
+    snprintf(buffer, 255, "preview start to first frame (%lld ms), preview pool %s, "
+             "record pool %s, in (%lld us)\n",
+             (long long)(mPreviewStartLatency / 1000000),
+             mPreviewHeapReused ? "reused" : "allocated",
+             mRecordHeapReused ? "reused" : "allocated",
+             (long long)(mPreviewHeapTime / 1000));
+    result.append(buffer);
+    snprintf(buffer, 255, "zsl (%s), ring depth (%d) of %dx%d, last shutter latency (%lld ms)\n",
+             mZslEnabled ? "on" : "off", mZslDepth, mZslWidth, mZslHeight,
+             (long long)(mShutterLatency / 1000000));
+    result.append(buffer);
+    snprintf(buffer, 255, "memory budget (%u KB, 0 for none), in use (%u KB), "
+             "peak (%u KB)\n", (unsigned)(gMemBudget.limit() >> 10),
+             (unsigned)(gMemBudget.used() >> 10), (unsigned)(gMemBudget.peak() >> 10));
+    result.append(buffer);
+    const char *pool;
+    size_t current, peak;
+    for (int i = 0; gMemBudget.pool(i, &pool, &current, &peak); i++) {
+        snprintf(buffer, 255, "  %s: %u KB, peak %u KB\n", pool,
+                 (unsigned)(current >> 10), (unsigned)(peak >> 10));
+        result.append(buffer);
+    }
+    static const char *consumers[CPU_CONSUMERS] = {
+        "preview flip", "data copy", "data map", "crop", "display",
+        "histogram", "zsl", "liveshot", "jpeg"
+    };
+    snprintf(buffer, 255, "cpu access (%s pmem)\n",
+             mCachedPmem ? "cached" : "uncached");
+    result.append(buffer);
+    {
+        Mutex::Autolock l(&mCpuAccessLock);
+        for (int i = 0; i < CPU_CONSUMERS; i++) {
+            const CpuAccessStat& stat = mCpuAccessStats[i];
+            if (stat.count == 0)
+                continue;
+            snprintf(buffer, 255, "  %s: %u times, avg (%lld us), (%llu MB/s)\n",
+                     consumers[i], stat.count,
+                     (long long)(stat.time / stat.count / 1000),
+                     (unsigned long long)(stat.time > 0 ?
+                        stat.bytes * 1000 / stat.time : 0));
+            result.append(buffer);
+        }
+    }
     write(fd, result.string(), result.size());
 
     // Dump internal objects.
@@ -1766,6 +2176,19 @@ status_t QualcommCameraHardware::dump(int fd,
     if (mJpegHeap != 0) {
         mJpegHeap->dump(fd, args);
     }
+    {
+        Mutex::Autolock l(&mSnapshotCacheLock);
+        if (mCachedRawHeap != 0)
+            mCachedRawHeap->dump(fd, args);
+        if (mCachedJpegHeap != 0)
+            mCachedJpegHeap->dump(fd, args);
+        if (mCachedThumbnailHeap != 0)
+            mCachedThumbnailHeap->dump(fd, args);
+        if (mCachedPreviewHeap != 0)
+            mCachedPreviewHeap->dump(fd, args);
+        if (mCachedRecordHeap != 0)
+            mCachedRecordHeap->dump(fd, args);
+    }
     mParameters.dump(fd, args);
     return NO_ERROR;
 }
@@ -1796,192 +2219,27 @@ bool static native_stop_ops(mm_camera_ops_type_t  type, void* value)
 static cam_frame_start_parms frame_parms;
 static int recordingState = 0;
 
-#define GPS_PROCESSING_METHOD_SIZE  101
-#define FOCAL_LENGTH_DECIMAL_PRECISON 100
-
-static const char ExifAsciiPrefix[] = { 0x41, 0x53, 0x43, 0x49, 0x49, 0x0, 0x0, 0x0 };
-#define EXIF_ASCII_PREFIX_SIZE (sizeof(ExifAsciiPrefix))
-
-static rat_t latitude[3];
-static rat_t longitude[3];
-static char lonref[2];
-static char latref[2];
-static rat_t altitude;
-static rat_t gpsTimestamp[3];
-static char gpsDatestamp[20];
-static char dateTime[20];
-static rat_t focalLength;
-static char gpsProcessingMethod[EXIF_ASCII_PREFIX_SIZE + GPS_PROCESSING_METHOD_SIZE];
-
-
-
-static void addExifTag(exif_tag_id_t tagid, exif_tag_type_t type,
-                        uint32_t count, uint8_t copy, void *data) {
-    ALOGV("%s E", __FUNCTION__);
-
-    if(exif_table_numEntries == MAX_EXIF_TABLE_ENTRIES) {
-        ALOGE("Number of entries exceeded limit");
-        return;
-    }
-
-    int index = exif_table_numEntries;
-    exif_data[index].tag_id = tagid;
-    exif_data[index].tag_entry.type = type;
-    exif_data[index].tag_entry.count = count;
-    exif_data[index].tag_entry.copy = copy;
-    if((type == EXIF_RATIONAL) && (count > 1))
-        exif_data[index].tag_entry.data._rats = (rat_t *)data;
-    if((type == EXIF_RATIONAL) && (count == 1))
-        exif_data[index].tag_entry.data._rat = *(rat_t *)data;
-    else if(type == EXIF_ASCII)
-        exif_data[index].tag_entry.data._ascii = (char *)data;
-    else if(type == EXIF_BYTE)
-        exif_data[index].tag_entry.data._byte = *(uint8_t *)data;
-
-    // Increase number of entries
-    exif_table_numEntries++;
-    return;
-}
-
-static void parseLatLong(const char *latlonString, int *pDegrees,
-                           int *pMinutes, int *pSeconds ) {
-    ALOGV("%s E", __FUNCTION__);
-
-    double value = atof(latlonString);
-    value = fabs(value);
-    int degrees = (int) value;
-
-    double remainder = value - degrees;
-    int minutes = (int) (remainder * 60);
-    int seconds = (int) (((remainder * 60) - minutes) * 60 * 1000);
-
-    *pDegrees = degrees;
-    *pMinutes = minutes;
-    *pSeconds = seconds;
-}
-
-static void setLatLon(exif_tag_id_t tag, const char *latlonString) {
-
-    int degrees, minutes, seconds;
-
-    parseLatLong(latlonString, &degrees, &minutes, &seconds);
-
-    rat_t value[3] = { {degrees, 1},
-                       {minutes, 1},
-                       {seconds, 1000} };
-
-    if(tag == EXIFTAGID_GPS_LATITUDE) {
-        memcpy(latitude, value, sizeof(latitude));
-        addExifTag(EXIFTAGID_GPS_LATITUDE, EXIF_RATIONAL, 3,
-                    1, (void *)latitude);
-    } else {
-        memcpy(longitude, value, sizeof(longitude));
-        addExifTag(EXIFTAGID_GPS_LONGITUDE, EXIF_RATIONAL, 3,
-                    1, (void *)longitude);
-    }
-}
-
-void QualcommCameraHardware::setGpsParameters() {
-    const char *str = NULL;
-    ALOGV("%s E", __FUNCTION__);
-
-    str = mParameters.get(CameraParameters::KEY_GPS_PROCESSING_METHOD);
-    if (str!=NULL) {
-       memcpy(gpsProcessingMethod, ExifAsciiPrefix, EXIF_ASCII_PREFIX_SIZE);
-       strlcpy(gpsProcessingMethod + EXIF_ASCII_PREFIX_SIZE, str,
-           GPS_PROCESSING_METHOD_SIZE-1);
-       gpsProcessingMethod[EXIF_ASCII_PREFIX_SIZE + GPS_PROCESSING_METHOD_SIZE-1] = '\0';
-       addExifTag(EXIFTAGID_GPS_PROCESSINGMETHOD, EXIF_ASCII,
-           EXIF_ASCII_PREFIX_SIZE + strlen(gpsProcessingMethod + EXIF_ASCII_PREFIX_SIZE) + 1,
-           1, (void *)gpsProcessingMethod);
-    }
-
-    str = NULL;
-
-    //Set Latitude
-    str = mParameters.get(CameraParameters::KEY_GPS_LATITUDE);
-
-    if(str != NULL) {
-        setLatLon(EXIFTAGID_GPS_LATITUDE, str);
-        float latitudeValue = mParameters.getFloat(CameraParameters::KEY_GPS_LATITUDE);
-        latref[0] = 'N';
-        if(latitudeValue < 0 ){
-            latref[0] = 'S';
-        }
-        latref[1] = '\0';
-        mParameters.set(CameraParameters::KEY_GPS_LATITUDE_REF, latref);
-        addExifTag(EXIFTAGID_GPS_LATITUDE_REF, EXIF_ASCII, 2,
-                                1, (void *)latref);
-    }
-
-    //set Longitude
-    str = NULL;
-    str = mParameters.get(CameraParameters::KEY_GPS_LONGITUDE);
-    if(str != NULL) {
-        setLatLon(EXIFTAGID_GPS_LONGITUDE, str);
-        //set Longitude Ref
-        float longitudeValue = mParameters.getFloat(CameraParameters::KEY_GPS_LONGITUDE);
-        lonref[0] = 'E';
-        if(longitudeValue < 0){
-            lonref[0] = 'W';
-        }
-        lonref[1] = '\0';
-        mParameters.set(CameraParameters::KEY_GPS_LONGITUDE_REF, lonref);
-        addExifTag(EXIFTAGID_GPS_LONGITUDE_REF, EXIF_ASCII, 2,
-                                1, (void *)lonref);
-    }
-
-    //set Altitude
-    str = NULL;
-    str = mParameters.get(CameraParameters::KEY_GPS_ALTITUDE);
-    if(str != NULL) {
-        double value = atof(str);
-        int ref = 0;
-        if(value < 0){
-            ref = 1;
-            value = -value;
-        }
-        uint32_t value_meter = value * 1000;
-        rat_t alt_value = {value_meter, 1000};
-        memcpy(&altitude, &alt_value, sizeof(altitude));
-        addExifTag(EXIFTAGID_GPS_ALTITUDE, EXIF_RATIONAL, 1,
-                    1, (void *)&altitude);
-        //set AltitudeRef
-        mParameters.set(CameraParameters::KEY_GPS_ALTITUDE_REF, ref);
-        addExifTag(EXIFTAGID_GPS_ALTITUDE_REF, EXIF_BYTE, 1,
-                    1, (void *)&ref);
-    }
-
-    //set Gps TimeStamp
-    str = NULL;
-    str = mParameters.get(CameraParameters::KEY_GPS_TIMESTAMP);
-    if(str != NULL) {
-
-      long value = atol(str);
-      time_t unixTime;
-      struct tm *UTCTimestamp;
-
-      unixTime = (time_t)value;
-      UTCTimestamp = gmtime(&unixTime);
-
-      strftime(gpsDatestamp, sizeof(gpsDatestamp), "%Y:%m:%d", UTCTimestamp);
-      addExifTag(EXIFTAGID_GPS_DATESTAMP, EXIF_ASCII,
-                          strlen(gpsDatestamp)+1 , 1, (void *)&gpsDatestamp);
-
-      rat_t time_value[3] = { {UTCTimestamp->tm_hour, 1},
-                              {UTCTimestamp->tm_min, 1},
-                              {UTCTimestamp->tm_sec, 1} };
-
-
-      memcpy(&gpsTimestamp, &time_value, sizeof(gpsTimestamp));
-      addExifTag(EXIFTAGID_GPS_TIMESTAMP, EXIF_RATIONAL,
-                  3, 1, (void *)&gpsTimestamp);
-    }
+bool QualcommCameraHardware::native_jpeg_encode(void)
+{
+    return native_jpeg_encode(mRawHeap, mDimension, mCrop);
 }
 
-bool QualcommCameraHardware::native_jpeg_encode(void)
+bool QualcommCameraHardware::native_jpeg_encode(const sp<PmemPool>& rawHeap,
+                                                const cam_ctrl_dimension_t& dim,
+                                                const common_crop_t& crop)
 {
     ALOGV("%s E", __FUNCTION__);
+    JpegJob job;
+    memset(&job, 0, sizeof(job));
+    job.quality = -1;
+    job.thumbnailQuality = -1;
+    job.rotation = -1;
+
+    // The encoder keeps pointers to these until the join, take copies so a
+    // preview restart can reconfigure mDimension meanwhile.
+    mEncodeRawHeap = rawHeap;
+    mEncodeCrop = crop;
+    mEncodeDimension = dim;
     int jpeg_quality = mParameters.getInt("jpeg-quality");
     if (jpeg_quality >= 0) {
         //Application can pass quality of zero
@@ -1991,10 +2249,7 @@ bool QualcommCameraHardware::native_jpeg_encode(void)
         if(jpeg_quality == 0) jpeg_quality = 85;
         ALOGV("native_jpeg_encode, current jpeg main img quality =%d",
              jpeg_quality);
-        if(!LINK_jpeg_encoder_setMainImageQuality(jpeg_quality)) {
-            ALOGE("native_jpeg_encode set jpeg-quality failed");
-            return false;
-        }
+        job.quality = jpeg_quality;
     }
 
     int thumbnail_quality = mParameters.getInt("jpeg-thumbnail-quality");
@@ -2006,40 +2261,22 @@ bool QualcommCameraHardware::native_jpeg_encode(void)
         if(thumbnail_quality == 0) thumbnail_quality = 85;
         ALOGV("native_jpeg_encode, current jpeg thumbnail quality =%d",
              thumbnail_quality);
-        if(!LINK_jpeg_encoder_setThumbnailQuality(thumbnail_quality)) {
-            ALOGE("native_jpeg_encode set thumbnail-quality failed");
-            return false;
-        }
+        job.thumbnailQuality = thumbnail_quality;
     }
 
-    if( (mCurrentTarget != TARGET_MSM7630) && (mCurrentTarget != TARGET_MSM7627) && (mCurrentTarget != TARGET_MSM8660) ) {
-        int rotation = mParameters.getInt("rotation");
-        if (rotation >= 0) {
+    // setParameters() keeps mExif up to date, the picture only patches in
+    // its orientation and size.
+    mEncodeExif = mExif;
+    int rotation = mParameters.getInt("rotation");
+    if (rotation >= 0) {
+        mEncodeExif.setOrientation(rotation);
+        // initRaw already told the encoder on these targets.
+        if( (mCurrentTarget != TARGET_MSM7630) && (mCurrentTarget != TARGET_MSM7627) && (mCurrentTarget != TARGET_MSM8660) ) {
             ALOGV("native_jpeg_encode, rotation = %d", rotation);
-            if(!LINK_jpeg_encoder_setRotation(rotation)) {
-                ALOGE("native_jpeg_encode set rotation failed");
-                return false;
-            }
+            job.rotation = rotation;
         }
     }
 
-    jpeg_set_location();
-
-    //set TimeStamp
-    const char *str = mParameters.get(CameraParameters::KEY_EXIF_DATETIME);
-    if(str != NULL) {
-      strlcpy(dateTime, str, 20);
-      addExifTag(EXIFTAGID_EXIF_DATE_TIME_ORIGINAL, EXIF_ASCII,
-                  20, 1, (void *)dateTime);
-    }
-
-    int focalLengthValue = (int) (mParameters.getFloat(
-                CameraParameters::KEY_FOCAL_LENGTH) * FOCAL_LENGTH_DECIMAL_PRECISON);
-    rat_t focalLengthRational = {focalLengthValue, FOCAL_LENGTH_DECIMAL_PRECISON};
-    memcpy(&focalLength, &focalLengthRational, sizeof(focalLengthRational));
-    addExifTag(EXIFTAGID_FOCAL_LENGTH, EXIF_RATIONAL, 1,
-                1, (void *)&focalLength);
-
     uint8_t * thumbnailHeap = NULL;
     int thumbfd = -1;
 
@@ -2049,12 +2286,14 @@ bool QualcommCameraHardware::native_jpeg_encode(void)
     ALOGV("width %d and height %d", width , height);
 
     if(width != 0 && height != 0){
+        job.thumbnailWidth = width;
+        job.thumbnailHeight = height;
         if((mCurrentTarget == TARGET_MSM7630) ||
            (mCurrentTarget == TARGET_MSM8660) ||
            (mCurrentTarget == TARGET_MSM7627) ||
            (strTexturesOn == true)) {
-            thumbnailHeap = (uint8_t *)mRawHeap->mHeap->base();
-            thumbfd =  mRawHeap->mHeap->getHeapID();
+            thumbnailHeap = (uint8_t *)rawHeap->mHeap->base();
+            thumbfd =  rawHeap->mHeap->getHeapID();
         } else {
             thumbnailHeap = (uint8_t *)mThumbnailHeap->mHeap->base();
             thumbfd =  mThumbnailHeap->mHeap->getHeapID();
@@ -2073,14 +2312,14 @@ bool QualcommCameraHardware::native_jpeg_encode(void)
         // Set the input and output dimensions for thumbnail generation to main
         // image dimensions and required thumbanail size repectively, for the
         // encoder to do downscaling of the main image accordingly.
-        mCrop.in1_w  = mDimension.orig_picture_dx;
-        mCrop.in1_h  = mDimension.orig_picture_dy;
+        mEncodeCrop.in1_w  = mEncodeDimension.orig_picture_dx;
+        mEncodeCrop.in1_h  = mEncodeDimension.orig_picture_dy;
         /* For Adreno format on targets that don't use VFE other output
          * for postView, thumbnail_width and thumbnail_height has the
          * actual thumbnail dimensions.
          */
-        mCrop.out1_w = mDimension.thumbnail_width;
-        mCrop.out1_h = mDimension.thumbnail_height;
+        mEncodeCrop.out1_w = mEncodeDimension.thumbnail_width;
+        mEncodeCrop.out1_h = mEncodeDimension.thumbnail_height;
         /* For targets, that uses VFE other output for postview,
          * thumbnail_width and thumbnail_height has values based on postView
          * dimensions(mostly previewWidth X previewHeight), but not based on
@@ -2092,45 +2331,126 @@ bool QualcommCameraHardware::native_jpeg_encode(void)
         if( (mCurrentTarget == TARGET_MSM7630)||
             (mCurrentTarget == TARGET_MSM7627) ||
             (mCurrentTarget == TARGET_MSM8660)) {
-            mCrop.out1_w = mThumbnailWidth;
-            mCrop.out1_h = mThumbnailHeight;
-        }
-        mDimension.thumbnail_width = mDimension.orig_picture_dx;
-        mDimension.thumbnail_height = mDimension.orig_picture_dy;
-        ALOGV("mCrop.in1_w = %d, mCrop.in1_h = %d", mCrop.in1_w, mCrop.in1_h);
-        ALOGV("mCrop.out1_w = %d, mCrop.out1_h = %d", mCrop.out1_w, mCrop.out1_h);
-        ALOGV("mDimension.thumbnail_width = %d, mDimension.thumbnail_height = %d", mDimension.thumbnail_width, mDimension.thumbnail_height);
+            mEncodeCrop.out1_w = mThumbnailWidth;
+            mEncodeCrop.out1_h = mThumbnailHeight;
+        }
+        mEncodeDimension.thumbnail_width = mEncodeDimension.orig_picture_dx;
+        mEncodeDimension.thumbnail_height = mEncodeDimension.orig_picture_dy;
+        ALOGV("mEncodeCrop.in1_w = %d, mEncodeCrop.in1_h = %d", mEncodeCrop.in1_w, mEncodeCrop.in1_h);
+        ALOGV("mEncodeCrop.out1_w = %d, mEncodeCrop.out1_h = %d", mEncodeCrop.out1_w, mEncodeCrop.out1_h);
+        ALOGV("mEncodeDimension.thumbnail_width = %d, mEncodeDimension.thumbnail_height = %d", mEncodeDimension.thumbnail_width, mEncodeDimension.thumbnail_height);
         int CbCrOffset = -1;
         if(mPreviewFormat == CAMERA_YUV_420_NV21_ADRENO)
             CbCrOffset = mCbCrOffsetRaw;
-        mCrop.in1_w = mDimension.orig_picture_dx - jpegPadding; // when cropping is enabled
-        mCrop.in1_h = mDimension.orig_picture_dy - jpegPadding; // when cropping is enabled
-
-        if (!LINK_jpeg_encoder_encode(&mDimension,
-                                      thumbnailHeap,
-                                      thumbfd,
-                                      (uint8_t *)mRawHeap->mHeap->base(),
-                                      mRawHeap->mHeap->getHeapID(),
-                                      &mCrop, exif_data, exif_table_numEntries,
-                                      jpegPadding/2, CbCrOffset)) {
-            ALOGE("native_jpeg_encode: jpeg_encoder_encode failed.");
-            return false;
-        }
+        mEncodeCrop.in1_w = mEncodeDimension.orig_picture_dx - jpegPadding; // when cropping is enabled
+        mEncodeCrop.in1_h = mEncodeDimension.orig_picture_dy - jpegPadding; // when cropping is enabled
+
+        job.cbcrOffset = CbCrOffset;
     } else {
-        if (!LINK_jpeg_encoder_encode(&mDimension,
-                                     thumbnailHeap,
-                                     thumbfd,
-                                     (uint8_t *)mRawHeap->mHeap->base(),
-                                     mRawHeap->mHeap->getHeapID(),
-                                     &mCrop, exif_data, exif_table_numEntries,
-                                     jpegPadding/2, -1)) {
-            ALOGE("native_jpeg_encode: jpeg_encoder_encode failed.");
-            return false;
+        job.cbcrOffset = -1;
+    }
+
+    job.dimension = &mEncodeDimension;
+    job.crop = &mEncodeCrop;
+    job.thumbnail = thumbnailHeap;
+    job.thumbfd = thumbfd;
+    job.raw = (uint8_t *)rawHeap->mHeap->base();
+    job.rawfd = rawHeap->mHeap->getHeapID();
+    job.padding = jpegPadding/2;
+    job.nv21 = mEncodeDimension.main_img_format != CAMERA_YUV_420_NV12;
+    getEncodeLayout(rawHeap, mEncodeDimension,
+                    mEncodeCrop.in2_w != 0 && mEncodeCrop.in2_h != 0, &job.image);
+    mEncodeExif.setPictureSize(job.image.width, job.image.height);
+    job.exif = &mEncodeExif;
+
+    // The software encoder meets a target size by itself, possibly coding
+    // the picture twice. The others get a quality predicted for it, less
+    // an allowance for APP1 and their thumbnail.
+    // Software encoders read the picture through the cache. The encode
+    // itself is timed with the JPEG stats, this only covers the invalidate.
+    nsecs_t cpuStart = systemTime();
+    rawHeap->beginCpu(0, rawHeap->mBufferSize, CameraHardwareInterface::CPU_READ);
+    accountCpuAccess(CPU_JPEG, rawHeap->mBufferSize, cpuStart);
+
+    memset(&mJpegStats, 0, sizeof(mJpegStats));
+    int targetSize = mParameters.getInt("jpeg-target-size");
+    mJpegTargetSize = targetSize > 0 ? targetSize : 0;
+    job.targetSize = mJpegTargetSize;
+    job.stats = &mJpegStats;
+    if (mJpegTargetSize > 0 && strcmp(mJpegBackend->name(), "sw")) {
+        uint32_t app1 = mEncodeExif.app1Size(job.thumbnailWidth * job.thumbnailHeight / 4);
+        nsecs_t start = systemTime();
+        int quality = jpeg_estimate_quality(&job.image, job.nv21,
+                mJpegTargetSize > app1 ? mJpegTargetSize - app1 : 1);
+        if (quality > 0) {
+            job.quality = quality;
+            mJpegStats.quality = quality;
+            mJpegStats.passes = 1;
+            mJpegStats.extra_time = systemTime() - start;
         }
     }
-    return true;
+
+    if (mJpegSink != NULL && !mJpegSink->begin())
+        return false;
+    mJpegEncodeStart = systemTime();
+    if (mJpegBackend->encode(job))
+        return true;
+    if (!strcmp(mJpegBackend->name(), "sw"))
+        return false;
+
+    // Give the picture to the software encoder rather than lose it, and
+    // stay with it from now on.
+    ALOGE("native_jpeg_encode: %s encoder failed, retrying in software",
+          mJpegBackend->name());
+    mJpegBackend->join();
+    mJpegBackend = new SoftwareJpegBackend();
+    mJpegSize = 0;
+    memset(&mJpegStats, 0, sizeof(mJpegStats));
+    if (mJpegSink != NULL && !mJpegSink->begin())
+        return false;
+    return mJpegBackend->init() && mJpegBackend->encode(job);
+}
+
+/*
+ * Where the main image of dim sits in the raw heap handed to
+ * native_jpeg_encode, for encoders that read it directly. Mirrors what
+ * initRaw, initZsl and crop_yuv420 lay out; cropped tells whether the
+ * picture was cropped in place.
+ */
+void QualcommCameraHardware::getEncodeLayout(const sp<PmemPool>& rawHeap,
+                                             const cam_ctrl_dimension_t& dim,
+                                             bool cropped,
+                                             yuv_sp_frame_t *image)
+{
+    uint8_t *base = (uint8_t *)rawHeap->mHeap->base();
+    int width = dim.orig_picture_dx;
+    int height = dim.orig_picture_dy;
+    uint32_t yOffset = rawHeap->myOffset;
+    uint32_t cbcrOffset = rawHeap->mCbCrOffset;
+    uint32_t size;
+
+    image->width = width;
+    image->height = height;
+    image->y_stride = width;
+    image->uv_stride = width;
+    if (dim.main_img_format == CAMERA_YUV_420_NV21_ADRENO) {
+        image->y_stride = CEILING32(width);
+        image->uv_stride = 2 * CEILING32(width/2);
+    } else if ((mCurrentTarget == TARGET_MSM7630) ||
+               (mCurrentTarget == TARGET_MSM7627) ||
+               (mCurrentTarget == TARGET_MSM8660) ||
+               !strcmp(rawHeap->mName, "zsl") || cropped) {
+        // Encoder layout, also for a picture cropped in place.
+        LINK_jpeg_encoder_get_buffer_offset(width, height, &yOffset,
+                                            &cbcrOffset, &size);
+    }
+    image->y = base + yOffset;
+    image->uv = base + cbcrOffset;
+    ALOGV("getEncodeLayout: %dx%d, y at %u, cbcr at %u", width, height,
+          yOffset, cbcrOffset);
 }
 
+
 bool QualcommCameraHardware::native_set_parms(
     mm_camera_parm_type_t type, uint16_t length, void *value)
 {
@@ -2157,55 +2477,6 @@ bool QualcommCameraHardware::native_set_parms(
     return false;
 }
 
-void QualcommCameraHardware::jpeg_set_location()
-{
-    bool encode_location = true;
-    camera_position_type pt;
-
-    ALOGV("%s E", __FUNCTION__);
-#define PARSE_LOCATION(what,type,fmt,desc) do {                                \
-        pt.what = 0;                                                           \
-        const char *what##_str = mParameters.get("gps-"#what);                 \
-        ALOGV("GPS PARM %s --> [%s]", "gps-"#what, what##_str);                 \
-        if (what##_str) {                                                      \
-            type what = 0;                                                     \
-            if (sscanf(what##_str, fmt, &what) == 1)                           \
-                pt.what = what;                                                \
-            else {                                                             \
-                ALOGE("GPS " #what " %s could not"                              \
-                     " be parsed as a " #desc, what##_str);                    \
-                encode_location = false;                                       \
-            }                                                                  \
-        }                                                                      \
-        else {                                                                 \
-            ALOGV("GPS " #what " not specified: "                               \
-                 "defaulting to zero in EXIF header.");                        \
-            encode_location = false;                                           \
-       }                                                                       \
-    } while(0)
-
-    PARSE_LOCATION(timestamp, long, "%ld", "long");
-    if (!pt.timestamp) pt.timestamp = time(NULL);
-    PARSE_LOCATION(altitude, short, "%hd", "short");
-    PARSE_LOCATION(latitude, double, "%lf", "double float");
-    PARSE_LOCATION(longitude, double, "%lf", "double float");
-
-#undef PARSE_LOCATION
-
-    if (encode_location) {
-        ALOGD("setting image location ALT %d LAT %lf LON %lf",
-             pt.altitude, pt.latitude, pt.longitude);
-
-        setGpsParameters();
-        /* Disabling until support is available.
-        if (!LINK_jpeg_encoder_setLocation(&pt)) {
-            ALOGE("jpeg_set_location: LINK_jpeg_encoder_setLocation failed.");
-        }
-        */
-    }
-    else ALOGV("not setting image location");
-}
-
 void QualcommCameraHardware::runFrameThread(void *data)
 {
     ALOGV("runFrameThread E");
@@ -2220,19 +2491,22 @@ void QualcommCameraHardware::runFrameThread(void *data)
         ALOGV("after LINK_cam_frame");
     }
 
+    // No more frames are coming, let the display stage go before the
+    // buffers it refers to are released.
+    stopDisplayThread();
+    deinitZsl();
+
     ALOGV("runFrameThread: clearing mPreviewHeap");
     mPmemWaitLock.lock();
-    mPreviewHeap.clear();
-    mPreviewHeap = NULL;
+    cachePreviewPool(mPreviewHeap, mCachedPreviewHeap);
     mPrevHeapDeallocRunning = true;
     mPmemWait.signal();
-    mPmemWaitLock.unlock();
 
     if((mCurrentTarget == TARGET_MSM7630) || (mCurrentTarget == TARGET_QSD8250) || (mCurrentTarget == TARGET_MSM8660)) {
         ALOGV("runFrameThread: clearing mRecordHeap");
-        mRecordHeap.clear();
-        mRecordHeap = NULL;
+        cachePreviewPool(mRecordHeap, mCachedRecordHeap);
     }
+    mPmemWaitLock.unlock();
 
     mFrameThreadWaitLock.lock();
     mFrameThreadRunning = false;
@@ -2248,14 +2522,11 @@ void QualcommCameraHardware::runVideoThread(void *data)
     msm_frame* vframe = NULL;
 
     while(true) {
-        pthread_mutex_lock(&(g_busy_frame_queue.mut));
-
         // Exit the thread , in case of stop recording..
         mVideoThreadWaitLock.lock();
         if(mVideoThreadExit){
             ALOGV("Exiting video thread..");
             mVideoThreadWaitLock.unlock();
-            pthread_mutex_unlock(&(g_busy_frame_queue.mut));
             break;
         }
         mVideoThreadWaitLock.unlock();
@@ -2271,14 +2542,14 @@ void QualcommCameraHardware::runVideoThread(void *data)
         if(mVideoThreadExit){
             ALOGV("Exiting video thread..");
             mVideoThreadWaitLock.unlock();
-            pthread_mutex_unlock(&(g_busy_frame_queue.mut));
             break;
         }
         mVideoThreadWaitLock.unlock();
 
         // Get the video frame to be encoded
         vframe = cam_frame_get_video ();
-        pthread_mutex_unlock(&(g_busy_frame_queue.mut));
+        if (vframe == NULL)
+            continue;
         ALOGV("in video_thread : got video frame ");
 
         if (UNLIKELY(mDebugFps)) {
@@ -2286,20 +2557,30 @@ void QualcommCameraHardware::runVideoThread(void *data)
         }
 
         if(vframe != NULL) {
-            // Find the offset within the heap of the current buffer.
-            ALOGV("Got video frame :  buffer %lu base %p ", vframe->buffer, mRecordHeap->mHeap->base());
-            ssize_t offset =
-                (ssize_t)vframe->buffer - (ssize_t)mRecordHeap->mHeap->base();
-            ALOGV("offset = %lu , alignsize = %d , offset later = %ld", offset, mRecordHeap->mAlignedBufferSize, (offset / mRecordHeap->mAlignedBufferSize));
-
-            offset /= mRecordHeap->mAlignedBufferSize;
+            // Find the index within the heap of the current buffer.
+            int offset = recordBufferIndex(vframe->buffer);
+            ALOGV("Got video frame :  buffer %lu index %d", vframe->buffer, offset);
+            if (offset < 0) {
+                ALOGE("in video_thread : frame %lx is not a record buffer", vframe->buffer);
+                LINK_camframe_free_video(vframe);
+                continue;
+            }
 
-            //set the track flag to true for this video buffer
-            record_buffers_tracking_flag[offset] = true;
+            // The encoder owns the buffer until releaseRecordingFrame.
+            mRecordBuffers.move(offset, 1 << RECORD_BUFFER_BUSY, RECORD_BUFFER_CLIENT);
 
             /* Extract the timestamp of this frame */
 	    nsecs_t timeStamp = nsecs_t(vframe->ts.tv_sec)*1000000000LL + vframe->ts.tv_nsec;
 
+            // A live snapshot pins the buffer before the client can release
+            // it, whichever of the two finishes last gives it back.
+            countRecordFrame(timeStamp);
+            if (android_atomic_cmpxchg(1, 0, &mLiveshotArmed) == 0) {
+                mRecordBuffers.pin(offset);
+                if (!startLiveshotThread(vframe, offset))
+                    mRecordBuffers.unpin(offset);
+            }
+
             // dump frames for test purpose
 #ifdef DUMP_VIDEO_FRAMES
             static int frameCnt = 0;
@@ -2332,6 +2613,11 @@ void QualcommCameraHardware::runVideoThread(void *data)
             if(rcb != NULL && (msgEnabled & CAMERA_MSG_VIDEO_FRAME) ) {
                 ALOGV("in video_thread : got video frame, giving frame to services/encoder");
                 rcb(timeStamp, CAMERA_MSG_VIDEO_FRAME, mRecordHeap->mBuffers[offset], rdata);
+            } else if (mRecordBuffers.move(offset, 1 << RECORD_BUFFER_CLIENT,
+                                           RECORD_BUFFER_CAMFRAME) &&
+                       mRecordBuffers.dropPin(offset)) {
+                // Nobody will release this frame, give it back right away.
+                LINK_camframe_free_video(vframe);
             }
 #else
             // 720p output2  : simulate release frame here:
@@ -2374,9 +2660,240 @@ void *frame_thread(void *user)
     return NULL;
 }
 
-static int parse_size(const char *str, int &width, int &height)
+void *display_thread(void *user)
 {
-    ALOGV("%s E", __FUNCTION__);
+    ALOGV("display_thread E");
+    sp<QualcommCameraHardware> obj = QualcommCameraHardware::getInstance();
+    if (obj != 0) {
+        obj->runDisplayThread();
+    }
+    else ALOGW("not starting display thread: the object went away!");
+    ALOGV("display_thread X");
+    return NULL;
+}
+
+void QualcommCameraHardware::startDisplayThread()
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    // persist.camera.hal.display.depth sets how many frames may wait for
+    // the display, 0 queues them from the frame thread as before. Each one
+    // costs a preview frame of pmem for its copy.
+    property_get("persist.camera.hal.display.depth", value, "1");
+    int depth = atoi(value);
+    if (depth > kMaxDisplayDepth)
+        depth = kMaxDisplayDepth;
+    if (depth < 0 || !mUseOverlay)
+        depth = 0;
+
+    property_get("persist.camera.hal.display.drop", value, "oldest");
+
+    // A pool of the same size is kept, the overlay may still show one of
+    // its buffers.
+    if (depth > 0 && (mDisplayCopyHeap == NULL ||
+                      mDisplayCopyHeap->mBufferSize != (int)mPreviewFrameSize ||
+                      mDisplayCopyHeap->mNumBuffers != depth + 1)) {
+        mDisplayCopyHeap = new PmemPool("/dev/pmem_adsp",
+                                        cpuPmemFlags(),
+                                        MSM_PMEM_PREVIEW,
+                                        mPreviewFrameSize,
+                                        depth + 1,
+                                        mPreviewFrameSize,
+                                        PAD_TO_WORD(mPreviewFrameSize * 2/3),
+                                        0,
+                                        "display copy");
+        mDisplayShowing = -1;
+        if (!mDisplayCopyHeap->initialized()) {
+            ALOGE("startDisplayThread: no pmem for %d display copies, "
+                 "queueing frames synchronously", depth + 1);
+            mDisplayCopyHeap.clear();
+            depth = 0;
+        }
+    }
+
+    Mutex::Autolock l(&mDisplayLock);
+    mDisplayDepth = depth;
+    mDisplayDropNewest = !strcmp(value, "newest");
+    mDisplayHead = 0;
+    mDisplayCount = 0;
+    mDisplayMaxCount = 0;
+    mDisplayCropValid = false;
+    mDisplayPosted = mDisplayShown = mDisplayDropped = 0;
+    mDisplayThreadExit = false;
+
+    if (mDisplayDepth > 0) {
+        mDisplayThreadRunning = !pthread_create(&mDisplayThread, NULL,
+                                                display_thread, NULL);
+        if (!mDisplayThreadRunning) {
+            ALOGE("startDisplayThread: could not start display thread, "
+                 "queueing frames synchronously");
+            mDisplayDepth = 0;
+        }
+    }
+    ALOGI("startDisplayThread: depth %d, drop %s", mDisplayDepth,
+         mDisplayDropNewest ? "newest" : "oldest");
+}
+
+void QualcommCameraHardware::stopDisplayThread()
+{
+    mDisplayLock.lock();
+    if (!mDisplayThreadRunning) {
+        mDisplayLock.unlock();
+        return;
+    }
+    mDisplayThreadExit = true;
+    mDisplayWait.signal();
+    mDisplayLock.unlock();
+
+    pthread_join(mDisplayThread, NULL);
+
+    mDisplayLock.lock();
+    mDisplayThreadRunning = false;
+    mDisplayDepth = 0;
+    mDisplayLock.unlock();
+
+    ALOGI("stopDisplayThread: posted %u shown %u dropped %u",
+         mDisplayPosted, mDisplayShown, mDisplayDropped);
+}
+
+/* A copy buffer neither waiting in the ring, on the overlay nor held as
+ * postview, -1 if there is none. Called with mDisplayLock held. */
+int QualcommCameraHardware::displayCopySlot()
+{
+    for (int slot = 0; slot < mDisplayCopyHeap->mNumBuffers; slot++) {
+        bool busy = slot == mDisplayShowing || mDisplayCopyHeap->held(slot);
+        for (int i = 0; i < mDisplayCount && !busy; i++)
+            busy = mDisplayRing[(mDisplayHead + i) % mDisplayDepth].index == slot;
+        if (!busy)
+            return slot;
+    }
+    return -1;
+}
+
+void QualcommCameraHardware::postDisplayFrame(DisplayFrame &frame)
+{
+    mDisplayLock.lock();
+    mDisplayPosted++;
+
+    if (mDisplayDepth == 0) {
+        mDisplayLock.unlock();
+        showDisplayFrame(frame);
+        mDisplayLock.lock();
+        mDisplayShown++;
+        mDisplayLock.unlock();
+        return;
+    }
+
+    if (mDisplayCount == mDisplayDepth) {
+        mDisplayDropped++;
+        if (mDisplayDropNewest) {
+            mDisplayLock.unlock();
+            return;
+        }
+        mDisplayHead = (mDisplayHead + 1) % mDisplayDepth;
+        mDisplayCount--;
+    }
+    int slot = displayCopySlot();
+    if (slot < 0) {
+        mDisplayDropped++;
+        mDisplayLock.unlock();
+        return;
+    }
+
+    // The preview buffer is the VFE's again once the callback returns.
+    nsecs_t start = systemTime();
+    uint32_t offset = mem_layout_offset(&mDisplayCopyHeap->mLayout, slot);
+    mPreviewHeap->beginCpu((uint8_t *)frame.vaddr -
+                           (uint8_t *)mPreviewHeap->mHeap->base(),
+                           mPreviewFrameSize, CameraHardwareInterface::CPU_READ);
+    memcpy((uint8_t *)mDisplayCopyHeap->mHeap->base() + offset, frame.vaddr,
+           mPreviewFrameSize);
+    mDisplayCopyHeap->endCpu(offset, mPreviewFrameSize,
+                             CameraHardwareInterface::CPU_WRITE);
+    accountCpuAccess(CPU_DISPLAY, mPreviewFrameSize, start);
+
+    frame.offset = offset;
+    frame.fd = mDisplayCopyHeap->mHeap->getHeapID();
+    frame.index = slot;
+    frame.pool = mDisplayCopyHeap;
+    frame.vaddr = (uint8_t *)mDisplayCopyHeap->mHeap->base() + offset;
+    mDisplayRing[(mDisplayHead + mDisplayCount) % mDisplayDepth] = frame;
+    mDisplayCount++;
+    if (mDisplayCount > mDisplayMaxCount)
+        mDisplayMaxCount = mDisplayCount;
+    mDisplayWait.signal();
+    mDisplayLock.unlock();
+}
+
+void QualcommCameraHardware::runDisplayThread()
+{
+    ALOGV("runDisplayThread E");
+
+    mDisplayLock.lock();
+    while (true) {
+        while (!mDisplayThreadExit && mDisplayCount == 0)
+            mDisplayWait.wait(mDisplayLock);
+        if (mDisplayThreadExit)
+            break;
+
+        DisplayFrame frame = mDisplayRing[mDisplayHead];
+        mDisplayHead = (mDisplayHead + 1) % mDisplayDepth;
+        mDisplayCount--;
+        mDisplayShowing = frame.index;
+
+        mDisplayLock.unlock();
+        showDisplayFrame(frame);
+        mDisplayLock.lock();
+        mDisplayShown++;
+    }
+    mDisplayDropped += mDisplayCount;
+    mDisplayCount = 0;
+    mDisplayLock.unlock();
+
+    ALOGV("runDisplayThread X");
+}
+
+void QualcommCameraHardware::showDisplayFrame(const DisplayFrame &frame)
+{
+    mOverlayLock.lock();
+    if (mOverlay != NULL) {
+        mOverlay->setFd(frame.fd);
+        /* A crop of 0x0 resets the crop, so that the overlay driver does
+         * not keep applying the old zoom to the preview frames. */
+        if (!mDisplayCropValid ||
+            mDisplayCrop[0] != frame.cropX || mDisplayCrop[1] != frame.cropY ||
+            mDisplayCrop[2] != frame.cropW || mDisplayCrop[3] != frame.cropH) {
+            mOverlay->setCrop(frame.cropX, frame.cropY, frame.cropW, frame.cropH);
+            mDisplayCrop[0] = frame.cropX;
+            mDisplayCrop[1] = frame.cropY;
+            mDisplayCrop[2] = frame.cropW;
+            mDisplayCrop[3] = frame.cropH;
+            mDisplayCropValid = true;
+        }
+        mOverlay->queueBuffer((void *)frame.offset);
+        /* To overcome a timing case where we could be having the overlay refer to deallocated
+           mDisplayHeap(and showing corruption), the mDisplayHeap is not deallocated untill the
+           first preview frame is queued to the overlay in 8660. Also adding the condition
+           to check if snapshot is currently in progress ensures that the resources being
+           used by the snapshot thread are not incorrectly deallocated by preview thread*/
+        if ((mCurrentTarget == TARGET_MSM8660)&&(mFirstFrame == true)&&(!mSnapshotThreadRunning)) {
+            ALOGD(" showDisplayFrame : first frame queued, display heap being deallocated");
+            mThumbnailHeap.clear();
+            mThumbnailHeap = NULL;
+            mDisplayHeap.clear();
+            mDisplayHeap = NULL;
+            mFirstFrame = false;
+            mPostViewFrame.clear();
+        }
+        mLastQueued = frame;
+        mLastQueuedValid = true;
+    }
+    mOverlayLock.unlock();
+}
+
+static int parse_size(const char *str, int &width, int &height)
+{
+    ALOGV("%s E", __FUNCTION__);
     // Find the width.
     char *end;
     int w = (int)strtol(str, &end, 10);
@@ -2510,15 +3027,39 @@ bool QualcommCameraHardware::initPreview()
     }
 
     mPrevHeapDeallocRunning = false;
-    mPreviewHeap = new PmemPool(pmem_region,
-                                MemoryHeapBase::READ_ONLY | MemoryHeapBase::NO_CACHING,
-                                MSM_PMEM_PREVIEW, //MSM_PMEM_OUTPUT2,
-                                mPreviewFrameSize,
-                                kPreviewBufferCountActual,
-                                mPreviewFrameSize,
-                                CbCrOffset,
-                                0,
-                                "preview");
+    nsecs_t heapStart = systemTime();
+    mPreviewHeapReused = false;
+
+    mPreviewHeap = takeCachedPool(mCachedPreviewHeap, MSM_PMEM_PREVIEW,
+                                  mPreviewFrameSize,
+                                  kPreviewBufferCountActual,
+                                  mPreviewFrameSize, CbCrOffset, 0);
+    mPreviewHeapReused = mPreviewHeap != NULL;
+    if (mPreviewHeap == NULL)
+        mPreviewHeap = new PmemPool(pmem_region,
+                                    cpuPmemFlags(),
+                                    MSM_PMEM_PREVIEW, //MSM_PMEM_OUTPUT2,
+                                    mPreviewFrameSize,
+                                    kPreviewBufferCountActual,
+                                    mPreviewFrameSize,
+                                    CbCrOffset,
+                                    0,
+                                    "preview");
+
+    // Flush both caches, a stale record pool may hold the pmem too.
+    if (!mPreviewHeap->initialized() &&
+        (flushSnapshotCache() | flushPreviewCache())) {
+        ALOGI("initPreview: released cached pools, retrying preview heap");
+        mPreviewHeap = new PmemPool(pmem_region,
+                                    cpuPmemFlags(),
+                                    MSM_PMEM_PREVIEW,
+                                    mPreviewFrameSize,
+                                    kPreviewBufferCountActual,
+                                    mPreviewFrameSize,
+                                    CbCrOffset,
+                                    0,
+                                    "preview");
+    }
 
     if (!mPreviewHeap->initialized()) {
         mPreviewHeap.clear();
@@ -2536,12 +3077,20 @@ bool QualcommCameraHardware::initPreview()
             return false;
         }
     }
+    mPreviewHeapTime = systemTime() - heapStart;
+    ALOGI("initPreview: preview pool %s, record pool %s, in %lld us",
+          mPreviewHeapReused ? "reused" : "allocated",
+          mRecordHeapReused ? "reused" : "allocated",
+          (long long)(mPreviewHeapTime / 1000));
+
+    if (mZslEnabled)
+        initZsl();
 
     if (ret) {
         for (cnt = 0; cnt < kPreviewBufferCount; cnt++) {
             frames[cnt].fd = mPreviewHeap->mHeap->getHeapID();
             frames[cnt].buffer =
-                (uint32_t)mPreviewHeap->mHeap->base() + mPreviewHeap->mAlignedBufferSize * cnt;
+                (uint32_t)mPreviewHeap->mHeap->base() + mem_layout_offset(&mPreviewHeap->mLayout, cnt);
             frames[cnt].y_off = 0;
             frames[cnt].cbcr_off = CbCrOffset;
             frames[cnt].path = OUTPUT_TYPE_P; // MSM_FRAME_ENC;
@@ -2562,12 +3111,15 @@ bool QualcommCameraHardware::initPreview()
         ALOGV ("initpreview before cam_frame thread carete , video frame  buffer=%lu fd=%d y_off=%d cbcr_off=%d \n",
           (unsigned long)frame_parms.video_frame.buffer, frame_parms.video_frame.fd, frame_parms.video_frame.y_off,
           frame_parms.video_frame.cbcr_off);
+        startDisplayThread();
         mFrameThreadRunning = !pthread_create(&mFrameThread,
                                               &attr,
                                               frame_thread,
                                               (void*)&(frame_parms));
         ret = mFrameThreadRunning;
         mFrameThreadWaitLock.unlock();
+        if (!ret)
+            stopDisplayThread();
     }
     mFirstFrame = true;
 
@@ -2746,7 +3298,9 @@ bool QualcommCameraHardware::initRaw(bool initJpegHeap)
     }
 
     if (mJpegHeap != NULL) {
-        ALOGV("initRaw: clearing old mJpegHeap.");
+        ALOGV("initRaw: parking old mJpegHeap.");
+        Mutex::Autolock l(&mSnapshotCacheLock);
+        mCachedJpegHeap = mJpegHeap;
         mJpegHeap.clear();
     }
 
@@ -2806,17 +3360,35 @@ bool QualcommCameraHardware::initRaw(bool initJpegHeap)
     }
     mPmemWaitLock.unlock();
 
-    ALOGV("initRaw: initializing mRawHeap.");
-    mRawHeap =
-        new PmemPool(pmem_region,
-                     MemoryHeapBase::READ_ONLY | MemoryHeapBase::NO_CACHING,
-                     MSM_PMEM_MAINIMG,
-                     mJpegMaxSize,
-                     kRawBufferCount,
-                     mRawSize,
-                     mCbCrOffsetRaw,
-                     yOffset,
-                     "snapshot camera");
+    mRawHeap = takeCachedPool(mCachedRawHeap, MSM_PMEM_MAINIMG,
+                              mJpegMaxSize, kRawBufferCount,
+                              mRawSize, mCbCrOffsetRaw, yOffset);
+    if (mRawHeap == NULL) {
+        ALOGV("initRaw: initializing mRawHeap.");
+        mRawHeap =
+            new PmemPool(pmem_region,
+                         cpuPmemFlags(),
+                         MSM_PMEM_MAINIMG,
+                         mJpegMaxSize,
+                         kRawBufferCount,
+                         mRawSize,
+                         mCbCrOffsetRaw,
+                         yOffset,
+                         "snapshot camera");
+        if (!mRawHeap->initialized() && flushPreviewCache()) {
+            ALOGI("initRaw: released preview cache, retrying mRawHeap");
+            mRawHeap =
+                new PmemPool(pmem_region,
+                             cpuPmemFlags(),
+                             MSM_PMEM_MAINIMG,
+                             mJpegMaxSize,
+                             kRawBufferCount,
+                             mRawSize,
+                             mCbCrOffsetRaw,
+                             yOffset,
+                             "snapshot camera");
+        }
+    }
 
     if (!mRawHeap->initialized()) {
        ALOGE("initRaw X failed ");
@@ -2826,6 +3398,30 @@ bool QualcommCameraHardware::initRaw(bool initJpegHeap)
        return false;
     }
 
+    // Extra raw buffers for a burst start out unregistered, so the VFE
+    // keeps writing into mRawHeap until runBurst switches slots.
+    mBurstSlots[0].heap = mRawHeap;
+    mBurstRegistered = 0;
+    for (int i = 1; i < mBurstDepth; i++) {
+        mBurstSlots[i].heap =
+            new PmemPool(pmem_region,
+                         cpuPmemFlags(),
+                         MSM_PMEM_MAINIMG,
+                         mJpegMaxSize,
+                         kRawBufferCount,
+                         mRawSize,
+                         mCbCrOffsetRaw,
+                         yOffset,
+                         "snapshot burst");
+        if (!mBurstSlots[i].heap->initialized()) {
+            ALOGE("initRaw: could not allocate burst buffer %d, ring depth %d", i, i);
+            mBurstSlots[i].heap.clear();
+            mBurstDepth = i;
+            break;
+        }
+        mBurstSlots[i].heap->registerBuffers(false);
+    }
+
     //This is kind of workaround for the GPU limitation, as it can't
     //output in line to correct NV21 adreno formula for some snapshot
     //sizes (like 3264x2448). This change of cbcr offset will ensure that
@@ -2839,16 +3435,7 @@ bool QualcommCameraHardware::initRaw(bool initJpegHeap)
     // Jpeg
 
     if (initJpegHeap) {
-        ALOGV("initRaw: initializing mJpegHeap.");
-        mJpegHeap =
-            new AshmemPool(mJpegMaxSize,
-                           kJpegBufferCount,
-                           0, // we do not know how big the picture will be
-                           "jpeg");
-
-        if (!mJpegHeap->initialized()) {
-            mJpegHeap.clear();
-            mJpegHeap = NULL;
+        if (!this->initJpegHeap(mJpegMaxSize)) {
             mRawHeap.clear();
             mRawHeap = NULL;
             ALOGE("initRaw X failed: error initializing mJpegHeap.");
@@ -2871,19 +3458,27 @@ bool QualcommCameraHardware::initRaw(bool initJpegHeap)
         }
         pmem_region = "/dev/pmem_adsp";
 
-        if (mThumbnailHeap != NULL)
+        if (mThumbnailHeap != NULL) {
+            Mutex::Autolock l(&mSnapshotCacheLock);
+            mCachedThumbnailHeap = mThumbnailHeap;
             mThumbnailHeap.clear();
+        }
 
-        mThumbnailHeap =
-            new PmemPool(pmem_region,
-                         MemoryHeapBase::READ_ONLY | MemoryHeapBase::NO_CACHING,
-                         MSM_PMEM_THUMBNAIL,
-                         thumbnailBufferSize,
-                         1,
-                         thumbnailBufferSize,
-                         CbCrOffsetThumb,
-                         yOffsetThumb,
-                         "thumbnail");
+        mThumbnailHeap = takeCachedPool(mCachedThumbnailHeap, MSM_PMEM_THUMBNAIL,
+                                        thumbnailBufferSize, 1,
+                                        thumbnailBufferSize, CbCrOffsetThumb,
+                                        yOffsetThumb);
+        if (mThumbnailHeap == NULL)
+            mThumbnailHeap =
+                new PmemPool(pmem_region,
+                             cpuPmemFlags(),
+                             MSM_PMEM_THUMBNAIL,
+                             thumbnailBufferSize,
+                             1,
+                             thumbnailBufferSize,
+                             CbCrOffsetThumb,
+                             yOffsetThumb,
+                             "thumbnail");
 
         if (!mThumbnailHeap->initialized()) {
             mThumbnailHeap.clear();
@@ -2902,6 +3497,43 @@ bool QualcommCameraHardware::initRaw(bool initJpegHeap)
 }
 
 
+/* Sets up mJpegHeap for a picture of at most size bytes. */
+bool QualcommCameraHardware::initJpegHeap(int size)
+{
+    if (mJpegSink != NULL) {
+        ALOGV("initJpegHeap: streaming to the %s sink.", mJpegSink->name());
+        Mutex::Autolock l(&mSnapshotCacheLock);
+        mCachedJpegHeap.clear();
+        return true;
+    }
+    {
+        Mutex::Autolock l(&mSnapshotCacheLock);
+        if (mCachedJpegHeap != NULL &&
+            mCachedJpegHeap->mBufferSize == size &&
+            mCachedJpegHeap->mNumBuffers == kJpegBufferCount) {
+            ALOGV("initJpegHeap: reusing cached mJpegHeap.");
+            mJpegHeap = mCachedJpegHeap;
+        }
+        mCachedJpegHeap.clear();
+    }
+    if (mJpegHeap == NULL) {
+        ALOGV("initJpegHeap: initializing mJpegHeap.");
+        mJpegHeap =
+            new AshmemPool(size,
+                           kJpegBufferCount,
+                           0, // we do not know how big the picture will be
+                           "jpeg");
+    }
+
+    if (!mJpegHeap->initialized()) {
+        mJpegHeap.clear();
+        mJpegHeap = NULL;
+        ALOGE("initJpegHeap: error initializing mJpegHeap.");
+        return false;
+    }
+    return true;
+}
+
 void QualcommCameraHardware::deinitRawSnapshot()
 {
     ALOGV("deinitRawSnapshot E");
@@ -2910,10 +3542,177 @@ void QualcommCameraHardware::deinitRawSnapshot()
     ALOGV("deinitRawSnapshot X");
 }
 
+/*
+ * Returns the cached pool if it was registered with the same layout, so its
+ * buffers are still known to the driver. A cached pool that does not match
+ * is dropped first to give its pmem back before the caller allocates.
+ */
+sp<QualcommCameraHardware::PmemPool> QualcommCameraHardware::takeCachedPool(
+        sp<PmemPool>& cache, int pmem_type, int buffer_size, int num_buffers,
+        int frame_size, int cbcr_offset, int yoffset)
+{
+    Mutex::Autolock l(&mSnapshotCacheLock);
+    sp<PmemPool> pool = cache;
+
+    cache.clear();
+    if (pool == NULL)
+        return NULL;
+
+    if (pool->mPmemType == pmem_type &&
+        pool->mBufferSize == buffer_size &&
+        pool->mNumBuffers == num_buffers &&
+        pool->mFrameSize == frame_size &&
+        pool->mCbCrOffset == cbcr_offset &&
+        pool->myOffset == yoffset) {
+        ALOGV("takeCachedPool: reusing %s", pool->mName);
+        pool->registerBuffers(true);
+        return pool;
+    }
+
+    ALOGV("takeCachedPool: layout of %s changed, dropping it", pool->mName);
+    return NULL;
+}
+
+bool QualcommCameraHardware::snapshotCacheAllowed()
+{
+    char value[PROPERTY_VALUE_MAX];
+    struct sysinfo info;
+
+    property_get("persist.camera.hal.snapcache", value, "1");
+    if (!atoi(value))
+        return false;
+
+    // Free memory floor in MB below which the pools are released.
+    property_get("persist.camera.hal.snapcache.minfree", value, "48");
+    uint64_t minFree = (uint64_t)atoi(value) << 20;
+    if (sysinfo(&info) == 0) {
+        uint64_t avail = ((uint64_t)info.freeram + info.bufferram) * info.mem_unit;
+        if (avail < minFree) {
+            ALOGI("snapshot cache: %llu MB free, releasing pools",
+                  (unsigned long long)(avail >> 20));
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Drops every cached snapshot pool, returns true if any was held. */
+bool QualcommCameraHardware::flushSnapshotCache()
+{
+    Mutex::Autolock l(&mSnapshotCacheLock);
+    bool held = mCachedRawHeap != NULL || mCachedJpegHeap != NULL ||
+                mCachedThumbnailHeap != NULL;
+
+    mCachedRawHeap.clear();
+    mCachedJpegHeap.clear();
+    mCachedThumbnailHeap.clear();
+    return held;
+}
+
+/*
+ * Takes pool from the driver and keeps it in cache for the next preview
+ * start, unless persist.camera.hal.prevcache is 0. Clears pool either way.
+ */
+void QualcommCameraHardware::cachePreviewPool(sp<PmemPool>& pool,
+                                              sp<PmemPool>& cache)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get("persist.camera.hal.prevcache", value, "1");
+    if (pool != NULL && atoi(value)) {
+        pool->registerBuffers(false);
+        Mutex::Autolock l(&mSnapshotCacheLock);
+        cache = pool;
+    }
+    pool.clear();
+    pool = NULL;
+}
+
+/* Drops the cached preview and record pools, returns true if any was held. */
+bool QualcommCameraHardware::flushPreviewCache()
+{
+    Mutex::Autolock l(&mSnapshotCacheLock);
+    bool held = mCachedPreviewHeap != NULL || mCachedRecordHeap != NULL;
+
+    mCachedPreviewHeap.clear();
+    mCachedRecordHeap.clear();
+    return held;
+}
+
+/* Bytes of the cached pools and of the preview pools that would be cached. */
+size_t QualcommCameraHardware::cachedPoolBytes()
+{
+    // Same order as cachePreviewPool, the frame thread may be moving the
+    // preview pools into the cache.
+    Mutex::Autolock pmem(&mPmemWaitLock);
+    Mutex::Autolock l(&mSnapshotCacheLock);
+    const MemPool *pools[] = {
+        mCachedRawHeap.get(), mCachedJpegHeap.get(), mCachedThumbnailHeap.get(),
+        mCachedPreviewHeap.get(), mCachedRecordHeap.get(),
+        mPreviewHeap.get(), mRecordHeap.get()
+    };
+    size_t bytes = 0;
+
+    for (size_t i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+        if (pools[i] != NULL)
+            bytes += pools[i]->mCharged;
+    }
+    return bytes;
+}
+
+/*
+ * Whether the pools of the capture about to start fit the memory budget
+ * once preview is stopped and the caches are evicted. initRaw would
+ * otherwise run out halfway, with preview already gone. The sizes are
+ * upper bounds of what initRaw and storePreviewFrameForPostview ask for.
+ */
+bool QualcommCameraHardware::captureFits()
+{
+    size_t limit = gMemBudget.limit();
+    if (!limit)
+        return true;
+
+    int width, height;
+    size_t page_mask = getpagesize() - 1;
+    mParameters.getPictureSize(&width, &height);
+    size_t frame = ((size_t)width * height * 3 / 2 + page_mask) & ~page_mask;
+    size_t thumbnail = ((size_t)previewWidth * previewHeight * 3 / 2 + page_mask) & ~page_mask;
+
+    size_t need = frame * kRawBufferCount;
+    if (mSnapshotFormat == PICTURE_FORMAT_JPEG) {
+        need = need * mBurstDepth + thumbnail;
+        if (mDataCallback && (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE))
+            need += frame;
+    }
+
+    size_t held = gMemBudget.used() - cachedPoolBytes();
+    if (held + need <= limit)
+        return true;
+
+    ALOGE("takePicture: %dx%d needs %u KB, the budget of %u KB has %u KB "
+          "held by pools in use", width, height, (unsigned)(need >> 10),
+          (unsigned)(limit >> 10), (unsigned)(held >> 10));
+    return false;
+}
+
 void QualcommCameraHardware::deinitRaw()
 {
     ALOGV("deinitRaw E");
 
+    if (snapshotCacheAllowed()) {
+        Mutex::Autolock l(&mSnapshotCacheLock);
+        if (mRawHeap != NULL)
+            mCachedRawHeap = mRawHeap;
+        if (mJpegHeap != NULL)
+            mCachedJpegHeap = mJpegHeap;
+        if (mCurrentTarget != TARGET_MSM8660 && mThumbnailHeap != NULL)
+            mCachedThumbnailHeap = mThumbnailHeap;
+    } else {
+        flushSnapshotCache();
+    }
+
+    for (int i = 0; i < kMaxBurstDepth; i++)
+        mBurstSlots[i].heap.clear();
     mJpegHeap.clear();
     mJpegHeap = NULL;
     mRawHeap.clear();
@@ -2954,7 +3753,12 @@ void QualcommCameraHardware::release()
         stopPreviewInternal();
         ALOGI("release: stopPreviewInternal done.");
     }
-    LINK_jpeg_encoder_join();
+    android_atomic_release_store(0, &mLiveshotArmed);
+    waitForLiveshot();
+    free(mLiveshotCopy);
+    mLiveshotCopy = NULL;
+    mLiveshotCopySize = 0;
+    jpegEncoderJoin();
     //Signal the snapshot thread
     mJpegThreadWaitLock.lock();
     mJpegThreadRunning = false;
@@ -2970,24 +3774,32 @@ void QualcommCameraHardware::release()
         ALOGV("takePicture: old snapshot thread completed.");
     }
     mSnapshotThreadWaitLock.unlock();
+    waitForEncode();
 
     {
         Mutex::Autolock l (&mRawPictureHeapLock);
         deinitRaw();
+        flushSnapshotCache();
     }
+    flushPreviewCache();
 
     deinitRawSnapshot();
     ALOGI("release: clearing resources done.");
     if(mCurrentTarget == TARGET_MSM8660) {
        ALOGV("release : Clearing the mThumbnailHeap and mDisplayHeap");
-       mPostViewHeap.clear();
-       mPostViewHeap = NULL;
+       mPostViewFrame.clear();
        mThumbnailHeap.clear();
        mThumbnailHeap = NULL;
        mDisplayHeap.clear();
        mDisplayHeap = NULL;
     }
 
+    mOverlayLock.lock();
+    mLastQueued.pool.clear();
+    mLastQueuedValid = false;
+    mOverlayLock.unlock();
+    mDisplayCopyHeap.clear();
+
     /* Release heaps */
     if (mPreviewHeap != NULL) {
        ALOGV("release: clearing mPreviewHeap");
@@ -3029,6 +3841,7 @@ void QualcommCameraHardware::release()
 QualcommCameraHardware::~QualcommCameraHardware()
 {
     ALOGI("~QualcommCameraHardware E");
+    gMemBudget.removeEvictors(this);
     LINK_mm_camera_destroy();
 
     libmmcamera = NULL;
@@ -3039,8 +3852,6 @@ QualcommCameraHardware::~QualcommCameraHardware()
     if( mCurrentTarget == TARGET_MSM7630 || mCurrentTarget == TARGET_QSD8250 || mCurrentTarget == TARGET_MSM8660 ) {
         delete [] recordframes;
         recordframes = NULL;
-        delete [] record_buffers_tracking_flag;
-        record_buffers_tracking_flag = NULL;
     }
     singleton.clear();
     singleton_releasing = false;
@@ -3071,9 +3882,11 @@ status_t QualcommCameraHardware::startPreviewInternal()
     }
 
     if (!mPreviewInitialized) {
-        mLastQueuedFrame = NULL;
+        mLastQueuedValid = false;
+        mPreviewStartTime = systemTime();
         mPreviewInitialized = initPreview();
         if (!mPreviewInitialized) {
+            mPreviewStartTime = 0;
             ALOGE("startPreview X initPreview failed.  Not starting preview.");
             return UNKNOWN_ERROR;
         }
@@ -3098,9 +3911,6 @@ status_t QualcommCameraHardware::startPreviewInternal()
         return UNKNOWN_ERROR;
     }
 
-    //Reset the Gps Information
-    exif_table_numEntries = 0;
-
     ALOGV("startPreviewInternal X");
     return NO_ERROR;
 }
@@ -3152,9 +3962,7 @@ void QualcommCameraHardware::stopPreviewInternal()
                 mVideoThreadExit = 1;
                 mVideoThreadWaitLock.unlock();
                 //  720p : signal the video thread , and check in video thread if stop is called, if so exit video thread.
-                pthread_mutex_lock(&(g_busy_frame_queue.mut));
-                pthread_cond_signal(&(g_busy_frame_queue.wait));
-                pthread_mutex_unlock(&(g_busy_frame_queue.mut));
+                g_busy_frame_queue.wake();
                 /* Flush the Busy Q */
                 cam_frame_flush_video();
                 /* Flush the Free Q */
@@ -3376,6 +4184,8 @@ void QualcommCameraHardware::runSnapshotThread(void *data)
         mSnapshotCancel = false;
         mSnapshotCancelLock.unlock();
         ALOGV("%s: cancelpicture has been called..so abort taking snapshot", __FUNCTION__);
+        if (mZslCapture)
+            finishZsl();
         deinitRaw();
         mInSnapshotModeWaitLock.lock();
         mInSnapshotMode = false;
@@ -3389,8 +4199,12 @@ void QualcommCameraHardware::runSnapshotThread(void *data)
     }
     mSnapshotCancelLock.unlock();
 
-    if(mSnapshotFormat == PICTURE_FORMAT_JPEG){
-        if (native_start_ops(CAMERA_OPS_SNAPSHOT, NULL))
+    if(mZslCapture){
+        ret = captureZsl();
+    } else if(mSnapshotFormat == PICTURE_FORMAT_JPEG){
+        if (mBurstShots > 1)
+            ret = runBurst();
+        else if (native_start_ops(CAMERA_OPS_SNAPSHOT, NULL))
             ret = receiveRawPicture();
         else {
             ALOGE("main: snapshot failed! [CAMERA_OPS_SNAPSHOT]");
@@ -3411,20 +4225,23 @@ void QualcommCameraHardware::runSnapshotThread(void *data)
 
     mSnapshotFormat = 0;
     if(ret != false) {
-        if(strTexturesOn != true ) {
-            mJpegThreadWaitLock.lock();
-            while (mJpegThreadRunning) {
-                ALOGI("runSnapshotThread: waiting for jpeg thread to complete.");
-                mJpegThreadWait.wait(mJpegThreadWaitLock);
-                ALOGI("runSnapshotThread: jpeg thread completed.");
-            }
-            mJpegThreadWaitLock.unlock();
-            //clear the resources
-            ALOGV("%s, libmmcamera: %p\n", __FUNCTION__, libmmcamera);
-            if(libmmcamera != NULL)
-            {
-                LINK_jpeg_encoder_join();
-            }
+        // A burst has already joined the encoder after every frame.
+        if(strTexturesOn != true && mBurstShots == 1) {
+            // The picture is out of the VFE. Hand it to the encode stage
+            // and stop counting as a snapshot, so preview can be restarted
+            // and reconfigured while the JPEG is being produced.
+            mEncodeWaitLock.lock();
+            mEncodeRunning = true;
+            mEncodeWaitLock.unlock();
+
+            mSnapshotThreadWaitLock.lock();
+            mSnapshotThreadRunning = false;
+            mSnapshotThreadWait.signal();
+            mSnapshotThreadWaitLock.unlock();
+
+            runEncodeStage();
+            ALOGV("runSnapshotThread X");
+            return;
         }
     } else {
         if( mDataCallback
@@ -3436,6 +4253,8 @@ void QualcommCameraHardware::runSnapshotThread(void *data)
             mDataCallback(CAMERA_MSG_COMPRESSED_IMAGE, NULL, mCallbackCookie);
         }
     }
+    if (mZslCapture)
+        finishZsl();
     deinitRaw();
 
     mSnapshotThreadWaitLock.lock();
@@ -3446,6 +4265,48 @@ void QualcommCameraHardware::runSnapshotThread(void *data)
     ALOGV("runSnapshotThread X");
 }
 
+/*
+ * Waits for the JPEG callback and releases the raw picture. The snapshot
+ * thread runs this after it has handed the capture over, takePicture(),
+ * takeLiveSnapshot() and release() wait for it through waitForEncode().
+ */
+void QualcommCameraHardware::runEncodeStage()
+{
+    nsecs_t start = systemTime();
+
+    mJpegThreadWaitLock.lock();
+    while (mJpegThreadRunning) {
+        ALOGI("runEncodeStage: waiting for jpeg thread to complete.");
+        mJpegThreadWait.wait(mJpegThreadWaitLock);
+        ALOGI("runEncodeStage: jpeg thread completed.");
+    }
+    mJpegThreadWaitLock.unlock();
+    //clear the resources
+    ALOGV("%s, libmmcamera: %p\n", __FUNCTION__, libmmcamera);
+    jpegEncoderJoin();
+
+    if (mZslCapture)
+        finishZsl();
+    mEncodeRawHeap.clear();
+    deinitRaw();
+    ALOGV("runEncodeStage: encoder done after %lld ms",
+          (long long)((systemTime() - start) / 1000000));
+
+    mEncodeWaitLock.lock();
+    mEncodeRunning = false;
+    mEncodeWait.broadcast();
+    mEncodeWaitLock.unlock();
+}
+
+void QualcommCameraHardware::waitForEncode()
+{
+    Mutex::Autolock l(&mEncodeWaitLock);
+    while (mEncodeRunning) {
+        ALOGV("waitForEncode: waiting for the previous picture to be encoded.");
+        mEncodeWait.wait(mEncodeWaitLock);
+    }
+}
+
 void *snapshot_thread(void *user)
 {
     ALOGD("snapshot_thread E");
@@ -3458,10 +4319,193 @@ void *snapshot_thread(void *user)
     return NULL;
 }
 
+bool QualcommCameraHardware::snapshotCancelled()
+{
+    Mutex::Autolock l(&mSnapshotCancelLock);
+    return mSnapshotCancel;
+}
+
+void QualcommCameraHardware::runBurstEncodeThread()
+{
+    int next = 0;
+
+    ALOGV("runBurstEncodeThread E");
+    for (;;) {
+        BurstSlot &slot = mBurstSlots[next];
+
+        mBurstLock.lock();
+        while (slot.state != BURST_SLOT_FULL && !mBurstCaptureDone)
+            mBurstWait.wait(mBurstLock);
+        if (slot.state != BURST_SLOT_FULL) {
+            mBurstLock.unlock();
+            break;
+        }
+        mBurstLock.unlock();
+
+        // Frames captured before a cancelPicture are dropped unencoded.
+        bool ok = !snapshotCancelled() && encodeBurstFrame(slot);
+
+        mBurstLock.lock();
+        if (ok)
+            mBurstEncoded++;
+        slot.state = BURST_SLOT_FREE;
+        mBurstWait.broadcast();
+        mBurstLock.unlock();
+
+        next = (next + 1) % mBurstDepth;
+    }
+
+    mBurstLock.lock();
+    mBurstEncoderRunning = false;
+    mBurstWait.broadcast();
+    mBurstLock.unlock();
+    ALOGV("runBurstEncodeThread X");
+}
+
+void *burst_encode_thread(void *user)
+{
+    ALOGV("burst_encode_thread E");
+    sp<QualcommCameraHardware> obj = QualcommCameraHardware::getInstance();
+    if (obj != 0) {
+        obj->runBurstEncodeThread();
+    }
+    else ALOGW("not starting burst encode thread: the object went away!");
+    ALOGV("burst_encode_thread X");
+    return NULL;
+}
+
+/*
+ * Captures mBurstShots pictures back to back. Slot k % mBurstDepth of the
+ * raw ring receives frame k; the encode thread releases a slot once its
+ * JPEG has been delivered, so capture only waits when the ring is full.
+ */
+bool QualcommCameraHardware::runBurst()
+{
+    nsecs_t start = systemTime();
+    cam_ctrl_dimension_t dim = mDimension;
+    int captured = 0;
+
+    mBurstLock.lock();
+    for (int i = 0; i < mBurstDepth; i++)
+        mBurstSlots[i].state = BURST_SLOT_FREE;
+    mBurstCaptureDone = false;
+    mBurstEncoded = 0;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    mBurstEncoderRunning = !pthread_create(&mBurstEncoderThread,
+                                           &attr,
+                                           burst_encode_thread,
+                                           NULL);
+    mBurstLock.unlock();
+
+    if (!mBurstEncoderRunning) {
+        ALOGE("runBurst: could not start the encode thread");
+        return false;
+    }
+
+    for (int k = 0; k < mBurstShots && !snapshotCancelled(); k++) {
+        int index = k % mBurstDepth;
+        BurstSlot &slot = mBurstSlots[index];
+
+        mBurstLock.lock();
+        while (slot.state != BURST_SLOT_FREE)
+            mBurstWait.wait(mBurstLock);
+        mBurstLock.unlock();
+
+        if (index != mBurstRegistered) {
+            mBurstSlots[mBurstRegistered].heap->registerBuffers(false);
+            slot.heap->registerBuffers(true);
+            mBurstRegistered = index;
+        }
+
+        if (k > 0) {
+            mShutterLock.lock();
+            mShutterPending = true;
+            mShutterLock.unlock();
+        }
+
+        if (!native_start_ops(CAMERA_OPS_SNAPSHOT, NULL)) {
+            ALOGE("runBurst: snapshot %d failed! [CAMERA_OPS_SNAPSHOT]", k);
+            break;
+        }
+
+        slot.dim = dim;
+        bool ok;
+        {
+            Mutex::Autolock cbLock(&mCallbackLock);
+            ok = getRawPicture(&slot.crop, &slot.dim, slot.heap);
+        }
+        if (!ok)
+            break;
+
+        mBurstLock.lock();
+        slot.frame = k;
+        slot.state = BURST_SLOT_FULL;
+        mBurstWait.broadcast();
+        mBurstLock.unlock();
+        captured++;
+    }
+
+    mBurstLock.lock();
+    mBurstCaptureDone = true;
+    mBurstWait.broadcast();
+    while (mBurstEncoderRunning)
+        mBurstWait.wait(mBurstLock);
+    int encoded = mBurstEncoded;
+    mBurstLock.unlock();
+
+    // Leave mRawHeap registered, the snapshot cache keeps it that way.
+    if (mBurstRegistered != 0) {
+        mBurstSlots[mBurstRegistered].heap->registerBuffers(false);
+        mBurstSlots[0].heap->registerBuffers(true);
+        mBurstRegistered = 0;
+    }
+
+    nsecs_t elapsed = systemTime() - start;
+    mBurstFps = elapsed > 0 ? encoded * 1000000000.0f / elapsed : 0;
+    ALOGI("runBurst: %d of %d captured, %d encoded in %lld ms (%.2f fps)",
+          captured, mBurstShots, encoded, (long long)(elapsed / 1000000), mBurstFps);
+
+    return encoded > 0;
+}
+
+/* Encodes one burst frame and waits for its JPEG callback. */
+bool QualcommCameraHardware::encodeBurstFrame(BurstSlot &slot)
+{
+    ALOGV("encodeBurstFrame: frame %d", slot.frame);
+
+    mJpegSize = 0;
+
+    mJpegThreadWaitLock.lock();
+    if (!jpegEncoderInit()) {
+        mJpegThreadWaitLock.unlock();
+        ALOGE("encodeBurstFrame: jpeg_encoder_init failed.");
+        return false;
+    }
+    mJpegThreadRunning = true;
+    mJpegThreadWaitLock.unlock();
+
+    bool ok = native_jpeg_encode(slot.heap, slot.dim, slot.crop);
+
+    mJpegThreadWaitLock.lock();
+    if (!ok) {
+        ALOGE("encodeBurstFrame: jpeg encoding of frame %d failed", slot.frame);
+        mJpegThreadRunning = false;
+    }
+    while (mJpegThreadRunning)
+        mJpegThreadWait.wait(mJpegThreadWaitLock);
+    mJpegThreadWaitLock.unlock();
+
+    jpegEncoderJoin();
+    return ok;
+}
+
 status_t QualcommCameraHardware::takePicture()
 {
     ALOGV("takePicture(%d)", mMsgEnabled);
     Mutex::Autolock l(&mLock);
+    mShutterTime = systemTime();
 
     if(strTexturesOn == true){
         mEncodePendingWaitLock.lock();
@@ -3480,6 +4524,8 @@ status_t QualcommCameraHardware::takePicture()
         mSnapshotThreadWait.wait(mSnapshotThreadWaitLock);
         ALOGV("takePicture: old snapshot thread completed.");
     }
+    // There is a single encoder and the raw heaps are still in use by it.
+    waitForEncode();
     //mSnapshotFormat is protected by mSnapshotThreadWaitLock
     if(mParameters.getPictureFormat() != 0 &&
             !strcmp(mParameters.getPictureFormat(),
@@ -3488,34 +4534,72 @@ status_t QualcommCameraHardware::takePicture()
     else
         mSnapshotFormat = PICTURE_FORMAT_JPEG;
 
-    if(mSnapshotFormat == PICTURE_FORMAT_JPEG){
-        if(!native_start_ops(CAMERA_OPS_PREPARE_SNAPSHOT, NULL)) {
-            mSnapshotThreadWaitLock.unlock();
-            ALOGE("PREPARE SNAPSHOT: CAMERA_OPS_PREPARE_SNAPSHOT ioctl Failed");
-            return UNKNOWN_ERROR;
+    // Burst needs the thumbnail to come from the main image, the VFE
+    // thumbnail output would be overwritten by the next capture.
+    mBurstShots = 1;
+    mBurstDepth = 1;
+    if (mSnapshotFormat == PICTURE_FORMAT_JPEG && mBurstCount > 1) {
+        if (strTexturesOn ||
+            !(mDataCallback && (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE)) ||
+            ((mCurrentTarget != TARGET_MSM7630) &&
+             (mCurrentTarget != TARGET_MSM8660) &&
+             (mCurrentTarget != TARGET_MSM7627))) {
+            ALOGI("takePicture: burst not possible, taking a single picture");
+        } else {
+            char value[PROPERTY_VALUE_MAX];
+            property_get("persist.camera.hal.burst.depth", value, "2");
+            mBurstShots = mBurstCount;
+            mBurstDepth = atoi(value);
+            if (mBurstDepth < 1)
+                mBurstDepth = 1;
+            if (mBurstDepth > kMaxBurstDepth)
+                mBurstDepth = kMaxBurstDepth;
+            if (mBurstDepth > mBurstShots)
+                mBurstDepth = mBurstShots;
+            ALOGI("takePicture: burst of %d, %d raw buffers", mBurstShots, mBurstDepth);
         }
     }
 
-    if(mCurrentTarget == TARGET_MSM8660) {
-       /* Store the last frame queued for preview. This
-        * shall be used as postview */
-        if (!(storePreviewFrameForPostview()))
-        return UNKNOWN_ERROR;
-    }
-    stopPreviewInternal();
-
-    if(mSnapshotFormat == PICTURE_FORMAT_JPEG){
-        if (!initRaw(mDataCallback && (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE))) {
-            ALOGE("initRaw failed.  Not taking picture.");
+    // With zero shutter lag the picture comes out of the preview ring, so
+    // preview keeps running and nothing is reconfigured.
+    mZslCapture = mBurstShots == 1 && zslUsable();
+    if (mZslCapture) {
+        ALOGI("takePicture: zero shutter lag capture");
+    } else {
+        if (!captureFits()) {
             mSnapshotThreadWaitLock.unlock();
-            return UNKNOWN_ERROR;
+            return NO_MEMORY;
         }
-    } else if(mSnapshotFormat == PICTURE_FORMAT_RAW ){
-        if(!initRawSnapshot()){
-            ALOGE("initRawSnapshot failed. Not taking picture.");
-            mSnapshotThreadWaitLock.unlock();
+
+        if(mSnapshotFormat == PICTURE_FORMAT_JPEG){
+            if(!native_start_ops(CAMERA_OPS_PREPARE_SNAPSHOT, NULL)) {
+                mSnapshotThreadWaitLock.unlock();
+                ALOGE("PREPARE SNAPSHOT: CAMERA_OPS_PREPARE_SNAPSHOT ioctl Failed");
+                return UNKNOWN_ERROR;
+            }
+        }
+
+        if(mCurrentTarget == TARGET_MSM8660) {
+           /* Store the last frame queued for preview. This
+            * shall be used as postview */
+            if (!(storePreviewFrameForPostview()))
             return UNKNOWN_ERROR;
         }
+        stopPreviewInternal();
+
+        if(mSnapshotFormat == PICTURE_FORMAT_JPEG){
+            if (!initRaw(mDataCallback && (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE))) {
+                ALOGE("initRaw failed.  Not taking picture.");
+                mSnapshotThreadWaitLock.unlock();
+                return UNKNOWN_ERROR;
+            }
+        } else if(mSnapshotFormat == PICTURE_FORMAT_RAW ){
+            if(!initRawSnapshot()){
+                ALOGE("initRawSnapshot failed. Not taking picture.");
+                mSnapshotThreadWaitLock.unlock();
+                return UNKNOWN_ERROR;
+            }
+        }
     }
 
     mShutterLock.lock();
@@ -3543,18 +4627,6 @@ status_t QualcommCameraHardware::takePicture()
     return mSnapshotThreadRunning ? NO_ERROR : UNKNOWN_ERROR;
 }
 
-void QualcommCameraHardware::set_liveshot_exifinfo()
-{
-    setGpsParameters();
-    //set TimeStamp
-    const char *str = mParameters.get(CameraParameters::KEY_EXIF_DATETIME);
-    if(str != NULL) {
-        strlcpy(dateTime, str, 20);
-        addExifTag(EXIFTAGID_EXIF_DATE_TIME_ORIGINAL, EXIF_ASCII,
-                   20, 1, (void *)dateTime);
-    }
-}
-
 status_t QualcommCameraHardware::takeLiveSnapshot()
 {
     ALOGV("takeLiveSnapshot: E ");
@@ -3564,9 +4636,37 @@ status_t QualcommCameraHardware::takeLiveSnapshot()
         return NO_ERROR;
     }
 
-    if( (mCurrentTarget != TARGET_MSM7630) && (mCurrentTarget != TARGET_MSM8660)) {
-        ALOGI("LiveSnapshot not supported on this target");
-        liveshot_state = LIVESHOT_STOPPED;
+    // A picture handed to the encode stage still writes its fragments to
+    // mJpegHeap and reads mEncodeExif, both replaced below. Its deinitRaw()
+    // would also drop the new mJpegHeap.
+    waitForEncode();
+
+    if (softwareLiveSnapshot()) {
+        // The video thread, or the frame thread where preview frames are
+        // the recording, hands the next frame to runLiveshotThread.
+        bool record = mCurrentTarget == TARGET_MSM7630 ||
+                      mCurrentTarget == TARGET_QSD8250 ||
+                      mCurrentTarget == TARGET_MSM8660;
+        int width = record ? videoWidth : previewWidth;
+        int height = record ? videoHeight : previewHeight;
+
+        waitForLiveshot();
+        if (!initLiveSnapshot(width, height)) {
+            ALOGE("takeLiveSnapshot: Jpeg Heap Memory allocation failed.  Not taking Live Snapshot.");
+            liveshot_state = LIVESHOT_STOPPED;
+            return UNKNOWN_ERROR;
+        }
+        mEncodeExif = mExif;
+        int rotation = mParameters.getInt("rotation");
+        if (rotation >= 0)
+            mEncodeExif.setOrientation(rotation);
+        mEncodeExif.setPictureSize(width, height);
+        int quality = mParameters.getInt(CameraParameters::KEY_JPEG_QUALITY);
+        mLiveshotQuality = quality > 0 ? quality : 85;
+        mLiveshotStart = systemTime();
+        liveshot_state = LIVESHOT_IN_PROGRESS;
+        android_atomic_release_store(1, &mLiveshotArmed);
+        ALOGV("takeLiveSnapshot: X, software");
         return NO_ERROR;
     }
 
@@ -3579,9 +4679,10 @@ status_t QualcommCameraHardware::takeLiveSnapshot()
     }
 
     uint32_t maxjpegsize = videoWidth * videoHeight *1.5;
-    set_liveshot_exifinfo();
+    mEncodeExif = mExif;
+    int exifCount = exportExifTable(mEncodeExif, mLiveshotExif);
     if(!LINK_set_liveshot_params(videoWidth, videoHeight,
-                                exif_data, exif_table_numEntries,
+                                mLiveshotExif, exifCount,
                                 (uint8_t *)mJpegHeap->mHeap->base(), maxjpegsize)) {
         ALOGE("Link_set_liveshot_params failed.");
         mJpegHeap.clear();
@@ -3589,45 +4690,229 @@ status_t QualcommCameraHardware::takeLiveSnapshot()
         return NO_ERROR;
     }
 
-    if(!native_start_ops(CAMERA_OPS_LIVESHOT, NULL)) {
-        ALOGE("start_liveshot ioctl failed");
+    if(!native_start_ops(CAMERA_OPS_LIVESHOT, NULL)) {
+        ALOGE("start_liveshot ioctl failed");
+        liveshot_state = LIVESHOT_STOPPED;
+        mJpegHeap.clear();
+        mJpegHeap = NULL;
+        return UNKNOWN_ERROR;
+    }
+
+    ALOGV("takeLiveSnapshot: X");
+    return NO_ERROR;
+}
+
+bool QualcommCameraHardware::initLiveSnapshot(int videowidth, int videoheight)
+{
+    ALOGV("initLiveSnapshot E");
+
+    if (mJpegHeap != NULL) {
+        ALOGV("initLiveSnapshot: clearing old mJpegHeap.");
+        mJpegHeap.clear();
+    }
+
+    mJpegMaxSize = videowidth * videoheight * 1.5;
+
+    ALOGV("initLiveSnapshot: initializing mJpegHeap.");
+    mJpegHeap =
+        new AshmemPool(mJpegMaxSize,
+                       kJpegBufferCount,
+                       0, // we do not know how big the picture will be
+                       "jpeg");
+
+    if (!mJpegHeap->initialized()) {
+        mJpegHeap.clear();
+        mJpegHeap = NULL;
+        ALOGE("initLiveSnapshot X failed: error initializing mJpegHeap.");
+        return false;
+    }
+
+    ALOGV("initLiveSnapshot X");
+    return true;
+}
+
+/*
+ * Whether live snapshots are encoded here rather than by the VFE, which
+ * only 7x30 and 8x60 do. persist.camera.hal.liveshot=sw picks the software
+ * path on those too.
+ */
+bool QualcommCameraHardware::softwareLiveSnapshot() const
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    if (mCurrentTarget != TARGET_MSM7630 && mCurrentTarget != TARGET_MSM8660)
+        return true;
+#if DLOPEN_LIBMMCAMERA
+    if (LINK_set_liveshot_params == NULL)
+        return true;
+#endif
+    property_get("persist.camera.hal.liveshot", value, "hw");
+    return !strcmp(value, "sw");
+}
+
+void *liveshot_thread(void *user)
+{
+    ALOGV("liveshot_thread E");
+    sp<QualcommCameraHardware> obj = QualcommCameraHardware::getInstance();
+    if (obj != 0) {
+        obj->runLiveshotThread();
+    }
+    else ALOGW("not starting live snapshot thread: the object went away!");
+    ALOGV("liveshot_thread X");
+    return NULL;
+}
+
+/*
+ * Hands a recording frame to the live snapshot thread: record buffer index,
+ * pinned by the caller, or with index -1 a preview frame, copied here as
+ * it goes back to the kernel when the caller returns. The copy is
+ * accounted as CPU_LIVESHOT.
+ */
+bool QualcommCameraHardware::startLiveshotThread(const struct msm_frame *frame,
+                                                 int index)
+{
+    int width = index >= 0 ? videoWidth : previewWidth;
+    int height = index >= 0 ? videoHeight : previewHeight;
+    uint8_t *y = (uint8_t *)frame->buffer + frame->y_off;
+    uint8_t *uv = (uint8_t *)frame->buffer + frame->cbcr_off;
+
+    if (index < 0 && mPreviewFormat == CAMERA_YUV_420_NV21_ADRENO) {
+        ALOGE("startLiveshotThread: tiled preview frames are not supported");
+        liveshot_state = LIVESHOT_STOPPED;
+        return false;
+    }
+    if (index < 0) {
+        size_t size = width * height * 3 / 2;
+        if (size > mLiveshotCopySize) {
+            free(mLiveshotCopy);
+            mLiveshotCopy = (uint8_t *)malloc(size);
+            mLiveshotCopySize = mLiveshotCopy != NULL ? size : 0;
+        }
+        if (mLiveshotCopy == NULL) {
+            ALOGE("startLiveshotThread: no memory for a %dx%d frame", width, height);
+            liveshot_state = LIVESHOT_STOPPED;
+            return false;
+        }
+        nsecs_t start = systemTime();
+        mPreviewHeap->beginCpu((uint8_t *)frame->buffer -
+                               (uint8_t *)mPreviewHeap->mHeap->base(),
+                               mPreviewFrameSize,
+                               CameraHardwareInterface::CPU_READ);
+        memcpy(mLiveshotCopy, y, width * height);
+        memcpy(mLiveshotCopy + width * height, uv, width * height / 2);
+        accountCpuAccess(CPU_LIVESHOT, size, start);
+        yuv_sp_frame_init(&mLiveshotImage, mLiveshotCopy, width, height, width);
+    } else {
+        mLiveshotImage.y = y;
+        mLiveshotImage.uv = uv;
+        mLiveshotImage.width = width;
+        mLiveshotImage.height = height;
+        mLiveshotImage.y_stride = width;
+        mLiveshotImage.uv_stride = width;
+    }
+    mLiveshotBuffer = index;
+    mRecordFrameGaps.startEncode();
+
+    mLiveshotThreadWaitLock.lock();
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    mLiveshotThreadRunning = !pthread_create(&thread, &attr, liveshot_thread, NULL);
+    bool running = mLiveshotThreadRunning;
+    mLiveshotThreadWaitLock.unlock();
+
+    if (!running) {
+        ALOGE("startLiveshotThread: could not start the thread");
+        mRecordFrameGaps.cancelEncode();
         liveshot_state = LIVESHOT_STOPPED;
-        mJpegHeap.clear();
-        mJpegHeap = NULL;
-        return UNKNOWN_ERROR;
     }
-
-    ALOGV("takeLiveSnapshot: X");
-    return NO_ERROR;
+    return running;
 }
 
-bool QualcommCameraHardware::initLiveSnapshot(int videowidth, int videoheight)
+void QualcommCameraHardware::waitForLiveshot()
 {
-    ALOGV("initLiveSnapshot E");
-
-    if (mJpegHeap != NULL) {
-        ALOGV("initLiveSnapshot: clearing old mJpegHeap.");
-        mJpegHeap.clear();
+    mLiveshotThreadWaitLock.lock();
+    while (mLiveshotThreadRunning) {
+        ALOGV("waitForLiveshot: waiting for the live snapshot to complete.");
+        mLiveshotThreadWait.wait(mLiveshotThreadWaitLock);
     }
+    mLiveshotThreadWaitLock.unlock();
+}
 
-    mJpegMaxSize = videowidth * videoheight * 1.5;
+struct LiveshotOutput {
+    uint8_t *base;
+    size_t size;
+    size_t max;
+    bool overflow;
+};
 
-    ALOGV("initLiveSnapshot: initializing mJpegHeap.");
-    mJpegHeap =
-        new AshmemPool(mJpegMaxSize,
-                       kJpegBufferCount,
-                       0, // we do not know how big the picture will be
-                       "jpeg");
+static void liveshot_output(const uint8_t *data, uint32_t size, void *user)
+{
+    LiveshotOutput *out = (LiveshotOutput *)user;
 
-    if (!mJpegHeap->initialized()) {
+    if (out->overflow || size > out->max - out->size) {
+        out->overflow = true;
+        return;
+    }
+    memcpy(out->base + out->size, data, size);
+    out->size += size;
+}
+
+void QualcommCameraHardware::runLiveshotThread()
+{
+    ALOGV("runLiveshotThread E");
+    // The recording must not wait for the snapshot: background priority
+    // and one thread, so the video encoder keeps its cores.
+    androidSetThreadPriority(0, ANDROID_PRIORITY_BACKGROUND);
+
+    LiveshotOutput out = { (uint8_t *)mJpegHeap->mHeap->base(), 0, mJpegMaxSize, false };
+    jpeg_encode_params_t params;
+    jpeg_encode_params_init(&params);
+    params.quality = mLiveshotQuality;
+    params.nv21 = true;
+    params.exif = &mEncodeExif;
+    params.threads = 1;
+    params.output = liveshot_output;
+    params.user = &out;
+
+    nsecs_t start = systemTime();
+    int size = jpeg_encode_yuv420sp(&mLiveshotImage, &params);
+    nsecs_t encodeTime = systemTime() - start;
+    mRecordFrameGaps.endEncode();
+
+    if (mLiveshotBuffer >= 0 && mRecordBuffers.dropPin(mLiveshotBuffer))
+        freeRecordBuffer(mLiveshotBuffer);
+
+    mLiveshotLatency = systemTime() - mLiveshotStart;
+    mLiveshotCount++;
+    ALOGI("runLiveshotThread: %dx%d %s, %d bytes, encoded in %lld ms, "
+          "%lld ms after the request",
+          mLiveshotImage.width, mLiveshotImage.height,
+          mLiveshotBuffer >= 0 ? "record buffer" : "copied frame", size,
+          (long long)(encodeTime / 1000000), (long long)(mLiveshotLatency / 1000000));
+    if (size > 0 && !out.overflow) {
+        receiveLiveSnapshot(size);
+    } else {
+        ALOGE("runLiveshotThread: encoding failed (%d bytes for %d)", size, mJpegMaxSize);
         mJpegHeap.clear();
         mJpegHeap = NULL;
-        ALOGE("initLiveSnapshot X failed: error initializing mJpegHeap.");
-        return false;
+        liveshot_state = LIVESHOT_STOPPED;
     }
 
-    ALOGV("initLiveSnapshot X");
-    return true;
+    mLiveshotThreadWaitLock.lock();
+    mLiveshotThreadRunning = false;
+    mLiveshotThreadWait.signal();
+    mLiveshotThreadWaitLock.unlock();
+    ALOGV("runLiveshotThread X");
+}
+
+/* Called for every recording frame by the thread delivering them. */
+void QualcommCameraHardware::countRecordFrame(nsecs_t timestamp)
+{
+    int drops = mRecordFrameGaps.frame(timestamp);
+    if (drops >= 0)
+        ALOGI("countRecordFrame: live snapshot cost the recording %d frames", drops);
 }
 
 
@@ -3698,6 +4983,8 @@ status_t QualcommCameraHardware::setParameters(const CameraParameters& params)
     if ((rc = setRecordSize(params)))  final_rc = rc;
     if ((rc = setSceneDetect(params)))  final_rc = rc;
     if ((rc = setStrTextures(params)))   final_rc = rc;
+    if ((rc = setNumSnapsPerShutter(params)))   final_rc = rc;
+    if ((rc = setZsl(params)))   final_rc = rc;
     if ((rc = setPreviewFormat(params)))   final_rc = rc;
     if ((rc = setSkinToneEnhancement(params)))   final_rc = rc;
     if ((rc = setAntibanding(params)))  final_rc = rc;
@@ -3971,7 +5258,12 @@ void QualcommCameraHardware::receiveRecordingFrame(struct msm_frame *frame)
     // post busy frame
     if (frame)
     {
-        cam_frame_post_video (frame);
+        int index = recordBufferIndex(frame->buffer);
+        if (index >= 0)
+            mRecordBuffers.move(index, (1 << RECORD_BUFFER_KERNEL) |
+                                (1 << RECORD_BUFFER_CAMFRAME), RECORD_BUFFER_BUSY);
+        if (!cam_frame_post_video (frame) && index >= 0)
+            mRecordBuffers.move(index, 1 << RECORD_BUFFER_BUSY, RECORD_BUFFER_CAMFRAME);
     }
     else ALOGE("in  receiveRecordingFrame frame is NULL");
     ALOGV("receiveRecordingFrame X");
@@ -4096,8 +5388,6 @@ void QualcommCameraHardware::receiveLiveSnapshot(uint32_t jpeg_size)
     }
     else ALOGV("JPEG callback was cancelled--not delivering image.");
 
-    //Reset the Gps Information & relieve memory
-    exif_table_numEntries = 0;
     mJpegHeap.clear();
     mJpegHeap = NULL;
 
@@ -4119,6 +5409,14 @@ void QualcommCameraHardware::receivePreviewFrame(struct msm_frame *frame)
         debugShowPreviewFPS();
     }
 
+    if (mPreviewStartTime) {
+        mPreviewStartLatency = systemTime() - mPreviewStartTime;
+        mPreviewStartTime = 0;
+        ALOGI("receivePreviewFrame: first frame %lld ms after startPreview "
+              "(preview pool %s)", (long long)(mPreviewStartLatency / 1000000),
+              mPreviewHeapReused ? "reused" : "allocated");
+    }
+
     mCallbackLock.lock();
     int msgEnabled = mMsgEnabled;
     data_callback pcb = mDataCallback;
@@ -4135,6 +5433,7 @@ void QualcommCameraHardware::receivePreviewFrame(struct msm_frame *frame)
     ssize_t offset_addr =
         (ssize_t)frame->buffer - (ssize_t)mPreviewHeap->mHeap->base();
     ssize_t offset = offset_addr / mPreviewHeap->mAlignedBufferSize;
+    mPreviewHeap->hardwareWrote(offset);
 
     common_crop_t *crop = (common_crop_t *) (frame->cropinfo);
 
@@ -4162,64 +5461,39 @@ void QualcommCameraHardware::receivePreviewFrame(struct msm_frame *frame)
           frameCnt++;
 #endif
 
+    storeZslFrame(frame);
+
     mInPreviewCallback = true;
     if(mUseOverlay) {
-        mOverlayLock.lock();
-        if(mOverlay != NULL) {
-            mOverlay->setFd(mPreviewHeap->mHeap->getHeapID());
-            if (crop->in1_w != 0 || crop->in1_h != 0) {
-                zoomCropInfo.x = (crop->out1_w - crop->in1_w + 1) / 2 - 1;
-                zoomCropInfo.y = (crop->out1_h - crop->in1_h + 1) / 2 - 1;
-                zoomCropInfo.w = zoomCropInfo.x + crop->in1_w;
-                zoomCropInfo.h = zoomCropInfo.y + crop->in1_h;
-                /* There can be scenarios where the in1_wXin1_h and
-                 * out1_wXout1_h are same. In those cases, reset the
-                 * x and y to zero instead of negative for proper zooming
-                 */
-                if (zoomCropInfo.x < 0) zoomCropInfo.x = 0;
-                if (zoomCropInfo.y < 0) zoomCropInfo.y = 0;
-                mOverlay->setCrop(zoomCropInfo.x, zoomCropInfo.y,
-                    zoomCropInfo.w, zoomCropInfo.h);
-                /* Set mResetOverlayCrop to true, so that when there is
-                 * no crop information, setCrop will be called
-                 * with zero crop values.
-                 */
-                mResetOverlayCrop = true;
-
-            } else {
-                // Reset zoomCropInfo variables. This will ensure that
-                // stale values wont be used for postview
-                zoomCropInfo.w = crop->in1_w;
-                zoomCropInfo.h = crop->in1_h;
-                /* This reset is required, if not, overlay driver continues
-                 * to use the old crop information for these preview
-                 * frames which is not the correct behavior. To avoid
-                 * multiple calls, reset once.
-                 */
-                if(mResetOverlayCrop == true){
-                    mOverlay->setCrop(0, 0, zoomCropInfo.w, zoomCropInfo.h);
-                    mResetOverlayCrop = false;
-                }
-            }
-            mOverlay->queueBuffer((void *)offset_addr);
-            /* To overcome a timing case where we could be having the overlay refer to deallocated
-               mDisplayHeap(and showing corruption), the mDisplayHeap is not deallocated untill the
-               first preview frame is queued to the overlay in 8660. Also adding the condition
-               to check if snapshot is currently in progress ensures that the resources being
-               used by the snapshot thread are not incorrectly deallocated by preview thread*/
-            if ((mCurrentTarget == TARGET_MSM8660)&&(mFirstFrame == true)&&(!mSnapshotThreadRunning)) {
-                ALOGD(" receivePreviewFrame : first frame queued, display heap being deallocated");
-                mThumbnailHeap.clear();
-                mThumbnailHeap = NULL;
-                mDisplayHeap.clear();
-                mDisplayHeap = NULL;
-                mFirstFrame = false;
-                mPostViewHeap.clear();
-                mPostViewHeap = NULL;
-            }
-            mLastQueuedFrame = (void *)frame->buffer;
+        DisplayFrame displayFrame;
+        displayFrame.offset = offset_addr;
+        displayFrame.fd = mPreviewHeap->mHeap->getHeapID();
+        displayFrame.index = offset;
+        displayFrame.vaddr = (void *)frame->buffer;
+        if (crop->in1_w != 0 || crop->in1_h != 0) {
+            zoomCropInfo.x = (crop->out1_w - crop->in1_w + 1) / 2 - 1;
+            zoomCropInfo.y = (crop->out1_h - crop->in1_h + 1) / 2 - 1;
+            zoomCropInfo.w = zoomCropInfo.x + crop->in1_w;
+            zoomCropInfo.h = zoomCropInfo.y + crop->in1_h;
+            /* There can be scenarios where the in1_wXin1_h and
+             * out1_wXout1_h are same. In those cases, reset the
+             * x and y to zero instead of negative for proper zooming
+             */
+            if (zoomCropInfo.x < 0) zoomCropInfo.x = 0;
+            if (zoomCropInfo.y < 0) zoomCropInfo.y = 0;
+            displayFrame.cropX = zoomCropInfo.x;
+            displayFrame.cropY = zoomCropInfo.y;
+        } else {
+            // Reset zoomCropInfo variables. This will ensure that
+            // stale values wont be used for postview
+            zoomCropInfo.w = crop->in1_w;
+            zoomCropInfo.h = crop->in1_h;
+            displayFrame.cropX = 0;
+            displayFrame.cropY = 0;
         }
-        mOverlayLock.unlock();
+        displayFrame.cropW = zoomCropInfo.w;
+        displayFrame.cropH = zoomCropInfo.h;
+        postDisplayFrame(displayFrame);
     } else {
         if (crop->in1_w != 0 || crop->in1_h != 0) {
             dstOffset = (dstOffset + 1) % NUM_MORE_BUFS;
@@ -4229,11 +5503,10 @@ void QualcommCameraHardware::receivePreviewFrame(struct msm_frame *frame)
                 offset_addr, dstOffset_addr, crop)) {
                 ALOGE(" Error while doing MDP zoom ");
                 offset = offset_addr / mPreviewHeap->mAlignedBufferSize;
+            } else {
+                mPreviewHeap->hardwareWrote(offset);
             }
         }
-        if (mCurrentTarget == TARGET_MSM7627) {
-            mLastQueuedFrame = (void *)mPreviewHeap->mBuffers[offset]->pointer();
-        }
     }
     if (pcb != NULL && (msgEnabled & CAMERA_MSG_PREVIEW_FRAME))
         pcb(CAMERA_MSG_PREVIEW_FRAME, mPreviewHeap->mBuffers[offset],
@@ -4245,7 +5518,14 @@ void QualcommCameraHardware::receivePreviewFrame(struct msm_frame *frame)
 
     if( (mCurrentTarget != TARGET_MSM7630 ) &&  (mCurrentTarget != TARGET_QSD8250) && (mCurrentTarget != TARGET_MSM8660)) {
         if(rcb != NULL && (msgEnabled & CAMERA_MSG_VIDEO_FRAME)) {
+            countRecordFrame(timeStamp);
             rcb(timeStamp, CAMERA_MSG_VIDEO_FRAME, mPreviewHeap->mBuffers[offset], rdata);
+            // The buffer goes back to the kernel on return, a live snapshot
+            // takes a copy. There is no call to hold a preview buffer, but
+            // this thread waits for the encoder to release the frame below,
+            // so the copy runs while the encoder reads it.
+            if (android_atomic_cmpxchg(1, 0, &mLiveshotArmed) == 0)
+                startLiveshotThread(frame, -1);
             Mutex::Autolock rLock(&mRecordFrameLock);
             if (mReleasedRecordingFrame != true) {
                 ALOGV("block waiting for frame release");
@@ -4320,8 +5600,12 @@ void QualcommCameraHardware::receiveCameraStats(camstats_type stype, camera_prev
         mSendData = false;
         mCurrent = (mCurrent+1)%3;
     // The first element of the array will contain the maximum hist value provided by driver.
+        // The source is the driver's and the stat heap is ashmem, there is
+        // no cache maintenance to do, only the copy to time.
+        nsecs_t start = systemTime();
         *(uint32_t *)(mStatHeap->mHeap->base()+ (mStatHeap->mBufferSize * mCurrent)) = histinfo->max_value;
         memcpy((uint32_t *)((unsigned int)mStatHeap->mHeap->base()+ (mStatHeap->mBufferSize * mCurrent)+ sizeof(int32_t)), (uint32_t *)histinfo->buffer,(sizeof(int32_t) * 256));
+        accountCpuAccess(CPU_HISTOGRAM, sizeof(int32_t) * 257, start);
 
         mStatsWaitLock.unlock();
 
@@ -4381,15 +5665,34 @@ bool QualcommCameraHardware::initRecord()
         mRecordHeap.clear();
     }
 
-    mRecordHeap = new PmemPool(pmem_region,
-                               MemoryHeapBase::READ_ONLY | MemoryHeapBase::NO_CACHING,
-                                MSM_PMEM_VIDEO,
-                                recordBufferSize,
-                                kRecordBufferCount,
-                                mRecordFrameSize,
-                                CbCrOffset,
-                                0,
-                                "record");
+    mRecordHeap = takeCachedPool(mCachedRecordHeap, MSM_PMEM_VIDEO,
+                                 recordBufferSize, kRecordBufferCount,
+                                 mRecordFrameSize, CbCrOffset, 0);
+    mRecordHeapReused = mRecordHeap != NULL;
+    if (mRecordHeap == NULL) {
+        mRecordHeap = new PmemPool(pmem_region,
+                                   MemoryHeapBase::READ_ONLY | MemoryHeapBase::NO_CACHING,
+                                   MSM_PMEM_VIDEO,
+                                   recordBufferSize,
+                                   kRecordBufferCount,
+                                   mRecordFrameSize,
+                                   CbCrOffset,
+                                   0,
+                                   "record");
+    }
+
+    if (!mRecordHeap->initialized() && flushSnapshotCache()) {
+        ALOGI("initRecord: released snapshot cache, retrying record heap");
+        mRecordHeap = new PmemPool(pmem_region,
+                                   MemoryHeapBase::READ_ONLY | MemoryHeapBase::NO_CACHING,
+                                   MSM_PMEM_VIDEO,
+                                   recordBufferSize,
+                                   kRecordBufferCount,
+                                   mRecordFrameSize,
+                                   CbCrOffset,
+                                   0,
+                                   "record");
+    }
 
     if (!mRecordHeap->initialized()) {
         mRecordHeap.clear();
@@ -4400,11 +5703,10 @@ bool QualcommCameraHardware::initRecord()
     for (int cnt = 0; cnt < kRecordBufferCount; cnt++) {
         recordframes[cnt].fd = mRecordHeap->mHeap->getHeapID();
         recordframes[cnt].buffer =
-            (uint32_t)mRecordHeap->mHeap->base() + mRecordHeap->mAlignedBufferSize * cnt;
+            (uint32_t)mRecordHeap->mHeap->base() + mem_layout_offset(&mRecordHeap->mLayout, cnt);
         recordframes[cnt].y_off = 0;
         recordframes[cnt].cbcr_off = CbCrOffset;
         recordframes[cnt].path = OUTPUT_TYPE_V;
-        record_buffers_tracking_flag[cnt] = false;
         ALOGV ("initRecord :  record heap , video buffers  buffer=%lu fd=%d y_off=%d cbcr_off=%d \n",
           (unsigned long)recordframes[cnt].buffer, recordframes[cnt].fd, recordframes[cnt].y_off,
           recordframes[cnt].cbcr_off);
@@ -4422,15 +5724,22 @@ bool QualcommCameraHardware::initRecord()
     }
     mVideoThreadWaitLock.unlock();
 
+    mRecordBufferStride = mRecordHeap->mAlignedBufferSize;
+    mRecordBuffers.reset();
+
     // flush free queue and add 5,6,7,8 buffers.
     LINK_cam_frame_flush_free_video();
     if(mVpeEnabled) {
         //If VPE is enabled, the VPE buffer shouldn't be added to Free Q initally.
-        for(int i=ACTIVE_VIDEO_BUFFERS+1;i <kRecordBufferCount-1; i++)
+        for(int i=ACTIVE_VIDEO_BUFFERS+1;i <kRecordBufferCount-1; i++) {
+            mRecordBuffers.move(i, 1 << RECORD_BUFFER_KERNEL, RECORD_BUFFER_CAMFRAME);
             LINK_camframe_free_video(&recordframes[i]);
+        }
     } else {
-        for(int i=ACTIVE_VIDEO_BUFFERS+1;i <kRecordBufferCount; i++)
+        for(int i=ACTIVE_VIDEO_BUFFERS+1;i <kRecordBufferCount; i++) {
+            mRecordBuffers.move(i, 1 << RECORD_BUFFER_KERNEL, RECORD_BUFFER_CAMFRAME);
             LINK_camframe_free_video(&recordframes[i]);
+        }
     }
     ALOGV("initRecord X");
 
@@ -4498,6 +5807,11 @@ status_t QualcommCameraHardware::startRecording()
     int ret;
     Mutex::Autolock l(&mLock);
     mReleasedRecordingFrame = false;
+    char value[PROPERTY_VALUE_MAX];
+    property_get("persist.debug.camera.recbufs", value, "0");
+    mDebugRecordBuffers = atoi(value);
+    mRecordBuffers.setDebug(mDebugRecordBuffers);
+    mRecordFrameGaps.reset();
     if( (ret=startPreviewInternal())== NO_ERROR){
         if(mVpeEnabled){
             ALOGI("startRecording: VPE enabled, setting vpe parameters");
@@ -4514,19 +5828,22 @@ status_t QualcommCameraHardware::startRecording()
             // Remove the left out frames in busy Q and them in free Q.
             // this should be done before starting video_thread so that,
             // frames in previous recording are flushed out.
-            ALOGV("frames in busy Q = %d", g_busy_frame_queue.num_of_frames);
-            while((g_busy_frame_queue.num_of_frames) >0){
-                msm_frame* vframe = cam_frame_get_video ();
+            ALOGV("frames in busy Q = %d", g_busy_frame_queue.count());
+            msm_frame* vframe;
+            while((vframe = cam_frame_get_video ()) != NULL){
+                int index = recordBufferIndex(vframe->buffer);
+                if (index >= 0)
+                    mRecordBuffers.move(index, 1 << RECORD_BUFFER_BUSY, RECORD_BUFFER_CAMFRAME);
                 LINK_camframe_free_video(vframe);
             }
-            ALOGV("frames in busy Q = %d after deQueing", g_busy_frame_queue.num_of_frames);
+            ALOGV("frames in busy Q = %d after deQueing", g_busy_frame_queue.count());
 
             //Clear the dangling buffers and put them in free queue
             for(int cnt = 0; cnt < kRecordBufferCount; cnt++) {
-                if(record_buffers_tracking_flag[cnt] == true) {
+                if (mRecordBuffers.state(cnt) == RECORD_BUFFER_CLIENT &&
+                    mRecordBuffers.move(cnt, 1 << RECORD_BUFFER_CLIENT, RECORD_BUFFER_CAMFRAME)) {
                     ALOGI("Dangling buffer: offset = %d, buffer = %d", cnt, (unsigned int)recordframes[cnt].buffer);
                     LINK_camframe_free_video(&recordframes[cnt]);
-                    record_buffers_tracking_flag[cnt] = false;
                 }
             }
 
@@ -4543,6 +5860,9 @@ status_t QualcommCameraHardware::startRecording()
                                               NULL);
             mVideoThreadWaitLock.unlock();
             // Remove the left out frames in busy Q and them in free Q.
+        } else {
+            // Preview frames are the recording, live snapshots copy them.
+            recordingState = 1;
         }
     }
     return ret;
@@ -4552,6 +5872,10 @@ void QualcommCameraHardware::stopRecording()
 {
     ALOGV("stopRecording: E");
     Mutex::Autolock l(&mLock);
+    // A live snapshot still waiting for its frame will not get one.
+    if (android_atomic_cmpxchg(1, 0, &mLiveshotArmed) == 0)
+        liveshot_state = LIVESHOT_STOPPED;
+    waitForLiveshot();
     {
         mRecordFrameLock.lock();
         mReleasedRecordingFrame = true;
@@ -4571,9 +5895,10 @@ void QualcommCameraHardware::stopRecording()
         mVideoThreadWaitLock.unlock();
         native_stop_ops(CAMERA_OPS_VIDEO_RECORDING, NULL);
 
-        pthread_mutex_lock(&(g_busy_frame_queue.mut));
-        pthread_cond_signal(&(g_busy_frame_queue.wait));
-        pthread_mutex_unlock(&(g_busy_frame_queue.mut));
+        g_busy_frame_queue.wake();
+
+        if (mDebugRecordBuffers)
+            reportRecordBuffers();
     }
     else  // for other targets where output2 is not enabled
         stopPreviewInternal();
@@ -4591,46 +5916,84 @@ void QualcommCameraHardware::releaseRecordingFrame(
        const sp<IMemory>& mem __attribute__((unused)))
 {
     ALOGV("releaseRecordingFrame E");
-    Mutex::Autolock rLock(&mRecordFrameLock);
+    mRecordFrameLock.lock();
     mReleasedRecordingFrame = true;
     mRecordWait.signal();
+    mRecordFrameLock.unlock();
 
     // Ff 7x30 : add the frame to the free camframe queue
     if( (mCurrentTarget == TARGET_MSM7630 )  || (mCurrentTarget == TARGET_QSD8250) || (mCurrentTarget == TARGET_MSM8660)) {
         ssize_t offset;
         size_t size;
         sp<IMemoryHeap> heap = mem->getMemory(&offset, &size);
-        msm_frame* releaseframe = NULL;
-        ALOGV(" in release recording frame :  heap base %p offset %lu buffer %lx ", heap->base(), offset, (unsigned long)heap->base() + offset );
-        int cnt;
-        for (cnt = 0; cnt < kRecordBufferCount; cnt++) {
-            if((unsigned int)recordframes[cnt].buffer == ((unsigned int)heap->base()+ offset)){
-                ALOGV("in release recording frame found match , releasing buffer %d", (unsigned int)recordframes[cnt].buffer);
-                releaseframe = &recordframes[cnt];
-                break;
-            }
+        unsigned long buffer = (unsigned long)heap->base() + offset;
+        ALOGV(" in release recording frame :  heap base %p offset %lu buffer %lx ", heap->base(), offset, buffer);
+        int cnt = recordBufferIndex(buffer);
+        if (cnt < 0) {
+            ALOGE("in release recordingframe XXXXX error , buffer %lx not found", buffer);
+            return;
         }
-        if(cnt < kRecordBufferCount) {
-            // do this only if frame thread is running
-            mFrameThreadWaitLock.lock();
-            if(mFrameThreadRunning ) {
-                //Reset the track flag for this frame buffer
-                record_buffers_tracking_flag[cnt] = false;
-                LINK_camframe_free_video(releaseframe);
-            }
 
-            mFrameThreadWaitLock.unlock();
-        } else {
-            ALOGE("in release recordingframe XXXXX error , buffer not found");
-            for (int i=0; i< kRecordBufferCount; i++) {
-                 ALOGE(" recordframes[%d].buffer = %d", i, (unsigned int)recordframes[i].buffer);
-            }
-        }
+        // Only the release that wins the CLIENT -> CAMFRAME transition may
+        // hand the buffer back, a second release of the same frame fails here.
+        if (!mRecordBuffers.move(cnt, 1 << RECORD_BUFFER_CLIENT, RECORD_BUFFER_CAMFRAME))
+            return;
+        // A live snapshot still reading the buffer gives it back itself.
+        if (!mRecordBuffers.dropPin(cnt))
+            return;
+
+        ALOGV("in release recording frame, releasing buffer %d", cnt);
+        freeRecordBuffer(cnt);
     }
 
     ALOGV("releaseRecordingFrame X");
 }
 
+int QualcommCameraHardware::recordBufferIndex(unsigned long buffer) const
+{
+    if (recordframes == NULL || mRecordBufferStride == 0)
+        return -1;
+
+    unsigned long base = recordframes[0].buffer;
+    if (buffer < base || (buffer - base) % mRecordBufferStride)
+        return -1;
+
+    unsigned long index = (buffer - base) / mRecordBufferStride;
+    if (index >= (unsigned long)kRecordBufferCount)
+        return -1;
+
+    return index;
+}
+
+// Gives a buffer in the CAMFRAME state back to camframe. With the frame
+// thread gone there is no free queue to add it to, so the buffer goes
+// back to KERNEL, where the next startRecording expects it.
+void QualcommCameraHardware::freeRecordBuffer(int index)
+{
+    Mutex::Autolock l(&mFrameThreadWaitLock);
+    if (mFrameThreadRunning)
+        LINK_camframe_free_video(&recordframes[index]);
+    else
+        mRecordBuffers.move(index, 1 << RECORD_BUFFER_CAMFRAME, RECORD_BUFFER_KERNEL);
+}
+
+void QualcommCameraHardware::reportRecordBuffers()
+{
+    int held = 0;
+
+    for (int i = 0; i < kRecordBufferCount; i++) {
+        int state = mRecordBuffers.state(i);
+        if (state == RECORD_BUFFER_CLIENT) {
+            ALOGE("record buffer %d (%lx) still held by the encoder",
+                  i, (unsigned long)recordframes[i].buffer);
+            held++;
+        } else if (state == RECORD_BUFFER_BUSY) {
+            ALOGI("record buffer %d left on the busy queue", i);
+        }
+    }
+    ALOGI("stopRecording: %d of %d record buffers not released", held, kRecordBufferCount);
+}
+
 bool QualcommCameraHardware::recordingEnabled()
 {
     ALOGV("%s E", __FUNCTION__);
@@ -4757,11 +6120,11 @@ static void receive_shutter_callback(common_crop_t *crop)
 // Crop the picture in place.
 static void crop_yuv420(uint32_t width, uint32_t height,
                  uint32_t cropped_width, uint32_t cropped_height,
-                 uint8_t *image, const char *name)
+                 uint8_t *image, const char *name, bool adreno)
 {
-    uint32_t i;
+    char value[PROPERTY_VALUE_MAX];
     uint32_t x, y;
-    uint8_t* chroma_src, *chroma_dst;
+    yuv_sp_frame_t src, dst;
     int yOffsetSrc, yOffsetDst, CbCrOffsetSrc, CbCrOffsetDst;
     int mSrcSize, mDstSize;
 
@@ -4781,92 +6144,40 @@ static void crop_yuv420(uint32_t width, uint32_t height,
     x &= ~1;
     y &= ~1;
 
-    if((mCurrentTarget == TARGET_MSM7627)
+    if (adreno) {
+        // Rows stay 32 aligned and the chroma plane where it was, which is
+        // what getEncodeLayout hands the encoder.
+        yOffsetSrc = yOffsetDst = 0;
+        CbCrOffsetSrc = CbCrOffsetDst = PAD_TO_4K(CEILING32(width) * CEILING32(height));
+    } else if((mCurrentTarget == TARGET_MSM7627)
        || (mCurrentTarget == TARGET_MSM7630)
        || (mCurrentTarget == TARGET_MSM8660)) {
-        if (!strcmp("snapshot camera", name)) {
-            chroma_src = image + CbCrOffsetSrc;
-            chroma_dst = image + CbCrOffsetDst;
-        } else {
-            chroma_src = image + width * height;
-            chroma_dst = image + cropped_width * cropped_height;
+        // The ZSL ring stores frames in the encoder layout too.
+        if (strcmp("snapshot camera", name) && strcmp("zsl", name)) {
             yOffsetSrc = 0;
             yOffsetDst = 0;
             CbCrOffsetSrc = width * height;
             CbCrOffsetDst = cropped_width * cropped_height;
         }
-    } else {
-       chroma_src = image + CbCrOffsetSrc;
-       chroma_dst = image + CbCrOffsetDst;
-    }
-
-    int32_t bufDst = yOffsetDst;
-    int32_t bufSrc = yOffsetSrc + (width * y) + x;
-
-    if( bufDst > bufSrc ){
-        ALOGV("crop yuv Y destination position follows source position");
-        /*
-         * If buffer destination follows buffer source, memcpy
-         * of lines will lead to overwriting subsequent lines. In order
-         * to prevent this, reverse copying of lines is performed
-         * for the set of lines where destination follows source and
-         * forward copying of lines is performed for lines where source
-         * follows destination. To calculate the position to switch,
-         * the initial difference between source and destination is taken
-         * and divided by difference between width and cropped width. For
-         * every line copied the difference between source destination
-         * drops by width - cropped width
-         */
-        //calculating inversion
-        int position = ( bufDst - bufSrc ) / (width - cropped_width);
-        // Copy luma component.
-        for(i=position+1; i < cropped_height; i++){
-            memmove(image + yOffsetDst + i * cropped_width,
-                    image + yOffsetSrc + width * (y + i) + x,
-                    cropped_width);
-        }
-        for(int j=position; j>=0; j--){
-            memmove(image + yOffsetDst + j * cropped_width,
-                    image + yOffsetSrc + width * (y + j) + x,
-                    cropped_width);
-        }
-    } else {
-        // Copy luma component.
-        for(i = 0; i < cropped_height; i++)
-            memcpy(image + yOffsetDst + i * cropped_width,
-                   image + yOffsetSrc + width * (y + i) + x,
-                   cropped_width);
     }
 
-    // Copy chroma components.
-    cropped_height /= 2;
-    y /= 2;
-
-    bufDst = CbCrOffsetDst;
-    bufSrc = CbCrOffsetSrc + (width * y) + x;
+    src.y = image + yOffsetSrc;
+    src.uv = image + CbCrOffsetSrc;
+    src.width = width;
+    src.height = height;
+    src.y_stride = adreno ? CEILING32(width) : width;
+    src.uv_stride = adreno ? 2 * CEILING32(width / 2) : width;
+    dst.y = image + yOffsetDst;
+    dst.uv = image + CbCrOffsetDst;
+    dst.width = cropped_width;
+    dst.height = cropped_height;
+    dst.y_stride = adreno ? CEILING32(cropped_width) : cropped_width;
+    dst.uv_stride = adreno ? 2 * CEILING32(cropped_width / 2) : cropped_width;
 
-    if( bufDst > bufSrc ) {
-        ALOGV("crop yuv Chroma destination position follows source position");
-        /*
-         * Similar to y
-         */
-        int position = ( bufDst - bufSrc ) / (width - cropped_width);
-        for(i=position+1; i < cropped_height; i++){
-            memmove(chroma_dst + i * cropped_width,
-                    chroma_src + width * (y + i) + x,
-                    cropped_width);
-        }
-        for(int j=position; j >=0; j--){
-            memmove(chroma_dst + j * cropped_width,
-                    chroma_src + width * (y + j) + x,
-                    cropped_width);
-        }
-    } else {
-        for(i = 0; i < cropped_height; i++)
-            memcpy(chroma_dst + i * cropped_width,
-                   chroma_src + width * (y + i) + x,
-                   cropped_width);
-    }
+    property_get("persist.camera.hal.crop.threads", value, "0");
+    if (yuv_crop(&src, &dst, x, y, atoi(value)) < 0)
+        ALOGE("%s: cropping %s to %ux%u failed", __FUNCTION__, name,
+              cropped_width, cropped_height);
 }
 
 bool QualcommCameraHardware::receiveRawSnapshot(){
@@ -4896,152 +6207,550 @@ bool QualcommCameraHardware::receiveRawSnapshot(){
 
     }
 
-    //cleanup
-    deinitRawSnapshot();
+    //cleanup
+    deinitRawSnapshot();
+
+    ALOGV("receiveRawSnapshot X");
+    return true;
+}
+
+/*
+ * Digital zoom: scales the zoomed part of the picture in rawHeap back up to
+ * the full picture size, in place of the zoom_crop_upscale libmmcamera
+ * never enabled. The zoomed part is cropped into a scratch buffer first as
+ * the output covers it. Returns false when upscaling is off or failed; the
+ * picture is then untouched and gets cropped as before.
+ */
+bool QualcommCameraHardware::upscalePicture(const common_crop_t *crop,
+                                            const cam_ctrl_dimension_t& dim,
+                                            const sp<PmemPool>& rawHeap)
+{
+    yuv_sp_frame_t full;
+
+    getEncodeLayout(rawHeap, dim, false, &full);
+    return upscaleZoomed(&full, (crop->in2_w + jpegPadding) & ~1,
+                         (crop->in2_h + jpegPadding) & ~1);
+}
+
+/*
+ * Scales the centered width x height part of full up to all of full.
+ * Returns false, leaving full untouched, when persist.camera.hal.zoom.upscale
+ * is off or scaling failed.
+ */
+bool QualcommCameraHardware::upscaleZoomed(yuv_sp_frame_t *full,
+                                           int width, int height)
+{
+    char value[PROPERTY_VALUE_MAX];
+    yuv_sp_frame_t zoomed;
+
+    property_get("persist.camera.hal.zoom.upscale", value, "lanczos");
+    if (!strcmp(value, "off"))
+        return false;
+    yuv_scale_filter_t filter =
+        yuv_scale_filter_from_string(value, YUV_SCALE_LANCZOS3);
+    property_get("persist.camera.hal.zoom.threads", value, "0");
+    int threads = atoi(value);
+
+    if (width > full->width || height > full->height)
+        return false;
+
+    uint8_t *scratch = (uint8_t *)malloc(width * height * 3 / 2);
+    if (scratch == NULL) {
+        ALOGE("upscaleZoomed: no memory for %dx%d", width, height);
+        return false;
+    }
+    yuv_sp_frame_init(&zoomed, scratch, width, height, width);
+
+    nsecs_t start = systemTime();
+    bool ok = yuv_crop(full, &zoomed, ((full->width - width) / 2) & ~1,
+                       ((full->height - height) / 2) & ~1, threads) == 0 &&
+              yuv_scale(&zoomed, full, filter, threads) == 0;
+    free(scratch);
+    if (!ok) {
+        ALOGE("upscaleZoomed: scaling %dx%d failed", width, height);
+        return false;
+    }
+    ALOGI("upscaleZoomed: %dx%d to %dx%d in %lld ms", width, height,
+          full->width, full->height, (long long)((systemTime() - start) / 1000000));
+    return true;
+}
+
+/*
+ * Fetches the picture the last CAMERA_OPS_SNAPSHOT captured into rawHeap,
+ * crops it when zoomed and hands out the shutter, postview and raw image
+ * callbacks. crop and dim receive what the encoder needs for this frame.
+ * Called with mCallbackLock held.
+ */
+bool QualcommCameraHardware::getRawPicture(common_crop_t *crop,
+                                           cam_ctrl_dimension_t *dim,
+                                           const sp<PmemPool>& rawHeap)
+{
+    if(native_start_ops(CAMERA_OPS_GET_PICTURE, crop) == false) {
+        ALOGE("getPicture: CAMERA_OPS_GET_PICTURE ioctl failed!");
+        return false;
+    }
+    mSnapshotDone = FALSE;
+    if (rawHeap != NULL)
+        rawHeap->hardwareWrote(-1);
+    if (mThumbnailHeap != NULL)
+        mThumbnailHeap->hardwareWrote(-1);
+    crop->in1_w &= ~1;
+    crop->in1_h &= ~1;
+    crop->in2_w &= ~1;
+    crop->in2_h &= ~1;
+
+    // Crop the image if zoomed.
+    if (crop->in2_w != 0 && crop->in2_h != 0 &&
+            ((crop->in2_w + jpegPadding) < crop->out2_w) &&
+            ((crop->in2_h + jpegPadding) < crop->out2_h) &&
+            ((crop->in1_w + jpegPadding) < crop->out1_w)  &&
+            ((crop->in1_h + jpegPadding) < crop->out1_h) ) {
+
+        // By the time native_get_picture returns, picture is taken. Call
+        // shutter callback if cam config thread has not done that.
+        notifyShutter(crop, FALSE);
+        bool upscaled = false;
+        {
+            Mutex::Autolock l(&mRawPictureHeapLock);
+            const int rw = CameraHardwareInterface::CPU_READ |
+                           CameraHardwareInterface::CPU_WRITE;
+            if(rawHeap != NULL){
+              nsecs_t start = systemTime();
+              rawHeap->beginCpu(0, rawHeap->mBufferSize, rw);
+              upscaled = upscalePicture(crop, *dim, rawHeap);
+              if (!upscaled)
+                crop_yuv420(crop->out2_w, crop->out2_h, (crop->in2_w + jpegPadding), (crop->in2_h + jpegPadding),
+                        (uint8_t *)rawHeap->mHeap->base(), rawHeap->mName,
+                        mPreviewFormat == CAMERA_YUV_420_NV21_ADRENO);
+              rawHeap->endCpu(0, rawHeap->mBufferSize, rw);
+              accountCpuAccess(CPU_CROP, rawHeap->mBufferSize, start);
+            }
+            if( (mThumbnailHeap != NULL) &&
+                (mCurrentTarget != TARGET_MSM7630) &&
+                (mCurrentTarget != TARGET_MSM8660) ) {
+                //Don't crop the mThumbnailHeap for 7630. As this heap
+                //is used for postview rather than for thumbnail. (thumbnail is generated from main image).
+                //overlay's setCrop will take of cropping while displaying postview.
+                nsecs_t start = systemTime();
+                mThumbnailHeap->beginCpu(0, mThumbnailHeap->mBufferSize, rw);
+                crop_yuv420(crop->out1_w, crop->out1_h, (crop->in1_w + jpegPadding), (crop->in1_h + jpegPadding),
+                        (uint8_t *)mThumbnailHeap->mHeap->base(), mThumbnailHeap->mName,
+                        mPreviewFormat == CAMERA_YUV_420_NV21_ADRENO);
+                mThumbnailHeap->endCpu(0, mThumbnailHeap->mBufferSize, rw);
+                accountCpuAccess(CPU_CROP, mThumbnailHeap->mBufferSize, start);
+            }
+        }
+
+        if (upscaled) {
+            // The main image is back at full size, only the postview is
+            // still cropped.
+            crop->in2_w = 0;
+            crop->in2_h = 0;
+        } else {
+            // We do not need jpeg encoder to upscale the image. Set the new
+            // dimension for encoder.
+            dim->orig_picture_dx = crop->in2_w + jpegPadding;
+            dim->orig_picture_dy = crop->in2_h + jpegPadding;
+        }
+        /* Don't update the thumbnail_width/height, if jpeg downscaling
+         * is used to generate thumbnail. These parameters should contain
+         * the original thumbnail dimensions.
+         */
+        if(strTexturesOn != true) {
+            dim->thumbnail_width = crop->in1_w + jpegPadding;
+            dim->thumbnail_height = crop->in1_h + jpegPadding;
+        }
+    }else {
+        memset(crop, 0 ,sizeof(*crop));
+        // By the time native_get_picture returns, picture is taken. Call
+        // shutter callback if cam config thread has not done that.
+        notifyShutter(crop, FALSE);
+    }
+
+    if( mUseOverlay ){
+        mOverlayLock.lock();
+        if (mOverlay != NULL) {
+        mOverlay->setFd(mDisplayHeap->mHeap->getHeapID());
+        int cropX = 0;
+        int cropY = 0;
+        int cropW = 0;
+        int cropH = 0;
+        //Caculate the crop dimensions from crop.
+        //crop will have the crop dimensions for VFE's
+        //postview output.
+        if (crop->in1_w != 0 && crop->in1_h != 0) {
+            cropX = (crop->out1_w - crop->in1_w + 1) / 2 - 1;
+            cropY = (crop->out1_h - crop->in1_h + 1) / 2 - 1;
+            if(cropX < 0) cropX = 0;
+            if(cropY < 0) cropY = 0;
+            cropW = cropX + crop->in1_w;
+            cropH = cropY + crop->in1_h;
+            mOverlay->setCrop(cropX, cropY, cropW, cropH);
+            mResetOverlayCrop = true;
+        } else {
+            /* as the VFE second output is being used for postView,
+             * VPE is doing the necessary cropping. Clear the
+             * preview cropping information with overlay, so that
+             * the same  won't be applied to postview.
+             */
+             mOverlay->setCrop(0, 0, dim->ui_thumbnail_width,
+                                dim->ui_thumbnail_height);
+        }
+
+        ALOGV(" Queueing Postview for display ");
+        mOverlay->queueBuffer((void *)0);
+        }
+        // The preview frame shown until now can go back to its pool, the
+        // pool itself possibly with it once the lock is dropped.
+        sp<FrameHandle> shown = mPostViewFrame;
+        mPostViewFrame.clear();
+        mOverlayLock.unlock();
+    }
+    if (mDataCallback && (mMsgEnabled & CAMERA_MSG_RAW_IMAGE))
+        mDataCallback(CAMERA_MSG_RAW_IMAGE, mDisplayHeap->mBuffers[0],
+                         mCallbackCookie);
+    if(strTexturesOn == true) {
+        ALOGI("Raw Data given to app for processing...will wait for jpeg encode call");
+        mEncodePendingWaitLock.lock();
+        mEncodePending = true;
+        mEncodePendingWaitLock.unlock();
+    }
+    return true;
+}
+
+bool QualcommCameraHardware::receiveRawPicture()
+{
+    ALOGV("receiveRawPicture: E");
+
+    Mutex::Autolock cbLock(&mCallbackLock);
+    if (mDataCallback && ((mMsgEnabled & CAMERA_MSG_RAW_IMAGE) || mSnapshotDone)) {
+        if (!getRawPicture(&mCrop, &mDimension, mRawHeap))
+            return false;
+    }
+    else ALOGV("Raw-picture callback was canceled--skipping.");
+
+    if(strTexturesOn != true) {
+        if (mDataCallback && (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE)) {
+            mJpegSize = 0;
+            mJpegThreadWaitLock.lock();
+            if (jpegEncoderInit()) {
+                mJpegThreadRunning = true;
+                mJpegThreadWaitLock.unlock();
+                if(native_jpeg_encode()) {
+                    ALOGV("receiveRawPicture: X (success)");
+                    return true;
+                }
+                ALOGE("jpeg encoding failed");
+            }
+            else {
+                ALOGE("receiveRawPicture X: jpeg_encoder_init failed.");
+                mJpegThreadWaitLock.unlock();
+            }
+        }
+        else ALOGV("JPEG callback is NULL, not encoding image.");
+        deinitRaw();
+        return false;
+    }
+    ALOGV("receiveRawPicture: X");
+    return false;
+}
+
+/*
+ * Allocates the ZSL ring for the current preview size. The depth comes from
+ * persist.camera.hal.zsl.depth and is capped so the ring stays within
+ * persist.camera.hal.zsl.maxmem (MB).
+ */
+bool QualcommCameraHardware::initZsl()
+{
+    char value[PROPERTY_VALUE_MAX];
+    uint32_t yOffset = 0, cbcrOffset = 0, size = 0;
+    const char *pmem_region;
+
+    if ((mCurrentTarget != TARGET_MSM7630) && (mCurrentTarget != TARGET_MSM8660)) {
+        ALOGI("initZsl: zero shutter lag not supported on this target");
+        return false;
+    }
+    if (mPreviewFormat == CAMERA_YUV_420_NV21_ADRENO) {
+        ALOGI("initZsl: zero shutter lag not supported for Adreno preview");
+        return false;
+    }
+
+    Mutex::Autolock l(&mZslLock);
+    if (mZslDepth > 0 && mZslWidth == previewWidth && mZslHeight == previewHeight)
+        return true;
+
+    // Store frames the way the encoder and crop_yuv420 expect them.
+    LINK_jpeg_encoder_get_buffer_offset(previewWidth, previewHeight,
+                                        &yOffset, &cbcrOffset, &size);
+    if (size < (uint32_t)(previewWidth * previewHeight * 3 / 2)) {
+        yOffset = 0;
+        cbcrOffset = previewWidth * previewHeight;
+        size = previewWidth * previewHeight * 3 / 2;
+    }
+
+    property_get("persist.camera.hal.zsl.depth", value, "3");
+    int depth = atoi(value);
+    property_get("persist.camera.hal.zsl.maxmem", value, "8");
+    int maxDepth = ((uint64_t)atoi(value) << 20) / size;
+    if (depth > maxDepth)
+        depth = maxDepth;
+    if (depth > kMaxZslDepth)
+        depth = kMaxZslDepth;
+
+    if(mCurrentTarget == TARGET_MSM8660)
+        pmem_region = "/dev/pmem_smipool";
+    else
+        pmem_region = "/dev/pmem_adsp";
+
+    for (int i = 0; i < kMaxZslDepth; i++) {
+        mZslFrames[i].heap.clear();
+        mZslFrames[i].state = ZSL_EMPTY;
+    }
+    mZslDepth = 0;
+    for (int i = 0; i < depth; i++) {
+        mZslFrames[i].heap = new PmemPool(pmem_region,
+                                          MemoryHeapBase::READ_ONLY | MemoryHeapBase::NO_CACHING,
+                                          MSM_PMEM_MAINIMG,
+                                          size,
+                                          1,
+                                          size,
+                                          cbcrOffset,
+                                          yOffset,
+                                          "zsl");
+        if (!mZslFrames[i].heap->initialized()) {
+            mZslFrames[i].heap.clear();
+            break;
+        }
+        mZslDepth++;
+    }
+    if (mZslDepth == 0) {
+        ALOGE("initZsl: could not allocate the ring");
+        return false;
+    }
+
+    mZslNext = 0;
+    mZslWidth = previewWidth;
+    mZslHeight = previewHeight;
+    mZslYOffset = yOffset;
+    mZslCbCrOffset = cbcrOffset;
+    ALOGI("initZsl: %d frames of %dx%d, %u KB", mZslDepth, mZslWidth, mZslHeight,
+          mZslDepth * mZslFrames[0].heap->mAlignedBufferSize / 1024);
+    return true;
+}
+
+void QualcommCameraHardware::deinitZsl()
+{
+    Mutex::Autolock l(&mZslLock);
+    for (int i = 0; i < kMaxZslDepth; i++) {
+        mZslFrames[i].heap.clear();
+        mZslFrames[i].state = ZSL_EMPTY;
+    }
+    mZslDepth = 0;
+    mZslWidth = mZslHeight = 0;
+}
+
+/* Copies a preview frame into the oldest ring slot not being encoded,
+ * nothing while the picture size keeps the ring from being used. */
+void QualcommCameraHardware::storeZslFrame(struct msm_frame *frame)
+{
+    common_crop_t *crop = (common_crop_t *)frame->cropinfo;
+    sp<PmemPool> heap;
+    int index = -1;
+
+    mZslLock.lock();
+    for (int n = 0; mZslPictureFits && n < mZslDepth; n++) {
+        int i = (mZslNext + n) % mZslDepth;
+        if (mZslFrames[i].state == ZSL_EMPTY || mZslFrames[i].state == ZSL_READY) {
+            index = i;
+            break;
+        }
+    }
+    if (index >= 0) {
+        heap = mZslFrames[index].heap;
+        mZslFrames[index].state = ZSL_WRITING;
+        mZslNext = (index + 1) % mZslDepth;
+    }
+    mZslLock.unlock();
+
+    if (index < 0)
+        return;
+
+    uint8_t *dst = (uint8_t *)heap->mHeap->base();
+    const uint8_t *src = (const uint8_t *)frame->buffer;
+    int lumaSize = mZslWidth * mZslHeight;
+    nsecs_t start = systemTime();
+    mPreviewHeap->beginCpu((uint8_t *)frame->buffer -
+                           (uint8_t *)mPreviewHeap->mHeap->base(),
+                           mPreviewFrameSize, CameraHardwareInterface::CPU_READ);
+    memcpy(dst + mZslYOffset, src + frame->y_off, lumaSize);
+    memcpy(dst + mZslCbCrOffset, src + frame->cbcr_off, lumaSize / 2);
+    accountCpuAccess(CPU_ZSL, lumaSize * 3 / 2, start);
+
+    // The frame is matched against the shutter by when the sensor took it,
+    // the copy can run a frame or more later.
+    nsecs_t timestamp = nsecs_t(frame->ts.tv_sec)*1000000000LL + frame->ts.tv_nsec;
+    if (timestamp == 0)
+        timestamp = start;
+
+    mZslLock.lock();
+    // deinitZsl may have run meanwhile, then the slot is gone.
+    if (mZslFrames[index].heap == heap) {
+        mZslFrames[index].timestamp = timestamp;
+        mZslFrames[index].crop = *crop;
+        mZslFrames[index].state = ZSL_READY;
+    }
+    mZslLock.unlock();
+}
+
+bool QualcommCameraHardware::zslUsable()
+{
+    Mutex::Autolock l(&mZslLock);
+
+    if (!mZslEnabled || mZslDepth == 0 || !mCameraRunning)
+        return false;
+    if (mSnapshotFormat != PICTURE_FORMAT_JPEG || strTexturesOn)
+        return false;
+    if (!(mDataCallback && (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE)))
+        return false;
+
+    // The ring holds preview sized frames, any other size needs the VFE.
+    int width, height;
+    mParameters.getPictureSize(&width, &height);
+    if (width != mZslWidth || height != mZslHeight)
+        return false;
 
-    ALOGV("receiveRawSnapshot X");
-    return true;
+    for (int i = 0; i < mZslDepth; i++)
+        if (mZslFrames[i].state == ZSL_READY)
+            return true;
+    return false;
 }
 
-bool QualcommCameraHardware::receiveRawPicture()
+/* Encodes the ring frame closest to the shutter, preview keeps running. */
+bool QualcommCameraHardware::captureZsl()
 {
-    ALOGV("receiveRawPicture: E");
-
-    Mutex::Autolock cbLock(&mCallbackLock);
-    if (mDataCallback && ((mMsgEnabled & CAMERA_MSG_RAW_IMAGE) || mSnapshotDone)) {
-        if(native_start_ops(CAMERA_OPS_GET_PICTURE, &mCrop) == false) {
-            ALOGE("getPicture: CAMERA_OPS_GET_PICTURE ioctl failed!");
-            return false;
+    int index = -1;
+    nsecs_t best = 0;
+
+    mZslLock.lock();
+    for (int i = 0; i < mZslDepth; i++) {
+        if (mZslFrames[i].state != ZSL_READY)
+            continue;
+        nsecs_t delta = mZslFrames[i].timestamp - mShutterTime;
+        if (delta < 0)
+            delta = -delta;
+        if (index < 0 || delta < best) {
+            index = i;
+            best = delta;
         }
-        mSnapshotDone = FALSE;
-        mCrop.in1_w &= ~1;
-        mCrop.in1_h &= ~1;
-        mCrop.in2_w &= ~1;
-        mCrop.in2_h &= ~1;
-
-        // Crop the image if zoomed.
-        if (mCrop.in2_w != 0 && mCrop.in2_h != 0 &&
-                ((mCrop.in2_w + jpegPadding) < mCrop.out2_w) &&
-                ((mCrop.in2_h + jpegPadding) < mCrop.out2_h) &&
-                ((mCrop.in1_w + jpegPadding) < mCrop.out1_w)  &&
-                ((mCrop.in1_h + jpegPadding) < mCrop.out1_h) ) {
-
-            // By the time native_get_picture returns, picture is taken. Call
-            // shutter callback if cam config thread has not done that.
-            notifyShutter(&mCrop, FALSE);
-            {
-                Mutex::Autolock l(&mRawPictureHeapLock);
-                if(mRawHeap != NULL){
-                  crop_yuv420(mCrop.out2_w, mCrop.out2_h, (mCrop.in2_w + jpegPadding), (mCrop.in2_h + jpegPadding),
-                            (uint8_t *)mRawHeap->mHeap->base(), mRawHeap->mName);
-                }
-                if( (mThumbnailHeap != NULL) &&
-                    (mCurrentTarget != TARGET_MSM7630) &&
-                    (mCurrentTarget != TARGET_MSM8660) ) {
-                    //Don't crop the mThumbnailHeap for 7630. As this heap
-                    //is used for postview rather than for thumbnail. (thumbnail is generated from main image).
-                    //overlay's setCrop will take of cropping while displaying postview.
-                    crop_yuv420(mCrop.out1_w, mCrop.out1_h, (mCrop.in1_w + jpegPadding), (mCrop.in1_h + jpegPadding),
-                            (uint8_t *)mThumbnailHeap->mHeap->base(), mThumbnailHeap->mName);
-                }
-            }
+    }
+    if (index >= 0) {
+        mZslFrames[index].state = ZSL_HELD;
+        mZslEncodeHeap = mZslFrames[index].heap;
+    }
+    common_crop_t crop = index >= 0 ? mZslFrames[index].crop : common_crop_t();
+    int width = mZslWidth;
+    int height = mZslHeight;
+    uint32_t yOffset = mZslYOffset;
+    uint32_t cbcrOffset = mZslCbCrOffset;
+    mZslLock.unlock();
 
-            // We do not need jpeg encoder to upscale the image. Set the new
-            // dimension for encoder.
-            mDimension.orig_picture_dx = mCrop.in2_w + jpegPadding;
-            mDimension.orig_picture_dy = mCrop.in2_h + jpegPadding;
-            /* Don't update the thumbnail_width/height, if jpeg downscaling
-             * is used to generate thumbnail. These parameters should contain
-             * the original thumbnail dimensions.
-             */
-            if(strTexturesOn != true) {
-                mDimension.thumbnail_width = mCrop.in1_w + jpegPadding;
-                mDimension.thumbnail_height = mCrop.in1_h + jpegPadding;
-            }
-        }else {
-            memset(&mCrop, 0 ,sizeof(mCrop));
-            // By the time native_get_picture returns, picture is taken. Call
-            // shutter callback if cam config thread has not done that.
-            notifyShutter(&mCrop, FALSE);
-        }
-
-        if( mUseOverlay ){
-            mOverlayLock.lock();
-            if (mOverlay != NULL) {
-            mOverlay->setFd(mDisplayHeap->mHeap->getHeapID());
-            int cropX = 0;
-            int cropY = 0;
-            int cropW = 0;
-            int cropH = 0;
-            //Caculate the crop dimensions from mCrop.
-            //mCrop will have the crop dimensions for VFE's
-            //postview output.
-            if (mCrop.in1_w != 0 && mCrop.in1_h != 0) {
-                cropX = (mCrop.out1_w - mCrop.in1_w + 1) / 2 - 1;
-                cropY = (mCrop.out1_h - mCrop.in1_h + 1) / 2 - 1;
-                if(cropX < 0) cropX = 0;
-                if(cropY < 0) cropY = 0;
-                cropW = cropX + mCrop.in1_w;
-                cropH = cropY + mCrop.in1_h;
-                mOverlay->setCrop(cropX, cropY, cropW, cropH);
-                mResetOverlayCrop = true;
-            } else {
-                /* as the VFE second output is being used for postView,
-                 * VPE is doing the necessary cropping. Clear the
-                 * preview cropping information with overlay, so that
-                 * the same  won't be applied to postview.
-                 */
-                 mOverlay->setCrop(0, 0, mDimension.ui_thumbnail_width,
-                                    mDimension.ui_thumbnail_height);
-            }
+    mZslIndex = index;
+    if (index < 0) {
+        ALOGE("captureZsl: no frame in the ring");
+        return false;
+    }
+    ALOGI("captureZsl: frame %d, %lld us from the shutter", index,
+          (long long)(best / 1000));
 
-            ALOGV(" Queueing Postview for display ");
-            mOverlay->queueBuffer((void *)0);
-            }
-            mOverlayLock.unlock();
-        }
-        if (mDataCallback && (mMsgEnabled & CAMERA_MSG_RAW_IMAGE))
-            mDataCallback(CAMERA_MSG_RAW_IMAGE, mDisplayHeap->mBuffers[0],
-                             mCallbackCookie);
-        if(strTexturesOn == true) {
-            ALOGI("Raw Data given to app for processing...will wait for jpeg encode call");
-            mEncodePendingWaitLock.lock();
-            mEncodePending = true;
-            mEncodePendingWaitLock.unlock();
+    mShutterLock.lock();
+    mShutterPending = false;
+    mShutterLock.unlock();
+    if (mNotifyCallback && (mMsgEnabled & CAMERA_MSG_SHUTTER))
+        notifyShutter(&crop, TRUE);
+
+    // Digital zoom: keep what the preview showed, scaled back up to the
+    // picture size like upscalePicture does for the VFE path.
+    crop.in1_w &= ~1;
+    crop.in1_h &= ~1;
+    if (crop.in1_w != 0 && crop.in1_h != 0 &&
+        crop.in1_w < crop.out1_w && crop.in1_h < crop.out1_h) {
+        uint8_t *base = (uint8_t *)mZslEncodeHeap->mHeap->base();
+        yuv_sp_frame_t full;
+        full.y = base + yOffset;
+        full.uv = base + cbcrOffset;
+        full.width = width;
+        full.height = height;
+        full.y_stride = full.uv_stride = width;
+        if (!upscaleZoomed(&full, crop.in1_w, crop.in1_h)) {
+            crop_yuv420(width, height, crop.in1_w, crop.in1_h, base, "zsl", false);
+            width = crop.in1_w;
+            height = crop.in1_h;
         }
     }
-    else ALOGV("Raw-picture callback was canceled--skipping.");
 
-    if(strTexturesOn != true) {
-        if (mDataCallback && (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE)) {
-            mJpegSize = 0;
-            mJpegThreadWaitLock.lock();
-            if (LINK_jpeg_encoder_init()) {
-                mJpegThreadRunning = true;
-                mJpegThreadWaitLock.unlock();
-                if(native_jpeg_encode()) {
-                    ALOGV("receiveRawPicture: X (success)");
-                    return true;
-                }
-                ALOGE("jpeg encoding failed");
-            }
-            else {
-                ALOGE("receiveRawPicture X: jpeg_encoder_init failed.");
-                mJpegThreadWaitLock.unlock();
-            }
-        }
-        else ALOGV("JPEG callback is NULL, not encoding image.");
-        deinitRaw();
+    int rotation = mParameters.getInt("rotation");
+    if (rotation >= 0 && !LINK_jpeg_encoder_setRotation(rotation)) {
+        ALOGE("captureZsl: set rotation failed");
         return false;
     }
-    ALOGV("receiveRawPicture: X");
-    return false;
+
+    mJpegMaxSize = width * height * 3 / 2;
+    if (!initJpegHeap(mJpegMaxSize))
+        return false;
+
+    // Preview keeps running on mDimension, the encoder gets its own.
+    cam_ctrl_dimension_t dim = mDimension;
+    dim.orig_picture_dx = width;
+    dim.orig_picture_dy = height;
+    mThumbnailWidth = mParameters.getInt(CameraParameters::KEY_JPEG_THUMBNAIL_WIDTH);
+    mThumbnailHeight = mParameters.getInt(CameraParameters::KEY_JPEG_THUMBNAIL_HEIGHT);
+    common_crop_t noCrop;
+    memset(&noCrop, 0, sizeof(noCrop));
+
+    mJpegSize = 0;
+    mJpegThreadWaitLock.lock();
+    if (!jpegEncoderInit()) {
+        mJpegThreadWaitLock.unlock();
+        ALOGE("captureZsl: jpeg_encoder_init failed.");
+        return false;
+    }
+    mJpegThreadRunning = true;
+    mJpegThreadWaitLock.unlock();
+
+    bool ok = native_jpeg_encode(mZslEncodeHeap, dim, noCrop);
+    if (!ok) {
+        ALOGE("captureZsl: jpeg encoding failed");
+        mJpegThreadWaitLock.lock();
+        mJpegThreadRunning = false;
+        mJpegThreadWaitLock.unlock();
+        jpegEncoderJoin();
+        return false;
+    }
+    return true;
+}
+
+/* Gives the encoded frame back to the ring once the JPEG is out. */
+void QualcommCameraHardware::finishZsl()
+{
+    Mutex::Autolock l(&mZslLock);
+
+    if (mZslIndex >= 0 && mZslFrames[mZslIndex].heap == mZslEncodeHeap)
+        mZslFrames[mZslIndex].state = ZSL_EMPTY;
+    mZslEncodeHeap.clear();
+    mZslIndex = -1;
+    mZslCapture = false;
 }
 
 void QualcommCameraHardware::receiveJpegPictureFragment(
     uint8_t *buff_ptr, uint32_t buff_size)
 {
     ALOGV("receiveJpegPictureFragment size %d", buff_size);
+    if (mJpegSink != NULL) {
+        mJpegSink->write(buff_ptr, buff_size);
+        mJpegSize += buff_size;
+        return;
+    }
+
     uint32_t remaining = mJpegHeap->mHeap->virtualSize();
     remaining -= mJpegSize;
     uint8_t *base = (uint8_t *)mJpegHeap->mHeap->base();
@@ -5059,25 +6768,59 @@ void QualcommCameraHardware::receiveJpegPictureFragment(
 
 void QualcommCameraHardware::receiveJpegPicture(void)
 {
-    ALOGV("receiveJpegPicture: E image (%d uint8_ts out of %d)",
-         mJpegSize, mJpegHeap->mBufferSize);
+    ALOGV("receiveJpegPicture: E image (%d uint8_ts)", mJpegSize);
+    mJpegEncodeTime = systemTime() - mJpegEncodeStart;
+    ALOGI("receiveJpegPicture: %s encoder took %lld ms for %d bytes",
+          mJpegBackend->name(), (long long)(mJpegEncodeTime / 1000000), mJpegSize);
+    if (mJpegTargetSize > 0) {
+        // CAMERA_EXIT_CB_FILE_SIZE_EXCEEDED has no way to the client in this
+        // HAL, a picture over the target is delivered and only logged.
+        ALOGI("receiveJpegPicture: %d bytes for a target of %u (%d%%)%s, "
+              "quality %d, %d pass(es), %lld ms extra",
+              mJpegSize, mJpegTargetSize,
+              (int)((int64_t)mJpegSize * 100 / mJpegTargetSize),
+              (uint32_t)mJpegSize > mJpegTargetSize ? ", file size exceeded" : "",
+              mJpegStats.quality, mJpegStats.passes,
+              (long long)(mJpegStats.extra_time / 1000000));
+    }
     Mutex::Autolock cbLock(&mCallbackLock);
 
     int index = 0;
 
     if (mDataCallback && (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE)) {
-        // The reason we do not allocate into mJpegHeap->mBuffers[offset] is
-        // that the JPEG image's size will probably change from one snapshot
-        // to the next, so we cannot reuse the MemoryBase object.
-        sp<MemoryBase> buffer = new
-            MemoryBase(mJpegHeap->mHeap,
-                       index * mJpegHeap->mBufferSize +
-                       0,
-                       mJpegSize);
-        mDataCallback(CAMERA_MSG_COMPRESSED_IMAGE, buffer, mCallbackCookie);
+        sp<IMemory> buffer;
+        if (mJpegSink != NULL) {
+            // The sink either hands the picture over itself or gives it back.
+            buffer = mJpegSink->end(true);
+        } else {
+            // The reason we do not allocate into mJpegHeap->mBuffers[offset] is
+            // that the JPEG image's size will probably change from one snapshot
+            // to the next, so we cannot reuse the MemoryBase object.
+            buffer = new
+                MemoryBase(mJpegHeap->mHeap,
+                           index * mJpegHeap->mBufferSize +
+                           0,
+                           mJpegSize);
+        }
+        if (buffer != NULL)
+            mDataCallback(CAMERA_MSG_COMPRESSED_IMAGE, buffer, mCallbackCookie);
         buffer = NULL;
+        mShutterLatency = systemTime() - mShutterTime;
+        ALOGI("receiveJpegPicture: %lld ms from shutter to JPEG callback%s",
+              (long long)(mShutterLatency / 1000000), mZslCapture ? " (zsl)" : "");
     }
-    else ALOGV("JPEG callback was cancelled--not delivering image.");
+    else {
+        if (mJpegSink != NULL)
+            mJpegSink->end(false);
+        ALOGV("JPEG callback was cancelled--not delivering image.");
+    }
+
+    if (mJpegSink != NULL)
+        mJpegPeakMemory = mJpegSink->peakMemory();
+    else if (mJpegHeap != NULL)
+        mJpegPeakMemory = mJpegHeap->mHeap->getSize();
+    ALOGI("receiveJpegPicture: %u byte picture, %u bytes held for it (%s)",
+          mJpegSize, mJpegPeakMemory, mJpegSink != NULL ? mJpegSink->name() : "heap");
 
     mJpegThreadWaitLock.lock();
     mJpegThreadRunning = false;
@@ -5087,6 +6830,18 @@ void QualcommCameraHardware::receiveJpegPicture(void)
     ALOGV("receiveJpegPicture: X callback done.");
 }
 
+/* The encoder gave up on the picture, let the waiters carry on. */
+void QualcommCameraHardware::receiveJpegError(void)
+{
+    ALOGE("receiveJpegError: %s encoder failed", mJpegBackend->name());
+    if (mJpegSink != NULL)
+        mJpegSink->end(false);
+    mJpegThreadWaitLock.lock();
+    mJpegThreadRunning = false;
+    mJpegThreadWait.signal();
+    mJpegThreadWaitLock.unlock();
+}
+
 bool QualcommCameraHardware::previewEnabled()
 {
     ALOGV("%s E", __FUNCTION__);
@@ -5324,6 +7079,17 @@ status_t QualcommCameraHardware::setJpegQuality(const CameraParameters& params)
         ALOGE("Invalid jpeg thumbnail quality=%d", quality);
         rc = BAD_VALUE;
     }
+
+    const char *str = params.get("jpeg-target-size");
+    if (str != NULL) {
+        int size = atoi(str);
+        if (size >= 0) {
+            mParameters.set("jpeg-target-size", size);
+        } else {
+            ALOGE("Invalid jpeg target size=%d", size);
+            rc = BAD_VALUE;
+        }
+    }
     return rc;
 }
 
@@ -5496,6 +7262,71 @@ status_t QualcommCameraHardware::setStrTextures(const CameraParameters& params)
     return NO_ERROR;
 }
 
+status_t QualcommCameraHardware::setNumSnapsPerShutter(const CameraParameters& params) {
+    const char *str = params.get("num-snaps-per-shutter");
+    if (str == NULL)
+        return NO_ERROR;
+
+    int num = atoi(str);
+    int max = mParameters.getInt("max-num-snaps-per-shutter");
+    if (num < 1 || num > max) {
+        ALOGE("Invalid num-snaps-per-shutter %s (max %d)", str, max);
+        return BAD_VALUE;
+    }
+    ALOGV("num-snaps-per-shutter = %d", num);
+    mParameters.set("num-snaps-per-shutter", num);
+    mBurstCount = num;
+    return NO_ERROR;
+}
+
+status_t QualcommCameraHardware::setZsl(const CameraParameters& params) {
+    const char *str = params.get("zsl");
+    if (str != NULL) {
+        bool enable;
+        if (!strcmp(str, "on"))
+            enable = true;
+        else if (!strcmp(str, "off"))
+            enable = false;
+        else {
+            ALOGE("Invalid zsl value: %s", str);
+            return BAD_VALUE;
+        }
+
+        mParameters.set("zsl", str);
+        if (enable != mZslEnabled) {
+            mZslEnabled = enable;
+            if (!enable)
+                deinitZsl();
+            else if (mCameraRunning)
+                initZsl();
+        }
+    }
+
+    // The ring only holds preview sized frames, so that is the one picture
+    // size offered while zsl is on. Any other size is taken by the VFE and
+    // the ring is not filled for it.
+    int width, height, previewW, previewH;
+    mParameters.getPictureSize(&width, &height);
+    mParameters.getPreviewSize(&previewW, &previewH);
+    if (mZslEnabled) {
+        char sizes[32];
+        snprintf(sizes, sizeof(sizes), "%dx%d", previewW, previewH);
+        mParameters.set(CameraParameters::KEY_SUPPORTED_PICTURE_SIZES, sizes);
+    } else {
+        mParameters.set(CameraParameters::KEY_SUPPORTED_PICTURE_SIZES,
+                        picture_size_values.string());
+    }
+
+    Mutex::Autolock l(&mZslLock);
+    mZslPictureFits = mZslEnabled && width == previewW && height == previewH;
+    if (!mZslPictureFits) {
+        for (int i = 0; i < mZslDepth; i++)
+            if (mZslFrames[i].state == ZSL_READY)
+                mZslFrames[i].state = ZSL_EMPTY;
+    }
+    return NO_ERROR;
+}
+
 status_t QualcommCameraHardware::setBrightness(const CameraParameters& params) {
     if(!mCfgControl.mm_camera_is_supported(CAMERA_PARM_BRIGHTNESS)) {
         ALOGI("Set Brightness not supported for this sensor");
@@ -5926,9 +7757,46 @@ status_t QualcommCameraHardware::setGpsLocation(const CameraParameters& params)
          mParameters.remove(CameraParameters::KEY_GPS_TIMESTAMP);
     }
 
+    // Parse the location once here rather than for every picture.
+    ExifBuilder::Gps gps;
+    memset(&gps, 0, sizeof(gps));
+    gps.processingMethod = method;
+    gps.hasPosition = parseGpsValue("latitude", latitude, &gps.latitude) &&
+                      parseGpsValue("longitude", longitude, &gps.longitude);
+    if (gps.hasPosition) {
+        mParameters.set(CameraParameters::KEY_GPS_LATITUDE_REF,
+                        gps.latitude < 0 ? "S" : "N");
+        mParameters.set(CameraParameters::KEY_GPS_LONGITUDE_REF,
+                        gps.longitude < 0 ? "W" : "E");
+    }
+    gps.hasAltitude = parseGpsValue("altitude", altitude, &gps.altitude);
+    if (gps.hasAltitude)
+        mParameters.set(CameraParameters::KEY_GPS_ALTITUDE_REF,
+                        gps.altitude < 0 ? 1 : 0);
+    double seconds;
+    gps.hasTimestamp = parseGpsValue("timestamp", timestamp, &seconds);
+    gps.timestamp = (time_t)seconds;
+    mExif.setGps(&gps);
+    mExif.setDateTime(dateTime);
+
     return NO_ERROR;
 }
 
+bool QualcommCameraHardware::parseGpsValue(const char *name, const char *str,
+                                           double *value)
+{
+    char *end;
+
+    if (str == NULL)
+        return false;
+    *value = strtod(str, &end);
+    if (end == str || *end != '\0') {
+        ALOGE("GPS %s %s could not be parsed", name, str);
+        return false;
+    }
+    return true;
+}
+
 status_t QualcommCameraHardware::setRotation(const CameraParameters& params)
 {
     status_t rc = NO_ERROR;
@@ -6076,15 +7944,25 @@ sp<QualcommCameraHardware::MMCameraDL> QualcommCameraHardware::MMCameraDL::getIn
 
 QualcommCameraHardware::MemPool::MemPool(int buffer_size, int num_buffers,
                                          int frame_size,
-                                         const char *name) :
+                                         const char *name,
+                                         int cbcr_offset) :
     mBufferSize(buffer_size),
     mNumBuffers(num_buffers),
     mFrameSize(frame_size),
-    mBuffers(NULL), mName(name)
+    mBuffers(NULL), mName(name), mBackend("none"), mCharged(0)
 {
     ALOGV("%s E", __FUNCTION__);
-    int page_size_minus_1 = getpagesize() - 1;
-    mAlignedBufferSize = (buffer_size + page_size_minus_1) & (~page_size_minus_1);
+    mem_layout_init(&mLayout, buffer_size, num_buffers, frame_size,
+                    cbcr_offset, getpagesize());
+    mAlignedBufferSize = mLayout.aligned_buffer_size;
+}
+
+bool QualcommCameraHardware::MemPool::charge()
+{
+    if (!gMemBudget.charge(mName, mLayout.heap_size))
+        return false;
+    mCharged = mLayout.heap_size;
+    return true;
 }
 
 void QualcommCameraHardware::MemPool::completeInitialization()
@@ -6099,7 +7977,7 @@ void QualcommCameraHardware::MemPool::completeInitialization()
         for (int i = 0; i < mNumBuffers; i++) {
             mBuffers[i] = new
                 MemoryBase(mHeap,
-                           i * mAlignedBufferSize,
+                           mem_layout_offset(&mLayout, i),
                            mFrameSize);
         }
     }
@@ -6113,18 +7991,34 @@ QualcommCameraHardware::AshmemPool::AshmemPool(int buffer_size, int num_buffers,
                                     frame_size,
                                     name)
 {
-    ALOGV("constructing MemPool %s backed by ashmem: "
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get("persist.camera.hal.heap", value, "ashmem");
+    MemAllocator *allocator = MemAllocator::create(value);
+    if (allocator == NULL)
+        allocator = MemAllocator::create("ashmem");
+
+    ALOGV("constructing MemPool %s backed by %s: "
          "%d frames @ %d uint8_ts, "
          "buffer size %d",
-         mName,
+         mName, allocator != NULL ? allocator->name() : "ashmem",
          num_buffers, frame_size, buffer_size);
 
-    int page_mask = getpagesize() - 1;
-    int ashmem_size = buffer_size * num_buffers;
-    ashmem_size += page_mask;
-    ashmem_size &= ~page_mask;
+    if (!charge())
+        return;
 
-    mHeap = new MemoryHeapBase(ashmem_size);
+    // Slices start mAlignedBufferSize apart, so the heap covers all of
+    // them and not just num_buffers * buffer_size.
+    size_t size = mLayout.heap_size;
+    int fd = allocator != NULL ? allocator->allocate(mName, &size) : -1;
+    if (fd >= 0) {
+        mHeap = new MemoryHeapBase(fd, size);
+        mBackend = allocator->name();
+        close(fd);
+    } else {
+        mHeap = new MemoryHeapBase(mLayout.heap_size);
+        mBackend = "ashmem";
+    }
 
     completeInitialization();
 }
@@ -6149,10 +8043,15 @@ QualcommCameraHardware::PmemPool::PmemPool(const char *pmem_pool,
     QualcommCameraHardware::MemPool(buffer_size,
                                     num_buffers,
                                     frame_size,
-                                    name),
+                                    name,
+                                    cbcr_offset),
     mPmemType(pmem_type),
     mCbCrOffset(cbcr_offset),
-    myOffset(yOffset)
+    myOffset(yOffset),
+    mRegistered(false),
+    mCached(!(flags & MemoryHeapBase::NO_CACHING)),
+    mStale(NULL),
+    mHolds(NULL)
 {
     ALOGI("constructing MemPool %s backed by pmem pool %s: "
          "%d frames @ %d bytes, buffer size %d",
@@ -6162,9 +8061,12 @@ QualcommCameraHardware::PmemPool::PmemPool(const char *pmem_pool,
 
     mMMCameraDLRef = QualcommCameraHardware::MMCameraDL::getInstance();
 
+    if (!charge())
+        return;
+
     // Make a new mmap'ed heap that can be shared across processes.
     // mAlignedBufferSize is already in 4k aligned. (do we need total size necessary to be in power of 2??)
-    mAlignedSize = mAlignedBufferSize * num_buffers;
+    mAlignedSize = mLayout.heap_size;
 
     sp<MemoryHeapBase> masterHeap =
         new MemoryHeapBase(pmem_pool, mAlignedSize, flags);
@@ -6180,6 +8082,7 @@ QualcommCameraHardware::PmemPool::PmemPool(const char *pmem_pool,
         pmemHeap->slap();
         masterHeap.clear();
         mHeap = pmemHeap;
+        mBackend = "pmem";
         pmemHeap.clear();
 
         mFd = mHeap->getHeapID();
@@ -6196,43 +8099,18 @@ QualcommCameraHardware::PmemPool::PmemPool(const char *pmem_pool,
              mFd,
              mSize.len);
         ALOGD("mBufferSize=%d, mAlignedBufferSize=%d\n", mBufferSize, mAlignedBufferSize);
-        // Unregister preview buffers with the camera drivers.  Allow the VFE to write
-        // to all preview buffers except for the last one.
         // Only Register the preview, snapshot and thumbnail buffers with the kernel.
-        if( (strcmp("postview", mName) != 0) ){
-            int num_buf = num_buffers;
-            if(!strcmp("preview", mName)) num_buf = kPreviewBufferCount;
-            ALOGD("num_buffers = %d", num_buf);
-            for (int cnt = 0; cnt < num_buf; ++cnt) {
-                int active = 1;
-                if(pmem_type == MSM_PMEM_VIDEO){
-                     active = (cnt<ACTIVE_VIDEO_BUFFERS);
-                     //When VPE is enabled, set the last record
-                     //buffer as active and pmem type as PMEM_VIDEO_VPE
-                     //as this is a requirement from VPE operation.
-                     //No need to set this pmem type to VIDEO_VPE while unregistering,
-                     //because as per camera stack design: "the VPE AXI is also configured
-                     //when VFE is configured for VIDEO, which is as part of preview
-                     //initialization/start. So during this VPE AXI config camera stack
-                     //will lookup the PMEM_VIDEO_VPE buffer and give it as o/p of VPE and
-                     //change it's type to PMEM_VIDEO".
-                     if( (mVpeEnabled) && (cnt == kRecordBufferCount-1)) {
-                         active = 1;
-                         pmem_type = MSM_PMEM_VIDEO_VPE;
-                     }
-                     ALOGV(" pmempool creating video buffers : active %d ", active);
-                }
-                else if (pmem_type == MSM_PMEM_PREVIEW){
-                     active = (cnt < (num_buf-1));
-                }
-                register_buf(mBufferSize,
-                         mFrameSize, mCbCrOffset, myOffset,
-                         mHeap->getHeapID(),
-                         mAlignedBufferSize * cnt,
-                         (uint8_t *)mHeap->base() + mAlignedBufferSize * cnt,
-                         pmem_type,
-                         active);
-            }
+        if( (strcmp("display copy", mName) != 0) && (strcmp("zsl", mName) != 0) )
+            registerBuffers(true);
+
+        // Nothing the CPU saw of a cached pool is known to be current,
+        // and lines the previous owner left dirty must not land on
+        // what the hardware writes.
+        if (mCached) {
+            mStale = new bool[mNumBuffers];
+            for (int cnt = 0; cnt < mNumBuffers; cnt++)
+                mStale[cnt] = true;
+            flushCache(0, mAlignedSize);
         }
 
         completeInitialization();
@@ -6245,37 +8123,154 @@ QualcommCameraHardware::PmemPool::PmemPool(const char *pmem_pool,
 QualcommCameraHardware::PmemPool::~PmemPool()
 {
     ALOGI("%s: %s E", __FUNCTION__, mName);
-    if (mHeap != NULL) {
-        // Unregister preview buffers with the camera drivers.
-        //  Only Unregister the preview, snapshot and thumbnail
-        //  buffers with the kernel.
-        if( (strcmp("postview", mName) != 0) ){
-            int num_buffers = mNumBuffers;
-            if(!strcmp("preview", mName)) num_buffers = kPreviewBufferCount;
-            for (int cnt = 0; cnt < num_buffers; ++cnt) {
-                register_buf(mBufferSize,
-                         mFrameSize,
-                         mCbCrOffset,
-                         myOffset,
-                         mHeap->getHeapID(),
-                         mAlignedBufferSize * cnt,
-                         (uint8_t *)mHeap->base() + mAlignedBufferSize * cnt,
-                         mPmemType,
-                         false,
-                         false /* unregister */);
-            }
-        }
-    }
+    // Unregister preview buffers with the camera drivers.
+    registerBuffers(false);
+    delete [] mStale;
+    delete [] mHolds;
     mMMCameraDLRef.clear();
     ALOGI("%s: %s X", __FUNCTION__, mName);
 }
 
+void QualcommCameraHardware::PmemPool::flushCache(uint32_t offset, uint32_t size)
+{
+    struct pmem_region region;
+
+    region.offset = offset;
+    region.len = size;
+    if (::ioctl(mFd, PMEM_CACHE_FLUSH, &region) < 0)
+        ALOGE("%s: PMEM_CACHE_FLUSH of %u bytes at %u failed: %s", mName,
+              size, offset, ::strerror(errno));
+}
+
+void QualcommCameraHardware::PmemPool::hardwareWrote(int index)
+{
+    if (!mCached || mStale == NULL)
+        return;
+
+    Mutex::Autolock l(&mCacheLock);
+    if (index < 0) {
+        for (int cnt = 0; cnt < mNumBuffers; cnt++)
+            mStale[cnt] = true;
+    } else if (index < mNumBuffers) {
+        mStale[index] = true;
+    }
+}
+
+void QualcommCameraHardware::PmemPool::beginCpu(uint32_t offset, uint32_t size,
+                                                int access)
+{
+    CAMERA_HAL_UNUSED(access);
+    if (!mCached || mStale == NULL || size == 0)
+        return;
+
+    // Whole buffers, so one invalidate covers every reader of the frame.
+    Mutex::Autolock l(&mCacheLock);
+    int last = (offset + size - 1) / mAlignedBufferSize;
+    for (int cnt = offset / mAlignedBufferSize; cnt <= last && cnt < mNumBuffers; cnt++) {
+        if (mStale[cnt]) {
+            flushCache(mem_layout_offset(&mLayout, cnt), mBufferSize);
+            mStale[cnt] = false;
+        }
+    }
+}
+
+void QualcommCameraHardware::PmemPool::endCpu(uint32_t offset, uint32_t size,
+                                              int access)
+{
+    if (!mCached || !(access & CameraHardwareInterface::CPU_WRITE) || size == 0)
+        return;
+    flushCache(offset, size);
+}
+
+void QualcommCameraHardware::PmemPool::hold(int index, bool held)
+{
+    Mutex::Autolock l(&mHoldLock);
+    if (index < 0 || index >= mNumBuffers)
+        return;
+    if (mHolds == NULL) {
+        mHolds = new int[mNumBuffers];
+        memset(mHolds, 0, mNumBuffers * sizeof(int));
+    }
+    mHolds[index] += held ? 1 : -1;
+}
+
+bool QualcommCameraHardware::PmemPool::held(int index)
+{
+    Mutex::Autolock l(&mHoldLock);
+    return mHolds != NULL && index >= 0 && index < mNumBuffers &&
+           mHolds[index] > 0;
+}
+
+QualcommCameraHardware::FrameHandle::FrameHandle(const sp<PmemPool>& pool,
+                                                 int index)
+    : mPool(pool),
+      mIndex(index)
+{
+    mPool->hold(mIndex, true);
+}
+
+QualcommCameraHardware::FrameHandle::~FrameHandle()
+{
+    mPool->hold(mIndex, false);
+}
+
+void QualcommCameraHardware::PmemPool::registerBuffers(bool reg)
+{
+    if (mHeap == NULL || mRegistered == reg)
+        return;
+
+    // The preview pool has spare buffers the driver never sees.
+    int num_buf = mNumBuffers;
+    if(!strcmp("preview", mName)) num_buf = kPreviewBufferCount;
+    ALOGV("%s: %s %d buffers of %s", __FUNCTION__,
+          reg ? "registering" : "unregistering", num_buf, mName);
+    for (int cnt = 0; cnt < num_buf; ++cnt) {
+        int pmem_type = mPmemType;
+        int active = reg;
+        if (reg && pmem_type == MSM_PMEM_VIDEO) {
+             active = (cnt<ACTIVE_VIDEO_BUFFERS);
+             //When VPE is enabled, set the last record
+             //buffer as active and pmem type as PMEM_VIDEO_VPE
+             //as this is a requirement from VPE operation.
+             //No need to set this pmem type to VIDEO_VPE while unregistering,
+             //because as per camera stack design: "the VPE AXI is also configured
+             //when VFE is configured for VIDEO, which is as part of preview
+             //initialization/start. So during this VPE AXI config camera stack
+             //will lookup the PMEM_VIDEO_VPE buffer and give it as o/p of VPE and
+             //change it's type to PMEM_VIDEO".
+             if( (mVpeEnabled) && (cnt == kRecordBufferCount-1)) {
+                 active = 1;
+                 pmem_type = MSM_PMEM_VIDEO_VPE;
+             }
+        }
+        else if (reg && pmem_type == MSM_PMEM_PREVIEW) {
+             // Allow the VFE to write to all preview buffers except for
+             // the last one and those held by frame handles.
+             Mutex::Autolock l(&mHoldLock);
+             active = (cnt < (num_buf-1)) && (mHolds == NULL || !mHolds[cnt]);
+        }
+        register_buf(mBufferSize,
+                     mFrameSize,
+                     mCbCrOffset,
+                     myOffset,
+                     mHeap->getHeapID(),
+                     mem_layout_offset(&mLayout, cnt),
+                     (uint8_t *)mHeap->base() + mem_layout_offset(&mLayout, cnt),
+                     pmem_type,
+                     active,
+                     reg);
+    }
+    mRegistered = reg;
+}
+
 QualcommCameraHardware::MemPool::~MemPool()
 {
     ALOGV("destroying MemPool %s", mName);
     if (mFrameSize > 0)
         delete [] mBuffers;
     mHeap.clear();
+    if (mCharged)
+        gMemBudget.refund(mName, mCharged);
     ALOGV("destroying MemPool %s completed", mName);
 }
 
@@ -6324,7 +8319,7 @@ status_t QualcommCameraHardware::MemPool::dump(int fd, const Vector<String16>& a
     snprintf(buffer, 255, "QualcommCameraHardware::AshmemPool::dump\n");
     result.append(buffer);
     if (mName) {
-        snprintf(buffer, 255, "mem pool name (%s)\n", mName);
+        snprintf(buffer, 255, "mem pool name (%s), backed by (%s)\n", mName, mBackend);
         result.append(buffer);
     }
     if (mHeap != 0) {
@@ -6467,6 +8462,116 @@ status_t QualcommCameraHardware::setOverlay(const sp<Overlay> &Overlay)
     return NO_ERROR;
 }
 
+status_t QualcommCameraHardware::setJpegSink(const sp<JpegSink>& sink)
+{
+    Mutex::Autolock l(&mLock);
+
+    mSnapshotThreadWaitLock.lock();
+    bool capturing = mSnapshotThreadRunning;
+    mSnapshotThreadWaitLock.unlock();
+    if (capturing) {
+        ALOGE("%s: picture in progress", __FUNCTION__);
+        return INVALID_OPERATION;
+    }
+    // The encode stage may still be writing into the old sink.
+    waitForEncode();
+
+    mJpegSink = sink;
+    ALOGI("%s: %s", __FUNCTION__, sink != NULL ? sink->name() : "heap");
+    return NO_ERROR;
+}
+
+int QualcommCameraHardware::cpuPmemFlags() const
+{
+    return MemoryHeapBase::READ_ONLY |
+           (mCachedPmem ? 0 : MemoryHeapBase::NO_CACHING);
+}
+
+/* The cached pool behind heap, NULL if heap is not one. */
+sp<QualcommCameraHardware::PmemPool> QualcommCameraHardware::cpuPool(
+        const sp<IMemoryHeap>& heap)
+{
+    if (!mCachedPmem || heap == NULL)
+        return NULL;
+
+    // The frame thread drops the preview pool under mPmemWaitLock, the
+    // snapshot pools do not change while their frames are handed out.
+    Mutex::Autolock l(&mPmemWaitLock);
+    const sp<PmemPool> *pools[2 + kMaxBurstDepth] = {
+        &mPreviewHeap, &mRawHeap, &mThumbnailHeap
+    };
+    for (int i = 1; i < kMaxBurstDepth; i++)
+        pools[2 + i] = &mBurstSlots[i].heap;
+
+    for (size_t i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+        const sp<PmemPool>& pool = *pools[i];
+        if (pool != NULL && pool->mCached && heap.get() == pool->mHeap.get())
+            return pool;
+    }
+    return NULL;
+}
+
+nsecs_t QualcommCameraHardware::beginCpuAccess(const sp<IMemoryHeap>& heap,
+                                               size_t offset, size_t size,
+                                               int access)
+{
+    nsecs_t start = systemTime();
+    sp<PmemPool> pool = cpuPool(heap);
+
+    if (pool != NULL)
+        pool->beginCpu(offset, size, access);
+    return start;
+}
+
+void QualcommCameraHardware::endCpuAccess(const sp<IMemoryHeap>& heap,
+                                          size_t offset, size_t size,
+                                          int access, int consumer,
+                                          nsecs_t start)
+{
+    sp<PmemPool> pool = cpuPool(heap);
+
+    if (pool != NULL)
+        pool->endCpu(offset, size, access);
+    accountCpuAccess(consumer, size, start);
+}
+
+void QualcommCameraHardware::accountCpuAccess(int consumer, size_t size,
+                                              nsecs_t start)
+{
+    if (consumer < 0 || consumer >= CPU_CONSUMERS)
+        return;
+
+    Mutex::Autolock l(&mCpuAccessLock);
+    CpuAccessStat *stat = &mCpuAccessStats[consumer];
+    stat->count++;
+    stat->bytes += size;
+    stat->time += systemTime() - start;
+}
+
+bool QualcommCameraHardware::getHeapLayout(const sp<IMemoryHeap>& heap,
+                                           size_t *bufferSize, int *numBuffers)
+{
+    // Only the preview and record heaps are handed out frame by frame,
+    // mPmemWaitLock keeps the frame thread from dropping them meanwhile.
+    Mutex::Autolock l(&mPmemWaitLock);
+    const MemPool *pool = NULL;
+
+    if (heap == NULL)
+        return false;
+
+    if (mPreviewHeap != NULL && heap.get() == mPreviewHeap->mHeap.get())
+        pool = mPreviewHeap.get();
+    else if (mRecordHeap != NULL && heap.get() == mRecordHeap->mHeap.get())
+        pool = mRecordHeap.get();
+
+    if (pool != NULL) {
+        *bufferSize = pool->mAlignedBufferSize;
+        *numBuffers = pool->mNumBuffers;
+        return true;
+    }
+    return false;
+}
+
 void QualcommCameraHardware::receive_camframe_error_timeout(void) {
     ALOGI("receive_camframe_error_timeout: E");
     Mutex::Autolock l(&mCamframeTimeoutLock);
@@ -6495,50 +8600,38 @@ bool QualcommCameraHardware::storePreviewFrameForPostview(void) {
 
     /* Since there is restriction on the maximum overlay dimensions
      * that can be created, we use the last preview frame as postview
-     * for 7x30. */
-    ALOGV("Copying the preview buffer to postview buffer %d  ",
-         mPreviewFrameSize);
-    if(mPostViewHeap == NULL) {
-        int CbCrOffset = PAD_TO_WORD(mPreviewFrameSize * 2/3);
-        mPostViewHeap =
-           new PmemPool("/dev/pmem_adsp",
-           MemoryHeapBase::READ_ONLY | MemoryHeapBase::NO_CACHING,
-           MSM_PMEM_PREVIEW, //MSM_PMEM_OUTPUT2,
-           mPreviewFrameSize,
-           1,
-           mPreviewFrameSize,
-           CbCrOffset,
-           0,
-           "postview");
-
-           if (!mPostViewHeap->initialized()) {
-               mPostViewHeap.clear();
-               mPostViewHeap = NULL;
-               ALOGE(" Failed to initialize Postview Heap");
-               return false;
-            }
+     * for 8660. */
+    mOverlayLock.lock();
+    DisplayFrame last = mLastQueued;
+    bool valid = mLastQueuedValid;
+    mOverlayLock.unlock();
+    if (!valid) {
+        ALOGE("Failed to store Preview frame. No Postview ");
+        return true;
     }
 
-    if( mPostViewHeap != NULL && mLastQueuedFrame != NULL) {
-        memcpy(mPostViewHeap->mHeap->base(),
-               (uint8_t *)mLastQueuedFrame, mPreviewFrameSize );
-
-        if( mUseOverlay ){
-             mOverlayLock.lock();
-             if (mOverlay != NULL){
-                 mOverlay->setFd(mPostViewHeap->mHeap->getHeapID());
-                 if (zoomCropInfo.w !=0 && zoomCropInfo.h !=0) {
-                     ALOGD("zoomCropInfo non-zero, setting crop ");
-                     mOverlay->setCrop(zoomCropInfo.x, zoomCropInfo.y,
-                               zoomCropInfo.w, zoomCropInfo.h);
-                 }
-                 ALOGV("Queueing Postview with last frame till the snapshot is done ");
-                 mOverlay->queueBuffer((void *)0);
-             }
-             mOverlayLock.unlock();
-        }
-    } else
+    /* The frame is kept where it is, in the preview pool or in a display
+     * copy. The handle keeps the pool mapped while preview stops and the
+     * pool is unregistered, cached or dropped. */
+    sp<PmemPool> pool = last.pool != NULL ? last.pool : mPreviewHeap;
+    if (pool == NULL || last.index < 0 || last.index >= pool->mNumBuffers) {
         ALOGE("Failed to store Preview frame. No Postview ");
+        return true;
+    }
+    sp<FrameHandle> frame = new FrameHandle(pool, last.index);
+    ALOGV("Holding preview buffer %d as postview", last.index);
+    if (mUseOverlay) {
+        mOverlayLock.lock();
+        mPostViewFrame = frame;
+        if (mOverlay != NULL) {
+            mOverlay->setFd(frame->mPool->mHeap->getHeapID());
+            if (zoomCropInfo.w != 0 && zoomCropInfo.h != 0)
+                mOverlay->setCrop(zoomCropInfo.x, zoomCropInfo.y,
+                                  zoomCropInfo.w, zoomCropInfo.h);
+            mOverlay->queueBuffer((void *)frame->offset());
+        }
+        mOverlayLock.unlock();
+    }
     ALOGV("storePreviewFrameForPostview : X ");
     return true;
 }
@@ -6620,7 +8713,7 @@ void QualcommCameraHardware::encodeData() {
     if (mDataCallback && (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE)) {
         mJpegSize = 0;
         mJpegThreadWaitLock.lock();
-        if (LINK_jpeg_encoder_init()) {
+        if (jpegEncoderInit()) {
             mJpegThreadRunning = true;
             mJpegThreadWaitLock.unlock();
             if(native_jpeg_encode()) {
@@ -6635,7 +8728,7 @@ void QualcommCameraHardware::encodeData() {
                 }
                 mJpegThreadWaitLock.unlock();
                 //Call jpeg join in this thread context
-                LINK_jpeg_encoder_join();
+                jpegEncoderJoin();
             }
             ALOGE("encodeData: jpeg encoding failed");
         }
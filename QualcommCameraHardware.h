@@ -24,6 +24,13 @@
 #include <utils/threads.h>
 #include <stdint.h>
 #include "Overlay.h"
+#include "YuvTransform.h"
+#include "YuvScale.h"
+#include "JpegSink.h"
+#include "ExifBuilder.h"
+#include "JpegEncoder.h"
+#include "MemAlloc.h"
+#include "RecordBuffers.h"
 
 extern "C" {
 #include <linux/android_pmem.h>
@@ -224,7 +231,6 @@ public:
     virtual status_t cancelAutoFocus();
     virtual status_t takePicture();
     virtual status_t takeLiveSnapshot();
-    void set_liveshot_exifinfo();
     virtual status_t cancelPicture();
     virtual status_t setParameters(const CameraParameters& params);
     virtual CameraParameters getParameters() const;
@@ -235,6 +241,14 @@ public:
     virtual void release();
     virtual bool useOverlay();
     virtual status_t setOverlay(const sp<Overlay> &overlay);
+    virtual bool getHeapLayout(const sp<IMemoryHeap>& heap,
+                               size_t *bufferSize, int *numBuffers);
+    virtual nsecs_t beginCpuAccess(const sp<IMemoryHeap>& heap, size_t offset,
+                                   size_t size, int access);
+    virtual void endCpuAccess(const sp<IMemoryHeap>& heap, size_t offset,
+                              size_t size, int access, int consumer,
+                              nsecs_t start);
+    virtual status_t setJpegSink(const sp<JpegSink>& sink);
 
     /* For compatibility with TouchPad binary libcamera */
     virtual void stub1() {};
@@ -249,8 +263,8 @@ public:
     void receiveCameraStats(camstats_type stype, camera_preview_histogram_info* histinfo);
     void receiveRecordingFrame(struct msm_frame *frame);
     void receiveJpegPicture(void);
-    void jpeg_set_location();
     void receiveJpegPictureFragment(uint8_t *buf, uint32_t size);
+    void receiveJpegError(void);
     void notifyShutter(common_crop_t *crop, bool mPlayShutterSoundOnly);
     void receive_camframe_error_timeout();
     static void getCameraInfo();
@@ -305,16 +319,20 @@ private:
     };
 
     // This class represents a heap which maintains several contiguous
-    // buffers.  The heap may be backed by pmem (when pmem_pool contains
-    // the name of a /dev/pmem* file), or by ashmem (when pmem_pool == NULL).
+    // buffers.  The heap may be backed by pmem (PmemPool), or by ashmem or
+    // memfd (AshmemPool), the buffers are laid out by mem_layout_init.
 
     struct MemPool : public RefBase {
         MemPool(int buffer_size, int num_buffers,
                 int frame_size,
-                const char *name);
+                const char *name,
+                int cbcr_offset = 0);
 
         virtual ~MemPool() = 0;
 
+        // Charges the heap to the memory budget before it is allocated,
+        // the destructor refunds it. False when it does not fit.
+        bool charge();
         void completeInitialization();
         bool initialized() const {
             return mHeap != NULL && mHeap->base() != MAP_FAILED;
@@ -326,12 +344,17 @@ private:
         int mAlignedBufferSize;
         int mNumBuffers;
         int mFrameSize;
+        mem_layout_t mLayout;
         sp<MemoryHeapBase> mHeap;
         sp<MemoryBase> *mBuffers;
 
         const char *mName;
+        const char *mBackend;   // what the heap came from, for dump()
+        size_t mCharged;        // bytes charged to the memory budget
     };
 
+    // Not pmem, backed by the MemAllocator persist.camera.hal.heap names
+    // ("ashmem" by default, "memfd" or "memfd-huge").
     struct AshmemPool : public MemPool {
         AshmemPool(int buffer_size, int num_buffers,
                    int frame_size,
@@ -352,7 +375,33 @@ private:
         int mCameraControlFd;
         uint32_t mAlignedSize;
         struct pmem_region mSize;
+        bool mRegistered;
         sp<QualcommCameraHardware::MMCameraDL> mMMCameraDLRef;
+
+        // Cache maintenance of pools mapped cached (mCached), no-ops on
+        // the others. hardwareWrote marks a buffer, or all for -1, as
+        // written behind the CPU's back, the next beginCpu over it drops
+        // its stale lines. endCpu writes back what the CPU wrote.
+        bool mCached;
+        bool *mStale;
+        Mutex mCacheLock;
+        void hardwareWrote(int index);
+        void beginCpu(uint32_t offset, uint32_t size, int access);
+        void endCpu(uint32_t offset, uint32_t size, int access);
+        void flushCache(uint32_t offset, uint32_t size);
+
+        // Buffers held by frame handles. Registration leaves them to the
+        // CPU, the VFE does not get to write into them.
+        int *mHolds;
+        Mutex mHoldLock;
+        void hold(int index, bool held);
+        bool held(int index);
+
+        // (Un)registers the buffers with the driver, the same ones and
+        // with the same VFE write access as on construction. Picks which
+        // snapshot buffer the VFE writes into and lets cached pools go
+        // back to the driver.
+        void registerBuffers(bool reg);
     };
 
     sp<PmemPool> mPreviewHeap;
@@ -364,7 +413,21 @@ private:
     sp<AshmemPool> mStatHeap;
     sp<AshmemPool> mMetaDataHeap;
     sp<PmemPool> mRawSnapShotPmemHeap;
-    sp<PmemPool> mPostViewHeap;
+
+    // A buffer of a pool held past its callback. The pool stays mapped for
+    // as long as the handle lives, see PmemPool::hold.
+    struct FrameHandle : public RefBase {
+        FrameHandle(const sp<PmemPool>& pool, int index);
+        virtual ~FrameHandle();
+        uint32_t offset() const {
+            return mem_layout_offset(&mPool->mLayout, mIndex);
+        }
+        sp<PmemPool> mPool;
+        int mIndex;
+    };
+    // The last preview frame shown as postview on 8660 until the snapshot
+    // postview replaces it.
+    sp<FrameHandle> mPostViewFrame;
 
 
     sp<MMCameraDL> mMMCameraDLRef;
@@ -374,17 +437,221 @@ private:
     bool initRecord();
     void deinitPreview();
     bool initRaw(bool initJpegHeap);
+    bool initJpegHeap(int size);
     bool initLiveSnapshot(int videowidth, int videoheight);
     bool initRawSnapshot();
     void deinitRaw();
     void deinitRawSnapshot();
 
+    // Snapshot pools kept registered between captures, so back to back
+    // takePicture calls with the same layout skip the allocation.
+    sp<PmemPool> mCachedRawHeap;
+    sp<AshmemPool> mCachedJpegHeap;
+    sp<PmemPool> mCachedThumbnailHeap;
+    mutable Mutex mSnapshotCacheLock;
+    sp<PmemPool> takeCachedPool(sp<PmemPool>& cache, int pmem_type,
+                                int buffer_size, int num_buffers,
+                                int frame_size, int cbcr_offset, int yoffset);
+    bool snapshotCacheAllowed();
+    bool flushSnapshotCache();
+
+    // Preview and record pools kept unregistered between preview sessions
+    // under mSnapshotCacheLock, so restarting preview with the same sizes
+    // only registers them again.
+    sp<PmemPool> mCachedPreviewHeap;
+    sp<PmemPool> mCachedRecordHeap;
+    void cachePreviewPool(sp<PmemPool>& pool, sp<PmemPool>& cache);
+    bool flushPreviewCache();
+
+    // Every pool is charged to a memory budget, persist.camera.hal.membudget
+    // in MB. Cached pools are evicted to stay under it, a capture that
+    // cannot fit is refused before preview is stopped for it.
+    friend bool evict_cached_snapshot_pools(void *user);
+    friend bool evict_cached_preview_pools(void *user);
+    size_t cachedPoolBytes();
+    bool captureFits();
+
+    // Pools the CPU reads are mapped cached with persist.camera.hal.pmem.cached,
+    // their consumers bracket access with begin/endCpuAccess.
+    bool mCachedPmem;
+    int cpuPmemFlags() const;
+    sp<PmemPool> cpuPool(const sp<IMemoryHeap>& heap);
+    void accountCpuAccess(int consumer, size_t size, nsecs_t start);
+    struct CpuAccessStat {
+        uint32_t count;
+        uint64_t bytes;
+        nsecs_t time;
+    };
+    CpuAccessStat mCpuAccessStats[CPU_CONSUMERS];
+    mutable Mutex mCpuAccessLock;
+
+    // Burst capture (num-snaps-per-shutter > 1). Frames are captured into a
+    // ring of raw buffers, only the one being captured into is registered
+    // with the driver. The encode thread turns full slots into JPEGs while
+    // the snapshot thread captures the next frame.
+    enum { kMaxBurstDepth = 4 };
+    enum { BURST_SLOT_FREE, BURST_SLOT_FULL };
+    struct BurstSlot {
+        sp<PmemPool> heap;
+        common_crop_t crop;
+        cam_ctrl_dimension_t dim;
+        int state;
+        int frame;
+    };
+    BurstSlot mBurstSlots[kMaxBurstDepth];
+    int mBurstCount;        // num-snaps-per-shutter
+    int mBurstShots;        // frames to capture for the current takePicture
+    int mBurstDepth;        // raw buffers in the ring
+    int mBurstRegistered;   // slot the driver currently writes into
+    int mBurstEncoded;
+    bool mBurstCaptureDone;
+    bool mBurstEncoderRunning;
+    float mBurstFps;        // last burst throughput, reported by dump()
+    Mutex mBurstLock;
+    Condition mBurstWait;
+    pthread_t mBurstEncoderThread;
+    friend void *burst_encode_thread(void *user);
+    void runBurstEncodeThread();
+    bool runBurst();
+    bool encodeBurstFrame(BurstSlot &slot);
+    bool snapshotCancelled();
+
+    // Zero shutter lag: while preview runs, frames are copied into a ring
+    // laid out for the JPEG encoder. When the picture size is the preview
+    // size, takePicture then encodes the frame closest to the shutter
+    // without stopping preview.
+    enum { kMaxZslDepth = 8 };
+    enum { ZSL_EMPTY, ZSL_WRITING, ZSL_READY, ZSL_HELD };
+    struct ZslFrame {
+        sp<PmemPool> heap;
+        nsecs_t timestamp;      // capture time of the frame
+        common_crop_t crop;
+        int state;
+    };
+    ZslFrame mZslFrames[kMaxZslDepth];
+    int mZslDepth;
+    int mZslNext;
+    int mZslWidth, mZslHeight;
+    uint32_t mZslYOffset, mZslCbCrOffset;
+    bool mZslEnabled;       // "zsl" parameter
+    bool mZslPictureFits;   // zsl is on and the picture is preview sized
+    bool mZslCapture;       // the current takePicture is served from the ring
+    int mZslIndex;
+    sp<PmemPool> mZslEncodeHeap;
+    Mutex mZslLock;
+    bool initZsl();
+    void deinitZsl();
+    void storeZslFrame(struct msm_frame *frame);
+    bool zslUsable();
+    bool captureZsl();
+    void finishZsl();
+    status_t setZsl(const CameraParameters& params);
+
+    // JPEG encoding goes through a backend: the liboemcamera encoder or the
+    // software one in JpegEncoder.cpp. Both report the stream through
+    // receiveJpegPictureFragment() and finish with receiveJpegPicture().
+    struct JpegJob {
+        cam_ctrl_dimension_t *dimension;
+        common_crop_t *crop;
+        uint8_t *thumbnail;     // hardware thumbnail source, NULL for none
+        int thumbfd;
+        uint8_t *raw;
+        int rawfd;
+        int padding;
+        int cbcrOffset;         // as jpeg_encoder_encode takes it, -1 default
+        int quality;
+        int thumbnailQuality;
+        int rotation;           // for the hardware to apply, -1 if set already
+        int thumbnailWidth;     // size of the embedded thumbnail, 0 for none
+        int thumbnailHeight;
+        bool nv21;
+        yuv_sp_frame_t image;   // main image layout inside raw
+        const ExifBuilder *exif; // APP1 fields, orientation included
+        uint32_t targetSize;    // bytes to stay under, 0 to code at quality
+        jpeg_encode_stats_t *stats; // filled in by encoders with rate control
+    };
+    class JpegBackend : public virtual RefBase {
+    public:
+        virtual ~JpegBackend() {}
+        virtual const char *name() const = 0;
+        virtual bool init() = 0;
+        virtual bool encode(const JpegJob &job) = 0;
+        virtual void join() = 0;
+    };
+    class HardwareJpegBackend;
+    class SoftwareJpegBackend;
+    sp<JpegBackend> mJpegBackend;
+    nsecs_t mJpegEncodeStart;
+    nsecs_t mJpegEncodeTime;    // last encode, for dump()
+    void selectJpegBackend();
+    // Where the encoded picture goes, NULL collects it in mJpegHeap.
+    sp<JpegSink> mJpegSink;
+    size_t mJpegPeakMemory;     // held for the last picture, for dump()
+    uint32_t mJpegTargetSize;   // jpeg-target-size of the last picture
+    jpeg_encode_stats_t mJpegStats; // how the last picture met it
+    void selectJpegSink();
+    bool jpegEncoderInit();
+    void jpegEncoderJoin();
+
+    nsecs_t mShutterTime;       // when takePicture was called
+    nsecs_t mShutterLatency;    // shutter to last JPEG callback, for dump()
+    nsecs_t mPreviewStartTime;  // when startPreview was called, 0 once a frame came
+    nsecs_t mPreviewStartLatency; // startPreview to first frame, for dump()
+    nsecs_t mPreviewHeapTime;   // spent getting the preview and record pools
+    bool mPreviewHeapReused;    // the last preview start took the cached preview pool
+    bool mRecordHeapReused;     // and the cached record pool
+
     bool mFrameThreadRunning;
     Mutex mFrameThreadWaitLock;
     Condition mFrameThreadWait;
     friend void *frame_thread(void *user);
     void runFrameThread(void *data);
 
+    // Display stage: receivePreviewFrame posts the frames to a bounded ring
+    // and the display thread hands them to the overlay, so a stalled
+    // display does not stall the frame thread. The preview buffer goes
+    // back to the VFE when the callback returns, so the ring carries
+    // copies in mDisplayCopyHeap, one buffer more than the ring holds for
+    // the frame on the overlay.
+    struct DisplayFrame {
+        ssize_t offset;         // what the overlay queueBuffer gets
+        int fd;
+        int index;              // buffer of pool, or of the preview pool
+        sp<PmemPool> pool;      // the copy pool, NULL for a preview buffer
+        void *vaddr;
+        int cropX, cropY, cropW, cropH;
+    };
+    static const int kMaxDisplayDepth = kPreviewBufferCount;
+    DisplayFrame mDisplayRing[kMaxDisplayDepth];
+    int mDisplayDepth;          // ring capacity, 0 queues synchronously
+    int mDisplayHead;
+    int mDisplayCount;
+    bool mDisplayDropNewest;
+    sp<PmemPool> mDisplayCopyHeap;
+    int mDisplayShowing;        // copy the display thread took last
+    int mDisplayCrop[4];
+    bool mDisplayCropValid;
+    DisplayFrame mLastQueued;   // last frame the overlay got, under mOverlayLock
+    bool mLastQueuedValid;
+    // counters, reported by dump()
+    uint32_t mDisplayPosted;
+    uint32_t mDisplayShown;
+    uint32_t mDisplayDropped;
+    int mDisplayMaxCount;
+
+    bool mDisplayThreadRunning;
+    bool mDisplayThreadExit;
+    Mutex mDisplayLock;
+    Condition mDisplayWait;
+    pthread_t mDisplayThread;
+    friend void *display_thread(void *user);
+    void runDisplayThread();
+    void startDisplayThread();
+    void stopDisplayThread();
+    void postDisplayFrame(DisplayFrame &frame);
+    int displayCopySlot();
+    void showDisplayFrame(const DisplayFrame &frame);
+
     //720p recording video thread
     bool mVideoThreadExit;
     bool mVideoThreadRunning;
@@ -393,6 +660,38 @@ private:
     friend void *video_thread(void *user);
     void runVideoThread(void *data);
 
+    // Owner of each record buffer and the live snapshot's pins on them.
+    RecordBuffers mRecordBuffers;
+    unsigned long mRecordBufferStride;
+    bool mDebugRecordBuffers;
+    int recordBufferIndex(unsigned long buffer) const;
+    void freeRecordBuffer(int index);
+    void reportRecordBuffers();
+
+    // Software live snapshot: the next recording frame is encoded as is
+    // on a background thread. Record buffers are pinned. Preview frames
+    // standing in for them on targets without output2 are copied on the
+    // frame thread, as libmmcamera has no call to hold a preview buffer.
+    volatile int32_t mLiveshotArmed;    // takeLiveSnapshot wants a frame
+    bool mLiveshotThreadRunning;
+    Mutex mLiveshotThreadWaitLock;
+    Condition mLiveshotThreadWait;
+    int mLiveshotBuffer;                // pinned record buffer, -1 for a copy
+    uint8_t *mLiveshotCopy;
+    size_t mLiveshotCopySize;
+    yuv_sp_frame_t mLiveshotImage;
+    int mLiveshotQuality;
+    nsecs_t mLiveshotStart;             // when takeLiveSnapshot was called
+    nsecs_t mLiveshotLatency;           // last, to the callback, for dump()
+    uint32_t mLiveshotCount;
+    RecordFrameGaps mRecordFrameGaps;   // record frames live snapshots cost
+    friend void *liveshot_thread(void *user);
+    void runLiveshotThread();
+    bool startLiveshotThread(const struct msm_frame *frame, int index);
+    void waitForLiveshot();
+    void countRecordFrame(nsecs_t timestamp);
+    bool softwareLiveSnapshot() const;
+
     friend void *openCamera(void *data);
 
     // For Histogram
@@ -425,6 +724,13 @@ private:
     bool mEncodePending;
     Mutex mEncodePendingWaitLock;
     Condition mEncodePendingWait;
+    // Set while the snapshot thread only waits for the JPEG encoder and
+    // no longer counts as a running snapshot.
+    bool mEncodeRunning;
+    Mutex mEncodeWaitLock;
+    Condition mEncodeWait;
+    void runEncodeStage();
+    void waitForEncode();
 
     void debugShowPreviewFPS() const;
     void debugShowVideoFPS() const;
@@ -456,6 +762,7 @@ private:
     status_t setWhiteBalance(const CameraParameters& params);
     status_t setFlash(const CameraParameters& params);
     status_t setGpsLocation(const CameraParameters& params);
+    static bool parseGpsValue(const char *name, const char *str, double *value);
     status_t setRotation(const CameraParameters& params);
     status_t setZoom(const CameraParameters& params);
     status_t setFocusMode(const CameraParameters& params);
@@ -473,9 +780,9 @@ private:
     status_t setTouchAfAec(const CameraParameters& params);
     status_t setSceneDetect(const CameraParameters& params);
     status_t setStrTextures(const CameraParameters& params);
+    status_t setNumSnapsPerShutter(const CameraParameters& params);
     status_t setPreviewFormat(const CameraParameters& params);
     status_t setSelectableZoneAf(const CameraParameters& params);
-    void setGpsParameters();
     bool storePreviewFrameForPostview();
     bool isValidDimension(int w, int h);
 
@@ -485,6 +792,26 @@ private:
     bool mReleasedRecordingFrame;
 
     bool receiveRawPicture(void);
+    bool getRawPicture(common_crop_t *crop, cam_ctrl_dimension_t *dim,
+                       const sp<PmemPool>& rawHeap);
+    bool native_jpeg_encode (const sp<PmemPool>& rawHeap,
+                             const cam_ctrl_dimension_t& dim,
+                             const common_crop_t& crop);
+    void getEncodeLayout(const sp<PmemPool>& rawHeap,
+                         const cam_ctrl_dimension_t& dim, bool cropped,
+                         yuv_sp_frame_t *image);
+    bool upscalePicture(const common_crop_t *crop,
+                        const cam_ctrl_dimension_t& dim,
+                        const sp<PmemPool>& rawHeap);
+    bool upscaleZoomed(yuv_sp_frame_t *full, int width, int height);
+    // Encoder inputs, kept apart from what preview restart reconfigures.
+    sp<PmemPool> mEncodeRawHeap;
+    common_crop_t mEncodeCrop;
+    cam_ctrl_dimension_t mEncodeDimension;
+    ExifBuilder mEncodeExif;
+    // EXIF of the session, kept current by setParameters().
+    ExifBuilder mExif;
+    exif_tags_info_t mLiveshotExif[ExifBuilder::FIELD_COUNT];
     bool receiveRawSnapshot(void);
 
     Mutex mCallbackLock;
@@ -527,7 +854,6 @@ private:
     int mHJR;
     struct msm_frame frames[kPreviewBufferCount];
     struct msm_frame *recordframes;
-    bool *record_buffers_tracking_flag;
     bool mInPreviewCallback;
     bool mUseOverlay;
     sp<Overlay>  mOverlay;
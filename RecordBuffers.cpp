@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "RecordBuffers"
+#include <utils/Log.h>
+
+#include <cutils/atomic.h>
+
+#include "RecordBuffers.h"
+
+namespace android {
+
+static const char *stateName(int state)
+{
+    static const char *names[] = { "kernel", "camframe", "busy", "client" };
+    return names[state & 3];
+}
+
+RecordBuffers::RecordBuffers()
+    : mCount(0),
+      mStates(NULL),
+      mPins(NULL),
+      mDebug(false)
+{
+}
+
+RecordBuffers::~RecordBuffers()
+{
+    delete [] mStates;
+    delete [] mPins;
+}
+
+bool RecordBuffers::init(int count)
+{
+    if (count != mCount) {
+        delete [] mStates;
+        delete [] mPins;
+        mStates = new int32_t[(count + 15) / 16];
+        mPins = new int32_t[count];
+        mCount = count;
+    }
+    reset();
+    return true;
+}
+
+void RecordBuffers::reset()
+{
+    for (int i = 0; i < (mCount + 15) / 16; i++)
+        android_atomic_release_store(0, &mStates[i]);
+    for (int i = 0; i < mCount; i++)
+        android_atomic_release_store(0, &mPins[i]);
+}
+
+int RecordBuffers::state(int index) const
+{
+    uint32_t word = android_atomic_acquire_load(&mStates[index / 16]);
+    return (word >> ((index % 16) * 2)) & 3;
+}
+
+bool RecordBuffers::move(int index, int from, int to)
+{
+    volatile int32_t *addr = &mStates[index / 16];
+    int shift = (index % 16) * 2;
+    uint32_t old, val;
+    int state;
+
+    do {
+        old = android_atomic_acquire_load(addr);
+        state = (old >> shift) & 3;
+        if (!(from & (1 << state))) {
+            if (mDebug) {
+                if (state == RECORD_BUFFER_CAMFRAME && to == RECORD_BUFFER_CAMFRAME)
+                    ALOGE("record buffer %d released twice", index);
+                else
+                    ALOGE("record buffer %d: bad transition %s -> %s", index,
+                          stateName(state), stateName(to));
+            }
+            return false;
+        }
+        val = (old & ~(3U << shift)) | ((uint32_t)to << shift);
+    } while (android_atomic_release_cas(old, val, addr));
+
+    return true;
+}
+
+void RecordBuffers::pin(int index)
+{
+    android_atomic_release_store(2, &mPins[index]);
+}
+
+void RecordBuffers::unpin(int index)
+{
+    android_atomic_release_store(0, &mPins[index]);
+}
+
+bool RecordBuffers::dropPin(int index)
+{
+    if (android_atomic_acquire_load(&mPins[index]) == 0)
+        return true;
+    return android_atomic_dec(&mPins[index]) == 1;
+}
+
+RecordFrameGaps::RecordFrameGaps()
+    : mLast(0),
+      mInterval(0),
+      mEncoding(0),
+      mDrops(0),
+      mTotalDrops(0)
+{
+}
+
+void RecordFrameGaps::reset()
+{
+    mLast = 0;
+    mInterval = 0;
+}
+
+void RecordFrameGaps::startEncode()
+{
+    android_atomic_release_store(0, &mDrops);
+    android_atomic_release_store(1, &mEncoding);
+}
+
+void RecordFrameGaps::endEncode()
+{
+    // Counts the gap before the next frame too, then frame() stops.
+    android_atomic_release_store(2, &mEncoding);
+}
+
+void RecordFrameGaps::cancelEncode()
+{
+    android_atomic_release_store(0, &mEncoding);
+}
+
+int RecordFrameGaps::frame(nsecs_t timestamp)
+{
+    nsecs_t gap = timestamp - mLast;
+
+    mLast = timestamp;
+    if (gap <= 0 || gap > s2ns(1))
+        return -1;
+
+    int encoding = android_atomic_acquire_load(&mEncoding);
+    if (encoding == 0) {
+        mInterval = mInterval > 0 ? (mInterval * 7 + gap) / 8 : gap;
+        return -1;
+    }
+    if (mInterval > 0) {
+        int missed = (gap + mInterval / 2) / mInterval - 1;
+        if (missed > 0) {
+            android_atomic_add(missed, &mDrops);
+            mTotalDrops += missed;
+        }
+    }
+    if (encoding == 2 && android_atomic_cmpxchg(2, 0, &mEncoding) == 0)
+        return android_atomic_acquire_load(&mDrops);
+    return -1;
+}
+
+}; // namespace android
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_RECORD_BUFFERS_H
+#define ANDROID_HARDWARE_RECORD_BUFFERS_H
+
+#include <stdint.h>
+#include <utils/Timers.h>
+
+namespace android {
+
+// Owner of a record buffer
+enum {
+    RECORD_BUFFER_KERNEL = 0,   // queued to the VFE
+    RECORD_BUFFER_CAMFRAME,     // on the camframe free queue
+    RECORD_BUFFER_BUSY,         // on the busy queue
+    RECORD_BUFFER_CLIENT,       // handed to the encoder
+};
+
+/*
+ * Owner of each record buffer, two bits per buffer changed with compare
+ * and swap, so the video thread, releaseRecordingFrame and the live
+ * snapshot thread need no common lock.
+ *
+ * A live snapshot encoding a record buffer in place pins it: the snapshot
+ * and the client then both hold the buffer and whichever drops it last
+ * gives it back to camframe.
+ */
+class RecordBuffers {
+public:
+    RecordBuffers();
+    ~RecordBuffers();
+
+    /* Makes room for count buffers, call while recording is stopped. */
+    bool init(int count);
+
+    /* Gives every buffer to the kernel and drops all pins. */
+    void reset();
+
+    int count() const { return mCount; }
+    int state(int index) const;
+
+    /*
+     * Moves buffer index to state to if it is in one of the states set in
+     * the from mask. Returns false, and leaves the buffer alone, if not.
+     */
+    bool move(int index, int from, int to);
+
+    /* Pins a buffer about to go to the client for the live snapshot. */
+    void pin(int index);
+
+    /* Takes the pin back when the live snapshot did not start. */
+    void unpin(int index);
+
+    /*
+     * Drops one holder of buffer index. Returns true when the buffer was
+     * not pinned or the caller was the last holder; either way the caller
+     * gives it back to camframe.
+     */
+    bool dropPin(int index);
+
+    /* Logs refused transitions, persist.debug.camera.recbufs. */
+    void setDebug(bool debug) { mDebug = debug; }
+
+private:
+    RecordBuffers(const RecordBuffers &);
+    RecordBuffers &operator=(const RecordBuffers &);
+
+    int mCount;
+    volatile int32_t *mStates;
+    volatile int32_t *mPins;
+    bool mDebug;
+};
+
+/*
+ * Counts the recording frames a live snapshot costs. frame() is called
+ * for every recording frame by the thread delivering them. While a
+ * snapshot is encoded, and for the first frame after it, a gap of more
+ * than the usual interval counts the frames the recording missed.
+ */
+class RecordFrameGaps {
+public:
+    RecordFrameGaps();
+
+    /* Forgets the interval, recording starts. */
+    void reset();
+
+    /* The live snapshot starts, stops or failed to start. */
+    void startEncode();
+    void endEncode();
+    void cancelEncode();
+
+    /*
+     * Returns the frames the last snapshot cost once the frame after it
+     * came, -1 for every other frame.
+     */
+    int frame(nsecs_t timestamp);
+
+    uint32_t totalDrops() const { return mTotalDrops; }
+
+private:
+    nsecs_t mLast;              // timestamp of the last frame
+    nsecs_t mInterval;          // usual gap between frames
+    volatile int32_t mEncoding; // gaps are counted, 2 for one more frame
+    volatile int32_t mDrops;    // frames missed by the current snapshot
+    uint32_t mTotalDrops;       // and by all of them, for dump()
+};
+
+}; // namespace android
+
+#endif // ANDROID_HARDWARE_RECORD_BUFFERS_H
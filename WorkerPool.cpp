@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "WorkerPool"
+#include <utils/Log.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "WorkerPool.h"
+
+namespace android {
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    worker_pool_fn fn;      /* open for helpers to join, NULL otherwise */
+    void *arg;
+    int wanted;             /* helpers the open job still takes */
+    int active;             /* helpers inside fn */
+    int started;
+    bool busy;
+} gPool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0, 0, false
+};
+
+static void *pool_thread(void *)
+{
+    pthread_mutex_lock(&gPool.lock);
+    for (;;) {
+        while (gPool.fn == NULL || gPool.wanted == 0)
+            pthread_cond_wait(&gPool.work, &gPool.lock);
+        worker_pool_fn fn = gPool.fn;
+        void *arg = gPool.arg;
+        gPool.wanted--;
+        gPool.active++;
+        pthread_mutex_unlock(&gPool.lock);
+
+        fn(arg);
+
+        pthread_mutex_lock(&gPool.lock);
+        if (--gPool.active == 0)
+            pthread_cond_signal(&gPool.idle);
+    }
+    return NULL;
+}
+
+void worker_pool_run(worker_pool_fn fn, void *arg, int helpers)
+{
+    if (helpers > WORKER_POOL_MAX_HELPERS)
+        helpers = WORKER_POOL_MAX_HELPERS;
+
+    pthread_mutex_lock(&gPool.lock);
+    if (gPool.busy)
+        helpers = 0;
+    while (gPool.started < helpers) {
+        pthread_t thread;
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int rc = pthread_create(&thread, &attr, pool_thread, NULL);
+        pthread_attr_destroy(&attr);
+        if (rc != 0) {
+            ALOGE("%s: pthread_create failed: %s", __FUNCTION__, strerror(rc));
+            break;
+        }
+        gPool.started++;
+    }
+    if (helpers > gPool.started)
+        helpers = gPool.started;
+    if (helpers > 0) {
+        gPool.busy = true;
+        gPool.fn = fn;
+        gPool.arg = arg;
+        gPool.wanted = helpers;
+        pthread_cond_broadcast(&gPool.work);
+    }
+    pthread_mutex_unlock(&gPool.lock);
+
+    fn(arg);
+
+    if (helpers > 0) {
+        /* Close the job to late helpers, then wait for the ones in it. */
+        pthread_mutex_lock(&gPool.lock);
+        gPool.fn = NULL;
+        gPool.arg = NULL;
+        gPool.wanted = 0;
+        while (gPool.active > 0)
+            pthread_cond_wait(&gPool.idle, &gPool.lock);
+        gPool.busy = false;
+        pthread_mutex_unlock(&gPool.lock);
+    }
+}
+
+int worker_pool_cpus(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+}; // namespace android
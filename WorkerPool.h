@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_WORKER_POOL_H
+#define ANDROID_HARDWARE_WORKER_POOL_H
+
+namespace android {
+
+/*
+ * Process wide pool of helper threads for splitting picture processing
+ * (encoding, cropping, scaling) across cpus. Helpers are started the
+ * first time they are asked for and then sleep until the next job.
+ */
+
+#define WORKER_POOL_MAX_HELPERS 15
+
+/*
+ * Body of a job. The caller and every helper run it once with the same
+ * argument, so it should keep taking work items (e.g. with an atomic
+ * counter) until there are none left.
+ */
+typedef void (*worker_pool_fn)(void *arg);
+
+/*
+ * Runs fn(arg) on the calling thread and on up to helpers pool threads
+ * and returns once all of them are done. One job uses the pool at a time;
+ * a job started meanwhile runs on the calling thread alone.
+ */
+void worker_pool_run(worker_pool_fn fn, void *arg, int helpers);
+
+/* Number of online cpus, at least 1. */
+int worker_pool_cpus(void);
+
+}; // namespace android
+
+#endif // ANDROID_HARDWARE_WORKER_POOL_H
@@ -0,0 +1,676 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "YuvScale"
+#include <utils/Log.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <cutils/atomic.h>
+#include <cutils/properties.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define YUV_SCALE_NEON 1
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#define YUV_SCALE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#include "YuvScale.h"
+#include "WorkerPool.h"
+
+namespace android {
+
+/*
+ * Weights are 14-bit fixed point summing to 1 << 14. The horizontal pass
+ * keeps 6 fraction bits in the intermediate, enough headroom for the
+ * Lanczos overshoot in 16 bits; the vertical pass removes the other 20.
+ */
+#define SCALE_WEIGHT_BITS 14
+#define SCALE_H_SHIFT 8
+#define SCALE_V_SHIFT 20
+#define SCALE_MAX_TAPS 64
+
+#define SCALE_TILE_W 256        /* output elements (pixels or pairs) */
+#define SCALE_TILE_H 32         /* output rows, fewer when shrinking */
+
+/* Filter along one axis: output i reads taps inputs from start[i] on. */
+typedef struct {
+    int taps;
+    int *start;
+    int16_t *weights;           /* taps per output */
+} scale_axis_t;
+
+typedef struct {
+    const char *name;
+    /* outputs o0..o1 of a row: sum_k w[o][k] * src[start[o] + k] per channel */
+    void (*hfilter)(int16_t *dst, const uint8_t *src, const scale_axis_t *ax,
+                    int o0, int o1, int channels);
+    /* dst[i] = sum_k w[k] * rows[k][i], rounded, shifted and clamped */
+    void (*vfilter)(uint8_t *dst, const int16_t * const *rows,
+                    const int16_t *w, int taps, int n);
+} yuv_scale_kernels_t;
+
+/*******************************************************************
+ * filters
+ *******************************************************************/
+
+static double filter_bilinear(double x)
+{
+    x = fabs(x);
+    return x < 1.0 ? 1.0 - x : 0.0;
+}
+
+static double sinc(double x)
+{
+    if (x == 0.0)
+        return 1.0;
+    x *= M_PI;
+    return sin(x) / x;
+}
+
+static double filter_lanczos3(double x)
+{
+    x = fabs(x);
+    return x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+}
+
+/* The area filter has no kernel, its weights are the overlaps. */
+static const struct {
+    const char *name;
+    double (*fn)(double);
+    double support;
+} filters[YUV_SCALE_MAX] = {
+    { "bilinear", filter_bilinear, 1.0 },
+    { "lanczos",  filter_lanczos3, 3.0 },
+    { "area",     NULL,            0.5 },
+};
+
+yuv_scale_filter_t yuv_scale_filter_from_string(const char *str,
+                                                yuv_scale_filter_t def)
+{
+    if (!str)
+        return def;
+    for (int i = 0; i < YUV_SCALE_MAX; i++) {
+        if (!strcmp(str, filters[i].name))
+            return (yuv_scale_filter_t)i;
+    }
+    return def;
+}
+
+static void axis_free(scale_axis_t *ax)
+{
+    free(ax->start);
+    free(ax->weights);
+    ax->start = NULL;
+    ax->weights = NULL;
+}
+
+/* Output i averages inputs i * ratio to (i + 1) * ratio. */
+static double area_weights(double *w, int taps, int start, int i, double ratio)
+{
+    double lo = i * ratio, hi = (i + 1) * ratio;
+    double sum = 0.0;
+
+    for (int k = 0; k < taps; k++) {
+        double a = start + k > lo ? start + k : lo;
+        double b = start + k + 1 < hi ? start + k + 1 : hi;
+        w[k] = b > a ? b - a : 0.0;
+        sum += w[k];
+    }
+    return sum;
+}
+
+/*
+ * Builds the filter taking in inputs to out outputs, pixel centres
+ * aligned. When shrinking the filter is stretched to cover the inputs.
+ * Taps falling off the edge are folded onto the edge input.
+ */
+static bool axis_init(scale_axis_t *ax, yuv_scale_filter_t filter, int in, int out)
+{
+    double ratio = (double)in / out;
+    double stretch = ratio > 1.0 ? ratio : 1.0;
+    double support = filters[filter].support * stretch;
+    double w[SCALE_MAX_TAPS];
+
+    if (filter == YUV_SCALE_AREA)
+        ax->taps = (int)ceil(ratio) + 1;
+    else
+        ax->taps = (int)ceil(support) * 2;
+    if (ax->taps > SCALE_MAX_TAPS)
+        ax->taps = SCALE_MAX_TAPS;
+    if (ax->taps > in)
+        ax->taps = in;
+    ax->start = (int *)malloc(out * sizeof(int));
+    ax->weights = (int16_t *)malloc(out * ax->taps * sizeof(int16_t));
+    if (ax->start == NULL || ax->weights == NULL) {
+        axis_free(ax);
+        return false;
+    }
+
+    for (int i = 0; i < out; i++) {
+        double center = (i + 0.5) * ratio - 0.5;
+        int left = filter == YUV_SCALE_AREA ? (int)floor(i * ratio)
+                                            : (int)floor(center - support) + 1;
+        int start = left;
+        double sum = 0.0;
+
+        if (start > in - ax->taps)
+            start = in - ax->taps;
+        if (start < 0)
+            start = 0;
+        memset(w, 0, sizeof(w));
+        if (filter == YUV_SCALE_AREA) {
+            sum = area_weights(w, ax->taps, start, i, ratio);
+        } else {
+            for (int k = 0; k < (int)ceil(support) * 2; k++) {
+                int j = left + k;
+                double v = filters[filter].fn((j - center) / stretch);
+                if (j < 0)
+                    j = 0;
+                if (j > in - 1)
+                    j = in - 1;
+                if (j - start >= ax->taps)
+                    continue;   /* only when capped at SCALE_MAX_TAPS */
+                w[j - start] += v;
+                sum += v;
+            }
+        }
+
+        int16_t *q = ax->weights + i * ax->taps;
+        int total = 0, biggest = 0;
+        for (int k = 0; k < ax->taps; k++) {
+            q[k] = (int16_t)lrint(w[k] / sum * (1 << SCALE_WEIGHT_BITS));
+            total += q[k];
+            if (q[k] > q[biggest])
+                biggest = k;
+        }
+        q[biggest] += (1 << SCALE_WEIGHT_BITS) - total;
+        ax->start[i] = start;
+    }
+    return true;
+}
+
+/*******************************************************************
+ * C kernels
+ *******************************************************************/
+
+static void hfilter_c(int16_t *dst, const uint8_t *src, const scale_axis_t *ax,
+                      int o0, int o1, int channels)
+{
+    const int taps = ax->taps;
+
+    for (int o = o0; o < o1; o++) {
+        const uint8_t *s = src + ax->start[o] * channels;
+        const int16_t *w = ax->weights + o * taps;
+        for (int c = 0; c < channels; c++) {
+            int acc = 0;
+            for (int k = 0; k < taps; k++)
+                acc += w[k] * s[k * channels + c];
+            *dst++ = (int16_t)((acc + (1 << (SCALE_H_SHIFT - 1))) >> SCALE_H_SHIFT);
+        }
+    }
+}
+
+static inline uint8_t vfilter_one(const int16_t * const *rows,
+                                  const int16_t *w, int taps, int i)
+{
+    int acc = 1 << (SCALE_V_SHIFT - 1);
+    for (int k = 0; k < taps; k++)
+        acc += w[k] * rows[k][i];
+    acc >>= SCALE_V_SHIFT;
+    return acc < 0 ? 0 : acc > 255 ? 255 : acc;
+}
+
+static void vfilter_c(uint8_t *dst, const int16_t * const *rows,
+                      const int16_t *w, int taps, int n)
+{
+    for (int i = 0; i < n; i++)
+        dst[i] = vfilter_one(rows, w, taps, i);
+}
+
+static const yuv_scale_kernels_t kernels_c = { "c", hfilter_c, vfilter_c };
+
+/*******************************************************************
+ * NEON kernels
+ *******************************************************************/
+
+#ifdef YUV_SCALE_NEON
+/* Eight taps at a time, which pays off when shrinking. */
+static void hfilter_neon(int16_t *dst, const uint8_t *src, const scale_axis_t *ax,
+                         int o0, int o1, int channels)
+{
+    const int taps = ax->taps;
+
+    if (taps < 8) {
+        hfilter_c(dst, src, ax, o0, o1, channels);
+        return;
+    }
+    for (int o = o0; o < o1; o++) {
+        const uint8_t *s = src + ax->start[o] * channels;
+        const int16_t *w = ax->weights + o * taps;
+        int32x4_t acc[2] = { vdupq_n_s32(0), vdupq_n_s32(0) };
+        int k = 0;
+
+        for (; k + 8 <= taps; k += 8) {
+            int16x8_t wk = vld1q_s16(w + k);
+            if (channels == 1) {
+                int16x8_t v = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(s + k)));
+                acc[0] = vmlal_s16(acc[0], vget_low_s16(v), vget_low_s16(wk));
+                acc[0] = vmlal_s16(acc[0], vget_high_s16(v), vget_high_s16(wk));
+            } else {
+                uint8x8x2_t v = vld2_u8(s + k * 2);
+                for (int c = 0; c < 2; c++) {
+                    int16x8_t vc = vreinterpretq_s16_u16(vmovl_u8(v.val[c]));
+                    acc[c] = vmlal_s16(acc[c], vget_low_s16(vc), vget_low_s16(wk));
+                    acc[c] = vmlal_s16(acc[c], vget_high_s16(vc), vget_high_s16(wk));
+                }
+            }
+        }
+        for (int c = 0; c < channels; c++) {
+            int32x2_t t = vadd_s32(vget_low_s32(acc[c]), vget_high_s32(acc[c]));
+            int sum = vget_lane_s32(vpadd_s32(t, t), 0);
+            for (int j = k; j < taps; j++)
+                sum += w[j] * s[j * channels + c];
+            *dst++ = (int16_t)((sum + (1 << (SCALE_H_SHIFT - 1))) >> SCALE_H_SHIFT);
+        }
+    }
+}
+
+static void vfilter_neon(uint8_t *dst, const int16_t * const *rows,
+                         const int16_t *w, int taps, int n)
+{
+    const int32x4_t round = vdupq_n_s32(1 << (SCALE_V_SHIFT - 1));
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        int32x4_t lo = round, hi = round;
+        for (int k = 0; k < taps; k++) {
+            int16x8_t v = vld1q_s16(rows[k] + i);
+            int16x4_t wk = vdup_n_s16(w[k]);
+            lo = vmlal_s16(lo, vget_low_s16(v), wk);
+            hi = vmlal_s16(hi, vget_high_s16(v), wk);
+        }
+        /* >> 16 then >> 4 with saturation to 0..255 */
+        int16x8_t r = vcombine_s16(vqshrn_n_s32(lo, 16), vqshrn_n_s32(hi, 16));
+        vst1_u8(dst + i, vqshrun_n_s16(r, SCALE_V_SHIFT - 16));
+    }
+    for (; i < n; i++)
+        dst[i] = vfilter_one(rows, w, taps, i);
+}
+
+static const yuv_scale_kernels_t kernels_neon = { "neon", hfilter_neon, vfilter_neon };
+#endif
+
+/*******************************************************************
+ * SSE2 kernels
+ *******************************************************************/
+
+#ifdef YUV_SCALE_SSE2
+static inline int hsum_sse2(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(v);
+}
+
+/* Eight taps at a time, which pays off when shrinking. */
+static void hfilter_sse2(int16_t *dst, const uint8_t *src, const scale_axis_t *ax,
+                         int o0, int o1, int channels)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low = _mm_set1_epi16(0xff);
+    const int taps = ax->taps;
+
+    if (taps < 8) {
+        hfilter_c(dst, src, ax, o0, o1, channels);
+        return;
+    }
+    for (int o = o0; o < o1; o++) {
+        const uint8_t *s = src + ax->start[o] * channels;
+        const int16_t *w = ax->weights + o * taps;
+        __m128i acc[2] = { zero, zero };
+        int k = 0;
+
+        for (; k + 8 <= taps; k += 8) {
+            __m128i wk = _mm_loadu_si128((const __m128i *)(w + k));
+            if (channels == 1) {
+                __m128i v = _mm_loadl_epi64((const __m128i *)(s + k));
+                v = _mm_unpacklo_epi8(v, zero);
+                acc[0] = _mm_add_epi32(acc[0], _mm_madd_epi16(v, wk));
+            } else {
+                /* eight pairs, split into the two channels */
+                __m128i v = _mm_loadu_si128((const __m128i *)(s + k * 2));
+                acc[0] = _mm_add_epi32(acc[0], _mm_madd_epi16(_mm_and_si128(v, low), wk));
+                acc[1] = _mm_add_epi32(acc[1], _mm_madd_epi16(_mm_srli_epi16(v, 8), wk));
+            }
+        }
+        for (int c = 0; c < channels; c++) {
+            int sum = hsum_sse2(acc[c]);
+            for (int j = k; j < taps; j++)
+                sum += w[j] * s[j * channels + c];
+            *dst++ = (int16_t)((sum + (1 << (SCALE_H_SHIFT - 1))) >> SCALE_H_SHIFT);
+        }
+    }
+}
+
+static void vfilter_sse2(uint8_t *dst, const int16_t * const *rows,
+                         const int16_t *w, int taps, int n)
+{
+    const __m128i round = _mm_set1_epi32(1 << (SCALE_V_SHIFT - 1));
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i lo = round, hi = round;
+        /* taps in pairs, pmaddwd sums a row pair per 32-bit lane */
+        for (int k = 0; k < taps; k += 2) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(rows[k] + i));
+            __m128i b = zero;
+            int wb = 0;
+            if (k + 1 < taps) {
+                b = _mm_loadu_si128((const __m128i *)(rows[k + 1] + i));
+                wb = w[k + 1];
+            }
+            __m128i wp = _mm_set1_epi32((uint16_t)w[k] | ((uint32_t)(uint16_t)wb << 16));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wp));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wp));
+        }
+        lo = _mm_srai_epi32(lo, SCALE_V_SHIFT);
+        hi = _mm_srai_epi32(hi, SCALE_V_SHIFT);
+        __m128i r = _mm_packs_epi32(lo, hi);
+        _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(r, r));
+    }
+    for (; i < n; i++)
+        dst[i] = vfilter_one(rows, w, taps, i);
+}
+
+static const yuv_scale_kernels_t kernels_sse2 = { "sse2", hfilter_sse2, vfilter_sse2 };
+#endif
+
+/*******************************************************************
+ * runtime dispatch
+ *******************************************************************/
+
+static const yuv_scale_kernels_t *gKernels = &kernels_c;
+static pthread_once_t gKernelsOnce = PTHREAD_ONCE_INIT;
+
+#ifdef YUV_SCALE_NEON
+static bool cpu_has_neon(void)
+{
+#if defined(__aarch64__)
+    return true;
+#else
+    char line[512];
+    bool neon = false;
+    FILE *fp = fopen("/proc/cpuinfo", "r");
+
+    if (!fp)
+        return false;
+    while (!neon && fgets(line, sizeof(line), fp)) {
+        if (!strncmp(line, "Features", 8) && strstr(line, " neon"))
+            neon = true;
+    }
+    fclose(fp);
+    return neon;
+#endif
+}
+#endif
+
+static void select_kernels(void)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get("persist.camera.hal.scale.impl", value, "auto");
+    if (!strcmp(value, "c")) {
+        gKernels = &kernels_c;
+    } else {
+#if defined(YUV_SCALE_NEON)
+        if (cpu_has_neon())
+            gKernels = &kernels_neon;
+#elif defined(YUV_SCALE_SSE2)
+        gKernels = &kernels_sse2;
+#endif
+    }
+    ALOGI("%s: using %s kernels", __FUNCTION__, gKernels->name);
+}
+
+static inline const yuv_scale_kernels_t *kernels(void)
+{
+    pthread_once(&gKernelsOnce, select_kernels);
+    return gKernels;
+}
+
+const char *yuv_scale_impl_name(void)
+{
+    return kernels()->name;
+}
+
+/*******************************************************************
+ * tiled scaling
+ *******************************************************************/
+
+typedef struct {
+    const uint8_t *src;
+    int src_stride;
+    uint8_t *dst;
+    int dst_stride;
+    int dst_w;                  /* in elements */
+    int dst_h;
+    int channels;               /* 1 for luma, 2 for chroma pairs */
+    scale_axis_t x;
+    scale_axis_t y;
+    int tile_h;
+    int tiles_x;
+    int tiles;
+} scale_plane_t;
+
+typedef struct {
+    const yuv_scale_kernels_t *kernels;
+    scale_plane_t plane[2];
+    int tiles;
+    int tmp_rows;               /* most input rows a tile reads */
+    volatile int32_t next_tile;
+    volatile int32_t done_tiles;
+} scale_job_t;
+
+static void scale_tile(const scale_job_t *job, int tile, int16_t *tmp)
+{
+    const scale_plane_t *p = &job->plane[0];
+    const int16_t *rows[SCALE_MAX_TAPS];
+
+    if (tile >= p->tiles) {
+        tile -= p->tiles;
+        p = &job->plane[1];
+    }
+
+    int ox0 = tile % p->tiles_x * SCALE_TILE_W;
+    int oy0 = tile / p->tiles_x * p->tile_h;
+    int ox1 = ox0 + SCALE_TILE_W < p->dst_w ? ox0 + SCALE_TILE_W : p->dst_w;
+    int oy1 = oy0 + p->tile_h < p->dst_h ? oy0 + p->tile_h : p->dst_h;
+    int row = (ox1 - ox0) * p->channels;
+    int ry0 = p->y.start[oy0];
+    int ry1 = p->y.start[oy1 - 1] + p->y.taps;
+
+    for (int r = ry0; r < ry1; r++)
+        job->kernels->hfilter(tmp + (r - ry0) * row, p->src + r * p->src_stride,
+                              &p->x, ox0, ox1, p->channels);
+
+    for (int oy = oy0; oy < oy1; oy++) {
+        for (int k = 0; k < p->y.taps; k++)
+            rows[k] = tmp + (p->y.start[oy] + k - ry0) * row;
+        job->kernels->vfilter(p->dst + oy * p->dst_stride + ox0 * p->channels,
+                              rows, p->y.weights + oy * p->y.taps, p->y.taps, row);
+    }
+}
+
+static void scale_worker(void *arg)
+{
+    scale_job_t *job = (scale_job_t *)arg;
+    int16_t *tmp = (int16_t *)malloc(job->tmp_rows * SCALE_TILE_W * 2 * sizeof(int16_t));
+    int tile;
+
+    if (tmp == NULL)
+        return;
+    while ((tile = android_atomic_inc(&job->next_tile)) < job->tiles) {
+        scale_tile(job, tile, tmp);
+        android_atomic_inc(&job->done_tiles);
+    }
+    free(tmp);
+}
+
+static bool check_frames(const yuv_sp_frame_t *src, const yuv_sp_frame_t *dst,
+                         yuv_scale_filter_t filter)
+{
+    if (!src || !dst || !src->y || !src->uv || !dst->y || !dst->uv)
+        return false;
+    if (filter < 0 || filter >= YUV_SCALE_MAX)
+        return false;
+    if ((src->width | src->height | dst->width | dst->height) & 1)
+        return false;
+    return src->width > 0 && src->height > 0 && dst->width > 0 && dst->height > 0;
+}
+
+static void plane_init(scale_plane_t *p, const uint8_t *src, int src_stride,
+                       int src_h, uint8_t *dst, int dst_stride, int dst_w,
+                       int dst_h, int channels)
+{
+    /* Keep the input rows of a tile about SCALE_TILE_H when shrinking. */
+    int shrink = (src_h + dst_h - 1) / dst_h;
+
+    p->src = src;
+    p->src_stride = src_stride;
+    p->dst = dst;
+    p->dst_stride = dst_stride;
+    p->dst_w = dst_w;
+    p->dst_h = dst_h;
+    p->channels = channels;
+    p->tile_h = SCALE_TILE_H / shrink > 2 ? SCALE_TILE_H / shrink : 2;
+    p->tiles_x = (dst_w + SCALE_TILE_W - 1) / SCALE_TILE_W;
+    p->tiles = p->tiles_x * ((dst_h + p->tile_h - 1) / p->tile_h);
+}
+
+static void job_free(scale_job_t *job)
+{
+    for (int i = 0; i < 2; i++) {
+        axis_free(&job->plane[i].x);
+        axis_free(&job->plane[i].y);
+    }
+}
+
+static bool job_init(scale_job_t *job, const yuv_sp_frame_t *src,
+                     yuv_sp_frame_t *dst, yuv_scale_filter_t filter)
+{
+    memset(job, 0, sizeof(*job));
+    job->kernels = kernels();
+    plane_init(&job->plane[0], src->y, src->y_stride, src->height,
+               dst->y, dst->y_stride, dst->width, dst->height, 1);
+    plane_init(&job->plane[1], src->uv, src->uv_stride, src->height / 2,
+               dst->uv, dst->uv_stride, dst->width / 2, dst->height / 2, 2);
+
+    if (!axis_init(&job->plane[0].x, filter, src->width, dst->width) ||
+        !axis_init(&job->plane[0].y, filter, src->height, dst->height) ||
+        !axis_init(&job->plane[1].x, filter, src->width / 2, dst->width / 2) ||
+        !axis_init(&job->plane[1].y, filter, src->height / 2, dst->height / 2)) {
+        job_free(job);
+        return false;
+    }
+
+    job->tiles = job->plane[0].tiles + job->plane[1].tiles;
+    for (int i = 0; i < 2; i++) {
+        const scale_plane_t *p = &job->plane[i];
+        for (int oy0 = 0; oy0 < p->dst_h; oy0 += p->tile_h) {
+            int oy1 = oy0 + p->tile_h < p->dst_h ? oy0 + p->tile_h : p->dst_h;
+            int rows = p->y.start[oy1 - 1] + p->y.taps - p->y.start[oy0];
+            if (rows > job->tmp_rows)
+                job->tmp_rows = rows;
+        }
+    }
+    return true;
+}
+
+int yuv_scale(const yuv_sp_frame_t *src, yuv_sp_frame_t *dst,
+              yuv_scale_filter_t filter, int threads)
+{
+    scale_job_t job;
+
+    if (!check_frames(src, dst, filter)) {
+        ALOGE("%s: invalid frames for filter %d", __FUNCTION__, filter);
+        return -1;
+    }
+    if (!job_init(&job, src, dst, filter))
+        return -1;
+
+    if (threads <= 0)
+        threads = worker_pool_cpus();
+    if (threads > job.tiles)
+        threads = job.tiles;
+    worker_pool_run(scale_worker, &job, threads - 1);
+
+    int rc = job.done_tiles == job.tiles ? 0 : -1;
+    if (rc < 0)
+        ALOGE("%s: out of memory for the tile buffers", __FUNCTION__);
+    ALOGV("%s: %dx%d -> %dx%d %s, %d tiles", __FUNCTION__, src->width,
+          src->height, dst->width, dst->height, filters[filter].name, job.tiles);
+    job_free(&job);
+    return rc;
+}
+
+/*******************************************************************
+ * reference implementation
+ *******************************************************************/
+
+static bool plane_reference(const scale_plane_t *p, int src_h)
+{
+    int row = p->dst_w * p->channels;
+    int16_t *tmp = (int16_t *)malloc((size_t)src_h * row * sizeof(int16_t));
+    const int16_t *rows[SCALE_MAX_TAPS];
+
+    if (tmp == NULL)
+        return false;
+    for (int r = 0; r < src_h; r++)
+        hfilter_c(tmp + r * row, p->src + r * p->src_stride, &p->x,
+                0, p->dst_w, p->channels);
+    for (int oy = 0; oy < p->dst_h; oy++) {
+        for (int k = 0; k < p->y.taps; k++)
+            rows[k] = tmp + (p->y.start[oy] + k) * row;
+        vfilter_c(p->dst + oy * p->dst_stride, rows,
+                  p->y.weights + oy * p->y.taps, p->y.taps, row);
+    }
+    free(tmp);
+    return true;
+}
+
+int yuv_scale_reference(const yuv_sp_frame_t *src, yuv_sp_frame_t *dst,
+                        yuv_scale_filter_t filter)
+{
+    scale_job_t job;
+
+    if (!check_frames(src, dst, filter) || !job_init(&job, src, dst, filter))
+        return -1;
+
+    bool ok = plane_reference(&job.plane[0], src->height) &&
+              plane_reference(&job.plane[1], src->height / 2);
+    job_free(&job);
+    return ok ? 0 : -1;
+}
+
+}; // namespace android
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_YUV_SCALE_H
+#define ANDROID_HARDWARE_YUV_SCALE_H
+
+#include "YuvTransform.h"
+
+namespace android {
+
+/*
+ * Separable resampling of YUV420 semi-planar frames (NV21/NV12). Chroma
+ * pairs are filtered as two channels, so the chroma order is kept.
+ *
+ * Rows are filtered horizontally into a 16-bit intermediate and then
+ * vertically into the output. The output is cut into tiles small enough
+ * for a tile's intermediate rows to stay in the cache; the tiles are
+ * shared out among the worker pool threads.
+ */
+typedef enum {
+    YUV_SCALE_BILINEAR = 0,
+    YUV_SCALE_LANCZOS3,
+    YUV_SCALE_AREA,             /* box average over the covered inputs, for
+                                   shrinking by up to 63 */
+    YUV_SCALE_MAX
+} yuv_scale_filter_t;
+
+/* Parses "bilinear", "lanczos" or "area". */
+yuv_scale_filter_t yuv_scale_filter_from_string(const char *str,
+                                                yuv_scale_filter_t def);
+
+/*
+ * Scales src to the size of dst. The buffers must not overlap. Threads as
+ * for yuv_crop, 0 for one per online cpu.
+ * Returns 0 on success, -1 on invalid arguments or out of memory.
+ */
+int yuv_scale(const yuv_sp_frame_t *src, yuv_sp_frame_t *dst,
+              yuv_scale_filter_t filter, int threads);
+
+/* Untiled scalar implementation the vector kernels are checked against;
+ * the results are bit exact. */
+int yuv_scale_reference(const yuv_sp_frame_t *src, yuv_sp_frame_t *dst,
+                        yuv_scale_filter_t filter);
+
+/* Name of the kernel set picked at runtime ("neon", "sse2", "c"). */
+const char *yuv_scale_impl_name(void);
+
+}; // namespace android
+
+#endif // ANDROID_HARDWARE_YUV_SCALE_H
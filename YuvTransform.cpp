@@ -0,0 +1,988 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "YuvTransform"
+#include <utils/Log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <cutils/atomic.h>
+#include <cutils/properties.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define YUV_TRANSFORM_NEON 1
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#define YUV_TRANSFORM_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__) && !defined(__INTEL_COMPILER)
+#define YUV_TRANSFORM_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
+#include "YuvTransform.h"
+#include "WorkerPool.h"
+
+namespace android {
+
+/*
+ * Every transform is built from a few row/block primitives. The plane
+ * walkers below are shared by all implementations; only the primitives
+ * are replaced by the vector versions.
+ */
+typedef struct {
+    const char *name;
+    /* dst[i] = src[n - 1 - i] */
+    void (*reverse8)(uint8_t *dst, const uint8_t *src, int n);
+    void (*reverse16)(uint16_t *dst, const uint16_t *src, int n);
+    /* 8x8 block transpose: dst[i][j] = src[j][i] */
+    void (*transpose8)(uint8_t * const *dst, const uint8_t * const *src);
+    void (*transpose16)(uint16_t * const *dst, const uint16_t * const *src);
+    /* dst[i] = src[i], the rows don't overlap; keeps dst out of the cache
+     * where the cpu has stores for that */
+    void (*copy)(uint8_t *dst, const uint8_t *src, int n);
+} yuv_kernels_t;
+
+/*******************************************************************
+ * C kernels
+ *******************************************************************/
+
+static void reverse8_c(uint8_t *dst, const uint8_t *src, int n)
+{
+    const uint8_t *s = src + n - 1;
+    for (int i = 0; i < n; i++)
+        dst[i] = *s--;
+}
+
+static void reverse16_c(uint16_t *dst, const uint16_t *src, int n)
+{
+    const uint16_t *s = src + n - 1;
+    for (int i = 0; i < n; i++)
+        dst[i] = *s--;
+}
+
+static void transpose8_c(uint8_t * const *dst, const uint8_t * const *src)
+{
+    for (int i = 0; i < 8; i++)
+        for (int j = 0; j < 8; j++)
+            dst[i][j] = src[j][i];
+}
+
+static void transpose16_c(uint16_t * const *dst, const uint16_t * const *src)
+{
+    for (int i = 0; i < 8; i++)
+        for (int j = 0; j < 8; j++)
+            dst[i][j] = src[j][i];
+}
+
+static void copy_c(uint8_t *dst, const uint8_t *src, int n)
+{
+    memcpy(dst, src, n);
+}
+
+static const yuv_kernels_t kernels_c = {
+    "c", reverse8_c, reverse16_c, transpose8_c, transpose16_c, copy_c
+};
+
+/*******************************************************************
+ * NEON kernels
+ *******************************************************************/
+
+#ifdef YUV_TRANSFORM_NEON
+static void reverse8_neon(uint8_t *dst, const uint8_t *src, int n)
+{
+    const uint8_t *s = src + n;
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s -= 16;
+        uint8x16_t v = vrev64q_u8(vld1q_u8(s));
+        vst1q_u8(dst + i, vcombine_u8(vget_high_u8(v), vget_low_u8(v)));
+    }
+    reverse8_c(dst + i, src, n - i);
+}
+
+static void reverse16_neon(uint16_t *dst, const uint16_t *src, int n)
+{
+    const uint16_t *s = src + n;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s -= 8;
+        uint16x8_t v = vrev64q_u16(vld1q_u16(s));
+        vst1q_u16(dst + i, vcombine_u16(vget_high_u16(v), vget_low_u16(v)));
+    }
+    reverse16_c(dst + i, src, n - i);
+}
+
+static void transpose8_neon(uint8_t * const *dst, const uint8_t * const *src)
+{
+    uint8x8x2_t t0 = vtrn_u8(vld1_u8(src[0]), vld1_u8(src[1]));
+    uint8x8x2_t t1 = vtrn_u8(vld1_u8(src[2]), vld1_u8(src[3]));
+    uint8x8x2_t t2 = vtrn_u8(vld1_u8(src[4]), vld1_u8(src[5]));
+    uint8x8x2_t t3 = vtrn_u8(vld1_u8(src[6]), vld1_u8(src[7]));
+
+    uint16x4x2_t s0 = vtrn_u16(vreinterpret_u16_u8(t0.val[0]),
+                               vreinterpret_u16_u8(t1.val[0]));
+    uint16x4x2_t s1 = vtrn_u16(vreinterpret_u16_u8(t0.val[1]),
+                               vreinterpret_u16_u8(t1.val[1]));
+    uint16x4x2_t s2 = vtrn_u16(vreinterpret_u16_u8(t2.val[0]),
+                               vreinterpret_u16_u8(t3.val[0]));
+    uint16x4x2_t s3 = vtrn_u16(vreinterpret_u16_u8(t2.val[1]),
+                               vreinterpret_u16_u8(t3.val[1]));
+
+    uint32x2x2_t q0 = vtrn_u32(vreinterpret_u32_u16(s0.val[0]),
+                               vreinterpret_u32_u16(s2.val[0]));
+    uint32x2x2_t q1 = vtrn_u32(vreinterpret_u32_u16(s1.val[0]),
+                               vreinterpret_u32_u16(s3.val[0]));
+    uint32x2x2_t q2 = vtrn_u32(vreinterpret_u32_u16(s0.val[1]),
+                               vreinterpret_u32_u16(s2.val[1]));
+    uint32x2x2_t q3 = vtrn_u32(vreinterpret_u32_u16(s1.val[1]),
+                               vreinterpret_u32_u16(s3.val[1]));
+
+    vst1_u8(dst[0], vreinterpret_u8_u32(q0.val[0]));
+    vst1_u8(dst[1], vreinterpret_u8_u32(q1.val[0]));
+    vst1_u8(dst[2], vreinterpret_u8_u32(q2.val[0]));
+    vst1_u8(dst[3], vreinterpret_u8_u32(q3.val[0]));
+    vst1_u8(dst[4], vreinterpret_u8_u32(q0.val[1]));
+    vst1_u8(dst[5], vreinterpret_u8_u32(q1.val[1]));
+    vst1_u8(dst[6], vreinterpret_u8_u32(q2.val[1]));
+    vst1_u8(dst[7], vreinterpret_u8_u32(q3.val[1]));
+}
+
+static void transpose16_neon(uint16_t * const *dst, const uint16_t * const *src)
+{
+    uint16x8x2_t t0 = vtrnq_u16(vld1q_u16(src[0]), vld1q_u16(src[1]));
+    uint16x8x2_t t1 = vtrnq_u16(vld1q_u16(src[2]), vld1q_u16(src[3]));
+    uint16x8x2_t t2 = vtrnq_u16(vld1q_u16(src[4]), vld1q_u16(src[5]));
+    uint16x8x2_t t3 = vtrnq_u16(vld1q_u16(src[6]), vld1q_u16(src[7]));
+
+    uint32x4x2_t s0 = vtrnq_u32(vreinterpretq_u32_u16(t0.val[0]),
+                                vreinterpretq_u32_u16(t1.val[0]));
+    uint32x4x2_t s1 = vtrnq_u32(vreinterpretq_u32_u16(t0.val[1]),
+                                vreinterpretq_u32_u16(t1.val[1]));
+    uint32x4x2_t s2 = vtrnq_u32(vreinterpretq_u32_u16(t2.val[0]),
+                                vreinterpretq_u32_u16(t3.val[0]));
+    uint32x4x2_t s3 = vtrnq_u32(vreinterpretq_u32_u16(t2.val[1]),
+                                vreinterpretq_u32_u16(t3.val[1]));
+
+#define COMBINE_LOW(a, b) vreinterpretq_u16_u32(vcombine_u32(vget_low_u32(a), vget_low_u32(b)))
+#define COMBINE_HIGH(a, b) vreinterpretq_u16_u32(vcombine_u32(vget_high_u32(a), vget_high_u32(b)))
+    vst1q_u16(dst[0], COMBINE_LOW(s0.val[0], s2.val[0]));
+    vst1q_u16(dst[1], COMBINE_LOW(s1.val[0], s3.val[0]));
+    vst1q_u16(dst[2], COMBINE_LOW(s0.val[1], s2.val[1]));
+    vst1q_u16(dst[3], COMBINE_LOW(s1.val[1], s3.val[1]));
+    vst1q_u16(dst[4], COMBINE_HIGH(s0.val[0], s2.val[0]));
+    vst1q_u16(dst[5], COMBINE_HIGH(s1.val[0], s3.val[0]));
+    vst1q_u16(dst[6], COMBINE_HIGH(s0.val[1], s2.val[1]));
+    vst1q_u16(dst[7], COMBINE_HIGH(s1.val[1], s3.val[1]));
+#undef COMBINE_LOW
+#undef COMBINE_HIGH
+}
+
+/* ARMv7 has no non-temporal stores; wide loads and stores with the
+ * source prefetched ahead still beat a byte-aligned memcpy on A8/Scorpion. */
+static void copy_neon(uint8_t *dst, const uint8_t *src, int n)
+{
+    int i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __builtin_prefetch(src + i + 256);
+        uint8x16_t a = vld1q_u8(src + i);
+        uint8x16_t b = vld1q_u8(src + i + 16);
+        uint8x16_t c = vld1q_u8(src + i + 32);
+        uint8x16_t d = vld1q_u8(src + i + 48);
+        vst1q_u8(dst + i, a);
+        vst1q_u8(dst + i + 16, b);
+        vst1q_u8(dst + i + 32, c);
+        vst1q_u8(dst + i + 48, d);
+    }
+    memcpy(dst + i, src + i, n - i);
+}
+
+static const yuv_kernels_t kernels_neon = {
+    "neon", reverse8_neon, reverse16_neon, transpose8_neon, transpose16_neon,
+    copy_neon
+};
+#endif
+
+/*******************************************************************
+ * SSE2 / AVX2 kernels
+ *******************************************************************/
+
+#ifdef YUV_TRANSFORM_SSE2
+static inline __m128i reverse16x8_sse2(__m128i v)
+{
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+static void reverse8_sse2(uint8_t *dst, const uint8_t *src, int n)
+{
+    const uint8_t *s = src + n;
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s -= 16;
+        __m128i v = reverse16x8_sse2(_mm_loadu_si128((const __m128i *)s));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+    }
+    reverse8_c(dst + i, src, n - i);
+}
+
+static void reverse16_sse2(uint16_t *dst, const uint16_t *src, int n)
+{
+    const uint16_t *s = src + n;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s -= 8;
+        __m128i v = reverse16x8_sse2(_mm_loadu_si128((const __m128i *)s));
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+    }
+    reverse16_c(dst + i, src, n - i);
+}
+
+static void transpose8_sse2(uint8_t * const *dst, const uint8_t * const *src)
+{
+    __m128i a01 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)src[0]),
+                                    _mm_loadl_epi64((const __m128i *)src[1]));
+    __m128i a23 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)src[2]),
+                                    _mm_loadl_epi64((const __m128i *)src[3]));
+    __m128i a45 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)src[4]),
+                                    _mm_loadl_epi64((const __m128i *)src[5]));
+    __m128i a67 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)src[6]),
+                                    _mm_loadl_epi64((const __m128i *)src[7]));
+
+    __m128i b0 = _mm_unpacklo_epi16(a01, a23);
+    __m128i b1 = _mm_unpackhi_epi16(a01, a23);
+    __m128i b2 = _mm_unpacklo_epi16(a45, a67);
+    __m128i b3 = _mm_unpackhi_epi16(a45, a67);
+
+    __m128i c0 = _mm_unpacklo_epi32(b0, b2);
+    __m128i c1 = _mm_unpackhi_epi32(b0, b2);
+    __m128i c2 = _mm_unpacklo_epi32(b1, b3);
+    __m128i c3 = _mm_unpackhi_epi32(b1, b3);
+
+    _mm_storel_epi64((__m128i *)dst[0], c0);
+    _mm_storel_epi64((__m128i *)dst[1], _mm_unpackhi_epi64(c0, c0));
+    _mm_storel_epi64((__m128i *)dst[2], c1);
+    _mm_storel_epi64((__m128i *)dst[3], _mm_unpackhi_epi64(c1, c1));
+    _mm_storel_epi64((__m128i *)dst[4], c2);
+    _mm_storel_epi64((__m128i *)dst[5], _mm_unpackhi_epi64(c2, c2));
+    _mm_storel_epi64((__m128i *)dst[6], c3);
+    _mm_storel_epi64((__m128i *)dst[7], _mm_unpackhi_epi64(c3, c3));
+}
+
+static void transpose16_sse2(uint16_t * const *dst, const uint16_t * const *src)
+{
+    __m128i r[8];
+    for (int i = 0; i < 8; i++)
+        r[i] = _mm_loadu_si128((const __m128i *)src[i]);
+
+    __m128i t0 = _mm_unpacklo_epi16(r[0], r[1]);
+    __m128i t1 = _mm_unpackhi_epi16(r[0], r[1]);
+    __m128i t2 = _mm_unpacklo_epi16(r[2], r[3]);
+    __m128i t3 = _mm_unpackhi_epi16(r[2], r[3]);
+    __m128i t4 = _mm_unpacklo_epi16(r[4], r[5]);
+    __m128i t5 = _mm_unpackhi_epi16(r[4], r[5]);
+    __m128i t6 = _mm_unpacklo_epi16(r[6], r[7]);
+    __m128i t7 = _mm_unpackhi_epi16(r[6], r[7]);
+
+    __m128i u0 = _mm_unpacklo_epi32(t0, t2);
+    __m128i u1 = _mm_unpackhi_epi32(t0, t2);
+    __m128i u2 = _mm_unpacklo_epi32(t1, t3);
+    __m128i u3 = _mm_unpackhi_epi32(t1, t3);
+    __m128i u4 = _mm_unpacklo_epi32(t4, t6);
+    __m128i u5 = _mm_unpackhi_epi32(t4, t6);
+    __m128i u6 = _mm_unpacklo_epi32(t5, t7);
+    __m128i u7 = _mm_unpackhi_epi32(t5, t7);
+
+    _mm_storeu_si128((__m128i *)dst[0], _mm_unpacklo_epi64(u0, u4));
+    _mm_storeu_si128((__m128i *)dst[1], _mm_unpackhi_epi64(u0, u4));
+    _mm_storeu_si128((__m128i *)dst[2], _mm_unpacklo_epi64(u1, u5));
+    _mm_storeu_si128((__m128i *)dst[3], _mm_unpackhi_epi64(u1, u5));
+    _mm_storeu_si128((__m128i *)dst[4], _mm_unpacklo_epi64(u2, u6));
+    _mm_storeu_si128((__m128i *)dst[5], _mm_unpackhi_epi64(u2, u6));
+    _mm_storeu_si128((__m128i *)dst[6], _mm_unpacklo_epi64(u3, u7));
+    _mm_storeu_si128((__m128i *)dst[7], _mm_unpackhi_epi64(u3, u7));
+}
+
+static void copy_sse2(uint8_t *dst, const uint8_t *src, int n)
+{
+    int head = (16 - ((uintptr_t)dst & 15)) & 15;
+
+    if (n < head + 64) {
+        memcpy(dst, src, n);
+        return;
+    }
+    memcpy(dst, src, head);
+    int i = head;
+    for (; i + 64 <= n; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + i + 48));
+        _mm_stream_si128((__m128i *)(dst + i), a);
+        _mm_stream_si128((__m128i *)(dst + i + 16), b);
+        _mm_stream_si128((__m128i *)(dst + i + 32), c);
+        _mm_stream_si128((__m128i *)(dst + i + 48), d);
+    }
+    _mm_sfence();
+    memcpy(dst + i, src + i, n - i);
+}
+
+static const yuv_kernels_t kernels_sse2 = {
+    "sse2", reverse8_sse2, reverse16_sse2, transpose8_sse2, transpose16_sse2,
+    copy_sse2
+};
+
+#ifdef YUV_TRANSFORM_AVX2
+__attribute__((target("avx2")))
+static void reverse8_avx2(uint8_t *dst, const uint8_t *src, int n)
+{
+    const __m256i mask = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+                                          7, 6, 5, 4, 3, 2, 1, 0,
+                                          15, 14, 13, 12, 11, 10, 9, 8,
+                                          7, 6, 5, 4, 3, 2, 1, 0);
+    const uint8_t *s = src + n;
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        s -= 32;
+        __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)s), mask);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute2x128_si256(v, v, 0x01));
+    }
+    reverse8_sse2(dst + i, src, n - i);
+}
+
+__attribute__((target("avx2")))
+static void reverse16_avx2(uint16_t *dst, const uint16_t *src, int n)
+{
+    const __m256i mask = _mm256_setr_epi8(14, 15, 12, 13, 10, 11, 8, 9,
+                                          6, 7, 4, 5, 2, 3, 0, 1,
+                                          14, 15, 12, 13, 10, 11, 8, 9,
+                                          6, 7, 4, 5, 2, 3, 0, 1);
+    const uint16_t *s = src + n;
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s -= 16;
+        __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)s), mask);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute2x128_si256(v, v, 0x01));
+    }
+    reverse16_sse2(dst + i, src, n - i);
+}
+
+/* Transposes are latency bound on the 8x8 shuffles, the SSE2 ones are
+ * as fast as a 256-bit variant would be. */
+static const yuv_kernels_t kernels_avx2 = {
+    "avx2", reverse8_avx2, reverse16_avx2, transpose8_sse2, transpose16_sse2,
+    copy_sse2
+};
+#endif
+#endif
+
+/*******************************************************************
+ * runtime dispatch
+ *******************************************************************/
+
+static const yuv_kernels_t *gKernels = &kernels_c;
+static pthread_once_t gKernelsOnce = PTHREAD_ONCE_INIT;
+
+#ifdef YUV_TRANSFORM_NEON
+static bool cpu_has_neon(void)
+{
+#if defined(__aarch64__)
+    return true;
+#else
+    char line[512];
+    bool neon = false;
+    FILE *fp = fopen("/proc/cpuinfo", "r");
+
+    if (!fp)
+        return false;
+    while (!neon && fgets(line, sizeof(line), fp)) {
+        if (!strncmp(line, "Features", 8) && strstr(line, " neon"))
+            neon = true;
+    }
+    fclose(fp);
+    return neon;
+#endif
+}
+#endif
+
+static void select_kernels(void)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    /* "c" forces the plain kernels, handy to compare against the vector ones */
+    property_get("persist.camera.hal.transform.impl", value, "auto");
+    if (!strcmp(value, "c")) {
+        gKernels = &kernels_c;
+    } else {
+#if defined(YUV_TRANSFORM_NEON)
+        if (cpu_has_neon())
+            gKernels = &kernels_neon;
+#elif defined(YUV_TRANSFORM_SSE2)
+        gKernels = &kernels_sse2;
+#ifdef YUV_TRANSFORM_AVX2
+        if (strcmp(value, "sse2") && __builtin_cpu_supports("avx2"))
+            gKernels = &kernels_avx2;
+#endif
+#endif
+    }
+    ALOGI("%s: using %s kernels", __FUNCTION__, gKernels->name);
+}
+
+static inline const yuv_kernels_t *kernels(void)
+{
+    pthread_once(&gKernelsOnce, select_kernels);
+    return gKernels;
+}
+
+const char *yuv_transform_impl_name(void)
+{
+    return kernels()->name;
+}
+
+/*******************************************************************
+ * plane walkers
+ *******************************************************************/
+
+/* Copies rows, optionally in reverse order. */
+static void plane_copy(uint8_t *dst, int dst_stride,
+                       const uint8_t *src, int src_stride,
+                       int row_bytes, int rows, bool flip)
+{
+    if (!flip && dst_stride == row_bytes && src_stride == row_bytes) {
+        memcpy(dst, src, row_bytes * rows);
+        return;
+    }
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *s = src + (flip ? rows - 1 - r : r) * src_stride;
+        memcpy(dst + r * dst_stride, s, row_bytes);
+    }
+}
+
+/* Reverses every row, optionally also the order of rows (180 rotation). */
+static void plane_mirror(const yuv_kernels_t *k, uint8_t *dst, int dst_stride,
+                         const uint8_t *src, int src_stride,
+                         int width, int rows, int bpp, bool flip)
+{
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *s = src + (flip ? rows - 1 - r : r) * src_stride;
+        uint8_t *d = dst + r * dst_stride;
+        if (bpp == 1)
+            k->reverse8(d, s, width);
+        else
+            k->reverse16((uint16_t *)d, (const uint16_t *)s, width);
+    }
+}
+
+template <typename T>
+static void rotate_block_c(T *dst, int dst_stride, const T *src, int src_stride,
+                           int width, int height, int r0, int r1, int c0, int c1,
+                           bool clockwise)
+{
+    /* strides are in elements here */
+    for (int r = r0; r < r1; r++) {
+        T *d = dst + r * dst_stride;
+        for (int c = c0; c < c1; c++) {
+            if (clockwise)
+                d[c] = src[(height - 1 - c) * src_stride + r];
+            else
+                d[c] = src[c * src_stride + (width - 1 - r)];
+        }
+    }
+}
+
+/*
+ * Rotates a plane of width x height elements by 90 degrees. The output is
+ * height x width. Full 8x8 tiles go through the transpose kernel with the
+ * row order picked so that the transpose becomes a rotation, the borders
+ * are done element by element.
+ */
+template <typename T>
+static void plane_rotate(void (*transpose)(T * const *, const T * const *),
+                         uint8_t *dst8, int dst_stride,
+                         const uint8_t *src8, int src_stride,
+                         int width, int height, bool clockwise)
+{
+    T *dst = (T *)dst8;
+    const T *src = (const T *)src8;
+    int ds = dst_stride / sizeof(T);
+    int ss = src_stride / sizeof(T);
+    int out_w = height;
+    int out_h = width;
+    int full_w = out_w & ~7;
+    int full_h = out_h & ~7;
+    T *d[8];
+    const T *s[8];
+
+    for (int r0 = 0; r0 < full_h; r0 += 8) {
+        for (int c0 = 0; c0 < full_w; c0 += 8) {
+            for (int j = 0; j < 8; j++) {
+                if (clockwise) {
+                    s[j] = src + (height - 1 - c0 - j) * ss + r0;
+                    d[j] = dst + (r0 + j) * ds + c0;
+                } else {
+                    s[j] = src + (c0 + j) * ss + (width - 8 - r0);
+                    d[j] = dst + (r0 + 7 - j) * ds + c0;
+                }
+            }
+            transpose(d, s);
+        }
+        rotate_block_c(dst, ds, src, ss, width, height,
+                       r0, r0 + 8, full_w, out_w, clockwise);
+    }
+    rotate_block_c(dst, ds, src, ss, width, height,
+                   full_h, out_h, 0, out_w, clockwise);
+}
+
+static bool check_frames(const yuv_sp_frame_t *src, const yuv_sp_frame_t *dst,
+                         yuv_transform_t transform)
+{
+    if (!src || !dst || !src->y || !src->uv || !dst->y || !dst->uv)
+        return false;
+    if (transform < YUV_TRANSFORM_NONE || transform >= YUV_TRANSFORM_MAX)
+        return false;
+    if ((src->width | src->height) & 1)
+        return false;
+    if (yuv_transform_swaps_dimensions(transform))
+        return dst->width == src->height && dst->height == src->width;
+    return dst->width == src->width && dst->height == src->height;
+}
+
+int yuv_transform(const yuv_sp_frame_t *src, yuv_sp_frame_t *dst,
+                  yuv_transform_t transform)
+{
+    const yuv_kernels_t *k = kernels();
+    int w = src ? src->width : 0;
+    int h = src ? src->height : 0;
+
+    if (!check_frames(src, dst, transform)) {
+        ALOGE("%s: invalid frames for transform %d", __FUNCTION__, transform);
+        return -1;
+    }
+
+    switch (transform) {
+    case YUV_TRANSFORM_NONE:
+    case YUV_TRANSFORM_FLIP: {
+        bool flip = transform == YUV_TRANSFORM_FLIP;
+        plane_copy(dst->y, dst->y_stride, src->y, src->y_stride, w, h, flip);
+        plane_copy(dst->uv, dst->uv_stride, src->uv, src->uv_stride, w, h / 2, flip);
+        break;
+    }
+    case YUV_TRANSFORM_MIRROR:
+    case YUV_TRANSFORM_ROT_180: {
+        bool flip = transform == YUV_TRANSFORM_ROT_180;
+        plane_mirror(k, dst->y, dst->y_stride, src->y, src->y_stride, w, h, 1, flip);
+        plane_mirror(k, dst->uv, dst->uv_stride, src->uv, src->uv_stride,
+                     w / 2, h / 2, 2, flip);
+        break;
+    }
+    case YUV_TRANSFORM_ROT_90:
+    case YUV_TRANSFORM_ROT_270: {
+        bool cw = transform == YUV_TRANSFORM_ROT_90;
+        plane_rotate<uint8_t>(k->transpose8, dst->y, dst->y_stride,
+                              src->y, src->y_stride, w, h, cw);
+        plane_rotate<uint16_t>(k->transpose16, dst->uv, dst->uv_stride,
+                               src->uv, src->uv_stride, w / 2, h / 2, cw);
+        break;
+    }
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+/*******************************************************************
+ * reference implementation
+ *******************************************************************/
+
+/* Source coordinates of output element (x, y) in a w x h plane. */
+static inline void map_reference(yuv_transform_t transform, int w, int h,
+                                 int x, int y, int *sx, int *sy)
+{
+    switch (transform) {
+    case YUV_TRANSFORM_MIRROR:  *sx = w - 1 - x; *sy = y;         break;
+    case YUV_TRANSFORM_FLIP:    *sx = x;         *sy = h - 1 - y; break;
+    case YUV_TRANSFORM_ROT_180: *sx = w - 1 - x; *sy = h - 1 - y; break;
+    case YUV_TRANSFORM_ROT_90:  *sx = y;         *sy = h - 1 - x; break;
+    case YUV_TRANSFORM_ROT_270: *sx = w - 1 - y; *sy = x;         break;
+    default:                    *sx = x;         *sy = y;         break;
+    }
+}
+
+int yuv_transform_reference(const yuv_sp_frame_t *src, yuv_sp_frame_t *dst,
+                            yuv_transform_t transform)
+{
+    int sx, sy;
+
+    if (!check_frames(src, dst, transform))
+        return -1;
+
+    for (int y = 0; y < dst->height; y++) {
+        for (int x = 0; x < dst->width; x++) {
+            map_reference(transform, src->width, src->height, x, y, &sx, &sy);
+            dst->y[y * dst->y_stride + x] = src->y[sy * src->y_stride + sx];
+        }
+    }
+    for (int y = 0; y < dst->height / 2; y++) {
+        for (int x = 0; x < dst->width / 2; x++) {
+            map_reference(transform, src->width / 2, src->height / 2,
+                          x, y, &sx, &sy);
+            const uint8_t *s = src->uv + sy * src->uv_stride + sx * 2;
+            uint8_t *d = dst->uv + y * dst->uv_stride + x * 2;
+            d[0] = s[0];
+            d[1] = s[1];
+        }
+    }
+    return 0;
+}
+
+/*******************************************************************
+ * crop
+ *******************************************************************/
+
+/*
+ * A crop is a list of row copies, luma rows first, then chroma rows. In
+ * place the destination rows overlap source rows still to be read, so
+ * rows go in waves: a wave takes every row whose destination covers no
+ * unread source row except its own, and its rows are shared out among
+ * the threads. Rows further down move at least as far as the ones above
+ * them, so every wave frees room for the next and a zoomed picture takes
+ * one wave or a few.
+ */
+typedef struct {
+    const uint8_t *src;         /* first source row */
+    uint8_t *dst;
+    int src_stride;
+    int dst_stride;
+    int row_bytes;
+    int rows;
+} crop_plane_t;
+
+typedef struct {
+    const yuv_kernels_t *kernels;
+    crop_plane_t plane[2];
+    int *wave;                  /* rows of the current wave */
+    int count;
+    volatile int32_t next;
+} crop_job_t;
+
+#define CROP_ROWS_PER_TAKE 4
+#define CROP_BYTES_PER_THREAD (64 * 1024)
+
+static inline const crop_plane_t *crop_row(const crop_job_t *job, int row,
+                                           int *r)
+{
+    if (row < job->plane[0].rows) {
+        *r = row;
+        return &job->plane[0];
+    }
+    *r = row - job->plane[0].rows;
+    return &job->plane[1];
+}
+
+static inline intptr_t floor_div(intptr_t a, intptr_t b)
+{
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+/*
+ * Whether the destination of row can be written while the rows not yet
+ * done are still to be read. Row bytes never exceed a stride, so the
+ * destination meets at most two source rows of a plane.
+ */
+static bool crop_row_ready(const crop_job_t *job, const uint8_t *done, int row)
+{
+    int r;
+    const crop_plane_t *p = crop_row(job, row, &r);
+    const uint8_t *d = p->dst + r * p->dst_stride;
+
+    for (int i = 0; i < 2; i++) {
+        const crop_plane_t *q = &job->plane[i];
+        int first = i == 0 ? 0 : job->plane[0].rows;
+        intptr_t off = d - q->src;
+        intptr_t s = floor_div(off, q->src_stride);
+
+        /* row s starts at or before d, row s + 1 after it */
+        if (s >= 0 && s < q->rows && off < s * q->src_stride + q->row_bytes &&
+            first + s != row && !done[first + s])
+            return false;
+        s++;
+        if (s >= 0 && s < q->rows && off + p->row_bytes > s * q->src_stride &&
+            first + s != row && !done[first + s])
+            return false;
+    }
+    return true;
+}
+
+static void crop_copy_row(const crop_job_t *job, int row)
+{
+    int r;
+    const crop_plane_t *p = crop_row(job, row, &r);
+    const uint8_t *s = p->src + r * p->src_stride;
+    uint8_t *d = p->dst + r * p->dst_stride;
+
+    /* a row may still overlap its own source */
+    if (d + p->row_bytes > s && s + p->row_bytes > d)
+        memmove(d, s, p->row_bytes);
+    else
+        job->kernels->copy(d, s, p->row_bytes);
+}
+
+static void crop_worker(void *arg)
+{
+    crop_job_t *job = (crop_job_t *)arg;
+    int i;
+
+    while ((i = android_atomic_add(CROP_ROWS_PER_TAKE, &job->next)) < job->count) {
+        int end = i + CROP_ROWS_PER_TAKE < job->count ? i + CROP_ROWS_PER_TAKE : job->count;
+        for (; i < end; i++)
+            crop_copy_row(job, job->wave[i]);
+    }
+}
+
+/* Last resort should no row be ready: stage the remaining sources. */
+static int crop_staged(const crop_job_t *job, const int *rows, int count)
+{
+    int r;
+    size_t size = 0;
+
+    for (int i = 0; i < count; i++)
+        size += crop_row(job, rows[i], &r)->row_bytes;
+    uint8_t *tmp = (uint8_t *)malloc(size);
+    if (tmp == NULL)
+        return -1;
+
+    uint8_t *t = tmp;
+    for (int i = 0; i < count; i++) {
+        const crop_plane_t *p = crop_row(job, rows[i], &r);
+        memcpy(t, p->src + r * p->src_stride, p->row_bytes);
+        t += p->row_bytes;
+    }
+    t = tmp;
+    for (int i = 0; i < count; i++) {
+        const crop_plane_t *p = crop_row(job, rows[i], &r);
+        memcpy(p->dst + r * p->dst_stride, t, p->row_bytes);
+        t += p->row_bytes;
+    }
+    free(tmp);
+    return 0;
+}
+
+static bool check_crop(const yuv_sp_frame_t *src, const yuv_sp_frame_t *dst,
+                       int x, int y)
+{
+    if (!src || !dst || !src->y || !src->uv || !dst->y || !dst->uv)
+        return false;
+    if ((x | y | dst->width | dst->height) & 1)
+        return false;
+    if (x < 0 || y < 0 || dst->width <= 0 || dst->height <= 0)
+        return false;
+    if (x + dst->width > src->width || y + dst->height > src->height)
+        return false;
+    return dst->y_stride >= dst->width && dst->uv_stride >= dst->width &&
+           src->y_stride >= src->width && src->uv_stride >= src->width;
+}
+
+int yuv_crop(const yuv_sp_frame_t *src, yuv_sp_frame_t *dst, int x, int y,
+             int threads)
+{
+    crop_job_t job;
+    int rc = 0;
+
+    if (!check_crop(src, dst, x, y)) {
+        ALOGE("%s: invalid frames for a crop at %d,%d", __FUNCTION__, x, y);
+        return -1;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.kernels = kernels();
+    job.plane[0].src = src->y + y * src->y_stride + x;
+    job.plane[0].dst = dst->y;
+    job.plane[0].src_stride = src->y_stride;
+    job.plane[0].dst_stride = dst->y_stride;
+    job.plane[0].row_bytes = dst->width;
+    job.plane[0].rows = dst->height;
+    job.plane[1].src = src->uv + y / 2 * src->uv_stride + x;
+    job.plane[1].dst = dst->uv;
+    job.plane[1].src_stride = src->uv_stride;
+    job.plane[1].dst_stride = dst->uv_stride;
+    job.plane[1].row_bytes = dst->width;
+    job.plane[1].rows = dst->height / 2;
+
+    if (threads <= 0)
+        threads = worker_pool_cpus();
+
+    int total = job.plane[0].rows + job.plane[1].rows;
+    int *pending = (int *)malloc(2 * total * sizeof(int));
+    uint8_t *done = (uint8_t *)calloc(total, 1);
+    if (pending == NULL || done == NULL) {
+        free(pending);
+        free(done);
+        return -1;
+    }
+    job.wave = pending + total;
+
+    int left = total;
+    for (int i = 0; i < total; i++)
+        pending[i] = i;
+
+    int waves = 0;
+    while (left > 0) {
+        int still = 0;
+
+        job.count = 0;
+        for (int i = 0; i < left; i++) {
+            if (crop_row_ready(&job, done, pending[i]))
+                job.wave[job.count++] = pending[i];
+            else
+                pending[still++] = pending[i];
+        }
+        if (job.count == 0) {
+            ALOGE("%s: no row can move, staging %d rows", __FUNCTION__, left);
+            rc = crop_staged(&job, pending, left);
+            break;
+        }
+
+        int helpers = job.count * dst->width / CROP_BYTES_PER_THREAD;
+        if (helpers > threads)
+            helpers = threads;
+        if (helpers < 1)
+            helpers = 1;
+        job.next = 0;
+        worker_pool_run(crop_worker, &job, helpers - 1);
+
+        for (int i = 0; i < job.count; i++)
+            done[job.wave[i]] = 1;
+        left = still;
+        waves++;
+    }
+    ALOGV("%s: %dx%d at %d,%d in %d waves", __FUNCTION__, dst->width,
+          dst->height, x, y, waves);
+
+    free(pending);
+    free(done);
+    return rc;
+}
+
+int yuv_crop_reference(const yuv_sp_frame_t *src, yuv_sp_frame_t *dst,
+                       int x, int y)
+{
+    if (!check_crop(src, dst, x, y))
+        return -1;
+
+    int ysize = dst->width * dst->height;
+    uint8_t *tmp = (uint8_t *)malloc(ysize + ysize / 2);
+    if (tmp == NULL)
+        return -1;
+
+    for (int r = 0; r < dst->height; r++)
+        memcpy(tmp + r * dst->width, src->y + (y + r) * src->y_stride + x,
+               dst->width);
+    for (int r = 0; r < dst->height / 2; r++)
+        memcpy(tmp + ysize + r * dst->width,
+               src->uv + (y / 2 + r) * src->uv_stride + x, dst->width);
+
+    for (int r = 0; r < dst->height; r++)
+        memcpy(dst->y + r * dst->y_stride, tmp + r * dst->width, dst->width);
+    for (int r = 0; r < dst->height / 2; r++)
+        memcpy(dst->uv + r * dst->uv_stride, tmp + ysize + r * dst->width,
+               dst->width);
+    free(tmp);
+    return 0;
+}
+
+/*******************************************************************
+ * helpers
+ *******************************************************************/
+
+void yuv_sp_frame_init(yuv_sp_frame_t *frame, void *base,
+                       int width, int height, int stride)
+{
+    frame->y = (uint8_t *)base;
+    frame->uv = frame->y + stride * height;
+    frame->width = width;
+    frame->height = height;
+    frame->y_stride = stride;
+    frame->uv_stride = stride;
+}
+
+bool yuv_transform_swaps_dimensions(yuv_transform_t transform)
+{
+    return transform == YUV_TRANSFORM_ROT_90 || transform == YUV_TRANSFORM_ROT_270;
+}
+
+static const struct {
+    const char *name;
+    yuv_transform_t transform;
+} transform_names[] = {
+    { "none",   YUV_TRANSFORM_NONE },
+    { "mirror", YUV_TRANSFORM_MIRROR },
+    { "flip",   YUV_TRANSFORM_FLIP },
+    { "rot180", YUV_TRANSFORM_ROT_180 },
+    { "rot90",  YUV_TRANSFORM_ROT_90 },
+    { "rot270", YUV_TRANSFORM_ROT_270 },
+};
+
+yuv_transform_t yuv_transform_from_string(const char *str, yuv_transform_t def)
+{
+    if (!str)
+        return def;
+    for (size_t i = 0; i < sizeof(transform_names) / sizeof(transform_names[0]); i++) {
+        if (!strcmp(str, transform_names[i].name))
+            return transform_names[i].transform;
+    }
+    return def;
+}
+
+void yuv_transform_rect(yuv_transform_t transform, int width, int height,
+                        int *x, int *y, int *w, int *h)
+{
+    int rx = *x, ry = *y, rw = *w, rh = *h;
+
+    switch (transform) {
+    case YUV_TRANSFORM_MIRROR:
+        *x = width - rx - rw;
+        break;
+    case YUV_TRANSFORM_FLIP:
+        *y = height - ry - rh;
+        break;
+    case YUV_TRANSFORM_ROT_180:
+        *x = width - rx - rw;
+        *y = height - ry - rh;
+        break;
+    case YUV_TRANSFORM_ROT_90:
+        *x = height - ry - rh;
+        *y = rx;
+        *w = rh;
+        *h = rw;
+        break;
+    case YUV_TRANSFORM_ROT_270:
+        *x = ry;
+        *y = width - rx - rw;
+        *w = rh;
+        *h = rw;
+        break;
+    default:
+        break;
+    }
+}
+
+}; // namespace android
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_YUV_TRANSFORM_H
+#define ANDROID_HARDWARE_YUV_TRANSFORM_H
+
+#include <stdint.h>
+
+namespace android {
+
+/*
+ * Geometric transforms for YUV420 semi-planar frames (NV21/NV12).
+ *
+ * The chroma plane is treated as an array of 16-bit CbCr/CrCb pairs, so
+ * every transform keeps the chroma order of the source and the same code
+ * handles both NV21 and NV12.
+ */
+typedef enum {
+    YUV_TRANSFORM_NONE = 0,
+    YUV_TRANSFORM_MIRROR,       /* horizontal mirror */
+    YUV_TRANSFORM_FLIP,         /* vertical flip */
+    YUV_TRANSFORM_ROT_180,
+    YUV_TRANSFORM_ROT_90,       /* clockwise */
+    YUV_TRANSFORM_ROT_270,
+    YUV_TRANSFORM_MAX
+} yuv_transform_t;
+
+typedef struct {
+    uint8_t *y;
+    uint8_t *uv;
+    int width;          /* luma width in pixels, must be even */
+    int height;         /* luma height in pixels, must be even */
+    int y_stride;       /* bytes per luma row */
+    int uv_stride;      /* bytes per chroma row */
+} yuv_sp_frame_t;
+
+/* Fills a frame descriptor for a contiguous buffer with the chroma plane
+ * right after the luma plane. */
+void yuv_sp_frame_init(yuv_sp_frame_t *frame, void *base,
+                       int width, int height, int stride);
+
+/* Returns true when the transform swaps width and height of the output. */
+bool yuv_transform_swaps_dimensions(yuv_transform_t transform);
+
+/* Parses "none", "mirror", "flip", "rot180", "rot90" or "rot270". */
+yuv_transform_t yuv_transform_from_string(const char *str,
+                                          yuv_transform_t def);
+
+/* Maps a rectangle given in source coordinates into the transformed frame. */
+void yuv_transform_rect(yuv_transform_t transform, int width, int height,
+                        int *x, int *y, int *w, int *h);
+
+/*
+ * Applies the transform from src into dst. The buffers must not overlap
+ * and dst must have the (possibly swapped) output dimensions.
+ * Returns 0 on success, -1 on invalid arguments.
+ */
+int yuv_transform(const yuv_sp_frame_t *src, yuv_sp_frame_t *dst,
+                  yuv_transform_t transform);
+
+/* Pixel-by-pixel implementation the vector kernels are checked against. */
+int yuv_transform_reference(const yuv_sp_frame_t *src, yuv_sp_frame_t *dst,
+                            yuv_transform_t transform);
+
+/*
+ * Copies the dst->width x dst->height rectangle at (x, y) of src into dst.
+ * x and y must be even. dst may live in the same buffer as src and overlap
+ * it, e.g. to crop a picture in place. The rows are split over up to
+ * threads threads, 0 for one per online cpu.
+ * Returns 0 on success, -1 on invalid arguments or out of memory.
+ */
+int yuv_crop(const yuv_sp_frame_t *src, yuv_sp_frame_t *dst, int x, int y,
+             int threads);
+
+/* Row by row crop through a scratch copy, to check yuv_crop against. */
+int yuv_crop_reference(const yuv_sp_frame_t *src, yuv_sp_frame_t *dst,
+                       int x, int y);
+
+/* Name of the kernel set picked at runtime ("neon", "avx2", "sse2", "c"). */
+const char *yuv_transform_impl_name(void);
+
+}; // namespace android
+
+#endif // ANDROID_HARDWARE_YUV_TRANSFORM_H
@@ -23,6 +23,7 @@
 //#define DUMP_PARAMS 1   /* dump parameteters after get/set operation */
 
 #define MAX_CAMERAS_SUPPORTED 2
+#define MAX_MAPPED_HEAPS 8
 #define GRALLOC_USAGE_PMEM_PRIVATE_ADSP GRALLOC_USAGE_PRIVATE_0
 
 #include <fcntl.h>
@@ -31,21 +32,31 @@
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include <cutils/log.h>
+#include <cutils/native_handle.h>
 #include "Overlay.h"
 #include <camera/CameraParameters.h>
 #include <hardware/camera.h>
 #include <binder/IMemory.h>
 #include "CameraHardwareInterface.h"
+#include "JpegSink.h"
+#include "YuvTransform.h"
 #include <cutils/properties.h>
+#include <utils/Timers.h>
 
 using android::sp;
+using android::wp;
 using android::Overlay;
 using android::String8;
 using android::IMemory;
 using android::IMemoryHeap;
 using android::CameraParameters;
+using android::yuv_transform_t;
+using android::yuv_sp_frame_t;
+using android::ChunkJpegSink;
 
 using android::CameraInfo;
 using android::HAL_getCameraInfo;
@@ -84,6 +95,30 @@ camera_module_t HAL_MODULE_INFO_SYM = {
     get_camera_info: camera_get_camera_info,
 };
 
+/* Video buffer handed to the encoder in meta data mode, the layout the
+ * msm OMX encoder expects for kMetadataBufferTypeCameraSource. The handle
+ * carries fd, offset, size and the timestamp split in two ints. */
+#define METADATA_BUFFER_TYPE_CAMERA_SOURCE 0
+
+typedef struct {
+    int32_t buffer_type;
+    buffer_handle_t meta_handle;
+} video_metadata_t;
+
+/* camera_memory_t mapping a whole HAL heap, frames are passed by index */
+typedef struct {
+    wp<IMemoryHeap> heap;
+    int fd;
+    camera_memory_t *mem;
+    size_t buffer_size;
+    int num_buffers;
+    sp<IMemory> *recording;     /* video frames the client still holds */
+    camera_memory_t *meta;      /* video_metadata_t for each buffer */
+    native_handle_t **meta_handles;
+    int users;                  /* callbacks running on the mapping */
+    int unmap_pending;          /* unmap once users and recording drain */
+} mapped_heap_t;
+
 typedef struct priv_camera_device {
     camera_device_t base;
     /* specific "private" data can go here (base.priv) */
@@ -100,6 +135,13 @@ typedef struct priv_camera_device {
     int preview_height;
     sp<Overlay> overlay;
     gralloc_module_t const *gralloc;
+    /* applied while copying preview frames to the window */
+    yuv_transform_t preview_transform;
+    /* heaps mapped for the data callbacks, see map_heap_memory */
+    pthread_mutex_t mapped_lock;
+    int map_heaps;              /* cleared while preview is stopped */
+    int meta_data_mode;         /* video frames go out as video_metadata_t */
+    mapped_heap_t mapped_heaps[MAX_MAPPED_HEAPS];
 } priv_camera_device_t;
 
 
@@ -155,6 +197,10 @@ static void wrap_set_crop_hook(void *data,
 {
     priv_camera_device_t* dev = NULL;
     preview_stream_ops* window = NULL;
+    /* Overlay::setCrop callers pass right and bottom in w and h */
+    int left = x, top = y;
+    int width = w > x ? w - x : 0;
+    int height = h > y ? h - y : 0;
     ALOGV("%s+++: %p", __FUNCTION__,data);
 
     if(!data)
@@ -167,9 +213,52 @@ static void wrap_set_crop_hook(void *data,
 	if (window == 0)
 		return;
 
-	window->set_crop(window, x, y, w, h);
+    /* An empty crop resets it, there is nothing to transform */
+    if (width == 0 || height == 0) {
+        window->set_crop(window, x, y, w, h);
+        return;
+    }
+
+    /* the crop comes in sensor frame coordinates */
+    android::yuv_transform_rect(dev->preview_transform,
+                                dev->preview_width, dev->preview_height,
+                                &left, &top, &width, &height);
+
+	window->set_crop(window, left, top, left + width, top + height);
+}
+
+/* Logs the average time spent in the preview transform, enabled with
+ * persist.debug.camera.transform */
+static void debugShowTransformTime(priv_camera_device_t *dev, nsecs_t elapsed)
+{
+    static int debugTransform = -1;
+    static int frames = 0;
+    static nsecs_t total = 0;
+
+    if (debugTransform < 0) {
+        char value[PROPERTY_VALUE_MAX];
+        property_get("persist.debug.camera.transform", value, "0");
+        debugTransform = atoi(value);
+    }
+    if (!debugTransform)
+        return;
+
+    total += elapsed;
+    if (++frames == 60) {
+        ALOGI("preview transform %d (%s) %dx%d: %lld us/frame", dev->preview_transform,
+              android::yuv_transform_impl_name(), dev->preview_width,
+              dev->preview_height, (long long)(total / frames / 1000));
+        frames = 0;
+        total = 0;
+    }
 }
 
+/* Every preview frame is copied out of the preview heap into a window
+ * buffer. Letting the VFE write into the window buffers directly does not
+ * work with this driver: libmmcamera hands each buffer back to the VFE right
+ * after the preview callback, and the kernel only reads the active buffer
+ * set at AXI config, so a buffer the compositor still holds cannot be kept
+ * away from the VFE mid-stream. */
 //QiSS ME for preview
 static void wrap_queue_buffer_hook(void *data, void* buffer)
 {
@@ -202,73 +291,50 @@ static void wrap_queue_buffer_hook(void *data, void* buffer)
     int stride;
     void *vaddr;
     buffer_handle_t *buf_handle;
+    yuv_sp_frame_t src, dst;
+    nsecs_t start;
 
     int width = dev->preview_width;
     int height = dev->preview_height;
+    int out_width = width;
+    int out_height = height;
+
+    if (android::yuv_transform_swaps_dimensions(dev->preview_transform)) {
+        out_width = height;
+        out_height = width;
+    }
+
     if (0 != window->dequeue_buffer(window, &buf_handle, &stride)) {
         ALOGE("%s: could not dequeue gralloc buffer", __FUNCTION__);
         goto skipframe;
     }
     if (0 == dev->gralloc->lock(dev->gralloc, *buf_handle,
                                 GRALLOC_USAGE_SW_WRITE_MASK,
-                                0, 0, width, height, &vaddr)) {
+                                0, 0, out_width, out_height, &vaddr)) {
 
         /* Our cam sensor is configured in normal (not mirror mode)
          * but the Android expects the front cameras to be working
          * in mirror mode, so in result we have a preview rotated
          * by 180 degrees. For some reason this issue not appears
          * in ICS so we put the frame as it is there.
-         * On JB we're flipping the frame horizontally and vertically
-         * to compensate this rotation.
-         * To flip horizontally the YUV420SP frame we are reverting
-         * the order of data in the rows (horizontally) and the order
-         * of rows (vertically).
-         */
-#ifdef ANDROID_ICS
-        memcpy(vaddr, frame, width * height * 3 / 2);
-#else
-        /*
-         * The YUV420 Semi-Planar frame is constructed as follows:
-         *
-         * - the Y values are stored in one plane:
-         * |-------------------------------|   _
-         * | Y0 | Y1 | Y2 | Y3 | ...       |   |
-         * | ...                           | height
-         * |                               |   |
-         * |-------------------------------|   -
-         * <------------ width ------------>
-         *
-         * - the U and V values (sub-sampled by 2) are stored in another plane:
-         * |-------------------------------|   _
-         * | U0 | V0 | U2 | V2 | ....      |   |
-         * | ...                           | height/2
-         * |                               |   |
-         * |-------------------------------|   -
-         * <------------ width ------------>
+         * On JB the default transform rotates the frame by 180 degrees
+         * to compensate this rotation. It can be overridden per camera
+         * with persist.camera.hal.transform.<id>, see camera_device_open.
          */
+        if (stride < out_width)
+            stride = out_width;
 
-        uint8_t *buff = (uint8_t *)vaddr;
-        int pos_in = 0, pos_out = 0;
+        android::yuv_sp_frame_init(&src, frame, width, height, width);
+        android::yuv_sp_frame_init(&dst, vaddr, out_width, out_height, stride);
 
-        //swap Y plane
-        for (int y = 0; y < height; ++y)
-        {
-            pos_in = y * width;
-            pos_out = (height - y) * width;
-            for (int x = 0; x < width; ++x)
-                buff[pos_in + x] = frame[pos_out + width - x];
-        }
+        start = gCameraHals[dev->cameraid]->beginCpuAccess(heap, offset,
+                width * height * 3 / 2, CameraHardwareInterface::CPU_READ);
+        android::yuv_transform(&src, &dst, dev->preview_transform);
+        gCameraHals[dev->cameraid]->endCpuAccess(heap, offset,
+                width * height * 3 / 2, CameraHardwareInterface::CPU_READ,
+                CameraHardwareInterface::CPU_PREVIEW_FLIP, start);
+        debugShowTransformTime(dev, systemTime() - start);
 
-        //swap UV plane
-        pos_out = pos_in + width + width * height/2;
-        for (int y = 0; y < height/2; ++y)
-        {
-            pos_in += width;
-            pos_out -= width;
-            for (int x = 0; x < width; ++x)
-                buff[pos_in + x] = frame[pos_out + width - x];
-        }
-#endif
         ALOGV("%s: copy frame to gralloc buffer", __FUNCTION__);
     } else {
         ALOGE("%s: could not lock gralloc buffer", __FUNCTION__);
@@ -316,6 +382,260 @@ skipframe:
  * camera interface callback
  *******************************************************************/
 
+/* Logs how many bytes the data callbacks copy per second, enabled with
+ * persist.debug.camera.copy */
+static void debugShowCopyRate(size_t copied)
+{
+    static int debugCopy = -1;
+    static nsecs_t start = 0;
+    static unsigned long long bytes = 0;
+    static unsigned int callbacks = 0;
+
+    if (debugCopy < 0) {
+        char value[PROPERTY_VALUE_MAX];
+        property_get("persist.debug.camera.copy", value, "0");
+        debugCopy = atoi(value);
+    }
+    if (!debugCopy)
+        return;
+
+    nsecs_t now = systemTime();
+    if (start == 0)
+        start = now;
+    bytes += copied;
+    callbacks++;
+    if (now - start >= s2ns(1)) {
+        ALOGI("data callbacks: %llu bytes/s copied, %u callbacks",
+              bytes * 1000000000LL / (now - start), callbacks);
+        start = now;
+        bytes = 0;
+        callbacks = 0;
+    }
+}
+
+static void unmap_heap_memory(mapped_heap_t *mh)
+{
+    int i;
+
+    if (mh->meta) {
+        for (i = 0; i < mh->num_buffers; i++)
+            native_handle_delete(mh->meta_handles[i]);
+        delete [] mh->meta_handles;
+        mh->meta_handles = NULL;
+        mh->meta->release(mh->meta);
+        mh->meta = NULL;
+    }
+    mh->mem->release(mh->mem);
+    delete [] mh->recording;
+    mh->recording = NULL;
+    mh->heap.clear();
+    mh->mem = NULL;
+    mh->users = 0;
+    mh->unmap_pending = 0;
+}
+
+static int holds_recording_frames(const mapped_heap_t *mh)
+{
+    int i;
+
+    for (i = 0; i < mh->num_buffers; i++) {
+        if (mh->recording[i] != NULL)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Unmaps mh once no callback runs on it and the client gave back all the
+ * recording frames it was handed, the encoder may still read them through
+ * the mapping or their meta data until then. Must be called with
+ * mapped_lock held.
+ */
+static void release_heap_mapping(mapped_heap_t *mh)
+{
+    mh->unmap_pending = 1;
+    if (mh->users == 0 && !holds_recording_frames(mh))
+        unmap_heap_memory(mh);
+}
+
+/* Ends a callback started on a mapping found by map_heap_memory. */
+static void put_heap_mapping(priv_camera_device_t *dev, mapped_heap_t *mh)
+{
+    pthread_mutex_lock(&dev->mapped_lock);
+    mh->users--;
+    if (mh->unmap_pending)
+        release_heap_mapping(mh);
+    pthread_mutex_unlock(&dev->mapped_lock);
+}
+
+/*
+ * Drops all heap mappings, the HAL rebuilds its heaps on the next preview.
+ * Mappings still in use go once they are done. With force, used when the
+ * device closes, frames the client still holds are given back to the HAL
+ * and everything is unmapped right away.
+ */
+static void unmap_all_heaps(priv_camera_device_t *dev, int force)
+{
+    android::Vector<sp<IMemory> > held;
+    int i, j;
+
+    pthread_mutex_lock(&dev->mapped_lock);
+    for (i = 0; i < MAX_MAPPED_HEAPS; i++) {
+        mapped_heap_t *mh = &dev->mapped_heaps[i];
+        if (!mh->mem)
+            continue;
+        if (!force) {
+            release_heap_mapping(mh);
+            continue;
+        }
+        for (j = 0; j < mh->num_buffers; j++) {
+            if (mh->recording[j] != NULL)
+                held.push(mh->recording[j]);
+        }
+        unmap_heap_memory(mh);
+    }
+    pthread_mutex_unlock(&dev->mapped_lock);
+
+    if (!held.isEmpty())
+        ALOGE("%s: client still held %d recording frames", __FUNCTION__,
+              (int)held.size());
+    for (i = 0; i < (int)held.size(); i++)
+        gCameraHals[dev->cameraid]->releaseRecordingFrame(held[i]);
+}
+
+/*
+ * Returns the camera_memory_t mapping the whole heap behind dataPtr and the
+ * index of the frame in it, mapping the heap on first use. Returns NULL for
+ * heaps the HAL cannot describe (see getHeapLayout), their frames still get
+ * copied. The caller counts itself in mh->users before dropping
+ * mapped_lock to call out, and ends with put_heap_mapping. Must be called
+ * with mapped_lock held.
+ */
+static mapped_heap_t *map_heap_memory(priv_camera_device_t *dev,
+                                      const sp<IMemory>& dataPtr,
+                                      unsigned int *index)
+{
+    ssize_t offset;
+    size_t size;
+    mapped_heap_t *mh = NULL;
+    mapped_heap_t *free_slot = NULL;
+    int i;
+
+    if (!dev->request_memory || !dev->map_heaps)
+        return NULL;
+
+    sp<IMemoryHeap> heap = dataPtr->getMemory(&offset, &size);
+    if (heap == NULL)
+        return NULL;
+
+    for (i = 0; i < MAX_MAPPED_HEAPS && mh == NULL; i++) {
+        mapped_heap_t *m = &dev->mapped_heaps[i];
+        if (m->mem) {
+            sp<IMemoryHeap> mapped = m->heap.promote();
+            if (mapped == heap)
+                mh = m;
+            else if (mapped == NULL && !m->unmap_pending)
+                release_heap_mapping(m);
+        }
+        if (!m->mem && !free_slot)
+            free_slot = m;
+    }
+
+    /* The heap came back, e.g. a pool kept across a preview restart */
+    if (mh != NULL)
+        mh->unmap_pending = 0;
+
+    if (mh == NULL) {
+        size_t buffer_size;
+        int num_buffers;
+        camera_memory_t *mem;
+
+        if (!free_slot ||
+            !gCameraHals[dev->cameraid]->getHeapLayout(heap, &buffer_size, &num_buffers))
+            return NULL;
+
+        mem = dev->request_memory(heap->getHeapID(), buffer_size, num_buffers, dev->user);
+        if (!mem)
+            return NULL;
+        if (!mem->data || mem->data == MAP_FAILED) {
+            mem->release(mem);
+            return NULL;
+        }
+
+        ALOGI("%s: mapped heap %p, %d buffers of %u bytes", __FUNCTION__,
+              heap->base(), num_buffers, buffer_size);
+        mh = free_slot;
+        mh->heap = heap;
+        mh->fd = heap->getHeapID();
+        mh->mem = mem;
+        mh->buffer_size = buffer_size;
+        mh->num_buffers = num_buffers;
+        mh->recording = new sp<IMemory>[num_buffers];
+    }
+
+    if (offset % mh->buffer_size || size > mh->buffer_size ||
+        offset / mh->buffer_size >= (size_t)mh->num_buffers)
+        return NULL;
+
+    *index = offset / mh->buffer_size;
+    return mh;
+}
+
+/* Allocates the meta data buffers describing the frames of a mapped heap.
+ * Must be called with mapped_lock held. */
+static int map_heap_metadata(priv_camera_device_t *dev, mapped_heap_t *mh)
+{
+    int i;
+
+    if (mh->meta)
+        return 0;
+
+    mh->meta = dev->request_memory(-1, sizeof(video_metadata_t),
+                                   mh->num_buffers, dev->user);
+    if (!mh->meta)
+        return -1;
+    if (!mh->meta->data || mh->meta->data == MAP_FAILED) {
+        mh->meta->release(mh->meta);
+        mh->meta = NULL;
+        return -1;
+    }
+
+    mh->meta_handles = new native_handle_t *[mh->num_buffers];
+    for (i = 0; i < mh->num_buffers; i++) {
+        video_metadata_t *packet = (video_metadata_t *)mh->meta->data + i;
+        mh->meta_handles[i] = native_handle_create(1, 4);
+        mh->meta_handles[i]->data[0] = mh->fd;
+        mh->meta_handles[i]->data[1] = i * mh->buffer_size;
+        packet->buffer_type = METADATA_BUFFER_TYPE_CAMERA_SOURCE;
+        packet->meta_handle = mh->meta_handles[i];
+    }
+    return 0;
+}
+
+/* A mapped frame is read by the client while its callback runs. */
+static nsecs_t begin_mapped_access(priv_camera_device_t *dev,
+                                   const sp<IMemory>& dataPtr)
+{
+    ssize_t offset;
+    size_t size;
+    sp<IMemoryHeap> heap = dataPtr->getMemory(&offset, &size);
+
+    return gCameraHals[dev->cameraid]->beginCpuAccess(heap, offset, size,
+            CameraHardwareInterface::CPU_READ);
+}
+
+static void end_mapped_access(priv_camera_device_t *dev,
+                              const sp<IMemory>& dataPtr, nsecs_t start)
+{
+    ssize_t offset;
+    size_t size;
+    sp<IMemoryHeap> heap = dataPtr->getMemory(&offset, &size);
+
+    gCameraHals[dev->cameraid]->endCpuAccess(heap, offset, size,
+            CameraHardwareInterface::CPU_READ,
+            CameraHardwareInterface::CPU_DATA_MAP, start);
+}
+
 static camera_memory_t *wrap_memory_data(priv_camera_device_t *dev,
                                          const sp<IMemory>& dataPtr)
 {
@@ -369,7 +689,13 @@ static camera_memory_t *wrap_memory_data(priv_camera_device_t *dev,
 
     ALOGV(" mem:%p,mem->data%p ",  mem,mem->data);
 
+    nsecs_t start = gCameraHals[dev->cameraid]->beginCpuAccess(heap, offset,
+            size, CameraHardwareInterface::CPU_READ);
     memcpy(mem->data, data, size);
+    gCameraHals[dev->cameraid]->endCpuAccess(heap, offset, size,
+            CameraHardwareInterface::CPU_READ,
+            CameraHardwareInterface::CPU_DATA_COPY, start);
+    debugShowCopyRate(size);
 
     ALOGV("%s---", __FUNCTION__);
     return mem;
@@ -421,6 +747,29 @@ static void wrap_data_callback(int32_t msg_type, const sp<IMemory>& dataPtr,
         return;
     }
 
+    /* Frames from the preview and record heaps go out without a copy,
+     * counting as a user keeps the mapping alive until the client is
+     * done. The client is called without mapped_lock held. */
+    unsigned int index;
+    mapped_heap_t *mh;
+
+    pthread_mutex_lock(&dev->mapped_lock);
+    mh = map_heap_memory(dev, dataPtr, &index);
+    if (mh) {
+        camera_memory_t *mem = mh->mem;
+        mh->users++;
+        pthread_mutex_unlock(&dev->mapped_lock);
+
+        debugShowCopyRate(0);
+        nsecs_t start = begin_mapped_access(dev, dataPtr);
+        if (dev->data_callback)
+            dev->data_callback(msg_type, mem, index, NULL, dev->user);
+        end_mapped_access(dev, dataPtr, start);
+        put_heap_mapping(dev, mh);
+        return;
+    }
+    pthread_mutex_unlock(&dev->mapped_lock);
+
     data = wrap_memory_data(dev, dataPtr);
 
     if (dev->data_callback)
@@ -433,6 +782,43 @@ static void wrap_data_callback(int32_t msg_type, const sp<IMemory>& dataPtr,
     ALOGV("%s---", __FUNCTION__);
 }
 
+/*
+ * With persist.camera.hal.jpeg.sink=client the HAL streams the picture
+ * into chunks that are gathered straight into client memory, skipping
+ * both the JPEG heap and the copy in wrap_memory_data.
+ */
+class ClientJpegSink : public ChunkJpegSink {
+public:
+    ClientJpegSink(priv_camera_device_t *dev) : mDev(dev) {}
+
+    virtual const char *name() const { return "client"; }
+
+    virtual sp<IMemory> end(bool deliver) {
+        size_t picture = size();
+
+        if (deliver && !failed() && picture > 0 && mDev->request_memory) {
+            camera_memory_t *mem = mDev->request_memory(-1, picture, 1, mDev->user);
+            if (mem && mem->data && mem->data != MAP_FAILED) {
+                notePeak(picture);
+                gather(mem->data);
+                freeChunks();
+                if (mDev->data_callback)
+                    mDev->data_callback(CAMERA_MSG_COMPRESSED_IMAGE, mem, 0,
+                                        NULL, mDev->user);
+            } else {
+                ALOGE("%s: no client memory for %u bytes", __FUNCTION__, picture);
+            }
+            if (mem)
+                mem->release(mem);
+        }
+        freeChunks();
+        return NULL;
+    }
+
+private:
+    priv_camera_device_t *mDev;
+};
+
 //QiSS ME for record
 static void wrap_data_callback_timestamp(nsecs_t timestamp, int32_t msg_type,
                                          const sp<IMemory>& dataPtr, void* user)
@@ -454,6 +840,65 @@ static void wrap_data_callback_timestamp(nsecs_t timestamp, int32_t msg_type,
         return;
     }
 
+    /* Mapped video frames are given back to the HAL only once the client
+     * releases them, see camera_release_recording_frame. The client is
+     * called without mapped_lock held: CameraSource takes its own lock in
+     * the callback and holds it while releasing frames. */
+    unsigned int index;
+    mapped_heap_t *mh;
+
+    pthread_mutex_lock(&dev->mapped_lock);
+    mh = map_heap_memory(dev, dataPtr, &index);
+    if (mh && dev->meta_data_mode) {
+        /* The encoder only gets fd, offset and size of the frame */
+        if (map_heap_metadata(dev, mh)) {
+            ALOGE("%s: no meta data buffers, dropping frame", __FUNCTION__);
+            pthread_mutex_unlock(&dev->mapped_lock);
+            gCameraHals[dev->cameraid]->releaseRecordingFrame(dataPtr);
+            return;
+        }
+        ssize_t offset;
+        size_t size;
+        dataPtr->getMemory(&offset, &size);
+        native_handle_t *nh = mh->meta_handles[index];
+        nh->data[2] = size;
+        nh->data[3] = (int)(timestamp & 0xffffffff);
+        nh->data[4] = (int)(timestamp >> 32);
+
+        camera_memory_t *meta = mh->meta;
+        mh->recording[index] = dataPtr;
+        mh->users++;
+        pthread_mutex_unlock(&dev->mapped_lock);
+
+        debugShowCopyRate(0);
+        if (dev->data_timestamp_callback)
+            dev->data_timestamp_callback(timestamp, msg_type, meta, index, dev->user);
+        put_heap_mapping(dev, mh);
+        return;
+    }
+    if (mh) {
+        camera_memory_t *mem = mh->mem;
+        mh->recording[index] = dataPtr;
+        mh->users++;
+        pthread_mutex_unlock(&dev->mapped_lock);
+
+        debugShowCopyRate(0);
+        nsecs_t start = begin_mapped_access(dev, dataPtr);
+        if (dev->data_timestamp_callback)
+            dev->data_timestamp_callback(timestamp, msg_type, mem, index, dev->user);
+        end_mapped_access(dev, dataPtr, start);
+        put_heap_mapping(dev, mh);
+        return;
+    }
+    pthread_mutex_unlock(&dev->mapped_lock);
+
+    if (dev->meta_data_mode) {
+        /* The encoder cannot take raw frames in meta data mode */
+        ALOGE("%s: frame not in a mapped heap, dropping it", __FUNCTION__);
+        gCameraHals[dev->cameraid]->releaseRecordingFrame(dataPtr);
+        return;
+    }
+
     data = wrap_memory_data(dev, dataPtr);
 
     if (dev->data_timestamp_callback)
@@ -494,7 +939,6 @@ void CameraHAL_FixupParams(android::CameraParameters &camParams)
     camParams.set(android::CameraParameters::KEY_MAX_SHARPNESS, "30");
     camParams.set(android::CameraParameters::KEY_MAX_CONTRAST, "10");
     camParams.set(android::CameraParameters::KEY_MAX_SATURATION, "10");
-    camParams.set("num-snaps-per-shutter", "1");
 }
 
 int camera_set_preview_window(struct camera_device * device,
@@ -564,8 +1008,16 @@ int camera_set_preview_window(struct camera_device * device,
 
     window->set_usage(window, GRALLOC_USAGE_PMEM_PRIVATE_ADSP | GRALLOC_USAGE_SW_READ_OFTEN);
 
-    if (window->set_buffers_geometry(window, preview_width,
-                                     preview_height, hal_pixel_format)) {
+    /* 90/270 degree transforms hand out rotated buffers */
+    int window_width = preview_width;
+    int window_height = preview_height;
+    if (android::yuv_transform_swaps_dimensions(dev->preview_transform)) {
+        window_width = preview_height;
+        window_height = preview_width;
+    }
+
+    if (window->set_buffers_geometry(window, window_width,
+                                     window_height, hal_pixel_format)) {
         ALOGE("%s---: could not set buffers geometry to %s",
              __FUNCTION__, str_preview_format);
         return -1;
@@ -611,6 +1063,11 @@ void camera_set_callbacks(struct camera_device * device,
     gCameraHals[dev->cameraid]->setCallbacks(wrap_notify_callback, wrap_data_callback,
                                              wrap_data_callback_timestamp, (void *)dev);
 
+    char value[PROPERTY_VALUE_MAX];
+    property_get("persist.camera.hal.jpeg.sink", value, "heap");
+    if (!strcmp(value, "client"))
+        gCameraHals[dev->cameraid]->setJpegSink(new ClientJpegSink(dev));
+
     ALOGI("%s---", __FUNCTION__);
 }
 
@@ -687,6 +1144,13 @@ int camera_start_preview(struct camera_device * device)
 
     dev = (priv_camera_device_t*) device;
 
+    /* persist.camera.hal.mapheaps=0 goes back to copying every frame */
+    char value[PROPERTY_VALUE_MAX];
+    property_get("persist.camera.hal.mapheaps", value, "1");
+    pthread_mutex_lock(&dev->mapped_lock);
+    dev->map_heaps = atoi(value);
+    pthread_mutex_unlock(&dev->mapped_lock);
+
     rv = gCameraHals[dev->cameraid]->startPreview();
 
     ALOGI("%s--- rv %d", __FUNCTION__,rv);
@@ -705,6 +1169,13 @@ void camera_stop_preview(struct camera_device * device)
     dev = (priv_camera_device_t*) device;
 
     gCameraHals[dev->cameraid]->stopPreview();
+
+    /* The heaps go away with the preview, do not keep them mapped */
+    pthread_mutex_lock(&dev->mapped_lock);
+    dev->map_heaps = 0;
+    pthread_mutex_unlock(&dev->mapped_lock);
+    unmap_all_heaps(dev, 0);
+
     ALOGI("%s---", __FUNCTION__);
 }
 
@@ -739,11 +1210,19 @@ int camera_store_meta_data_in_buffers(struct camera_device * device, int enable)
 
     dev = (priv_camera_device_t*) device;
 
-    //  TODO: meta data buffer not current supported
-    //rv = gCameraHals[dev->cameraid]->storeMetaDataInBuffers(enable);
+    /* Meta data describes frames by their place in a mapped record heap,
+     * so it needs heap mapping (persist.camera.hal.mapheaps). */
+    char value[PROPERTY_VALUE_MAX];
+    property_get("persist.camera.hal.mapheaps", value, "1");
+    if (!enable || atoi(value)) {
+        pthread_mutex_lock(&dev->mapped_lock);
+        dev->meta_data_mode = enable;
+        pthread_mutex_unlock(&dev->mapped_lock);
+        rv = 0;
+    }
+
     ALOGI("%s--- rv %d", __FUNCTION__,rv);
     return rv;
-    //return enable ? android::INVALID_OPERATION: android::OK;
 }
 
 int camera_start_recording(struct camera_device * device)
@@ -805,21 +1284,43 @@ void camera_release_recording_frame(struct camera_device * device,
                                     const void *opaque)
 {
     priv_camera_device_t* dev = NULL;
-    //camera_memory_t *data = (camera_memory_t *)(&opaque);
-
+    sp<IMemory> frame;
+    int i;
 
-    //ALOGV("%s+++: device %p,opaque %p,data %p", __FUNCTION__, device,opaque,data);
+    ALOGV("%s+++: device %p,opaque %p", __FUNCTION__, device, opaque);
 
     if(!device)
         return;
 
     dev = (priv_camera_device_t*) device;
-    /*
-     if ( NULL != data ) {
-     data->release(data);
-     }
-     */
-    //gCameraHals[dev->cameraid]->releaseRecordingFrame(opaque);
+
+    /* Copied frames were released right after the callback, only the
+     * ones handed out from a mapped heap are still held. */
+    pthread_mutex_lock(&dev->mapped_lock);
+    for (i = 0; i < MAX_MAPPED_HEAPS && frame == NULL; i++) {
+        mapped_heap_t *mh = &dev->mapped_heaps[i];
+        const char *base = (const char *)(mh->mem ? mh->mem->data : NULL);
+        const char *meta = (const char *)(mh->meta ? mh->meta->data : NULL);
+        size_t index = mh->num_buffers;
+
+        if (base && (const char *)opaque >= base &&
+            (const char *)opaque < base + mh->buffer_size * mh->num_buffers)
+            index = ((const char *)opaque - base) / mh->buffer_size;
+        else if (meta && (const char *)opaque >= meta &&
+                 (const char *)opaque < meta + sizeof(video_metadata_t) * mh->num_buffers)
+            index = ((const char *)opaque - meta) / sizeof(video_metadata_t);
+
+        if (index < (size_t)mh->num_buffers) {
+            frame = mh->recording[index];
+            mh->recording[index].clear();
+            if (mh->unmap_pending)
+                release_heap_mapping(mh);
+        }
+    }
+    pthread_mutex_unlock(&dev->mapped_lock);
+
+    if (frame != NULL)
+        gCameraHals[dev->cameraid]->releaseRecordingFrame(frame);
 
     ALOGV("%s---", __FUNCTION__);
 }
@@ -1047,6 +1548,12 @@ int camera_device_close(hw_device_t* device)
     dev = (priv_camera_device_t*) device;
 
     if (dev) {
+        unmap_all_heaps(dev, 1);
+        pthread_mutex_destroy(&dev->mapped_lock);
+
+        /* The client sink points back at dev */
+        gCameraHals[dev->cameraid]->setJpegSink(NULL);
+
         gCameraHals[dev->cameraid].clear();
         gCameraHals[dev->cameraid] = NULL;
         gCamerasOpen--;
@@ -1142,6 +1649,9 @@ int camera_device_open(const hw_module_t* module, const char* name,
         memset(priv_camera_device, 0, sizeof(*priv_camera_device));
         memset(camera_ops, 0, sizeof(*camera_ops));
 
+        /* not held across the data callbacks, see put_heap_mapping */
+        pthread_mutex_init(&priv_camera_device->mapped_lock, NULL);
+
         priv_camera_device->base.common.tag = HARDWARE_DEVICE_TAG;
         priv_camera_device->base.common.version = 0;
         priv_camera_device->base.common.module = (hw_module_t *)(module);
@@ -1178,6 +1688,24 @@ int camera_device_open(const hw_module_t* module, const char* name,
 
         priv_camera_device->cameraid = cameraid;
 
+        /* The sensor output is rotated by 180 degrees compared to what
+         * JB expects (see wrap_queue_buffer_hook), ICS takes it as is. */
+        {
+            char prop[PROPERTY_KEY_MAX];
+            char value[PROPERTY_VALUE_MAX];
+#ifdef ANDROID_ICS
+            yuv_transform_t def = android::YUV_TRANSFORM_NONE;
+#else
+            yuv_transform_t def = android::YUV_TRANSFORM_ROT_180;
+#endif
+            snprintf(prop, sizeof(prop), "persist.camera.hal.transform.%d", cameraid);
+            property_get(prop, value, "");
+            priv_camera_device->preview_transform =
+                android::yuv_transform_from_string(value, def);
+            ALOGI("%s: camera %d preview transform %d", __FUNCTION__, cameraid,
+                  priv_camera_device->preview_transform);
+        }
+
         camera = HAL_openCameraHardware(cameraid);
         if(camera == NULL)
         {
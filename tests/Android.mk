@@ -0,0 +1,134 @@
+LOCAL_PATH:= $(call my-dir)
+
+# Host tests of the frame processing code, which does not depend on
+# libmmcamera. They print their results and exit non-zero on a failure;
+# pass -q to skip the benchmarks.
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := camera_yuv_transform_test
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_SRC_FILES := yuv_transform_test.cpp
+LOCAL_SRC_FILES += ../YuvTransform.cpp
+LOCAL_SRC_FILES += ../WorkerPool.cpp
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_LDLIBS := -lpthread -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := camera_frame_ring_test
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_SRC_FILES := frame_ring_test.cpp
+LOCAL_SRC_FILES += ../FrameRing.cpp
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_LDLIBS := -lpthread -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := camera_jpeg_encoder_test
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_SRC_FILES := jpeg_encoder_test.cpp
+LOCAL_SRC_FILES += ../JpegEncoder.cpp
+LOCAL_SRC_FILES += ../ExifBuilder.cpp
+LOCAL_SRC_FILES += ../YuvScale.cpp
+LOCAL_SRC_FILES += ../YuvTransform.cpp
+LOCAL_SRC_FILES += ../WorkerPool.cpp
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+# The host build decodes with the system libjpeg
+LOCAL_LDLIBS := -lpthread -lrt -ljpeg
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := camera_yuv_crop_test
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_SRC_FILES := yuv_crop_test.cpp
+LOCAL_SRC_FILES += ../YuvTransform.cpp
+LOCAL_SRC_FILES += ../WorkerPool.cpp
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_LDLIBS := -lpthread -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := camera_yuv_scale_test
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_SRC_FILES := yuv_scale_test.cpp
+LOCAL_SRC_FILES += ../YuvScale.cpp
+LOCAL_SRC_FILES += ../YuvTransform.cpp
+LOCAL_SRC_FILES += ../WorkerPool.cpp
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_LDLIBS := -lpthread -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := camera_exif_builder_test
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_SRC_FILES := exif_builder_test.cpp
+LOCAL_SRC_FILES += ../ExifBuilder.cpp
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_LDLIBS := -lpthread -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := camera_record_buffers_test
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_SRC_FILES := record_buffers_test.cpp
+LOCAL_SRC_FILES += ../RecordBuffers.cpp
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_LDLIBS := -lpthread -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := camera_mem_alloc_test
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_SRC_FILES := mem_alloc_test.cpp
+LOCAL_SRC_FILES += ../MemAlloc.cpp
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_LDLIBS := -lpthread -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_TEST_UTIL_H
+#define ANDROID_HARDWARE_TEST_UTIL_H
+
+/*
+ * Helpers of the host tests. Every test is one source file with a main()
+ * linked against the sources it checks, so everything here is static.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Random number in [0, n), 0 when n is not positive. */
+static inline int rnd(int n)
+{
+    return n > 0 ? rand() % n : 0;
+}
+
+static inline double now_ms()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+/* The benchmarks run unless the test is started with -q. */
+static inline bool want_benchmarks(int argc, char **argv)
+{
+    return !(argc > 1 && !strcmp(argv[1], "-q"));
+}
+
+/* Reports a failed check, with a NULL what returns the failures so far. */
+static inline int test_failure(const char *file, int line, const char *what)
+{
+    static int failures;
+
+    if (what != NULL) {
+        printf("FAIL %s:%d: %s\n", file, line, what);
+        failures++;
+    }
+    return failures;
+}
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) \
+            test_failure(__FILE__, __LINE__, #cond); \
+    } while (0)
+
+#define TEST_FAILURES() test_failure(NULL, 0, NULL)
+
+#endif // ANDROID_HARDWARE_TEST_UTIL_H
@@ -0,0 +1,340 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Runs random sequences of ExifBuilder setters, the way a session patches
+ * its template per picture, and compares the APP1 each one writes with a
+ * builder that was given only the final values. Every segment is read
+ * back with a strict TIFF reader: sorted tags, offsets inside the body
+ * and the thumbnail where IFD1 says it is.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ExifBuilder.h"
+#include "TestUtil.h"
+
+using namespace android;
+
+/* What the setters were last called with. */
+struct Settings {
+    char make[40];
+    char model[40];
+    float focal;
+    int orientation;
+    int width;
+    int height;
+    bool hasDate;
+    char date[32];
+    bool hasGps;
+    ExifBuilder::Gps gps;
+    char method[120];
+};
+
+static void random_string(char *dst, int max)
+{
+    int len = rnd(max);
+    for (int i = 0; i < len; i++)
+        dst[i] = 'a' + rnd(26);
+    dst[len] = '\0';
+}
+
+static void apply(ExifBuilder *exif, const Settings *s, int what)
+{
+    switch (what) {
+    case 0:
+        exif->setCamera(s->make, s->model);
+        break;
+    case 1:
+        exif->setFocalLength(s->focal);
+        break;
+    case 2:
+        exif->setOrientation(s->orientation);
+        break;
+    case 3:
+        exif->setPictureSize(s->width, s->height);
+        break;
+    case 4:
+        exif->setDateTime(s->hasDate ? s->date : NULL);
+        break;
+    case 5:
+        exif->setGps(s->hasGps ? &s->gps : NULL);
+        break;
+    }
+}
+
+/* Changes one setting and returns which setter has to pass it on. */
+static int change(Settings *s)
+{
+    static const int orientations[] = { 0, 90, 180, 270 };
+    int what = rnd(6);
+
+    switch (what) {
+    case 0:
+        random_string(s->make, 40);
+        random_string(s->model, 40);
+        break;
+    case 1:
+        s->focal = rnd(10000) / 100.0f;
+        break;
+    case 2:
+        s->orientation = orientations[rnd(4)];
+        break;
+    case 3:
+        s->width = 2 * rnd(5000);
+        s->height = 2 * rnd(4000);
+        break;
+    case 4:
+        s->hasDate = rnd(4) != 0;
+        snprintf(s->date, sizeof(s->date), "2012:%02d:%02d %02d:%02d:%02d",
+                 1 + rnd(12), 1 + rnd(28), rnd(24), rnd(60), rnd(60));
+        break;
+    case 5:
+        s->hasGps = rnd(3) != 0;
+        s->gps.hasPosition = rnd(2);
+        s->gps.latitude = (rnd(180000) - 90000) / 1000.0;
+        s->gps.longitude = (rnd(360000) - 180000) / 1000.0;
+        s->gps.hasAltitude = rnd(2);
+        s->gps.altitude = rnd(20000) - 1000;
+        s->gps.hasTimestamp = rnd(2);
+        s->gps.timestamp = 1300000000 + rnd(100000000);
+        random_string(s->method, 120);
+        s->gps.processingMethod = rnd(2) ? s->method : NULL;
+        break;
+    }
+    return what;
+}
+
+static inline uint16_t get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t get32(const uint8_t *p)
+{
+    return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static int type_size(int type)
+{
+    switch (type) {
+    case 1: case 2: case 7: return 1;
+    case 3: return 2;
+    case 4: return 4;
+    case 5: return 8;
+    }
+    return 0;
+}
+
+/*
+ * Checks the IFD at offset and returns the value of the entry with tag
+ * link, 0 if there is none. *next gets the link to the next IFD.
+ */
+static uint32_t check_ifd(const uint8_t *tiff, uint32_t size, uint32_t offset,
+                          uint16_t link, uint32_t *next, int *entries)
+{
+    uint32_t value = 0;
+
+    CHECK(offset >= 8 && offset + 2 <= size && !(offset & 1));
+    if (offset < 8 || offset + 2 > size)
+        return 0;
+    int count = get16(tiff + offset);
+    uint32_t end = offset + 2 + count * 12 + 4;
+    CHECK(count > 0 && end <= size);
+    if (end > size)
+        return 0;
+
+    int last = -1;
+    for (int i = 0; i < count; i++) {
+        const uint8_t *e = tiff + offset + 2 + i * 12;
+        int tag = get16(e);
+        int bytes = type_size(get16(e + 2)) * get32(e + 4);
+
+        CHECK(tag > last);
+        CHECK(bytes > 0);
+        if (bytes > 4) {
+            uint32_t at = get32(e + 8);
+            CHECK(at >= end && at + bytes <= size && !(at & 1));
+        }
+        if (tag == link)
+            value = get32(e + 8);
+        last = tag;
+    }
+    *next = get32(tiff + end - 4);
+    *entries += count;
+    return value;
+}
+
+/* Reads the segment back, returns the thumbnail bytes it points at. */
+static uint32_t check_app1(const uint8_t *app1, size_t size,
+                           const uint8_t *thumbnail, uint32_t thumbnailSize)
+{
+    CHECK(size > 18 && app1[0] == 0xff && app1[1] == 0xe1);
+    CHECK(((app1[2] << 8) | app1[3]) == (int)size - 2);
+    CHECK(!memcmp(app1 + 4, "Exif\0\0II*\0", 10));
+
+    const uint8_t *tiff = app1 + 10;
+    uint32_t tiffSize = size - 10, next, ignored;
+    int entries = 0;
+
+    uint32_t ifd0 = get32(tiff + 4);
+    uint32_t exif = check_ifd(tiff, tiffSize, ifd0, 0x8769, &next, &entries);
+    CHECK(exif != 0);
+    check_ifd(tiff, tiffSize, exif, 0, &ignored, &entries);
+    uint32_t gps = check_ifd(tiff, tiffSize, ifd0, 0x8825, &ignored, &entries);
+    if (gps != 0)
+        check_ifd(tiff, tiffSize, gps, 0, &ignored, &entries);
+
+    if (next == 0) {
+        CHECK(thumbnailSize == 0);
+        return 0;
+    }
+    uint32_t offset = 0, length = 0;
+    for (int i = 0; i < get16(tiff + next); i++) {
+        const uint8_t *e = tiff + next + 2 + i * 12;
+        if (get16(e) == 0x0201)
+            offset = get32(e + 8);
+        else if (get16(e) == 0x0202)
+            length = get32(e + 8);
+    }
+    CHECK(length == thumbnailSize && offset + length == tiffSize);
+    CHECK(offset + length <= tiffSize && !memcmp(tiff + offset, thumbnail, length));
+    return length;
+}
+
+static void check_sequences(int iterations)
+{
+    static uint8_t a[ExifBuilder::kMaxApp1Size], b[ExifBuilder::kMaxApp1Size];
+    uint8_t thumbnail[4096];
+    Settings s;
+    ExifBuilder session;
+
+    for (size_t i = 0; i < sizeof(thumbnail); i++)
+        thumbnail[i] = rand();
+    memset(&s, 0, sizeof(s));
+    s.hasDate = false;
+    for (int what = 0; what < 6; what++)
+        apply(&session, &s, what);
+
+    for (int it = 0; it < iterations; it++) {
+        // The session template changes now and then, every picture
+        // patches a copy of it.
+        if (rnd(4) == 0)
+            apply(&session, &s, change(&s));
+        ExifBuilder picture = session;
+        Settings p = s;
+        for (int n = rnd(4); n > 0; n--)
+            apply(&picture, &p, change(&p));
+
+        ExifBuilder fresh;
+        for (int what = 0; what < 6; what++)
+            apply(&fresh, &p, what);
+
+        uint32_t thumb = rnd(3) ? rnd(sizeof(thumbnail)) : 0;
+        size_t sa = picture.writeApp1(a, thumbnail, thumb);
+        size_t sb = fresh.writeApp1(b, thumbnail, thumb);
+        CHECK(sa == picture.app1Size(thumb) && sa == sb);
+        CHECK(!memcmp(a, b, sa));
+        CHECK(check_app1(a, sa, thumbnail, thumb) == thumb);
+
+        int type;
+        uint32_t count;
+        const uint16_t *orientation = (const uint16_t *)
+                picture.value(ExifBuilder::ORIENTATION, &type, &count);
+        CHECK(orientation != NULL && type == 3 && count == 1);
+        CHECK(picture.value(ExifBuilder::GPS_LATITUDE, &type, &count) ==
+              NULL || (p.hasGps && p.gps.hasPosition));
+        if (TEST_FAILURES()) {
+            printf("iteration %d\n", it);
+            return;
+        }
+    }
+}
+
+static void check_limits()
+{
+    static uint8_t app1[ExifBuilder::kMaxApp1Size];
+    static uint8_t thumbnail[ExifBuilder::kMaxApp1Size];
+    ExifBuilder exif;
+    ExifBuilder::Gps gps;
+    char longest[200];
+
+    memset(longest, 'x', sizeof(longest) - 1);
+    longest[sizeof(longest) - 1] = '\0';
+    memset(&gps, 0, sizeof(gps));
+    gps.hasPosition = gps.hasAltitude = gps.hasTimestamp = true;
+    gps.processingMethod = longest;
+    exif.setCamera(longest, longest);
+    exif.setDateTime(longest);
+    exif.setGps(&gps);
+
+    // Every field at its longest still fits the body
+    size_t max = exif.maxThumbnailSize();
+    CHECK(exif.app1Size(max) == ExifBuilder::kMaxApp1Size);
+    CHECK(exif.app1Size(0) < 10 + ExifBuilder::kMaxTiffSize);
+    CHECK(exif.writeApp1(app1, thumbnail, max) == ExifBuilder::kMaxApp1Size);
+    CHECK(check_app1(app1, ExifBuilder::kMaxApp1Size, thumbnail, max) == max);
+    CHECK(exif.writeApp1(app1, thumbnail, max + 1) == 0);
+
+    // Dropping GPS drops its IFD
+    size_t with = exif.app1Size(0);
+    exif.setGps(NULL);
+    CHECK(exif.app1Size(0) < with);
+    CHECK(exif.writeApp1(app1, NULL, 0) == exif.app1Size(0));
+    check_app1(app1, exif.app1Size(0), NULL, 0);
+}
+
+static void benchmark()
+{
+    static uint8_t app1[ExifBuilder::kMaxApp1Size];
+    uint8_t thumbnail[12000];
+    ExifBuilder session;
+    ExifBuilder::Gps gps;
+
+    memset(thumbnail, 0x55, sizeof(thumbnail));
+    memset(&gps, 0, sizeof(gps));
+    gps.hasPosition = gps.hasAltitude = gps.hasTimestamp = true;
+    session.setCamera("QCOM-AA", "QCAM-AA");
+    session.setFocalLength(4.31f);
+    session.setGps(&gps);
+
+    const int runs = 100000;
+    double start = now_ms();
+    for (int i = 0; i < runs; i++) {
+        ExifBuilder picture = session;
+        picture.setOrientation(i % 2 ? 90 : 0);
+        picture.setPictureSize(2592, 1944);
+        picture.setDateTime("2012:01:01 12:00:00");
+        picture.writeApp1(app1, thumbnail, sizeof(thumbnail));
+    }
+    printf("copy, patch and write APP1: %.2f us\n", (now_ms() - start) * 1e3 / runs);
+}
+
+int main(int argc, char **argv)
+{
+    srand(1);
+    check_limits();
+    check_sequences(20000);
+    if (TEST_FAILURES())
+        return 1;
+    printf("patched templates: identical to fresh ones\n");
+
+    if (want_benchmarks(argc, argv))
+        benchmark();
+    return 0;
+}
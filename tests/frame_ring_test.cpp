@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Pushes a million frames through a FrameRing the size of the video busy
+ * queue, a producer thread posting as fast as it can and the main thread
+ * waiting and draining as the video thread does. A second pass also
+ * flushes from a third thread, like the stop paths. Every frame must come
+ * out once and in order, and with flushes every frame must be received or
+ * dropped.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <cutils/atomic.h>
+
+#include "FrameRing.h"
+#include "TestUtil.h"
+
+struct msm_frame {
+    int seq;
+};
+
+using android::FrameRing;
+
+static const int kFrames = 1000000;
+static struct msm_frame gFrames[kFrames];
+
+struct Run {
+    FrameRing *ring;
+    volatile int32_t done;
+    volatile int32_t dropped;
+    int full;
+};
+
+static void *producer(void *data)
+{
+    Run *run = (Run *)data;
+
+    for (int i = 0; i < kFrames; i++) {
+        gFrames[i].seq = i;
+        while (!run->ring->post(&gFrames[i])) {
+            run->full++;
+            sched_yield();
+        }
+    }
+    android_atomic_release_store(1, &run->done);
+    run->ring->wake();
+    return NULL;
+}
+
+static void *flusher(void *data)
+{
+    Run *run = (Run *)data;
+
+    while (!android_atomic_acquire_load(&run->done)) {
+        for (volatile int spin = 0; spin < 1000; spin++)
+            ;
+        android_atomic_add(run->ring->flush(), &run->dropped);
+    }
+    return NULL;
+}
+
+static void stress(bool flush)
+{
+    FrameRing ring("test");
+    Run run = { &ring, 0, 0, 0 };
+    pthread_t producerThread, flushThread;
+    int received = 0, last = -1;
+
+    // RECORD_BUFFERS_8x50, the smallest video busy queue
+    CHECK(ring.init(8));
+    if (TEST_FAILURES())
+        return;
+    pthread_create(&producerThread, NULL, producer, &run);
+    if (flush)
+        pthread_create(&flushThread, NULL, flusher, &run);
+
+    for (;;) {
+        bool done = android_atomic_acquire_load(&run.done);
+        struct msm_frame *frame;
+
+        while ((frame = ring.get()) != NULL) {
+            CHECK(frame->seq > last && (flush || frame->seq == last + 1));
+            if (TEST_FAILURES()) {
+                printf("frame %d after %d\n", frame->seq, last);
+                return;
+            }
+            last = frame->seq;
+            received++;
+        }
+        if (done && ring.count() == 0)
+            break;
+        ring.wait();
+    }
+
+    pthread_join(producerThread, NULL);
+    if (flush)
+        pthread_join(flushThread, NULL);
+
+    printf("%s: %d received, %d flushed, producer found the ring full %d times\n",
+           flush ? "with flushes" : "in order", received, run.dropped, run.full);
+    CHECK(received + run.dropped == kFrames);
+}
+
+int main()
+{
+    stress(false);
+    if (!TEST_FAILURES())
+        stress(true);
+    return TEST_FAILURES() ? 1 : 0;
+}
@@ -0,0 +1,524 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Decodes what jpeg_encode_yuv420sp writes with libjpeg and compares it
+ * with the source frame and with libjpeg's own encoding at the same
+ * quality, at odd sizes and both chroma orders. Every thread count has
+ * to decode to the same pixels, also with several encoders running at
+ * once. The thumbnail in APP1 has to decode too, and a jpeg-target-size
+ * has to be met. Then times the 5 and 8 MP encodes per thread count.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <jpeglib.h>
+
+#include "JpegEncoder.h"
+#include "TestUtil.h"
+
+using namespace android;
+
+struct Buffer {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+};
+
+static void append(const uint8_t *data, uint32_t size, void *user)
+{
+    Buffer *b = (Buffer *)user;
+
+    if (b->size + size > b->capacity) {
+        b->capacity = (b->size + size) * 2;
+        b->data = (uint8_t *)realloc(b->data, b->capacity);
+    }
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+/* Smooth areas, fine texture and hard edges, like a photo has. */
+static uint8_t *make_image(yuv_sp_frame_t *image, int width, int height)
+{
+    uint8_t *pixels = (uint8_t *)malloc(width * height * 3 / 2);
+
+    yuv_sp_frame_init(image, pixels, width, height, width);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            double v = 128 + 50 * sin(x / 23.0) * cos(y / 31.0) + rnd(17) - 8;
+            if (((x / 64) + (y / 48)) % 5 == 0)
+                v = (x + y) % 8 < 4 ? 30 : 220;
+            image->y[y * width + x] = v < 0 ? 0 : (v > 255 ? 255 : (int)v);
+        }
+    }
+    for (int y = 0; y < height / 2; y++) {
+        for (int x = 0; x < width; x += 2) {
+            image->uv[y * width + x] = 128 + 40 * sin((x + y) / 40.0) + rnd(5);
+            image->uv[y * width + x + 1] = 128 + 40 * cos((x - y) / 50.0) + rnd(5);
+        }
+    }
+    return pixels;
+}
+
+struct Error {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+static void error_exit(j_common_ptr cinfo)
+{
+    longjmp(((Error *)cinfo->err)->jump, 1);
+}
+
+/* A decoded picture, YCbCr with the chroma repeated 2x2. */
+struct Decoded {
+    int width;
+    int height;
+    uint8_t *pixels;
+    uint8_t *app1;
+    size_t app1_size;
+};
+
+static void free_decoded(Decoded *d)
+{
+    free(d->pixels);
+    free(d->app1);
+    memset(d, 0, sizeof(*d));
+}
+
+static bool decode(const uint8_t *data, size_t size, Decoded *out)
+{
+    struct jpeg_decompress_struct cinfo;
+    Error err;
+
+    memset(out, 0, sizeof(*out));
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = error_exit;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        free_decoded(out);
+        return false;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char *)data, size);
+    jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xffff);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_YCbCr;
+    cinfo.do_fancy_upsampling = FALSE;
+    jpeg_start_decompress(&cinfo);
+
+    out->width = cinfo.output_width;
+    out->height = cinfo.output_height;
+    out->pixels = (uint8_t *)malloc(out->width * out->height * 3);
+    for (jpeg_saved_marker_ptr m = cinfo.marker_list; m != NULL; m = m->next) {
+        if (m->marker == JPEG_APP0 + 1 && out->app1 == NULL) {
+            out->app1 = (uint8_t *)malloc(m->data_length);
+            memcpy(out->app1, m->data, m->data_length);
+            out->app1_size = m->data_length;
+        }
+    }
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = out->pixels + cinfo.output_scanline * out->width * 3;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+/* libjpeg's encoding of the frame, for the quality to compare against. */
+static void encode_libjpeg(const yuv_sp_frame_t *image, bool nv21, int quality,
+                           Buffer *out)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned char *data = NULL;
+    unsigned long size = 0;
+    int cb = nv21 ? 1 : 0;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &data, &size);
+    cinfo.image_width = image->width;
+    cinfo.image_height = image->height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.dct_method = JDCT_FLOAT;
+    jpeg_start_compress(&cinfo, TRUE);
+
+    uint8_t *row = (uint8_t *)malloc(image->width * 3);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        int y = cinfo.next_scanline;
+        const uint8_t *uv = image->uv + (y / 2) * image->uv_stride;
+        for (int x = 0; x < image->width; x++) {
+            row[x * 3] = image->y[y * image->y_stride + x];
+            row[x * 3 + 1] = uv[(x & ~1) + cb];
+            row[x * 3 + 2] = uv[(x & ~1) + 1 - cb];
+        }
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    free(row);
+
+    out->size = 0;
+    append(data, size, out);
+    free(data);
+}
+
+/* PSNR of the decoded luma and chroma against the frame. */
+static void psnr(const yuv_sp_frame_t *image, bool nv21, const Decoded *d,
+                 double *luma, double *chroma)
+{
+    double ey = 0, ec = 0;
+    int cb = nv21 ? 1 : 0;
+
+    for (int y = 0; y < image->height; y++) {
+        const uint8_t *uv = image->uv + (y / 2) * image->uv_stride;
+        for (int x = 0; x < image->width; x++) {
+            const uint8_t *p = d->pixels + (y * d->width + x) * 3;
+            double dy = p[0] - image->y[y * image->y_stride + x];
+            double du = p[1] - uv[(x & ~1) + cb];
+            double dv = p[2] - uv[(x & ~1) + 1 - cb];
+            ey += dy * dy;
+            ec += du * du + dv * dv;
+        }
+    }
+    double n = (double)image->width * image->height;
+    *luma = 10 * log10(255.0 * 255.0 / (ey / n + 1e-9));
+    *chroma = 10 * log10(255.0 * 255.0 / (ec / (2 * n) + 1e-9));
+}
+
+static int encode(const yuv_sp_frame_t *image, bool nv21, int quality,
+                  int threads, Buffer *out)
+{
+    jpeg_encode_params_t params;
+
+    jpeg_encode_params_init(&params);
+    params.quality = quality;
+    params.nv21 = nv21;
+    params.threads = threads;
+    params.output = append;
+    params.user = out;
+    out->size = 0;
+    return jpeg_encode_yuv420sp(image, &params);
+}
+
+static void check_decode()
+{
+    static const int sizes[][2] = { {650, 482}, {1280, 720}, {16, 16}, {2, 2} };
+    static const int qualities[] = { 50, 90 };
+    Buffer ours = { NULL, 0, 0 }, theirs = { NULL, 0, 0 };
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        yuv_sp_frame_t image;
+        uint8_t *pixels = make_image(&image, sizes[s][0], sizes[s][1]);
+
+        for (int nv21 = 0; nv21 < 2; nv21++) {
+            for (size_t q = 0; q < sizeof(qualities) / sizeof(qualities[0]); q++) {
+                Decoded a, b;
+                double ly, lc, ry, rc;
+
+                int size = encode(&image, nv21, qualities[q], 1, &ours);
+                CHECK(size > 0 && (size_t)size == ours.size);
+                CHECK(decode(ours.data, ours.size, &a));
+                if (a.pixels == NULL)
+                    continue;
+                CHECK(a.width == image.width && a.height == image.height);
+                encode_libjpeg(&image, nv21, qualities[q], &theirs);
+                CHECK(decode(theirs.data, theirs.size, &b));
+                psnr(&image, nv21, &a, &ly, &lc);
+                psnr(&image, nv21, &b, &ry, &rc);
+
+                // Same tables and DCT: about the same quality and size.
+                CHECK(ly > ry - 0.5 && lc > rc - 0.5);
+                CHECK(ours.size < theirs.size * 1.1 + 64);
+                if (image.width >= 640) {
+                    printf("%dx%d %s q%d: %u bytes, %.2f/%.2f dB, "
+                           "libjpeg %u bytes, %.2f/%.2f dB\n",
+                           image.width, image.height, nv21 ? "nv21" : "nv12",
+                           qualities[q], (unsigned)ours.size, ly, lc,
+                           (unsigned)theirs.size, ry, rc);
+                }
+                free_decoded(&a);
+                free_decoded(&b);
+            }
+        }
+        free(pixels);
+    }
+
+    yuv_sp_frame_t odd;
+    uint8_t *pixels = make_image(&odd, 64, 64);
+    odd.width = 63;
+    CHECK(encode(&odd, true, 90, 1, &ours) == -1);
+    free(pixels);
+    free(ours.data);
+    free(theirs.data);
+}
+
+struct Concurrent {
+    const yuv_sp_frame_t *image;
+    const Buffer *expected;
+    int mismatches;
+};
+
+static void *encode_thread(void *arg)
+{
+    Concurrent *c = (Concurrent *)arg;
+    Buffer out = { NULL, 0, 0 };
+
+    for (int i = 0; i < 20; i++) {
+        encode(c->image, true, 85, 4, &out);
+        if (out.size != c->expected->size ||
+            memcmp(out.data, c->expected->data, out.size))
+            c->mismatches++;
+    }
+    free(out.data);
+    return NULL;
+}
+
+static void check_threads()
+{
+    static const int sizes[][2] = { {650, 482}, {320, 32}, {1280, 720} };
+    Buffer out = { NULL, 0, 0 };
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        yuv_sp_frame_t image;
+        uint8_t *pixels = make_image(&image, sizes[s][0], sizes[s][1]);
+        Decoded single;
+
+        encode(&image, true, 85, 1, &out);
+        CHECK(decode(out.data, out.size, &single));
+        for (int threads = 2; threads <= 8; threads++) {
+            Decoded d;
+            encode(&image, true, 85, threads, &out);
+            CHECK(decode(out.data, out.size, &d));
+            CHECK(d.pixels != NULL && single.pixels != NULL &&
+                  !memcmp(d.pixels, single.pixels, d.width * d.height * 3));
+            free_decoded(&d);
+        }
+        free_decoded(&single);
+        free(pixels);
+    }
+
+    // Encoders started together share the pool or code alone, the
+    // stream must not depend on which.
+    yuv_sp_frame_t image;
+    uint8_t *pixels = make_image(&image, 650, 482);
+    Buffer expected = { NULL, 0, 0 };
+    Concurrent runs[3];
+    pthread_t threads[3];
+
+    encode(&image, true, 85, 4, &expected);
+    for (int i = 0; i < 3; i++) {
+        runs[i].image = &image;
+        runs[i].expected = &expected;
+        runs[i].mismatches = 0;
+        pthread_create(&threads[i], NULL, encode_thread, &runs[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        pthread_join(threads[i], NULL);
+        CHECK(runs[i].mismatches == 0);
+    }
+    free(expected.data);
+    free(pixels);
+    free(out.data);
+}
+
+static inline uint16_t le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t le32(const uint8_t *p)
+{
+    return le16(p) | ((uint32_t)le16(p + 2) << 16);
+}
+
+/* Value of a SHORT or LONG tag in the IFD at offset, -1 if it is not there. */
+static long ifd_value(const uint8_t *tiff, size_t size, uint32_t offset,
+                      uint16_t tag)
+{
+    if (offset + 2 > size)
+        return -1;
+    int count = le16(tiff + offset);
+    for (int i = 0; i < count && offset + 2 + (i + 1) * 12 <= size; i++) {
+        const uint8_t *e = tiff + offset + 2 + i * 12;
+        if (le16(e) == tag)
+            return le16(e + 2) == 3 ? le16(e + 8) : (long)le32(e + 8);
+    }
+    return -1;
+}
+
+static void check_thumbnail()
+{
+    yuv_sp_frame_t image;
+    uint8_t *pixels = make_image(&image, 1280, 960);
+    uint8_t *thumbnail = (uint8_t *)malloc(320 * 240 * 3 / 2);
+    Buffer out = { NULL, 0, 0 };
+    ExifBuilder exif;
+    jpeg_encode_params_t params;
+    Decoded main, thumb;
+
+    exif.setCamera("QCOM-AA", "test");
+    exif.setOrientation(90);
+    exif.setPictureSize(image.width, image.height);
+    jpeg_encode_params_init(&params);
+    params.thumbnail_width = 320;
+    params.thumbnail_height = 240;
+    params.thumbnail_buffer = thumbnail;
+    params.exif = &exif;
+    params.threads = 4;
+    params.output = append;
+    params.user = &out;
+    CHECK(jpeg_encode_yuv420sp(&image, &params) == (int)out.size);
+    CHECK(decode(out.data, out.size, &main));
+    CHECK(main.width == 1280 && main.height == 960);
+
+    // "Exif\0\0", then a little endian TIFF with IFD0 linking to IFD1
+    const uint8_t *tiff = main.app1 + 6;
+    size_t size = main.app1_size - 6;
+    CHECK(main.app1 != NULL && main.app1_size > 14 &&
+          !memcmp(main.app1, "Exif\0\0II*\0", 10));
+    if (main.app1 != NULL && main.app1_size > 14) {
+        uint32_t ifd0 = le32(tiff + 4);
+        CHECK(ifd_value(tiff, size, ifd0, 0x0112) == 6);
+        uint32_t ifd1 = le32(tiff + ifd0 + 2 + le16(tiff + ifd0) * 12);
+        long offset = ifd_value(tiff, size, ifd1, 0x0201);
+        long length = ifd_value(tiff, size, ifd1, 0x0202);
+        CHECK(offset > 0 && length > 0 && (size_t)(offset + length) <= size);
+        if (offset > 0 && length > 0 && (size_t)(offset + length) <= size) {
+            CHECK(decode(tiff + offset, length, &thumb));
+            CHECK(thumb.width == 320 && thumb.height == 240);
+            free_decoded(&thumb);
+        }
+    }
+    free_decoded(&main);
+
+    // Without EXIF there is no APP1 and no thumbnail
+    params.exif = NULL;
+    out.size = 0;
+    CHECK(jpeg_encode_yuv420sp(&image, &params) == (int)out.size);
+    CHECK(decode(out.data, out.size, &main));
+    CHECK(main.app1 == NULL);
+    free_decoded(&main);
+
+    free(out.data);
+    free(thumbnail);
+    free(pixels);
+}
+
+static void check_target_size()
+{
+    static const int sizes[][2] = { {640, 480}, {1280, 960} };
+    static const int percents[] = { 20, 40, 70, 100, 130 };
+    Buffer out = { NULL, 0, 0 };
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        yuv_sp_frame_t image;
+        uint8_t *pixels = make_image(&image, sizes[s][0], sizes[s][1]);
+        uint32_t q90 = encode(&image, true, 90, 0, &out);
+
+        for (size_t p = 0; p < sizeof(percents) / sizeof(percents[0]); p++) {
+            uint32_t target = q90 / 100 * percents[p];
+            jpeg_encode_params_t params;
+            jpeg_encode_stats_t stats;
+            Decoded d;
+
+            jpeg_encode_params_init(&params);
+            params.target_size = target;
+            params.output = append;
+            params.user = &out;
+            params.stats = &stats;
+            out.size = 0;
+            int size = jpeg_encode_yuv420sp(&image, &params);
+            CHECK(size == (int)out.size && size == stats.size);
+            CHECK((uint32_t)size <= target || stats.quality == 1);
+            CHECK(stats.passes >= 1 && stats.passes <= 2);
+            CHECK(decode(out.data, out.size, &d));
+            free_decoded(&d);
+
+            // The prediction alone should land close to the target.
+            int quality = jpeg_estimate_quality(&image, true, target);
+            CHECK(quality >= 1 && quality <= 100);
+            uint32_t predicted = encode(&image, true, quality, 0, &out);
+            CHECK(quality == 1 || quality == 100 ||
+                  (predicted > target / 100 * 60 && predicted < target / 100 * 120));
+
+            printf("%dx%d target %u: %d bytes at q%d in %d passes, "
+                   "%.1f ms extra; predicted q%d gives %u bytes\n",
+                   image.width, image.height, target, size, stats.quality,
+                   stats.passes, stats.extra_time / 1e6, quality, predicted);
+        }
+        free(pixels);
+    }
+    free(out.data);
+}
+
+static void benchmark()
+{
+    static const int sizes[][2] = { {2592, 1944}, {3264, 2448} };
+    Buffer out = { NULL, 0, 0 };
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        yuv_sp_frame_t image;
+        uint8_t *pixels = make_image(&image, sizes[s][0], sizes[s][1]);
+        double single = 0;
+
+        for (int threads = 1; threads <= cpus; threads++) {
+            double best = 1e9;
+            for (int r = 0; r < 3; r++) {
+                double start = now_ms();
+                encode(&image, true, 85, threads, &out);
+                double t = now_ms() - start;
+                if (t < best)
+                    best = t;
+            }
+            if (threads == 1)
+                single = best;
+            printf("%dx%d q85 (%s): %d threads %.1f ms, %.2fx, %u bytes\n",
+                   image.width, image.height, jpeg_encoder_impl_name(),
+                   threads, best, single / best, (unsigned)out.size);
+        }
+        free(pixels);
+    }
+    free(out.data);
+}
+
+int main(int argc, char **argv)
+{
+    srand(1);
+    printf("jpeg encoder: %s kernels\n", jpeg_encoder_impl_name());
+    check_decode();
+    check_threads();
+    check_thumbnail();
+    check_target_size();
+    if (TEST_FAILURES())
+        return 1;
+    printf("decodes: match libjpeg\n");
+
+    if (want_benchmarks(argc, argv))
+        benchmark();
+    return 0;
+}
@@ -0,0 +1,353 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Lays out pools of odd buffer sizes and CbCr offsets and checks that no
+ * two buffers share a page and every frame stays inside its buffer. Then
+ * allocates, maps and shares regions from each MemAllocator this build
+ * has, memfd-huge falling back to small pages when the kernel has no huge
+ * ones. The MemBudget part charges pools over a limit and checks that
+ * the cached snapshot pools are evicted before the preview and record
+ * ones, and the per pool peaks. The benchmark times allocating, mapping
+ * and touching a set of record buffers per allocator.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "MemAlloc.h"
+#include "TestUtil.h"
+
+using namespace android;
+
+#define HUGE_PAGE (2U << 20)
+
+static void check_layout(const mem_layout_t *l, int buffer_size, int num_buffers,
+                         size_t align)
+{
+    CHECK(l->buffer_size == buffer_size && l->num_buffers == num_buffers);
+    CHECK(l->aligned_buffer_size % align == 0);
+    CHECK(l->aligned_buffer_size >= buffer_size);
+    CHECK((size_t)l->aligned_buffer_size < buffer_size + align);
+    CHECK(l->heap_size == (size_t)l->aligned_buffer_size * num_buffers);
+
+    for (int i = 0; i < num_buffers; i++) {
+        uint32_t offset = mem_layout_offset(l, i);
+        CHECK(offset % align == 0);
+        CHECK(offset + buffer_size <= l->heap_size);
+        if (i > 0)
+            CHECK(mem_layout_offset(l, i - 1) + buffer_size <= offset);
+        CHECK(mem_layout_cbcr(l, i) == offset + l->cbcr_offset);
+        CHECK(mem_layout_cbcr(l, i) < offset + buffer_size);
+    }
+}
+
+static void check_layouts(int iterations)
+{
+    // Preview, record and snapshot frames as the HAL lays them out
+    static const struct {
+        int width, height, cbcr_align, count;
+    } frames[] = {
+        { 176, 144, 1, 4 }, { 800, 480, 2048, 6 }, { 1280, 720, 2048, 6 },
+        { 1920, 1088, 2048, 8 }, { 2592, 1944, 1, 1 }, { 3264, 2448, 4096, 2 },
+        { 642, 482, 1, 3 },
+    };
+    static const size_t aligns[] = { 4096, 4096 * 4, HUGE_PAGE };
+    mem_layout_t l;
+
+    for (size_t f = 0; f < sizeof(frames) / sizeof(frames[0]); f++) {
+        int y = frames[f].width * frames[f].height;
+        int a = frames[f].cbcr_align;
+        int cbcr = (y + a - 1) / a * a;
+        int size = cbcr + y / 2;
+        for (size_t i = 0; i < sizeof(aligns) / sizeof(aligns[0]); i++) {
+            mem_layout_init(&l, size, frames[f].count, size, cbcr, aligns[i]);
+            check_layout(&l, size, frames[f].count, aligns[i]);
+        }
+    }
+
+    for (int it = 0; it < iterations; it++) {
+        int size = 1 + rnd(8 << 20);
+        int frame = 1 + rnd(size);
+        int cbcr = rnd(frame);
+        int count = 1 + rnd(16);
+        size_t align = (size_t)4096 << rnd(10);
+        mem_layout_init(&l, size, count, frame, cbcr, align);
+        check_layout(&l, size, count, align);
+        CHECK(l.frame_size == frame && l.cbcr_offset == cbcr);
+        if (TEST_FAILURES()) {
+            printf("%d buffers of %d, frame %d, cbcr at %d, align %u\n",
+                   count, size, frame, cbcr, (unsigned)align);
+            return;
+        }
+    }
+}
+
+/* Whether the pages the fd maps are shared: a second mapping sees them. */
+static bool check_region(int fd, size_t size)
+{
+    uint8_t *a = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    uint8_t *b = (uint8_t *)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    bool ok = a != MAP_FAILED && b != MAP_FAILED;
+
+    if (ok) {
+        for (size_t i = 0; i < size; i += 4096)
+            a[i] = i >> 12;
+        a[size - 1] = 0x5a;
+        for (size_t i = 0; ok && i < size; i += 4096)
+            ok = b[i] == (uint8_t)(i >> 12);
+        ok = ok && b[size - 1] == 0x5a;
+    }
+    if (a != MAP_FAILED)
+        munmap(a, size);
+    if (b != MAP_FAILED)
+        munmap(b, size);
+    return ok;
+}
+
+static void check_allocators()
+{
+    static const char *kinds[] = { "ashmem", "memfd", "memfd-huge" };
+    static const size_t sizes[] = { 1, 4095, 4097, (3 << 20) / 2 + 3, 3133440 };
+    size_t page = getpagesize();
+
+    CHECK(MemAllocator::create("pmem") == NULL);
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        MemAllocator *allocator = MemAllocator::create(kinds[k]);
+        int huge = 0;
+
+        if (allocator == NULL) {
+            printf("%s: not in this build\n", kinds[k]);
+            continue;
+        }
+        CHECK(!strcmp(allocator->name(), kinds[k]));
+        CHECK(MemAllocator::create(kinds[k]) == allocator);
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            size_t size = sizes[s];
+            int fd = allocator->allocate("mem_alloc_test", &size);
+
+            CHECK(fd >= 0);
+            if (fd < 0)
+                continue;
+            // Huge pages when there were some to spare, page rounded
+            // small ones otherwise.
+            if (size % HUGE_PAGE == 0 && size >= sizes[s] && size - sizes[s] < HUGE_PAGE &&
+                strstr(kinds[k], "huge") != NULL)
+                huge++;
+            else
+                CHECK(size == (sizes[s] + page - 1) / page * page);
+            CHECK(check_region(fd, size));
+            close(fd);
+        }
+        printf("%s: %d of %d regions on huge pages\n", kinds[k], huge,
+               (int)(sizeof(sizes) / sizeof(sizes[0])));
+    }
+}
+
+/* A cache of pools an evictor drops in one go. */
+struct Cache {
+    MemBudget *budget;
+    const char *names[2];
+    size_t bytes[2];
+    bool held;
+    int *order;
+    int id;
+};
+
+static void cache_fill(Cache *c)
+{
+    for (int i = 0; i < 2; i++)
+        CHECK(c->budget->charge(c->names[i], c->bytes[i]));
+    c->held = true;
+}
+
+static bool cache_evict(void *user)
+{
+    Cache *c = (Cache *)user;
+
+    if (!c->held)
+        return false;
+    for (int i = 0; i < 2; i++)
+        c->budget->refund(c->names[i], c->bytes[i]);
+    c->held = false;
+    *c->order = *c->order * 10 + c->id;
+    return true;
+}
+
+static size_t pool_bytes(const MemBudget &budget, const char *name, size_t *peak)
+{
+    const char *n;
+    size_t current, p;
+
+    for (int i = 0; budget.pool(i, &n, &current, &p); i++) {
+        if (!strcmp(n, name)) {
+            *peak = p;
+            return current;
+        }
+    }
+    *peak = 0;
+    return 0;
+}
+
+static void check_budget()
+{
+    const size_t MB = 1 << 20;
+    MemBudget budget;
+    int order = 0;
+    Cache snapshot = { &budget, { "snapshot", "thumbnail" }, { 6 * MB, 1 * MB }, false, &order, 1 };
+    Cache preview = { &budget, { "preview", "record" }, { 3 * MB, 5 * MB }, false, &order, 2 };
+    size_t peak;
+
+    // Without a limit everything fits and is only counted
+    CHECK(budget.charge("raw", 100 * MB));
+    CHECK(budget.used() == 100 * MB && budget.peak() == 100 * MB);
+    budget.refund("raw", 100 * MB);
+    CHECK(budget.used() == 0 && budget.peak() == 100 * MB);
+    CHECK(pool_bytes(budget, "raw", &peak) == 0 && peak == 100 * MB);
+
+    // Over the limit with nothing to evict the charge fails and costs nothing
+    budget.setLimit(20 * MB);
+    CHECK(budget.limit() == 20 * MB);
+    CHECK(budget.charge("raw", 12 * MB));
+    CHECK(!budget.charge("jpeg", 9 * MB));
+    CHECK(budget.used() == 12 * MB);
+    CHECK(pool_bytes(budget, "jpeg", &peak) == 0 && peak == 0);
+    budget.refund("raw", 12 * MB);
+
+    // The snapshot cache goes first, the preview one only when that is
+    // not enough
+    budget.addEvictor(cache_evict, &snapshot);
+    budget.addEvictor(cache_evict, &preview);
+    cache_fill(&snapshot);
+    cache_fill(&preview);
+    CHECK(budget.used() == 15 * MB);
+    CHECK(budget.charge("raw", 8 * MB));
+    CHECK(order == 1 && !snapshot.held && preview.held);
+    CHECK(budget.used() == 16 * MB);
+    CHECK(budget.charge("jpeg", 4 * MB));
+    CHECK(order == 1 && budget.used() == 20 * MB);
+    CHECK(budget.charge("postview", 4 * MB));
+    CHECK(order == 12 && !preview.held && budget.used() == 16 * MB);
+
+    // Nothing cached is left to drop
+    CHECK(!budget.charge("jpeg", 8 * MB));
+    CHECK(order == 12 && budget.used() == 16 * MB);
+
+    // Refunds keep the peaks
+    CHECK(pool_bytes(budget, "snapshot", &peak) == 0 && peak == 6 * MB);
+    CHECK(pool_bytes(budget, "record", &peak) == 0 && peak == 5 * MB);
+    CHECK(pool_bytes(budget, "jpeg", &peak) == 4 * MB && peak == 4 * MB);
+    budget.refund("raw", 8 * MB);
+    budget.refund("jpeg", 4 * MB);
+    budget.refund("postview", 4 * MB);
+    CHECK(budget.used() == 0 && budget.peak() == 100 * MB);
+    CHECK(pool_bytes(budget, "raw", &peak) == 0 && peak == 100 * MB);
+
+    // Evictors of a closed camera are not asked any more
+    cache_fill(&snapshot);
+    budget.removeEvictors(&snapshot);
+    CHECK(!budget.charge("raw", 14 * MB));
+    CHECK(snapshot.held && order == 12);
+    budget.removeEvictors(&preview);
+    budget.refund("snapshot", 6 * MB);
+    budget.refund("thumbnail", 1 * MB);
+
+    // Names past the table are counted together
+    char names[20][8];
+    for (int i = 0; i < 20; i++) {
+        snprintf(names[i], sizeof(names[i]), "pool%d", i);
+        CHECK(budget.charge(names[i], MB / 2));
+    }
+    int count = 0;
+    const char *name;
+    size_t current;
+    while (budget.pool(count, &name, &current, &peak))
+        count++;
+    CHECK(count == 16);
+    CHECK(pool_bytes(budget, "other", &peak) > MB / 2);
+    for (int i = 0; i < 20; i++)
+        budget.refund(names[i], MB / 2);
+    CHECK(budget.used() == 0);
+}
+
+static void benchmark()
+{
+    static const char *kinds[] = { "ashmem", "memfd", "memfd-huge" };
+    // RECORD_BUFFERS of 1280x720 NV12 with the CbCr plane 2K aligned
+    const int count = 9;
+    size_t want = 1384448;
+
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        MemAllocator *allocator = MemAllocator::create(kinds[k]);
+        if (allocator == NULL)
+            continue;
+
+        double best = 1e9, touch = 1e9;
+        for (int r = 0; r < 5; r++) {
+            int fds[count];
+            uint8_t *bases[count];
+            size_t size = want;
+
+            double start = now_ms();
+            for (int i = 0; i < count; i++) {
+                size = want;
+                fds[i] = allocator->allocate("bench", &size);
+                bases[i] = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED, fds[i], 0);
+                memset(bases[i], 0x80, size);
+            }
+            double t = now_ms() - start;
+            if (t < best)
+                best = t;
+
+            // A pass over every frame, as the CPU consumers make
+            start = now_ms();
+            unsigned sum = 0;
+            for (int i = 0; i < count; i++) {
+                for (size_t j = 0; j < size; j += 64)
+                    sum += bases[i][j];
+            }
+            t = now_ms() - start;
+            if (t < touch && sum)
+                touch = t;
+
+            for (int i = 0; i < count; i++) {
+                munmap(bases[i], size);
+                close(fds[i]);
+            }
+        }
+        printf("%-10s %d x %u bytes: allocate and fill %.2f ms, read %.2f ms\n",
+               kinds[k], count, (unsigned)want, best, touch);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    srand(1);
+    check_layouts(100000);
+    check_allocators();
+    check_budget();
+    if (TEST_FAILURES())
+        return 1;
+    printf("layouts, allocators and budget: ok\n");
+
+    if (want_benchmarks(argc, argv))
+        benchmark();
+    return 0;
+}
@@ -0,0 +1,318 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Drives RecordBuffers and RecordFrameGaps the way runVideoThread,
+ * releaseRecordingFrame and runLiveshotThread do. First every ordering of
+ * a pinned buffer's releases is played through one step at a time, then
+ * three threads run them against each other. A buffer must go back to
+ * camframe exactly once per delivery and never while the live snapshot
+ * still reads it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <cutils/atomic.h>
+
+#include "RecordBuffers.h"
+#include "TestUtil.h"
+
+using namespace android;
+
+// runVideoThread up to the callback
+static void deliver(RecordBuffers &buffers, int index)
+{
+    CHECK(buffers.move(index, (1 << RECORD_BUFFER_KERNEL) |
+                       (1 << RECORD_BUFFER_CAMFRAME), RECORD_BUFFER_BUSY));
+    CHECK(buffers.move(index, 1 << RECORD_BUFFER_BUSY, RECORD_BUFFER_CLIENT));
+}
+
+// releaseRecordingFrame, true when it gives the buffer back
+static bool clientRelease(RecordBuffers &buffers, int index)
+{
+    if (!buffers.move(index, 1 << RECORD_BUFFER_CLIENT, RECORD_BUFFER_CAMFRAME))
+        return false;
+    return buffers.dropPin(index);
+}
+
+static void checkOrderings()
+{
+    RecordBuffers buffers;
+    buffers.init(1);
+
+    // Client first, the live snapshot gives the buffer back
+    deliver(buffers, 0);
+    buffers.pin(0);
+    CHECK(!clientRelease(buffers, 0));
+    CHECK(buffers.dropPin(0));
+    CHECK(buffers.state(0) == RECORD_BUFFER_CAMFRAME);
+
+    // Live snapshot first, the client gives it back
+    deliver(buffers, 0);
+    buffers.pin(0);
+    CHECK(!buffers.dropPin(0));
+    CHECK(buffers.state(0) == RECORD_BUFFER_CLIENT);
+    CHECK(clientRelease(buffers, 0));
+
+    // The live snapshot thread did not start
+    deliver(buffers, 0);
+    buffers.pin(0);
+    buffers.unpin(0);
+    CHECK(clientRelease(buffers, 0));
+
+    // A second release of the same frame does nothing
+    deliver(buffers, 0);
+    CHECK(clientRelease(buffers, 0));
+    CHECK(!clientRelease(buffers, 0));
+
+    // Nobody takes the callback: runVideoThread drops the client's hold
+    deliver(buffers, 0);
+    buffers.pin(0);
+    CHECK(!clientRelease(buffers, 0));
+    CHECK(buffers.dropPin(0));
+
+    // A stray release of a buffer on the busy queue is refused
+    CHECK(buffers.move(0, 1 << RECORD_BUFFER_CAMFRAME, RECORD_BUFFER_BUSY));
+    CHECK(!clientRelease(buffers, 0));
+    CHECK(buffers.state(0) == RECORD_BUFFER_BUSY);
+
+    buffers.reset();
+    CHECK(buffers.state(0) == RECORD_BUFFER_KERNEL);
+}
+
+static void checkGaps()
+{
+    RecordFrameGaps gaps;
+    const nsecs_t interval = 33333333;
+    nsecs_t ts = s2ns(10);
+
+    for (int i = 0; i < 30; i++, ts += interval)
+        CHECK(gaps.frame(ts) == -1);
+
+    // Three frames lost while encoding, counted with the one after
+    gaps.startEncode();
+    CHECK(gaps.frame(ts) == -1);
+    ts += 4 * interval;
+    CHECK(gaps.frame(ts) == -1);
+    gaps.endEncode();
+    ts += interval;
+    CHECK(gaps.frame(ts) == 3);
+    ts += interval;
+    CHECK(gaps.frame(ts) == -1);
+    CHECK(gaps.totalDrops() == 3);
+
+    // A snapshot that did not start costs nothing
+    gaps.startEncode();
+    gaps.cancelEncode();
+    ts += 3 * interval;
+    CHECK(gaps.frame(ts) == -1);
+    CHECK(gaps.totalDrops() == 3);
+
+    // A pause of more than a second is not a drop
+    gaps.startEncode();
+    gaps.endEncode();
+    ts += s2ns(2);
+    CHECK(gaps.frame(ts) == -1);
+    ts += interval;
+    CHECK(gaps.frame(ts) == 0);
+    CHECK(gaps.totalDrops() == 3);
+}
+
+/* Threads */
+
+enum { kBuffers = 8, kFrames = 200000 };
+
+// Every buffer and the end marker fit, with one slot left to tell a full
+// queue from an empty one.
+struct Queue {
+    int items[kBuffers + 2];
+    int head, tail;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static void queueInit(Queue *q)
+{
+    q->head = q->tail = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+}
+
+static void queuePush(Queue *q, int item)
+{
+    pthread_mutex_lock(&q->lock);
+    q->items[q->tail] = item;
+    q->tail = (q->tail + 1) % (kBuffers + 2);
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static int queuePop(Queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->head == q->tail)
+        pthread_cond_wait(&q->cond, &q->lock);
+    int item = q->items[q->head];
+    q->head = (q->head + 1) % (kBuffers + 2);
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+static RecordBuffers gBuffers;
+static RecordFrameGaps gGaps;
+static Queue gKernel, gClient, gLiveshot;
+static volatile int32_t gDelivered[kBuffers];  // with the client or snapshot
+static volatile int32_t gReading[kBuffers];    // the snapshot reads it
+static volatile int32_t gLiveshotBusy;
+static volatile int32_t gFreed;
+static volatile int32_t gLiveshots;
+static volatile int32_t gDoubleReleases;
+
+static void spin(int n)
+{
+    for (volatile int i = 0; i < n; i++)
+        ;
+}
+
+// LINK_camframe_free_video, and the VFE filling the buffer again
+static void freeVideo(int index)
+{
+    CHECK(gBuffers.state(index) == RECORD_BUFFER_CAMFRAME);
+    CHECK(android_atomic_acquire_load(&gReading[index]) == 0);
+    CHECK(android_atomic_cmpxchg(1, 0, &gDelivered[index]) == 0);
+    android_atomic_inc(&gFreed);
+    CHECK(gBuffers.move(index, 1 << RECORD_BUFFER_CAMFRAME, RECORD_BUFFER_KERNEL));
+    queuePush(&gKernel, index);
+}
+
+static void *videoThread(void *)
+{
+    nsecs_t ts = 0;
+
+    for (int frame = 0; frame < kFrames; frame++) {
+        int index = queuePop(&gKernel);
+        int r = rand();
+
+        deliver(gBuffers, index);
+        android_atomic_release_store(1, &gDelivered[index]);
+        ts += 33333333;
+        gGaps.frame(ts);
+
+        if (frame % 7 == 0 && android_atomic_cmpxchg(0, 1, &gLiveshotBusy) == 0) {
+            gBuffers.pin(index);
+            if (r % 5 == 0) {
+                // pthread_create failed
+                gBuffers.unpin(index);
+                android_atomic_release_store(0, &gLiveshotBusy);
+            } else {
+                android_atomic_release_store(1, &gReading[index]);
+                gGaps.startEncode();
+                queuePush(&gLiveshot, index);
+            }
+        }
+
+        if (r % 16 == 1) {
+            // No recording callback
+            if (clientRelease(gBuffers, index))
+                freeVideo(index);
+        } else {
+            queuePush(&gClient, index);
+        }
+    }
+    queuePush(&gClient, -1);
+    queuePush(&gLiveshot, -1);
+    return NULL;
+}
+
+static void *clientThread(void *)
+{
+    for (;;) {
+        int index = queuePop(&gClient);
+        if (index < 0)
+            break;
+        spin(rand() % 2000);
+        if (rand() % 32 == 0) {
+            // The release races itself, only one may win
+            bool first = clientRelease(gBuffers, index);
+            bool second = clientRelease(gBuffers, index);
+            CHECK(!second);
+            android_atomic_inc(&gDoubleReleases);
+            if (first)
+                freeVideo(index);
+        } else if (clientRelease(gBuffers, index)) {
+            freeVideo(index);
+        }
+    }
+    return NULL;
+}
+
+static void *liveshotThread(void *)
+{
+    for (;;) {
+        int index = queuePop(&gLiveshot);
+        if (index < 0)
+            break;
+        spin(rand() % 20000);
+        android_atomic_release_store(0, &gReading[index]);
+        gGaps.endEncode();
+        android_atomic_inc(&gLiveshots);
+        android_atomic_release_store(0, &gLiveshotBusy);
+        if (gBuffers.dropPin(index))
+            freeVideo(index);
+    }
+    return NULL;
+}
+
+static void checkThreads()
+{
+    pthread_t video, client, liveshot;
+
+    gBuffers.init(kBuffers);
+    queueInit(&gKernel);
+    queueInit(&gClient);
+    queueInit(&gLiveshot);
+    for (int i = 0; i < kBuffers; i++)
+        queuePush(&gKernel, i);
+
+    pthread_create(&liveshot, NULL, liveshotThread, NULL);
+    pthread_create(&client, NULL, clientThread, NULL);
+    pthread_create(&video, NULL, videoThread, NULL);
+    pthread_join(video, NULL);
+    pthread_join(client, NULL);
+    pthread_join(liveshot, NULL);
+
+    CHECK(gFreed == kFrames);
+    for (int i = 0; i < kBuffers; i++) {
+        CHECK(gBuffers.state(i) == RECORD_BUFFER_KERNEL);
+        CHECK(gDelivered[i] == 0);
+    }
+    printf("threads: %d frames, %d live snapshots, %d double releases\n",
+           (int)gFreed, (int)gLiveshots, (int)gDoubleReleases);
+}
+
+int main()
+{
+    srand(1);
+    checkOrderings();
+    checkGaps();
+    if (TEST_FAILURES() == 0)
+        checkThreads();
+    printf("%d failures\n", TEST_FAILURES());
+    return TEST_FAILURES() != 0;
+}
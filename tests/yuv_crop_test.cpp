@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compares yuv_crop with yuv_crop_reference on random crops: in place as
+ * crop_yuv420 does for the snapshot heaps, with the chroma plane of the
+ * destination left where it was, with Adreno strides and into a separate
+ * buffer. Then times the in place 8 MP zoom crops.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "YuvTransform.h"
+#include "TestUtil.h"
+
+using namespace android;
+
+#define ALIGN32(x) (((x) + 31) & ~31)
+
+enum { MODE_PACKED, MODE_ADRENO, MODE_SEPARATE, MODE_STRIDE, MODE_COUNT };
+
+static bool check_random(int iterations)
+{
+    for (int it = 0; it < iterations; it++) {
+        int w = 2 + 2 * rnd(200), h = 2 + 2 * rnd(150);
+        int cw = 2 + 2 * rnd(w / 2), ch = 2 + 2 * rnd(h / 2);
+        int x = 2 * rnd((w - cw) / 2 + 1), y = 2 * rnd((h - ch) / 2 + 1);
+        int mode = rnd(MODE_COUNT);
+        bool adreno = mode == MODE_ADRENO;
+
+        int sys = adreno ? ALIGN32(w) : w + (mode == MODE_STRIDE ? 2 * rnd(16) : 0);
+        int suv = adreno ? 2 * ALIGN32(w / 2) : sys;
+        int dys = adreno ? ALIGN32(cw) : cw;
+        int duv = adreno ? 2 * ALIGN32(cw / 2) : cw;
+
+        // Plane offsets as the encoder layouts have them
+        int syo = rnd(3) ? 0 : rnd(4096);
+        int suo = syo + sys * h + rnd(64);
+        int dyo = rnd(2) ? 0 : rnd(8192);
+        int duo = rnd(2) ? suo : dyo + dys * ch + rnd(8192);
+        if (duo < dyo + dys * ch)
+            duo = dyo + dys * ch;
+        if (adreno) {
+            dyo = syo;
+            duo = suo;
+        }
+
+        size_t size = (size_t)suo + suv * (h / 2) + 16;
+        size_t dsize = (size_t)duo + duv * (ch / 2) + 16;
+        if (dsize > size)
+            size = dsize;
+        size_t doff = mode == MODE_SEPARATE ? size : 0;
+
+        uint8_t *a = (uint8_t *)malloc(size * 2);
+        uint8_t *b = (uint8_t *)malloc(size * 2);
+        for (size_t i = 0; i < size * 2; i++)
+            a[i] = rand();
+        memcpy(b, a, size * 2);
+
+        yuv_sp_frame_t sa = { a + syo, a + suo, w, h, sys, suv };
+        yuv_sp_frame_t da = { a + doff + dyo, a + doff + duo, cw, ch, dys, duv };
+        yuv_sp_frame_t sb = { b + syo, b + suo, w, h, sys, suv };
+        yuv_sp_frame_t db = { b + doff + dyo, b + doff + duo, cw, ch, dys, duv };
+        int threads = 1 + rnd(4);
+        int ra = yuv_crop(&sa, &da, x, y, threads);
+        int rb = yuv_crop_reference(&sb, &db, x, y);
+
+        bool same = ra == rb;
+        for (int r = 0; same && r < ch; r++)
+            same = !memcmp(da.y + r * dys, db.y + r * dys, cw);
+        for (int r = 0; same && r < ch / 2; r++)
+            same = !memcmp(da.uv + r * duv, db.uv + r * duv, cw);
+        free(a);
+        free(b);
+        if (!same) {
+            printf("FAIL mode %d %dx%d -> %dx%d at %d,%d, offsets %d %d %d %d, "
+                   "%d threads (rc %d, %d)\n", mode, w, h, cw, ch, x, y,
+                   syo, suo, dyo, duo, threads, ra, rb);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void benchmark()
+{
+    static const int zooms[][2] = { {2612, 1958}, {1632, 1224}, {816, 612} };
+    const int w = 3264, h = 2448;
+    uint8_t *image = (uint8_t *)malloc(w * h * 3 / 2);
+
+    for (size_t z = 0; z < sizeof(zooms) / sizeof(zooms[0]); z++) {
+        int cw = zooms[z][0], ch = zooms[z][1];
+        for (int threads = 1; threads <= 4; threads *= 2) {
+            yuv_sp_frame_t src = { image, image + w * h, w, h, w, w };
+            yuv_sp_frame_t dst = { image, image + cw * ch, cw, ch, cw, cw };
+            memset(image, 0x80, w * h * 3 / 2);
+            double start = now_ms();
+            yuv_crop(&src, &dst, ((w - cw) / 2) & ~1, ((h - ch) / 2) & ~1, threads);
+            printf("%dx%d -> %dx%d, %d threads: %.2f ms\n", w, h, cw, ch,
+                   threads, now_ms() - start);
+        }
+    }
+    free(image);
+}
+
+int main(int argc, char **argv)
+{
+    srand(1);
+    if (!check_random(5000))
+        return 1;
+    printf("random crops: match the reference\n");
+
+    if (!want_benchmarks(argc, argv))
+        return 0;
+    benchmark();
+    return 0;
+}
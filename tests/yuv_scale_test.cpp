@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Checks yuv_scale against yuv_scale_reference on random sizes, strides
+ * and filters, then times the digital zoom upscale of upscalePicture:
+ * the zoomed part of a 5 MP picture scaled back up to 5 MP.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "YuvScale.h"
+#include "TestUtil.h"
+
+using namespace android;
+
+static const char *kNames[YUV_SCALE_MAX] = { "bilinear", "lanczos", "area" };
+
+static bool check_random(int iterations)
+{
+    for (int it = 0; it < iterations; it++) {
+        int sw = 2 + 2 * rnd(150), sh = 2 + 2 * rnd(120);
+        int dw, dh;
+        if (rnd(2)) {
+            dw = 2 + 2 * rnd(300);
+            dh = 2 + 2 * rnd(240);
+        } else {
+            dw = 2 + 2 * rnd(sw / 2);
+            dh = 2 + 2 * rnd(sh / 2);
+        }
+        int sstride = sw + 2 * rnd(8), dstride = dw + 2 * rnd(8);
+        yuv_scale_filter_t filter = (yuv_scale_filter_t)rnd(YUV_SCALE_MAX);
+        size_t ssize = (size_t)sstride * sh * 3 / 2;
+        size_t dsize = (size_t)dstride * dh * 3 / 2;
+
+        uint8_t *s = (uint8_t *)malloc(ssize);
+        uint8_t *a = (uint8_t *)calloc(1, dsize);
+        uint8_t *b = (uint8_t *)calloc(1, dsize);
+        for (size_t i = 0; i < ssize; i++)
+            s[i] = rand();
+
+        yuv_sp_frame_t src, da, db;
+        yuv_sp_frame_init(&src, s, sw, sh, sstride);
+        yuv_sp_frame_init(&da, a, dw, dh, dstride);
+        yuv_sp_frame_init(&db, b, dw, dh, dstride);
+        int threads = 1 + rnd(4);
+        int ra = yuv_scale(&src, &da, filter, threads);
+        int rb = yuv_scale_reference(&src, &db, filter);
+        bool same = ra == rb && !memcmp(a, b, dsize);
+        free(s);
+        free(a);
+        free(b);
+        if (!same) {
+            printf("FAIL %s %dx%d -> %dx%d, %d threads (rc %d, %d)\n",
+                   kNames[filter], sw, sh, dw, dh, threads, ra, rb);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Exact mean of the factor x factor block, per channel. */
+static double block_mean(const uint8_t *p, int stride, int channels, int factor)
+{
+    int sum = 0;
+    for (int y = 0; y < factor; y++)
+        for (int x = 0; x < factor; x++)
+            sum += p[y * stride + x * channels];
+    return (double)sum / (factor * factor);
+}
+
+static bool check_area()
+{
+    static const int factors[] = { 2, 3, 4, 5, 8 };
+
+    for (size_t f = 0; f < sizeof(factors) / sizeof(factors[0]); f++) {
+        int k = factors[f];
+        int dw = 2 + 2 * rnd(60), dh = 2 + 2 * rnd(40);
+        int sw = dw * k, sh = dh * k;
+        uint8_t *s = (uint8_t *)malloc(sw * sh * 3 / 2);
+        uint8_t *d = (uint8_t *)malloc(dw * dh * 3 / 2);
+        yuv_sp_frame_t src, dst;
+
+        for (int i = 0; i < sw * sh * 3 / 2; i++)
+            s[i] = rand();
+        yuv_sp_frame_init(&src, s, sw, sh, sw);
+        yuv_sp_frame_init(&dst, d, dw, dh, dw);
+        CHECK(yuv_scale(&src, &dst, YUV_SCALE_AREA, 1 + rnd(4)) == 0);
+
+        // 2x is the rounded mean, the other factors are at most one off
+        // through the 16-bit intermediate.
+        double worst = 0;
+        for (int y = 0; y < dh; y++) {
+            for (int x = 0; x < dw; x++) {
+                double m = block_mean(src.y + y * k * sw + x * k, sw, 1, k);
+                double e = fabs(dst.y[y * dw + x] - m);
+                if (e > worst)
+                    worst = e;
+            }
+        }
+        for (int y = 0; y < dh / 2; y++) {
+            for (int x = 0; x < dw; x++) {
+                const uint8_t *p = src.uv + y * k * sw + (x / 2) * k * 2 + (x & 1);
+                double e = fabs(dst.uv[y * dw + x] - block_mean(p, sw, 2, k));
+                if (e > worst)
+                    worst = e;
+            }
+        }
+        CHECK(worst <= (k == 2 ? 0.5 : 1.0));
+        free(s);
+        free(d);
+        if (TEST_FAILURES()) {
+            printf("area %dx: %dx%d -> %dx%d off by %.2f\n", k, sw, sh, dw, dh, worst);
+            return false;
+        }
+    }
+
+    // The thumbnail of a zoomed 8 MP picture, 5.1x, bit exact
+    int sw = 1632, sh = 1224, dw = 320, dh = 240;
+    uint8_t *s = (uint8_t *)malloc(sw * sh * 3 / 2);
+    uint8_t *a = (uint8_t *)malloc(dw * dh * 3 / 2);
+    uint8_t *b = (uint8_t *)malloc(dw * dh * 3 / 2);
+    yuv_sp_frame_t src, da, db;
+
+    for (int i = 0; i < sw * sh * 3 / 2; i++)
+        s[i] = rand();
+    yuv_sp_frame_init(&src, s, sw, sh, sw);
+    yuv_sp_frame_init(&da, a, dw, dh, dw);
+    yuv_sp_frame_init(&db, b, dw, dh, dw);
+    CHECK(yuv_scale(&src, &da, YUV_SCALE_AREA, 0) == 0);
+    CHECK(yuv_scale_reference(&src, &db, YUV_SCALE_AREA) == 0);
+    CHECK(!memcmp(a, b, dw * dh * 3 / 2));
+    free(s);
+    free(a);
+    free(b);
+    return TEST_FAILURES() == 0;
+}
+
+static void benchmark_thumbnail()
+{
+    const int sw = 3264, sh = 2448, dw = 320, dh = 240;
+    uint8_t *s = (uint8_t *)malloc(sw * sh * 3 / 2);
+    uint8_t *d = (uint8_t *)malloc(dw * dh * 3 / 2);
+    yuv_sp_frame_t src, dst;
+
+    for (int i = 0; i < sw * sh * 3 / 2; i++)
+        s[i] = rand();
+    yuv_sp_frame_init(&src, s, sw, sh, sw);
+    yuv_sp_frame_init(&dst, d, dw, dh, dw);
+    for (int f = YUV_SCALE_BILINEAR; f < YUV_SCALE_MAX; f++) {
+        double best = 1e9;
+        for (int r = 0; r < 3; r++) {
+            double start = now_ms();
+            yuv_scale(&src, &dst, (yuv_scale_filter_t)f, 1);
+            double t = now_ms() - start;
+            if (t < best)
+                best = t;
+        }
+        printf("%dx%d -> %dx%d thumbnail %-8s %6.2f ms\n", sw, sh, dw, dh,
+               kNames[f], best);
+    }
+    free(s);
+    free(d);
+}
+
+static void benchmark()
+{
+    // 1.25x, 2x and 4x zoom of a 5 MP picture
+    static const int zooms[][2] = { {2074, 1556}, {1296, 972}, {648, 486} };
+    const int w = 2592, h = 1944;
+    uint8_t *d = (uint8_t *)malloc(w * h * 3 / 2);
+    yuv_sp_frame_t dst;
+
+    yuv_sp_frame_init(&dst, d, w, h, w);
+    for (size_t z = 0; z < sizeof(zooms) / sizeof(zooms[0]); z++) {
+        int sw = zooms[z][0], sh = zooms[z][1];
+        uint8_t *s = (uint8_t *)malloc(sw * sh * 3 / 2);
+        yuv_sp_frame_t src;
+
+        for (int i = 0; i < sw * sh * 3 / 2; i++)
+            s[i] = rand();
+        yuv_sp_frame_init(&src, s, sw, sh, sw);
+        for (int f = YUV_SCALE_BILINEAR; f <= YUV_SCALE_LANCZOS3; f++) {
+            yuv_scale_filter_t filter = (yuv_scale_filter_t)f;
+            double one = 1e9, all = 1e9;
+            for (int r = 0; r < 3; r++) {
+                double start = now_ms();
+                yuv_scale(&src, &dst, filter, 1);
+                double t = now_ms() - start;
+                if (t < one)
+                    one = t;
+                start = now_ms();
+                yuv_scale(&src, &dst, filter, 0);
+                t = now_ms() - start;
+                if (t < all)
+                    all = t;
+            }
+            double start = now_ms();
+            yuv_scale_reference(&src, &dst, filter);
+            double ref = now_ms() - start;
+            printf("%dx%d -> %dx%d %-8s %7.1f ms, all cpus %7.1f ms, "
+                   "reference %7.1f ms\n", sw, sh, w, h, kNames[f],
+                   one, all, ref);
+        }
+        free(s);
+    }
+    free(d);
+}
+
+int main(int argc, char **argv)
+{
+    srand(2);
+    printf("yuv_scale: %s kernels\n", yuv_scale_impl_name());
+    if (!check_random(2000))
+        return 1;
+    printf("random frames: bit exact\n");
+    if (!check_area())
+        return 1;
+    printf("area: block means\n");
+
+    if (!want_benchmarks(argc, argv))
+        return 0;
+    benchmark();
+    benchmark_thumbnail();
+    return 0;
+}
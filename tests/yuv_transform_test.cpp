@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2012 Tomasz Rostanski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Checks yuv_transform against yuv_transform_reference on random frames
+ * and strides, then times both at preview sizes. Exits non-zero on the
+ * first mismatching case.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "YuvTransform.h"
+#include "TestUtil.h"
+
+using namespace android;
+
+static const char *kNames[YUV_TRANSFORM_MAX] = {
+    "none", "mirror", "flip", "rot180", "rot90", "rot270"
+};
+
+static bool check_random(int iterations)
+{
+    for (int it = 0; it < iterations; it++) {
+        int w = 2 + 2 * rnd(120), h = 2 + 2 * rnd(120);
+        int sstride = w + 2 * rnd(8);
+        size_t ssize = (size_t)sstride * h * 3 / 2;
+        uint8_t *src = (uint8_t *)malloc(ssize);
+        for (size_t i = 0; i < ssize; i++)
+            src[i] = rand();
+
+        for (int t = 0; t < YUV_TRANSFORM_MAX; t++) {
+            yuv_transform_t transform = (yuv_transform_t)t;
+            bool swap = yuv_transform_swaps_dimensions(transform);
+            int ow = swap ? h : w, oh = swap ? w : h;
+            int dstride = ow + 2 * rnd(8);
+            size_t dsize = (size_t)dstride * oh * 3 / 2;
+            uint8_t *a = (uint8_t *)calloc(1, dsize);
+            uint8_t *b = (uint8_t *)calloc(1, dsize);
+            yuv_sp_frame_t s, da, db;
+
+            yuv_sp_frame_init(&s, src, w, h, sstride);
+            yuv_sp_frame_init(&da, a, ow, oh, dstride);
+            yuv_sp_frame_init(&db, b, ow, oh, dstride);
+            int ra = yuv_transform(&s, &da, transform);
+            int rb = yuv_transform_reference(&s, &db, transform);
+            bool same = ra == rb && !memcmp(a, b, dsize);
+            free(a);
+            free(b);
+            if (!same) {
+                printf("FAIL %s %dx%d stride %d -> stride %d (rc %d, %d)\n",
+                       kNames[t], w, h, sstride, dstride, ra, rb);
+                free(src);
+                return false;
+            }
+        }
+        free(src);
+    }
+    return true;
+}
+
+static void benchmark(int w, int h)
+{
+    size_t size = (size_t)w * h * 3 / 2;
+    uint8_t *src = (uint8_t *)malloc(size);
+    uint8_t *dst = (uint8_t *)malloc(size);
+    for (size_t i = 0; i < size; i++)
+        src[i] = rand();
+
+    for (int t = 0; t < YUV_TRANSFORM_MAX; t++) {
+        yuv_transform_t transform = (yuv_transform_t)t;
+        bool swap = yuv_transform_swaps_dimensions(transform);
+        yuv_sp_frame_t s, d;
+        double best = 1e9, ref = 1e9;
+
+        yuv_sp_frame_init(&s, src, w, h, w);
+        yuv_sp_frame_init(&d, dst, swap ? h : w, swap ? w : h, swap ? h : w);
+        for (int r = 0; r < 10; r++) {
+            double start = now_ms();
+            yuv_transform(&s, &d, transform);
+            double t1 = now_ms() - start;
+            if (t1 < best)
+                best = t1;
+            start = now_ms();
+            yuv_transform_reference(&s, &d, transform);
+            t1 = now_ms() - start;
+            if (t1 < ref)
+                ref = t1;
+        }
+        printf("%4dx%-4d %-6s %7.2f ms, reference %7.2f ms\n",
+               w, h, kNames[t], best, ref);
+    }
+    free(src);
+    free(dst);
+}
+
+int main(int argc, char **argv)
+{
+    // 1088 is 1080p as the VFE delivers it, padded to whole macroblocks
+    static const int sizes[][2] = {
+        {640, 480}, {1280, 720}, {1920, 1080}, {1920, 1088}
+    };
+
+    srand(1);
+    printf("yuv_transform: %s kernels\n", yuv_transform_impl_name());
+    if (!check_random(2000))
+        return 1;
+    printf("random frames: bit exact\n");
+
+    if (!want_benchmarks(argc, argv))
+        return 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        benchmark(sizes[i][0], sizes[i][1]);
+    return 0;
+}